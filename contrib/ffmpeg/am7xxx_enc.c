@@ -0,0 +1,244 @@
+/*
+ * am7xxx output device for FFmpeg
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Output device for Actions Micro AM7XXX based projectors, using libam7xxx.
+ *
+ * The device takes MJPEG packets or raw NV12 frames, no bigger than the
+ * native resolution of the projector; the packet data is handed to
+ * libam7xxx as it is, decoding, filtering and encoding are all left to the
+ * usual FFmpeg machinery:
+ *
+ *   ffmpeg -i input -vf scale=800:480 -f am7xxx 0
+ *   ffmpeg -i input -vf scale=800:480 -pix_fmt nv12 -c:v rawvideo -f am7xxx 0
+ *
+ * The file name is the index of the device to use.
+ *
+ * This file follows the FFmpeg coding style because it lives in the
+ * libavdevice directory of the FFmpeg source tree, see the README file
+ * next to it.
+ */
+
+#include <am7xxx.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
+#include "libavformat/mux.h"
+#include "avdevice.h"
+
+typedef struct AM7xxxContext {
+    AVClass *class;
+    am7xxx_context *ctx;
+    am7xxx_device *dev;
+    am7xxx_image_format format;
+    int width;
+    int height;
+    int frame_size;
+
+    int power_mode;
+    int zoom_mode;
+    int log_level;
+} AM7xxxContext;
+
+static int am7xxx_write_trailer(AVFormatContext *s)
+{
+    AM7xxxContext *am = s->priv_data;
+
+    /* am7xxx_shutdown() closes the device too */
+    if (am->ctx)
+        am7xxx_shutdown(am->ctx);
+    am->ctx = NULL;
+    am->dev = NULL;
+
+    return 0;
+}
+
+static int am7xxx_write_header(AVFormatContext *s)
+{
+    AM7xxxContext *am = s->priv_data;
+    AVCodecParameters *par;
+    am7xxx_device_info info;
+    unsigned int index;
+    char *tail;
+    int ret;
+
+    if (s->nb_streams != 1 ||
+        s->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+        av_log(s, AV_LOG_ERROR, "Only a single video stream is supported.\n");
+        return AVERROR(EINVAL);
+    }
+    par = s->streams[0]->codecpar;
+
+    if (par->codec_id == AV_CODEC_ID_MJPEG) {
+        am->format = AM7XXX_IMAGE_FORMAT_JPEG;
+        am->frame_size = 0;
+    } else if (par->codec_id == AV_CODEC_ID_RAWVIDEO &&
+               par->format == AV_PIX_FMT_NV12) {
+        am->format = AM7XXX_IMAGE_FORMAT_NV12;
+        am->frame_size = par->width * par->height * 3 / 2;
+    } else {
+        av_log(s, AV_LOG_ERROR,
+               "Unsupported codec %s, pixel format %s: use mjpeg, or rawvideo with nv12.\n",
+               avcodec_get_name(par->codec_id),
+               av_get_pix_fmt_name(par->format));
+        return AVERROR(EINVAL);
+    }
+    am->width = par->width;
+    am->height = par->height;
+
+    index = strtoul(s->url, &tail, 10);
+    if (!*s->url || *tail) {
+        av_log(s, AV_LOG_ERROR,
+               "Invalid device index '%s', use 0 for the first device.\n", s->url);
+        return AVERROR(EINVAL);
+    }
+
+    ret = am7xxx_init(&am->ctx);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Cannot initialize libam7xxx: %d\n", ret);
+        am->ctx = NULL;
+        return AVERROR_EXTERNAL;
+    }
+    am7xxx_set_log_level(am->ctx, am->log_level);
+
+    ret = am7xxx_open_device(am->ctx, &am->dev, index);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Cannot open device %u: %d\n", index, ret);
+        ret = ret == -ENODEV ? AVERROR(ENODEV) : AVERROR_EXTERNAL;
+        goto fail;
+    }
+
+    ret = am7xxx_get_device_info(am->dev, &info);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Cannot get the device information: %d\n", ret);
+        ret = AVERROR_EXTERNAL;
+        goto fail;
+    }
+
+    if (am->width > info.native_width || am->height > info.native_height) {
+        av_log(s, AV_LOG_ERROR,
+               "The frames are %dx%d, the device shows at most %ux%u: "
+               "scale them with -vf scale=%u:%u.\n",
+               am->width, am->height, info.native_width, info.native_height,
+               info.native_width, info.native_height);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    ret = am7xxx_set_zoom_mode(am->dev, am->zoom_mode);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Cannot set the zoom mode: %d\n", ret);
+        ret = AVERROR_EXTERNAL;
+        goto fail;
+    }
+
+    ret = am7xxx_set_power_mode(am->dev, am->power_mode);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Cannot set the power mode: %d\n", ret);
+        ret = AVERROR_EXTERNAL;
+        goto fail;
+    }
+
+    av_log(s, AV_LOG_VERBOSE, "Device %u opened, native resolution %ux%u\n",
+           index, info.native_width, info.native_height);
+
+    return 0;
+
+fail:
+    am7xxx_write_trailer(s);
+    return ret;
+}
+
+static int am7xxx_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    AM7xxxContext *am = s->priv_data;
+    int size = pkt->size;
+    int ret;
+
+    if (am->frame_size) {
+        if (size < am->frame_size) {
+            av_log(s, AV_LOG_ERROR, "Short NV12 frame: %d bytes, %d expected.\n",
+                   size, am->frame_size);
+            return AVERROR(EINVAL);
+        }
+        size = am->frame_size;
+    }
+
+    /*
+     * The packet data goes straight to libam7xxx, the _async() variant
+     * copies it into the transfer buffer and returns as soon as the
+     * previous frame has been sent, so the next frame gets encoded while
+     * this one is on the wire.
+     */
+    ret = am7xxx_send_image_async(am->dev, am->format, am->width, am->height,
+                                  pkt->data, size);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Cannot send the frame: %d\n", ret);
+        return ret == -ENODEV ? AVERROR(EIO) : AVERROR_EXTERNAL;
+    }
+
+    return 0;
+}
+
+#define OFFSET(x) offsetof(AM7xxxContext, x)
+#define ENC AV_OPT_FLAG_ENCODING_PARAM
+static const AVOption options[] = {
+    { "power_mode", "set the power mode, 2 and above need both USB connectors plugged in",
+      OFFSET(power_mode), AV_OPT_TYPE_INT, { .i64 = AM7XXX_POWER_LOW },
+      AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO, ENC, "power_mode" },
+    { "off",    NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_POWER_OFF    }, 0, 0, ENC, "power_mode" },
+    { "low",    NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_POWER_LOW    }, 0, 0, ENC, "power_mode" },
+    { "middle", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_POWER_MIDDLE }, 0, 0, ENC, "power_mode" },
+    { "high",   NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_POWER_HIGH   }, 0, 0, ENC, "power_mode" },
+    { "turbo",  NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_POWER_TURBO  }, 0, 0, ENC, "power_mode" },
+    { "zoom_mode", "set the zoom mode",
+      OFFSET(zoom_mode), AV_OPT_TYPE_INT, { .i64 = AM7XXX_ZOOM_ORIGINAL },
+      AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TEST, ENC, "zoom_mode" },
+    { "original", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_ZOOM_ORIGINAL }, 0, 0, ENC, "zoom_mode" },
+    { "h",        NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_ZOOM_H        }, 0, 0, ENC, "zoom_mode" },
+    { "h_v",      NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_ZOOM_H_V      }, 0, 0, ENC, "zoom_mode" },
+    { "test",     NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AM7XXX_ZOOM_TEST     }, 0, 0, ENC, "zoom_mode" },
+    { "am7xxx_log_level", "set the libam7xxx log level, between 0 (fatal) and 5 (trace)",
+      OFFSET(log_level), AV_OPT_TYPE_INT, { .i64 = AM7XXX_LOG_ERROR },
+      AM7XXX_LOG_FATAL, AM7XXX_LOG_TRACE, ENC },
+    { NULL },
+};
+
+static const AVClass am7xxx_class = {
+    .class_name = "am7xxx outdev",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+    .category   = AV_CLASS_CATEGORY_DEVICE_VIDEO_OUTPUT,
+};
+
+const FFOutputFormat ff_am7xxx_muxer = {
+    .p.name         = "am7xxx",
+    .p.long_name    = NULL_IF_CONFIG_SMALL("Actions Micro AM7XXX projectors"),
+    .p.audio_codec  = AV_CODEC_ID_NONE,
+    .p.video_codec  = AV_CODEC_ID_MJPEG,
+    .p.flags        = AVFMT_NOFILE | AVFMT_NOTIMESTAMPS,
+    .p.priv_class   = &am7xxx_class,
+    .priv_data_size = sizeof(AM7xxxContext),
+    .write_header   = am7xxx_write_header,
+    .write_packet   = am7xxx_write_packet,
+    .write_trailer  = am7xxx_write_trailer,
+};
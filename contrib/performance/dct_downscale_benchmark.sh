@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# dct_downscale_benchmark - compare the CPU time needed to decode and
+# rescale a big MJPEG input with and without the DCT domain downscaling
+#
+# Copyright (C) 2013  Antonio Ospite <ospite@studenti.unina.it>
+#
+# This program is free software. It comes without any warranty, to
+# the extent permitted by applicable law. You can redistribute it
+# and/or modify it under the terms of the Do What The Fuck You Want
+# To Public License, Version 2, as published by Sam Hocevar. See
+# http://sam.zoy.org/wtfpl/COPYING for more details.
+#
+# am7xxx-play decodes MJPEG pictures larger than the display at 1/2, 1/4 or
+# 1/8 of their size (the libavcodec 'lowres' option) and leaves only the
+# remaining rescaling to libswscale; the -S option disables that and goes
+# through sws_getCachedContext() for the whole rescaling.
+#
+# This script measures the same two paths with the ffmpeg command line tool,
+# so no device is needed, and produces two logs with the user CPU time of
+# each run, which can be compared with ministat(1), e.g.:
+#
+#   $ ./dct_downscale_benchmark.sh input_1920x1080.mjpeg 800 450 1
+#   $ ministat sws_scale.log lowres.log
+
+set -e
+
+[ $# -lt 4 ] && { echo "usage: $(basename $0) <input> <width> <height> <lowres> [runs]" 1>&2; exit 1; }
+
+INPUT="$1"
+WIDTH="$2"
+HEIGHT="$3"
+LOWRES="$4"
+RUNS="${5:-20}"
+
+FFMPEG="${FFMPEG:-ffmpeg}"
+
+benchmark() {
+  LOG="$1"
+  shift
+
+  : > "$LOG"
+  for i in $(seq 1 "$RUNS");
+  do
+    $FFMPEG -nostdin -v error -benchmark "$@" -i "$INPUT" \
+      -vf "scale=${WIDTH}:${HEIGHT}" -pix_fmt yuvj420p -f null - 2>&1 | \
+      sed -n -e 's/^bench: utime=\([0-9.]*\)s.*/\1/p' >> "$LOG"
+  done
+}
+
+benchmark sws_scale.log
+benchmark lowres.log -lowres "$LOWRES"
+
+if which ministat > /dev/null 2>&1;
+then
+  ministat sws_scale.log lowres.log
+fi
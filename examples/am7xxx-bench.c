@@ -0,0 +1,427 @@
+/*
+ * am7xxx-bench - measure the frame rate of am7xxx devices
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxx-bench.c
+ * am7xxx-bench sends the same frame over and over with every combination of
+ * the given chunk sizes and depths (see am7xxx_set_chunking()), and reports
+ * the frame rate and the throughput of each one, the best combination for
+ * the host controller in use is printed at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <am7xxx.h>
+
+#define BENCH_MAX_VALUES 16
+
+#define BENCH_DEFAULT_CHUNK_SIZES "0,16384,65536,262144,1048576"
+#define BENCH_DEFAULT_DEPTHS "1,2,4,8"
+
+struct bench_values {
+	unsigned int values[BENCH_MAX_VALUES];
+	unsigned int count;
+};
+
+struct bench_frame {
+	am7xxx_image_format format;
+	unsigned int width;
+	unsigned int height;
+	unsigned char *data;
+	unsigned int size;
+};
+
+static double monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse a comma separated list of unsigned numbers */
+static int parse_values(const char *list, struct bench_values *values)
+{
+	unsigned long value;
+	char *end;
+
+	values->count = 0;
+	do {
+		if (values->count == BENCH_MAX_VALUES) {
+			fprintf(stderr, "Too many values in '%s', at most %d are allowed\n",
+				list, BENCH_MAX_VALUES);
+			return -EINVAL;
+		}
+
+		errno = 0;
+		value = strtoul(list, &end, 10);
+		if (errno || end == list || (*end != ',' && *end != '\0')) {
+			fprintf(stderr, "Invalid list of values '%s'\n", list);
+			return -EINVAL;
+		}
+		values->values[values->count++] = value;
+
+		list = end + 1;
+	} while (*end == ',');
+
+	return 0;
+}
+
+/* A NV12 gradient, the content does not matter for raw frames */
+static int make_nv12_frame(struct bench_frame *frame,
+			   unsigned int width, unsigned int height)
+{
+	unsigned int i;
+
+	frame->format = AM7XXX_IMAGE_FORMAT_NV12;
+	frame->width = width;
+	frame->height = height;
+	frame->size = width * height * 3 / 2;
+
+	frame->data = malloc(frame->size);
+	if (frame->data == NULL) {
+		perror("malloc");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < width * height; i++)
+		frame->data[i] = (i % width) * 255 / width;
+	memset(frame->data + width * height, 128, frame->size - width * height);
+
+	return 0;
+}
+
+/* The JPEG image is sent as is, it should have the native dimensions */
+static int load_jpeg_frame(struct bench_frame *frame, const char *path,
+			   unsigned int width, unsigned int height)
+{
+	struct stat st;
+	FILE *file;
+	int ret;
+
+	frame->format = AM7XXX_IMAGE_FORMAT_JPEG;
+	frame->width = width;
+	frame->height = height;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		perror("fopen");
+		return -errno;
+	}
+
+	if (fstat(fileno(file), &st) < 0) {
+		perror("fstat");
+		ret = -errno;
+		goto out;
+	}
+	frame->size = st.st_size;
+
+	frame->data = malloc(frame->size);
+	if (frame->data == NULL) {
+		perror("malloc");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (fread(frame->data, 1, frame->size, file) != frame->size) {
+		fprintf(stderr, "Cannot read %s\n", path);
+		free(frame->data);
+		frame->data = NULL;
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = 0;
+out:
+	fclose(file);
+	return ret;
+}
+
+static int send_frame(am7xxx_device *dev, struct bench_frame *frame, int async)
+{
+	if (async)
+		return am7xxx_send_image_async(dev, frame->format,
+					       frame->width, frame->height,
+					       frame->data, frame->size);
+
+	return am7xxx_send_image(dev, frame->format,
+				 frame->width, frame->height,
+				 frame->data, frame->size);
+}
+
+/*
+ * Return the frame rate; with async sends the last frame may still be in
+ * flight when the time is taken, which gets amortized over many frames.
+ */
+static int bench_run(am7xxx_device *dev, struct bench_frame *frame,
+		     unsigned int frames, int async, double *fps)
+{
+	double start;
+	unsigned int i;
+	int ret;
+
+	/* get the device up to speed first */
+	for (i = 0; i < 2; i++) {
+		ret = send_frame(dev, frame, async);
+		if (ret < 0)
+			return ret;
+	}
+
+	start = monotonic_time();
+	for (i = 0; i < frames; i++) {
+		ret = send_frame(dev, frame, async);
+		if (ret < 0)
+			return ret;
+	}
+	*fps = frames / (monotonic_time() - start);
+
+	return 0;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-i <image>\t\ta JPEG image with the native dimensions of the device,\n");
+	printf("\t\t\t\tby default a NV12 frame is generated\n");
+	printf("\t-n <frames>\t\thow many frames to send in each run (default is 60)\n");
+	printf("\t-a \t\t\tsend the frames with am7xxx_send_image_async()\n");
+	printf("\t-c <sizes>\t\tthe chunk sizes to try, comma separated, 0 disables chunking\n");
+	printf("\t\t\t\t(default is %s)\n", BENCH_DEFAULT_CHUNK_SIZES);
+	printf("\t-q <depths>\t\tthe queue depths to try, comma separated\n");
+	printf("\t\t\t\t(default is %s)\n", BENCH_DEFAULT_DEPTHS);
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
+	       AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLE OF USE:\n");
+	printf("\t%s -n 100 -c 0,65536,131072 -q 2,4\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *image_path = NULL;
+	int frames = 60;
+	int async = 0;
+	int log_level = AM7XXX_LOG_ERROR;
+	int device_index = 0;
+	int power_mode = AM7XXX_POWER_LOW;
+	struct bench_values chunk_sizes;
+	struct bench_values depths;
+	struct bench_frame frame;
+	unsigned int best_chunk_size = 0;
+	unsigned int best_depth = 0;
+	double best_fps = 0;
+	double fps;
+	unsigned int i;
+	unsigned int j;
+	am7xxx_device_info device_info;
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+
+	parse_values(BENCH_DEFAULT_CHUNK_SIZES, &chunk_sizes);
+	parse_values(BENCH_DEFAULT_DEPTHS, &depths);
+	memset(&frame, 0, sizeof(frame));
+
+	while ((opt = getopt(argc, argv, "d:i:n:ac:q:l:p:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device_index = atoi(optarg);
+			if (device_index < 0) {
+				fprintf(stderr, "Unsupported device index\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'i':
+			free(image_path);
+			image_path = strdup(optarg);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			if (frames <= 0) {
+				fprintf(stderr, "Invalid number of frames, must be a positive number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'a':
+			async = 1;
+			break;
+		case 'c':
+			ret = parse_values(optarg, &chunk_sizes);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'q':
+			ret = parse_values(optarg, &depths);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			switch(power_mode) {
+			case AM7XXX_POWER_OFF:
+			case AM7XXX_POWER_LOW:
+			case AM7XXX_POWER_MIDDLE:
+			case AM7XXX_POWER_HIGH:
+			case AM7XXX_POWER_TURBO:
+				fprintf(stdout, "Power mode: %d\n", power_mode);
+				break;
+			default:
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+					AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	ret = am7xxx_init(&ctx);
+	if (ret < 0) {
+		perror("am7xxx_init");
+		goto out;
+	}
+
+	am7xxx_set_log_level(ctx, log_level);
+
+	ret = am7xxx_open_device(ctx, &dev, device_index);
+	if (ret < 0) {
+		perror("am7xxx_open_device");
+		goto cleanup;
+	}
+
+	ret = am7xxx_get_device_info(dev, &device_info);
+	if (ret < 0) {
+		perror("am7xxx_get_device_info");
+		goto cleanup;
+	}
+
+	if (image_path)
+		ret = load_jpeg_frame(&frame, image_path,
+				      device_info.native_width,
+				      device_info.native_height);
+	else
+		ret = make_nv12_frame(&frame,
+				      device_info.native_width,
+				      device_info.native_height);
+	if (ret < 0)
+		goto cleanup;
+
+	ret = am7xxx_set_zoom_mode(dev, AM7XXX_ZOOM_ORIGINAL);
+	if (ret < 0) {
+		perror("am7xxx_set_zoom_mode");
+		goto cleanup;
+	}
+
+	ret = am7xxx_set_power_mode(dev, power_mode);
+	if (ret < 0) {
+		perror("am7xxx_set_power_mode");
+		goto cleanup;
+	}
+
+	printf("%u bytes %s frames, %d per run, %s sends\n\n", frame.size,
+	       frame.format == AM7XXX_IMAGE_FORMAT_JPEG ? "JPEG" : "NV12",
+	       frames, async ? "async" : "sync");
+	printf("%10s %6s %10s %10s\n", "chunk", "depth", "fps", "MiB/s");
+
+	for (i = 0; i < chunk_sizes.count; i++) {
+		for (j = 0; j < depths.count; j++) {
+			/* the depth does not matter without chunking */
+			if (chunk_sizes.values[i] == 0 && j > 0)
+				break;
+
+			ret = am7xxx_set_chunking(dev, chunk_sizes.values[i],
+						  depths.values[j]);
+			if (ret < 0) {
+				fprintf(stderr, "Skipping chunk size %u, depth %u: %s\n",
+					chunk_sizes.values[i], depths.values[j],
+					strerror(-ret));
+				continue;
+			}
+
+			ret = bench_run(dev, &frame, frames, async, &fps);
+			if (ret < 0) {
+				fprintf(stderr, "Sending failed with chunk size %u, depth %u\n",
+					chunk_sizes.values[i], depths.values[j]);
+				goto cleanup;
+			}
+
+			if (chunk_sizes.values[i] == 0)
+				printf("%10s %6s", "none", "-");
+			else
+				printf("%10u %6u", chunk_sizes.values[i], depths.values[j]);
+			printf(" %10.2f %10.2f\n", fps, fps * frame.size / (1024 * 1024));
+
+			if (fps > best_fps) {
+				best_fps = fps;
+				best_chunk_size = chunk_sizes.values[i];
+				best_depth = depths.values[j];
+			}
+		}
+	}
+
+	if (best_fps == 0) {
+		fprintf(stderr, "No combination could be measured\n");
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	if (best_chunk_size == 0)
+		printf("\nBest: no chunking, %.2f fps\n", best_fps);
+	else
+		printf("\nBest: am7xxx_set_chunking(dev, %u, %u), %.2f fps\n",
+		       best_chunk_size, best_depth, best_fps);
+
+	ret = 0;
+
+cleanup:
+	am7xxx_shutdown(ctx);
+out:
+	free(frame.data);
+	free(image_path);
+	return ret;
+}
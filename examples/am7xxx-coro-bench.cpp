@@ -0,0 +1,338 @@
+/*
+ * am7xxx-coro-bench - compare coroutines and threads driving am7xxx devices
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxx-coro-bench.cpp
+ * am7xxx-coro-bench renders and sends frames to several devices at once,
+ * first with one thread and one context per device calling
+ * am7xxx_send_image(), then with one coroutine per device all run by a
+ * single am7xxx::coro::Scheduler, and reports the frame rate and the CPU
+ * time of both.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <exception>
+#include <barrier>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <am7xxx.hpp>
+#include <am7xxx_coro.hpp>
+
+struct bench_result {
+	double seconds;
+	double cpu_seconds;
+};
+
+static double monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* Stands for capturing and encoding: a NV12 gradient moving with n */
+static void render_frame(am7xxx::Frame &frame, unsigned int n)
+{
+	std::span<std::byte> data = frame.data();
+	unsigned int width = frame.width();
+	unsigned int height = frame.height();
+	unsigned int x;
+	unsigned int y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			data[y * width + x] = std::byte(((x + n) % width) * 255 / width);
+	std::memset(data.data() + width * height, 128, data.size() - width * height);
+}
+
+struct bench_settings {
+	unsigned int devices_count;
+	unsigned int frames;
+	unsigned int chunk_size;
+	unsigned int depth;
+	int log_level;
+	int power_mode;
+};
+
+/* Get a device ready for the benchmark, and a frame of its size */
+static am7xxx::Frame setup_device(am7xxx::Device &dev,
+				  const bench_settings &settings)
+{
+	am7xxx_device_info info = dev.info();
+
+	dev.set_zoom_mode(am7xxx::ZoomMode::Original);
+	dev.set_power_mode(static_cast<am7xxx::PowerMode>(settings.power_mode));
+	if (settings.chunk_size)
+		dev.set_chunking(settings.chunk_size, settings.depth);
+
+	return am7xxx::Frame::make<am7xxx::ImageFormat::NV12>(info.native_width,
+							      info.native_height);
+}
+
+/*
+ * The objects of a Context must be used from one thread at a time, so each
+ * thread has a Context of its own, as am7xxxd does.
+ */
+static void thread_run(const bench_settings &settings, unsigned int index,
+		       std::barrier<> &start_line, std::exception_ptr &exception)
+{
+	bool started = false;
+	unsigned int i;
+
+	try {
+		am7xxx::Context ctx;
+
+		ctx.set_log_level(static_cast<am7xxx::LogLevel>(settings.log_level));
+
+		am7xxx::Device dev = ctx.open_device(index);
+		am7xxx::Frame frame = setup_device(dev, settings);
+
+		/* opening the devices is not part of the measure */
+		start_line.arrive_and_wait();
+		started = true;
+
+		for (i = 0; i < settings.frames; i++) {
+			render_frame(frame, i);
+			dev.send(frame.format(), frame.width(), frame.height(),
+				 frame.data());
+		}
+	} catch (...) {
+		exception = std::current_exception();
+		if (!started)
+			start_line.arrive_and_drop();
+	}
+}
+
+static bench_result bench_threads(const bench_settings &settings)
+{
+	std::vector<std::exception_ptr> exceptions(settings.devices_count);
+	std::vector<std::thread> threads;
+	std::barrier<> start_line(settings.devices_count + 1);
+	double start;
+	double cpu_start;
+	unsigned int i;
+
+	for (i = 0; i < settings.devices_count; i++)
+		threads.emplace_back(thread_run, std::cref(settings), i,
+				     std::ref(start_line), std::ref(exceptions[i]));
+
+	start_line.arrive_and_wait();
+	start = monotonic_time();
+	cpu_start = cpu_time();
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	for (std::exception_ptr &exception : exceptions)
+		if (exception)
+			std::rethrow_exception(exception);
+
+	return { monotonic_time() - start, cpu_time() - cpu_start };
+}
+
+/*
+ * The send starts when the coroutine is suspended and the coroutine is
+ * resumed when it is done, so one frame is enough: the other coroutines
+ * render theirs meanwhile.
+ */
+static am7xxx::coro::Task coro_run(am7xxx::coro::Device dev,
+				   am7xxx::Frame &frame, unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i < frames; i++) {
+		render_frame(frame, i);
+		co_await dev.send(frame);
+	}
+}
+
+static bench_result bench_coroutines(const bench_settings &settings)
+{
+	am7xxx::Context ctx;
+	std::vector<am7xxx::Device> devices;
+	std::vector<am7xxx::Frame> frames;
+	double start;
+	double cpu_start;
+	unsigned int i;
+
+	ctx.set_log_level(static_cast<am7xxx::LogLevel>(settings.log_level));
+
+	/* all the devices are initialized at once */
+	devices = ctx.open_all_devices(settings.devices_count);
+	if (devices.size() < settings.devices_count) {
+		fprintf(stderr, "Only %zu devices found\n", devices.size());
+		throw am7xxx::Error("am7xxx_open_all_devices", -ENODEV);
+	}
+
+	for (am7xxx::Device &dev : devices)
+		frames.push_back(setup_device(dev, settings));
+
+	am7xxx::coro::Scheduler scheduler(ctx);
+
+	start = monotonic_time();
+	cpu_start = cpu_time();
+
+	for (i = 0; i < devices.size(); i++)
+		scheduler.spawn(coro_run(am7xxx::coro::Device(devices[i]),
+					 frames[i], settings.frames));
+	scheduler.run();
+
+	/* the last images are sent when the coroutines are done */
+	return { monotonic_time() - start, cpu_time() - cpu_start };
+}
+
+static void print_result(const char *name, const bench_result &result,
+			 unsigned int devices, unsigned int frames)
+{
+	printf("%12s %10.2f %10.2f %10.2f\n", name,
+	       devices * frames / result.seconds,
+	       frames / result.seconds,
+	       100.0 * result.cpu_seconds / result.seconds);
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-N <devices>\t\thow many devices to use, from index 0 (default is 1)\n");
+	printf("\t-n <frames>\t\thow many frames to send to each device (default is 300)\n");
+	printf("\t-m <mode>\t\tthreads, coroutines or both (default is both)\n");
+	printf("\t-c <chunk size>\t\tsend the frames in chunks, see am7xxx_set_chunking()\n");
+	printf("\t-q <depth>\t\thow many chunks to queue (default is 4)\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
+	       AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLE OF USE:\n");
+	printf("\t%s -N 2 -n 600\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int devices_count = 1;
+	int frames = 300;
+	int threads = 1;
+	int coroutines = 1;
+	unsigned int chunk_size = 0;
+	unsigned int depth = 4;
+	int log_level = AM7XXX_LOG_ERROR;
+	int power_mode = AM7XXX_POWER_LOW;
+	bench_settings settings;
+
+	while ((opt = getopt(argc, argv, "N:n:m:c:q:l:p:h")) != -1) {
+		switch (opt) {
+		case 'N':
+			devices_count = atoi(optarg);
+			if (devices_count <= 0) {
+				fprintf(stderr, "Invalid number of devices, must be a positive number\n");
+				return -EINVAL;
+			}
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			if (frames <= 0) {
+				fprintf(stderr, "Invalid number of frames, must be a positive number\n");
+				return -EINVAL;
+			}
+			break;
+		case 'm':
+			threads = strcmp(optarg, "coroutines") != 0;
+			coroutines = strcmp(optarg, "threads") != 0;
+			if (strcmp(optarg, "threads") != 0 &&
+			    strcmp(optarg, "coroutines") != 0 &&
+			    strcmp(optarg, "both") != 0) {
+				fprintf(stderr, "Invalid mode, must be threads, coroutines or both\n");
+				return -EINVAL;
+			}
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			if (power_mode < AM7XXX_POWER_OFF || power_mode > AM7XXX_POWER_TURBO) {
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+					AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				return -EINVAL;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default: /* '?' */
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	settings.devices_count = devices_count;
+	settings.frames = frames;
+	settings.chunk_size = chunk_size;
+	settings.depth = depth;
+	settings.log_level = log_level;
+	settings.power_mode = power_mode;
+
+	try {
+		printf("%d devices, %d NV12 frames each\n\n", devices_count, frames);
+		printf("%12s %10s %10s %10s\n", "mode", "fps", "fps/dev", "CPU %");
+
+		/* the threads close their devices before the coroutines open them */
+		if (threads)
+			print_result("threads", bench_threads(settings),
+				     devices_count, frames);
+		if (coroutines)
+			print_result("coroutines", bench_coroutines(settings),
+				     devices_count, frames);
+	} catch (const am7xxx::Error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return e.code();
+	}
+
+	return 0;
+}
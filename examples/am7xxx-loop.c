@@ -0,0 +1,320 @@
+/*
+ * am7xxx-loop - play frame files on am7xxx devices, over and over
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxx-loop.c
+ * am7xxx-loop plays the frame files written by am7xxx-play -O, the frames
+ * are already in a format the device can show and they are sent straight
+ * from the file mapped in memory, so playing them costs only the USB
+ * transfers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <am7xxx.h>
+
+#include "frame_file.h"
+#include "net_frame.h"
+
+/* When later than this, just go on from the current time */
+#define LOOP_MAX_LATENESS 1000000
+
+static volatile sig_atomic_t run = 1;
+
+static int64_t monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(int64_t time)
+{
+	struct timespec ts;
+
+	ts.tv_sec = time / 1000000;
+	ts.tv_nsec = (time % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* The frames go to the device, or to am7xxx-recv when 'sender' is set */
+static int play_frame_file(struct frame_file *file,
+			   unsigned int loops,
+			   am7xxx_device *dev,
+			   struct net_frame_sender *sender)
+{
+	struct frame_file_entry entry;
+	int64_t next_time;
+	unsigned int loop;
+	unsigned int i;
+	int ret;
+
+	next_time = monotonic_time();
+	for (loop = 0; run && (loops == 0 || loop < loops); loop++) {
+		for (i = 0; run && i < file->frames_count; i++) {
+			frame_file_get_entry(file, i, &entry);
+
+			sleep_until(next_time);
+
+			if (sender) {
+				ret = net_frame_send(sender,
+						     file->format,
+						     file->width,
+						     file->height,
+						     file->data + entry.offset,
+						     entry.size);
+				if (ret < 0)
+					return ret;
+			} else {
+				ret = am7xxx_send_image(dev,
+							file->format,
+							file->width,
+							file->height,
+							file->data + entry.offset,
+							entry.size);
+				if (ret < 0) {
+					perror("am7xxx_send_image");
+					return ret;
+				}
+			}
+
+			next_time += entry.duration;
+			if (monotonic_time() - next_time > LOOP_MAX_LATENESS)
+				next_time = monotonic_time();
+		}
+	}
+
+	return 0;
+}
+
+static void unset_run(int signo)
+{
+	(void) signo;
+	run = 0;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-i <frame file>\t\tthe file to play, as written by am7xxx-play -O\n");
+	printf("\t-n <loops>\t\thow many times to play the file (default is 0, forever)\n");
+	printf("\t-N <URL>\t\tsend the frames to am7xxx-recv instead of the device,\n");
+	printf("\t\t\t\tthe URL is tcp://<host>:<port> or udp://<host>:<port>\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
+	       AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-z <zoom mode>\t\tthe display zoom mode, between %d (original) and %d (test)\n",
+	       AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TEST);
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLE OF USE:\n");
+	printf("\t%s -i clip.am7\n", name);
+	printf("\t%s -i clip.am7 -N udp://projector-host:%s\n", name, NET_FRAME_DEFAULT_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *input_path = NULL;
+	char *url = NULL;
+	int loops = 0;
+	int log_level = AM7XXX_LOG_INFO;
+	int device_index = 0;
+	int power_mode = AM7XXX_POWER_LOW;
+	int zoom = AM7XXX_ZOOM_ORIGINAL;
+	struct frame_file file;
+	struct net_frame_sender sender;
+	am7xxx_device_info device_info;
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+
+	while ((opt = getopt(argc, argv, "d:i:n:N:l:p:z:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device_index = atoi(optarg);
+			if (device_index < 0) {
+				fprintf(stderr, "Unsupported device index\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'i':
+			free(input_path);
+			input_path = strdup(optarg);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			if (loops < 0) {
+				fprintf(stderr, "Invalid number of loops, must be a non-negative number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'N':
+			free(url);
+			url = strdup(optarg);
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			switch(power_mode) {
+			case AM7XXX_POWER_OFF:
+			case AM7XXX_POWER_LOW:
+			case AM7XXX_POWER_MIDDLE:
+			case AM7XXX_POWER_HIGH:
+			case AM7XXX_POWER_TURBO:
+				fprintf(stdout, "Power mode: %d\n", power_mode);
+				break;
+			default:
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+					AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'z':
+			zoom = atoi(optarg);
+			switch(zoom) {
+			case AM7XXX_ZOOM_ORIGINAL:
+			case AM7XXX_ZOOM_H:
+			case AM7XXX_ZOOM_H_V:
+			case AM7XXX_ZOOM_TEST:
+				fprintf(stdout, "Zoom: %d\n", zoom);
+				break;
+			default:
+				fprintf(stderr, "Invalid zoom mode value, must be between %d and %d\n",
+					AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TEST);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (input_path == NULL) {
+		fprintf(stderr, "The -i option must always be passed\n\n");
+		usage(argv[0]);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = frame_file_open(&file, input_path);
+	if (ret < 0)
+		goto out;
+
+	if (file.frames_count == 0) {
+		fprintf(stderr, "%s has no frames\n", input_path);
+		ret = -EINVAL;
+		goto out_close_file;
+	}
+
+	signal(SIGINT, unset_run);
+
+	if (url) {
+		ret = net_frame_sender_open(&sender, url);
+		if (ret < 0)
+			goto out_close_file;
+
+		ret = play_frame_file(&file, loops, NULL, &sender);
+		net_frame_sender_close(&sender);
+		goto out_close_file;
+	}
+
+	ret = am7xxx_init(&ctx);
+	if (ret < 0) {
+		perror("am7xxx_init");
+		goto out_close_file;
+	}
+
+	am7xxx_set_log_level(ctx, log_level);
+
+	ret = am7xxx_open_device(ctx, &dev, device_index);
+	if (ret < 0) {
+		perror("am7xxx_open_device");
+		goto cleanup;
+	}
+
+	ret = am7xxx_get_device_info(dev, &device_info);
+	if (ret < 0) {
+		perror("am7xxx_get_device_info");
+		goto cleanup;
+	}
+
+	if (file.width > device_info.native_width ||
+	    file.height > device_info.native_height)
+		fprintf(stderr,
+			"WARNING: frames are %ux%u, not fitting the native resolution, they may be displayed wrongly!\n",
+			file.width, file.height);
+
+	ret = am7xxx_set_zoom_mode(dev, zoom);
+	if (ret < 0) {
+		perror("am7xxx_set_zoom_mode");
+		goto cleanup;
+	}
+
+	ret = am7xxx_set_power_mode(dev, power_mode);
+	if (ret < 0) {
+		perror("am7xxx_set_power_mode");
+		goto cleanup;
+	}
+
+	/* When setting AM7XXX_ZOOM_TEST don't display the actual image */
+	if (zoom == AM7XXX_ZOOM_TEST)
+		goto cleanup;
+
+	ret = play_frame_file(&file, loops, dev, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "play_frame_file failed\n");
+		goto cleanup;
+	}
+
+cleanup:
+	am7xxx_shutdown(ctx);
+out_close_file:
+	frame_file_close(&file);
+out:
+	free(url);
+	free(input_path);
+	return ret;
+}
@@ -24,10 +24,14 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <libavdevice/avdevice.h>
 #include <libavformat/avformat.h>
@@ -35,6 +39,13 @@
 
 #include <am7xxx.h>
 
+#include "video_source.h"
+#include "frame_file.h"
+#include "frame_trace.h"
+#include "overlay.h"
+#include "orientation.h"
+#include "jpeg_transform.h"
+
 /* On some systems ENOTSUP is not defined, fallback to its value on
  * linux which is equal to EOPNOTSUPP which is 95
  */
@@ -42,18 +53,205 @@
 #define ENOTSUP 95
 #endif
 
-static unsigned int run = 1;
+/* How many times the -L option can be given */
+#define OVERLAYS_MAX 8
+
+static volatile sig_atomic_t run = 1;
+
+/* The capture sources which bypass libavdevice */
+static const struct video_source_ops *video_sources[] = {
+#ifdef HAVE_XCB_SHM
+	&xcb_shm_source_ops,
+#endif
+#ifdef HAVE_LINUX_FB
+	&fbdev_mmap_source_ops,
+#endif
+#ifdef HAVE_LINUX_VIDEODEV2
+	&v4l2_mmap_source_ops,
+#endif
+	NULL,
+};
+
+static int64_t monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 struct video_input_ctx {
 	AVFormatContext *format_ctx;
 	AVCodecContext  *codec_ctx;
 	int video_stream_index;
+	AVRational time_base;
+	int live;
+	int draining;
+	int passthrough;
+
+	/* when the last packet has been read, if tracing */
+	int trace;
+	int64_t read_time;
+
+	/* only for the native sources */
+	const struct video_source_ops *source_ops;
+	void *source;
+	struct video_source_picture source_picture;
+	int has_source_picture;
 };
 
+/* Open the decoder, picking the cheapest way to get pictures for the device */
+static int video_input_open_decoder(AVCodecContext *input_codec_ctx,
+				    AVCodec *input_codec,
+				    unsigned int dct_downscale,
+				    unsigned int upscale,
+				    am7xxx_device *dev)
+{
+	unsigned int scaled_width;
+	unsigned int scaled_height;
+	int lowres;
+	int ret;
+
+	/*
+	 * The JPEG decoder can downscale by 1/2, 1/4 or 1/8 while decoding,
+	 * by computing the IDCT on less coefficients; this is a lot cheaper
+	 * than decoding the picture at full size and then rescaling it.
+	 *
+	 * Pick the largest factor which still gives a picture not smaller
+	 * than the one to be shown, libswscale takes care of the rest.
+	 */
+	lowres = 0;
+	if (dct_downscale && input_codec_ctx->codec_id == CODEC_ID_MJPEG) {
+		ret = am7xxx_calc_scaled_image_dimensions(dev,
+							  upscale,
+							  input_codec_ctx->width,
+							  input_codec_ctx->height,
+							  &scaled_width,
+							  &scaled_height);
+		if (ret < 0) {
+			fprintf(stderr, "cannot calculate output dimension\n");
+			return ret;
+		}
+
+		while (lowres < input_codec->max_lowres &&
+		       (unsigned int)(input_codec_ctx->width >> (lowres + 1)) >= scaled_width &&
+		       (unsigned int)(input_codec_ctx->height >> (lowres + 1)) >= scaled_height)
+			lowres++;
+	}
+	input_codec_ctx->lowres = lowres;
+
+	/* open the decoder */
+	ret = avcodec_open2(input_codec_ctx, input_codec, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "cannot open input codec\n");
+		return -ENOTSUP;
+	}
+
+	/* avcodec_open2() already set the dimensions to the decoded ones,
+	 * the rest of the pipeline is set up on them */
+	if (lowres > 0)
+		fprintf(stdout, "decoding JPEG pictures at 1/%d of their size: %dx%d\n",
+			1 << lowres, input_codec_ctx->width, input_codec_ctx->height);
+
+	return 0;
+}
+
+static int video_input_init_source(struct video_input_ctx *input_ctx,
+				   const struct video_source_ops *source_ops,
+				   const char *input_path,
+				   AVDictionary **input_options,
+				   unsigned int dct_downscale,
+				   unsigned int upscale,
+				   am7xxx_device *dev)
+{
+	am7xxx_device_info device_info;
+	AVCodecContext *input_codec_ctx;
+	AVCodec *input_codec = NULL;
+	enum CodecID codec_id;
+	enum PixelFormat pix_fmt;
+	int width;
+	int height;
+	void *source;
+	int ret;
+
+	/* capture just what the device can show, when possible */
+	ret = am7xxx_get_device_info(dev, &device_info);
+	if (ret < 0) {
+		fprintf(stderr, "cannot get device info\n");
+		goto out;
+	}
+
+	ret = source_ops->open(&source, input_path, input_options,
+			       device_info.native_width,
+			       device_info.native_height);
+	if (ret < 0) {
+		fprintf(stderr, "cannot open the %s source\n", source_ops->name);
+		goto out;
+	}
+
+	source_ops->get_format(source, &width, &height, &pix_fmt, &codec_id);
+	if (codec_id != CODEC_ID_RAWVIDEO) {
+		input_codec = avcodec_find_decoder(codec_id);
+		if (input_codec == NULL) {
+			fprintf(stderr, "input_codec is NULL!\n");
+			ret = -ENOTSUP;
+			goto cleanup;
+		}
+	}
+
+	/* For raw pictures the codec context just describes them to the rest
+	 * of the pipeline, there is nothing to decode */
+	input_codec_ctx = avcodec_alloc_context3(input_codec);
+	if (input_codec_ctx == NULL) {
+		fprintf(stderr, "cannot allocate the input codec context!\n");
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	input_codec_ctx->codec_id = codec_id;
+	input_codec_ctx->width = width;
+	input_codec_ctx->height = height;
+	input_codec_ctx->pix_fmt = pix_fmt;
+
+	if (input_codec) {
+		/* decode each picture right away, so that its buffer can go
+		 * back to the source as soon as possible */
+		input_codec_ctx->thread_count = 1;
+
+		ret = video_input_open_decoder(input_codec_ctx, input_codec,
+					       dct_downscale, upscale, dev);
+		if (ret < 0) {
+			av_free(input_codec_ctx);
+			goto cleanup;
+		}
+	}
+
+	memset(input_ctx, 0, sizeof(*input_ctx));
+	input_ctx->codec_ctx = input_codec_ctx;
+	input_ctx->time_base.num = 1;
+	input_ctx->time_base.den = AV_TIME_BASE;
+	input_ctx->live = 1;
+	input_ctx->source_ops = source_ops;
+	input_ctx->source = source;
+
+	ret = 0;
+	goto out;
+
+cleanup:
+	source_ops->close(source);
+out:
+	av_dict_free(input_options);
+	*input_options = NULL;
+	return ret;
+}
+
 static int video_input_init(struct video_input_ctx *input_ctx,
 			    const char *input_format_string,
 			    const char *input_path,
-			    AVDictionary **input_options)
+			    AVDictionary **input_options,
+			    unsigned int threads,
+			    unsigned int dct_downscale,
+			    unsigned int upscale,
+			    am7xxx_device *dev)
 {
 	AVInputFormat *input_format = NULL;
 	AVFormatContext *input_format_ctx;
@@ -67,6 +265,18 @@ static int video_input_init(struct video_input_ctx *input_ctx,
 	avcodec_register_all();
 	av_register_all();
 
+	if (input_path == NULL) {
+		fprintf(stderr, "input_path must not be NULL!\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; input_format_string && video_sources[i]; i++)
+		if (strcmp(input_format_string, video_sources[i]->name) == 0)
+			return video_input_init_source(input_ctx, video_sources[i],
+						       input_path, input_options,
+						       dct_downscale, upscale, dev);
+
 	if (input_format_string) {
 		/* find the desired input format */
 		input_format = av_find_input_format(input_format_string);
@@ -77,12 +287,6 @@ static int video_input_init(struct video_input_ctx *input_ctx,
 		}
 	}
 
-	if (input_path == NULL) {
-		fprintf(stderr, "input_path must not be NULL!\n");
-		ret = -EINVAL;
-		goto out;
-	}
-
 	/* open the input format/device */
 	input_format_ctx = NULL;
 	ret = avformat_open_input(&input_format_ctx,
@@ -133,17 +337,21 @@ static int video_input_init(struct video_input_ctx *input_ctx,
 		goto cleanup;
 	}
 
-	/* open the decoder */
-	ret = avcodec_open2(input_codec_ctx, input_codec, NULL);
-	if (ret < 0) {
-		fprintf(stderr, "cannot open input codec\n");
-		ret = -ENOTSUP;
+	/* let the decoder use more threads, 0 means autodetect */
+	input_codec_ctx->thread_count = threads;
+	input_codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+	ret = video_input_open_decoder(input_codec_ctx, input_codec,
+				       dct_downscale, upscale, dev);
+	if (ret < 0)
 		goto cleanup;
-	}
 
+	memset(input_ctx, 0, sizeof(*input_ctx));
 	input_ctx->format_ctx = input_format_ctx;
 	input_ctx->codec_ctx = input_codec_ctx;
 	input_ctx->video_stream_index = video_index;
+	input_ctx->time_base = input_format_ctx->streams[video_index]->time_base;
+	input_ctx->live = !!(input_format_ctx->iformat->flags & AVFMT_NOFILE);
 
 	ret = 0;
 	goto out;
@@ -156,10 +364,31 @@ out:
 	return ret;
 }
 
+static void video_input_cleanup(struct video_input_ctx *input_ctx)
+{
+	if (input_ctx->source_ops) {
+		if (input_ctx->has_source_picture)
+			input_ctx->source_ops->release(input_ctx->source,
+						       &input_ctx->source_picture);
+		input_ctx->source_ops->close(input_ctx->source);
+		avcodec_close(input_ctx->codec_ctx);
+		av_free(input_ctx->codec_ctx);
+		return;
+	}
+
+	avcodec_close(input_ctx->codec_ctx);
+	avformat_close_input(&(input_ctx->format_ctx));
+}
+
+
+struct play_pipeline;
 
 struct video_output_ctx {
 	AVCodecContext  *codec_ctx;
 	int raw_output;
+	unsigned int quality;
+	struct jpeg_transform transform;
+	struct play_pipeline *pipeline;
 };
 
 static int video_output_init(struct video_output_ctx *output_ctx,
@@ -206,10 +435,8 @@ static int video_output_init(struct video_output_ctx *output_ctx,
 	output_codec_ctx->bit_rate   = (input_ctx->codec_ctx)->bit_rate;
 	output_codec_ctx->width      = new_output_width;
 	output_codec_ctx->height     = new_output_height;
-	output_codec_ctx->time_base.num  =
-		(input_ctx->format_ctx)->streams[input_ctx->video_stream_index]->time_base.num;
-	output_codec_ctx->time_base.den  =
-		(input_ctx->format_ctx)->streams[input_ctx->video_stream_index]->time_base.den;
+	output_codec_ctx->time_base.num  = input_ctx->time_base.num;
+	output_codec_ctx->time_base.den  = input_ctx->time_base.den;
 
 	/* When the raw format is requested we don't actually need to setup
 	 * and open a decoder
@@ -219,6 +446,7 @@ static int video_output_init(struct video_output_ctx *output_ctx,
 		output_codec_ctx->pix_fmt    = PIX_FMT_NV12;
 		output_ctx->codec_ctx = output_codec_ctx;
 		output_ctx->raw_output = 1;
+		output_ctx->quality = quality;
 		ret = 0;
 		goto out;
 	}
@@ -257,6 +485,7 @@ static int video_output_init(struct video_output_ctx *output_ctx,
 
 	output_ctx->codec_ctx = output_codec_ctx;
 	output_ctx->raw_output = 0;
+	output_ctx->quality = quality;
 
 	ret = 0;
 	goto out;
@@ -269,200 +498,1341 @@ out:
 }
 
 
+static unsigned int get_cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0)
+		return (unsigned int)cpus;
+#endif
+	return 1;
+}
+
+#define PICTURE_HASH_LANES   8
+#define PICTURE_HASH_PRIME_1 0x9e3779b1U
+#define PICTURE_HASH_PRIME_2 0x85ebca77U
+#define PICTURE_HASH_PRIME_3 0x100000001b3ULL
+
+/*
+ * Hash the content of a picture buffer in order to detect unchanged frames.
+ *
+ * The buffer is consumed in blocks of PICTURE_HASH_LANES 32 bits words which
+ * are accumulated in independent lanes, this way the inner loop has no
+ * dependencies between iterations and the compiler can vectorize it.
+ */
+static uint64_t picture_hash(const uint8_t *buffer, size_t len)
+{
+	uint32_t lanes[PICTURE_HASH_LANES];
+	uint64_t hash;
+	unsigned int i;
+
+	for (i = 0; i < PICTURE_HASH_LANES; i++)
+		lanes[i] = PICTURE_HASH_PRIME_1 * (i + 1);
+
+	while (len >= sizeof(lanes)) {
+		for (i = 0; i < PICTURE_HASH_LANES; i++) {
+			uint32_t word;
+
+			memcpy(&word, buffer + i * sizeof(word), sizeof(word));
+			lanes[i] += word * PICTURE_HASH_PRIME_2;
+			lanes[i] = (lanes[i] << 13) | (lanes[i] >> 19);
+			lanes[i] *= PICTURE_HASH_PRIME_1;
+		}
+		buffer += sizeof(lanes);
+		len -= sizeof(lanes);
+	}
+
+	hash = len;
+	for (i = 0; i < PICTURE_HASH_LANES; i++)
+		hash = (hash ^ lanes[i]) * PICTURE_HASH_PRIME_3;
+
+	while (len--)
+		hash = (hash ^ *buffer++) * PICTURE_HASH_PRIME_3;
+
+	return hash;
+}
+
+/*
+ * Check that a JPEG picture can be sent to the device as it is.
+ *
+ * Only baseline JPEGs with 4:2:0 chroma subsampling, like the ones produced
+ * by the encoder in video_output_init(), are accepted; the picture must also
+ * carry its own Huffman tables, which some cameras omit in MJPEG streams.
+ */
+static int jpeg_can_passthrough(const uint8_t *data, int size,
+				int width, int height)
+{
+	const uint8_t *end = data + size;
+	const uint8_t *segment;
+	unsigned int length;
+	int has_frame = 0;
+	int has_huffman_tables = 0;
+
+	if (size < 4 || data[0] != 0xff || data[1] != 0xd8)
+		return 0;
+
+	/* some cameras pad the pictures after the EOI marker */
+	while (end - data > 2 && end[-1] == 0x00)
+		end--;
+	if (end[-2] != 0xff || end[-1] != 0xd9)
+		return 0;
+
+	data += 2;
+	while (end - data >= 4) {
+		if (data[0] != 0xff)
+			return 0;
+
+		/* fill bytes */
+		if (data[1] == 0xff) {
+			data++;
+			continue;
+		}
+
+		length = (data[2] << 8) | data[3];
+		if (length < 2 || (unsigned int)(end - data) < length + 2)
+			return 0;
+		segment = data + 4;
+
+		switch (data[1]) {
+		case 0xc0: /* SOF0, baseline DCT */
+			if (length < 17 || segment[0] != 8 || segment[5] != 3)
+				return 0;
+			if (((segment[1] << 8) | segment[2]) != height ||
+			    ((segment[3] << 8) | segment[4]) != width)
+				return 0;
+			/* Y sampled 2x2, Cb and Cr 1x1 */
+			if (segment[7] != 0x22 || segment[10] != 0x11 || segment[13] != 0x11)
+				return 0;
+			has_frame = 1;
+			break;
+		case 0xc4: /* DHT */
+			has_huffman_tables = 1;
+			break;
+		case 0xda: /* SOS, the entropy coded data follows */
+			return has_frame && has_huffman_tables;
+		default:
+			/* any other SOFn, or DAC for arithmetic coding */
+			if (data[1] >= 0xc1 && data[1] <= 0xcf && data[1] != 0xc8)
+				return 0;
+			break;
+		}
+
+		data += length + 2;
+	}
+
+	return 0;
+}
+
+/* What video_input_read() got from the input */
+enum video_input_result {
+	VIDEO_INPUT_END            = 0,
+	VIDEO_INPUT_PICTURE        = 1,
+	VIDEO_INPUT_PACKET         = 2,
+	VIDEO_INPUT_SOURCE_PICTURE = 3,
+};
+
+/* Check that a NV12 picture is laid out the way the device wants it */
+static int nv12_can_passthrough(struct video_source_picture *picture,
+				int width, int height)
+{
+	return picture->linesize[0] == width &&
+	       picture->linesize[1] == width &&
+	       picture->data[1] == picture->data[0] + width * height &&
+	       picture->size >= width * height * 3 / 2;
+}
+
+/*
+ * Get a picture from a native source, the picture points straight into the
+ * source memory and it is given back on the next read.
+ *
+ * When passthrough is enabled and the picture can be sent to the device as
+ * it is, VIDEO_INPUT_SOURCE_PICTURE is returned and the caller owns the
+ * source picture in input_ctx->source_picture, which it has to release.
+ *
+ * Compressed pictures which cannot be passed through get decoded, and
+ * their buffer goes back to the source right away.
+ */
+static int video_input_read_source(struct video_input_ctx *input_ctx,
+				   AVFrame *picture)
+{
+	struct video_source_picture *source_picture = &input_ctx->source_picture;
+	AVCodecContext *codec_ctx = input_ctx->codec_ctx;
+	AVPacket packet;
+	int got_picture;
+	unsigned int i;
+	int ret;
+
+	if (input_ctx->has_source_picture) {
+		input_ctx->source_ops->release(input_ctx->source, source_picture);
+		input_ctx->has_source_picture = 0;
+	}
+
+read_picture:
+	do {
+		ret = input_ctx->source_ops->read(input_ctx->source, source_picture);
+	} while (ret == -EAGAIN && run);
+	if (ret == -EAGAIN)
+		return VIDEO_INPUT_END;
+	else if (ret <= 0)
+		return ret;
+
+	if (input_ctx->trace)
+		input_ctx->read_time = monotonic_time();
+
+	if (codec_ctx->codec_id == CODEC_ID_MJPEG) {
+		if (input_ctx->passthrough &&
+		    jpeg_can_passthrough(source_picture->data[0], source_picture->size,
+					 codec_ctx->width, codec_ctx->height))
+			return VIDEO_INPUT_SOURCE_PICTURE;
+
+		av_init_packet(&packet);
+		packet.data = source_picture->data[0];
+		packet.size = source_picture->size;
+		ret = avcodec_decode_video2(codec_ctx, picture, &got_picture, &packet);
+		input_ctx->source_ops->release(input_ctx->source, source_picture);
+
+		/* cameras send a broken picture every now and then */
+		if (ret < 0)
+			fprintf(stderr, "cannot decode video, skipping the picture\n");
+		if (ret < 0 || !got_picture)
+			goto read_picture;
+
+		return VIDEO_INPUT_PICTURE;
+	}
+
+	if (input_ctx->passthrough &&
+	    nv12_can_passthrough(source_picture, codec_ctx->width, codec_ctx->height)) {
+		source_picture->size = codec_ctx->width * codec_ctx->height * 3 / 2;
+		return VIDEO_INPUT_SOURCE_PICTURE;
+	}
+
+	input_ctx->has_source_picture = 1;
+
+	for (i = 0; i < 4; i++) {
+		picture->data[i] = source_picture->data[i];
+		picture->linesize[i] = source_picture->linesize[i];
+	}
+	picture->pkt_pts = AV_NOPTS_VALUE;
+	picture->pkt_dts = AV_NOPTS_VALUE;
+
+	return VIDEO_INPUT_PICTURE;
+}
+
+/*
+ * Read packets from the input and decode them until a full picture is
+ * available.
+ *
+ * When passthrough is enabled and a packet already holds a JPEG picture the
+ * device can show, the packet is returned undecoded in 'packet' and the
+ * caller owns it.
+ *
+ * Returns VIDEO_INPUT_PICTURE when a picture has been decoded,
+ * VIDEO_INPUT_PACKET when a packet can be passed through, VIDEO_INPUT_END
+ * when the input is over and there are no more pictures buffered in the
+ * decoder, or a negative value on error.
+ *
+ * Native sources are read with video_input_read_source() instead.
+ */
+static int video_input_read(struct video_input_ctx *input_ctx,
+			    AVFrame *picture,
+			    AVPacket *packet)
+{
+	int got_picture = 0;
+	int ret;
+
+	if (input_ctx->source_ops)
+		return video_input_read_source(input_ctx, picture);
+
+	do {
+		if (!input_ctx->draining) {
+			ret = av_read_frame(input_ctx->format_ctx, packet);
+			if (input_ctx->trace)
+				input_ctx->read_time = monotonic_time();
+			if (ret < 0) {
+				if (ret != (int)AVERROR_EOF &&
+				    !(input_ctx->format_ctx->pb &&
+				      input_ctx->format_ctx->pb->eof_reached)) {
+					fprintf(stderr, "av_read_frame failed, EOF?\n");
+					return ret;
+				}
+				input_ctx->draining = 1;
+			} else if (packet->stream_index != input_ctx->video_stream_index) {
+				av_free_packet(packet);
+				continue;
+			} else if (input_ctx->passthrough &&
+				   jpeg_can_passthrough(packet->data, packet->size,
+							(input_ctx->codec_ctx)->width,
+							(input_ctx->codec_ctx)->height)) {
+				/* make sure the data outlives the next read */
+				ret = av_dup_packet(packet);
+				if (ret < 0) {
+					av_free_packet(packet);
+					return ret;
+				}
+				return VIDEO_INPUT_PACKET;
+			}
+		}
+
+		/* When using frame threading the decoder keeps some pictures
+		 * buffered, get them out by passing empty packets */
+		if (input_ctx->draining) {
+			av_init_packet(packet);
+			packet->data = NULL;
+			packet->size = 0;
+		}
+
+		ret = avcodec_decode_video2(input_ctx->codec_ctx, picture, &got_picture, packet);
+		if (!input_ctx->draining)
+			av_free_packet(packet);
+		if (ret < 0) {
+			fprintf(stderr, "cannot decode video\n");
+			return ret;
+		}
+
+		if (input_ctx->draining && !got_picture)
+			return VIDEO_INPUT_END;
+	} while (!got_picture);
+
+	return VIDEO_INPUT_PICTURE;
+}
+
+/*
+ * A frame moving along the pipeline, the frames are allocated once and then
+ * passed from one stage to the next one via the frame queues, and finally
+ * recycled.
+ */
+struct play_frame {
+	unsigned int sequence;
+	int64_t pts;
+	int dropped;
+	int passthrough;
+	AVFrame *picture;
+	uint8_t *picture_buf;
+	int picture_buf_size;
+	AVPacket packet;
+	int got_packet;
+	struct video_source_picture source_picture;
+	int has_source_picture;
+	uint8_t *transformed_buf;
+	size_t transformed_buf_size;
+	uint8_t *data;
+	int data_size;
+	int traced;
+	struct frame_trace_record trace;
+};
+
+/* Record when a traced frame reaches a stage */
+static inline void frame_trace_stage(struct play_frame *frame,
+				     enum frame_trace_stage stage)
+{
+	if (frame->traced)
+		frame->trace.times[stage] = monotonic_time();
+}
+
+/* A bounded FIFO of frames, safe to be used from different threads */
+struct frame_queue {
+	struct play_frame **frames;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+static int frame_queue_init(struct frame_queue *queue, unsigned int size)
+{
+	int ret;
+
+	queue->frames = calloc(size, sizeof(*queue->frames));
+	if (queue->frames == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+
+	queue->size = size;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = 0;
+
+	ret = pthread_mutex_init(&queue->mutex, NULL);
+	if (ret != 0)
+		goto err_free_frames;
+
+	ret = pthread_cond_init(&queue->not_empty, NULL);
+	if (ret != 0)
+		goto err_destroy_mutex;
+
+	ret = pthread_cond_init(&queue->not_full, NULL);
+	if (ret != 0)
+		goto err_destroy_not_empty;
+
+	return 0;
+
+err_destroy_not_empty:
+	pthread_cond_destroy(&queue->not_empty);
+err_destroy_mutex:
+	pthread_mutex_destroy(&queue->mutex);
+err_free_frames:
+	free(queue->frames);
+	queue->frames = NULL;
+	fprintf(stderr, "cannot initialize the frame queue\n");
+	return -ret;
+}
+
+static void frame_queue_cleanup(struct frame_queue *queue)
+{
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue->frames);
+	queue->frames = NULL;
+}
+
+/* Add a frame to the queue, wait if the queue is full.
+ *
+ * Returns 0 on success or -EPIPE if the queue has been closed.
+ */
+static int frame_queue_push(struct frame_queue *queue, struct play_frame *frame)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == queue->size && !queue->closed)
+		pthread_cond_wait(&queue->not_full, &queue->mutex);
+
+	if (queue->closed) {
+		ret = -EPIPE;
+		goto out;
+	}
+
+	queue->frames[(queue->head + queue->count) % queue->size] = frame;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+
+out:
+	pthread_mutex_unlock(&queue->mutex);
+	return ret;
+}
+
+/* Get the oldest frame from the queue, wait if the queue is empty.
+ *
+ * Returns NULL when the queue has been closed and there are no more frames
+ * in it.
+ */
+static struct play_frame *frame_queue_pop(struct frame_queue *queue)
+{
+	struct play_frame *frame = NULL;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == 0 && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->mutex);
+
+	if (queue->count > 0) {
+		frame = queue->frames[queue->head];
+		queue->head = (queue->head + 1) % queue->size;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+	return frame;
+}
+
+/* After a queue is closed no more frames can be added to it, the frames
+ * already in the queue can still be taken out */
+static void frame_queue_close(struct frame_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * The playback is split in three stages running concurrently:
+ *
+ *   - the input thread reads, decodes and rescales the pictures;
+ *   - one or more encoder threads convert the pictures to the device format;
+ *   - the main thread sends the pictures to the device.
+ *
+ * The frames flow from the free_frames queue to the scaled_frames queue, to
+ * the encoded_frames queue and back to the free_frames queue, so the number
+ * of frames in the pool bounds the number of pictures in flight.
+ */
+struct play_pipeline {
+	struct video_input_ctx *input_ctx;
+	struct video_output_ctx *output_ctxs;
+	unsigned int encoders_count;
+	struct SwsContext *sw_scale_ctx;
+	unsigned int rescale_method;
+
+	struct play_frame *frames;
+	unsigned int frames_count;
+	struct frame_queue free_frames;
+	struct frame_queue scaled_frames;
+	struct frame_queue encoded_frames;
+
+	unsigned int skip_unchanged;
+	unsigned int keepalive_interval;
+
+	/* blended on the scaled pictures, before encoding */
+	struct overlay *overlays;
+	unsigned int overlays_count;
+
+	/* applied to the scaled pictures after the overlays, and to the
+	 * JPEG pictures passed through by the encoder threads */
+	enum orientation orientation;
+
+	/* the stage times of the frames, sampled */
+	struct frame_trace *trace;
+
+	/* the presentation clock, all times are in microseconds */
+	unsigned int pacing;
+	unsigned int preroll;
+	int64_t frame_duration;
+	int clock_started;
+	int64_t clock_start_time;
+	int64_t clock_start_pts;
+
+	pthread_mutex_t mutex;
+	unsigned int running_encoders;
+	int input_ret;
+	int encode_ret;
+};
+
+/* Frames later than this are dropped before being encoded */
+#define PACING_MAX_LATENESS 20000
+
+/* Timestamps further apart than this from the clock are considered
+ * a discontinuity in the stream, and the clock is restarted */
+#define PACING_MAX_DRIFT 2000000
+
+static void sleep_until(int64_t time)
+{
+	struct timespec ts;
+	int64_t delay;
+
+	/* nanosleep() is interrupted by signals, check run again then */
+	while (run && (delay = time - monotonic_time()) > 0) {
+		ts.tv_sec = delay / 1000000;
+		ts.tv_nsec = (delay % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Wait until it is time to show the picture with the given timestamp, the
+ * clock starts with the first picture shown */
+static void pipeline_clock_wait(struct play_pipeline *pipeline, int64_t pts)
+{
+	int64_t now = monotonic_time();
+	int64_t due;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	due = pipeline->clock_start_time + (pts - pipeline->clock_start_pts);
+	if (!pipeline->clock_started ||
+	    due - now > PACING_MAX_DRIFT || now - due > PACING_MAX_DRIFT) {
+		pipeline->clock_started = 1;
+		pipeline->clock_start_time = now;
+		pipeline->clock_start_pts = pts;
+		due = now;
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	sleep_until(due);
+}
+
+static int pipeline_frame_is_late(struct play_pipeline *pipeline, int64_t pts)
+{
+	int64_t due;
+	int late = 0;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	if (pipeline->clock_started) {
+		due = pipeline->clock_start_time + (pts - pipeline->clock_start_pts);
+		late = monotonic_time() - due > PACING_MAX_LATENESS;
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return late;
+}
+
+static void pipeline_abort(struct play_pipeline *pipeline)
+{
+	run = 0;
+	frame_queue_close(&pipeline->free_frames);
+	frame_queue_close(&pipeline->scaled_frames);
+	frame_queue_close(&pipeline->encoded_frames);
+}
+
+/* Give back the input data a frame was holding */
+static void pipeline_frame_recycle(struct play_pipeline *pipeline,
+				   struct play_frame *frame)
+{
+	struct video_input_ctx *input_ctx = pipeline->input_ctx;
+
+	if (frame->got_packet) {
+		av_free_packet(&frame->packet);
+		frame->got_packet = 0;
+	}
+
+	if (frame->has_source_picture) {
+		input_ctx->source_ops->release(input_ctx->source,
+					       &frame->source_picture);
+		frame->has_source_picture = 0;
+	}
+}
+
+static void pipeline_frames_free(struct play_pipeline *pipeline)
+{
+	unsigned int i;
+
+	for (i = 0; i < pipeline->frames_count; i++) {
+		struct play_frame *frame = &pipeline->frames[i];
+
+		pipeline_frame_recycle(pipeline, frame);
+		free(frame->transformed_buf);
+		av_free(frame->picture_buf);
+		av_free(frame->picture);
+	}
+	free(pipeline->frames);
+	pipeline->frames = NULL;
+}
+
+static int pipeline_frames_alloc(struct play_pipeline *pipeline,
+				 unsigned int frames_count)
+{
+	AVCodecContext *output_codec_ctx = pipeline->output_ctxs[0].codec_ctx;
+	unsigned int i;
+	int ret;
+
+	pipeline->frames = calloc(frames_count, sizeof(*pipeline->frames));
+	if (pipeline->frames == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+	pipeline->frames_count = frames_count;
+
+	for (i = 0; i < frames_count; i++) {
+		struct play_frame *frame = &pipeline->frames[i];
+
+		frame->picture = avcodec_alloc_frame();
+		if (frame->picture == NULL) {
+			fprintf(stderr, "cannot allocate the scaled picture!\n");
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		/* calculate the bytes needed for the output image and create
+		 * buffer for the output image */
+		frame->picture_buf_size = avpicture_get_size(output_codec_ctx->pix_fmt,
+							     output_codec_ctx->width,
+							     output_codec_ctx->height);
+		frame->picture_buf = av_malloc(frame->picture_buf_size * sizeof(uint8_t));
+		if (frame->picture_buf == NULL) {
+			fprintf(stderr, "cannot allocate output data buffer!\n");
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		/* assign appropriate parts of buffer to image planes in the
+		 * scaled picture */
+		avpicture_fill((AVPicture *)frame->picture,
+			       frame->picture_buf,
+			       output_codec_ctx->pix_fmt,
+			       output_codec_ctx->width,
+			       output_codec_ctx->height);
+
+		ret = frame_queue_push(&pipeline->free_frames, frame);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	pipeline_frames_free(pipeline);
+	return ret;
+}
+
+static void *input_thread(void *arg)
+{
+	struct play_pipeline *pipeline = arg;
+	struct video_input_ctx *input_ctx = pipeline->input_ctx;
+	AVCodecContext *output_codec_ctx = pipeline->output_ctxs[0].codec_ctx;
+	AVRational time_base_us = { 1, AV_TIME_BASE };
+	struct play_frame *frame = NULL;
+	AVFrame *picture_raw;
+	AVPacket packet;
+	int64_t pts;
+	int64_t dts;
+	int64_t last_pts = 0;
+	uint8_t *picture_data;
+	int picture_data_size;
+	uint64_t picture_scaled_hash;
+	uint64_t last_picture_hash = 0;
+	unsigned int skipped_frames = 0;
+	unsigned int sequence = 0;
+	int64_t read_start_time = 0;
+	int64_t decoded_time = 0;
+	unsigned int i;
+	int traced;
+	int ret = 0;
+
+	/* allocate an input frame */
+	picture_raw = avcodec_alloc_frame();
+	if (picture_raw == NULL) {
+		fprintf(stderr, "cannot allocate the raw picture frame!\n");
+		ret = -ENOMEM;
+		pipeline_abort(pipeline);
+		goto out;
+	}
+
+	while (run) {
+		/* skipped pictures do not take a sequence number */
+		traced = frame_trace_sampled(pipeline->trace, sequence);
+		input_ctx->trace = traced;
+		if (traced)
+			read_start_time = monotonic_time();
+
+		ret = video_input_read(input_ctx, picture_raw, &packet);
+		if (ret < 0) {
+			pipeline_abort(pipeline);
+			break;
+		} else if (ret == VIDEO_INPUT_END) {
+			break;
+		}
+
+		if (traced && ret == VIDEO_INPUT_PICTURE)
+			decoded_time = monotonic_time();
+
+		/* A frame left over from a skipped picture can be reused */
+		if (frame == NULL) {
+			frame = frame_queue_pop(&pipeline->free_frames);
+			if (frame == NULL) {
+				if (ret == VIDEO_INPUT_PACKET)
+					av_free_packet(&packet);
+				else if (ret == VIDEO_INPUT_SOURCE_PICTURE)
+					input_ctx->source_ops->release(input_ctx->source,
+								       &input_ctx->source_picture);
+				ret = 0;
+				break;
+			}
+		}
+
+		frame->traced = traced;
+		if (traced) {
+			memset(&frame->trace, 0, sizeof(frame->trace));
+			frame->trace.times[FRAME_TRACE_READ_START] = read_start_time;
+			frame->trace.times[FRAME_TRACE_READ] = input_ctx->read_time;
+			if (ret == VIDEO_INPUT_PICTURE)
+				frame->trace.times[FRAME_TRACE_DECODED] = decoded_time;
+		}
+
+		if (ret == VIDEO_INPUT_PACKET) {
+			/* the JPEG picture goes to the device as it is */
+			frame->packet = packet;
+			frame->got_packet = 1;
+			frame->passthrough = 1;
+
+			picture_data = packet.data;
+			picture_data_size = packet.size;
+			pts = packet.pts;
+			dts = packet.dts;
+		} else if (ret == VIDEO_INPUT_SOURCE_PICTURE) {
+			/* the picture goes to the device straight from the
+			 * source memory, which is given back once sent */
+			frame->source_picture = input_ctx->source_picture;
+			frame->has_source_picture = 1;
+			frame->passthrough = 1;
+
+			picture_data = frame->source_picture.data[0];
+			picture_data_size = frame->source_picture.size;
+			pts = AV_NOPTS_VALUE;
+			dts = AV_NOPTS_VALUE;
+		} else {
+			frame->passthrough = 0;
+
+			/* The pixel format of decoded pictures may be known
+			 * only after the first one, a cached context is set up
+			 * just once anyway */
+			pipeline->sw_scale_ctx = sws_getCachedContext(pipeline->sw_scale_ctx,
+								      (input_ctx->codec_ctx)->width,
+								      (input_ctx->codec_ctx)->height,
+								      (input_ctx->codec_ctx)->pix_fmt,
+								      output_codec_ctx->width,
+								      output_codec_ctx->height,
+								      output_codec_ctx->pix_fmt,
+								      pipeline->rescale_method,
+								      NULL, NULL, NULL);
+			if (pipeline->sw_scale_ctx == NULL) {
+				fprintf(stderr, "cannot set up the rescaling context!\n");
+				ret = -EINVAL;
+				pipeline_abort(pipeline);
+				break;
+			}
+
+			/* convert it to YUV */
+			frame_trace_stage(frame, FRAME_TRACE_SCALE_START);
+			sws_scale(pipeline->sw_scale_ctx,
+				  (const uint8_t * const*)picture_raw->data,
+				  picture_raw->linesize,
+				  0,
+				  (input_ctx->codec_ctx)->height,
+				  frame->picture->data,
+				  frame->picture->linesize);
+			for (i = 0; i < pipeline->overlays_count; i++)
+				overlay_blend(&pipeline->overlays[i],
+					      frame->picture->data[0],
+					      frame->picture->linesize[0],
+					      frame->picture->data[1],
+					      frame->picture->data[2],
+					      frame->picture->linesize[1]);
+			orientation_apply(pipeline->orientation,
+					  pipeline->output_ctxs[0].raw_output,
+					  frame->picture->data[0],
+					  frame->picture->linesize[0],
+					  frame->picture->data[1],
+					  frame->picture->data[2],
+					  frame->picture->linesize[1],
+					  output_codec_ctx->width,
+					  output_codec_ctx->height);
+			frame_trace_stage(frame, FRAME_TRACE_SCALED);
+
+			picture_data = frame->picture_buf;
+			picture_data_size = frame->picture_buf_size;
+			pts = picture_raw->pkt_pts;
+			dts = picture_raw->pkt_dts;
+		}
+
+		frame->data = picture_data;
+		frame->data_size = picture_data_size;
+
+		/* Skip the frame if the picture did not change since the last
+		 * one sent, the device keeps showing it anyway; still re-send
+		 * it every keepalive_interval frames, if requested.
+		 */
+		if (pipeline->skip_unchanged) {
+			picture_scaled_hash = picture_hash(picture_data,
+							   picture_data_size);
+			if (picture_scaled_hash == last_picture_hash &&
+			    (pipeline->keepalive_interval == 0 ||
+			     skipped_frames + 1 < pipeline->keepalive_interval)) {
+				skipped_frames++;
+				pipeline_frame_recycle(pipeline, frame);
+				continue;
+			}
+			last_picture_hash = picture_scaled_hash;
+			skipped_frames = 0;
+		}
+
+		/* Timestamps are kept in microseconds, when they are missing
+		 * use the capture time for live inputs, and just assume
+		 * a constant frame rate otherwise */
+		if (pts == AV_NOPTS_VALUE)
+			pts = dts;
+		if (pts != AV_NOPTS_VALUE)
+			frame->pts = av_rescale_q(pts, input_ctx->time_base, time_base_us);
+		else if (input_ctx->live)
+			frame->pts = monotonic_time();
+		else
+			frame->pts = last_pts + pipeline->frame_duration;
+		last_pts = frame->pts;
+
+		frame->sequence = sequence++;
+		frame->dropped = 0;
+		ret = frame_queue_push(&pipeline->scaled_frames, frame);
+		if (ret < 0) {
+			/* the pipeline has been aborted */
+			ret = 0;
+			break;
+		}
+		frame = NULL;
+	}
+
+	av_free(picture_raw);
+out:
+	frame_queue_close(&pipeline->scaled_frames);
+	pipeline->input_ret = ret < 0 ? ret : 0;
+	return NULL;
+}
+
+static void *encode_thread(void *arg)
+{
+	struct video_output_ctx *output_ctx = arg;
+	struct play_pipeline *pipeline = output_ctx->pipeline;
+	struct play_frame *frame;
+	size_t transformed_size;
+	int ret = 0;
+
+	while ((frame = frame_queue_pop(&pipeline->scaled_frames))) {
+		/* Don't waste time encoding a frame which is going to be shown
+		 * late anyway, the sender just recycles it */
+		if (pipeline->pacing && pipeline_frame_is_late(pipeline, frame->pts)) {
+			frame->dropped = 1;
+		} else if (frame->passthrough &&
+			   pipeline->orientation != ORIENTATION_NORMAL) {
+			/* only JPEG pictures are passed through when turning
+			 * them, and that does not need decoding them */
+			frame->trace.encoder = output_ctx - pipeline->output_ctxs;
+			frame_trace_stage(frame, FRAME_TRACE_ENCODE_START);
+			ret = jpeg_transform_picture(&output_ctx->transform,
+						     pipeline->orientation,
+						     frame->data,
+						     frame->data_size,
+						     &frame->transformed_buf,
+						     &frame->transformed_buf_size,
+						     &transformed_size);
+			if (ret == -ENOMEM) {
+				fprintf(stderr, "cannot allocate the transformed picture\n");
+				pipeline_abort(pipeline);
+				break;
+			} else if (ret < 0) {
+				fprintf(stderr, "cannot transform the JPEG picture, skipping it\n");
+				frame->dropped = 1;
+				ret = 0;
+			} else {
+				frame->data = frame->transformed_buf;
+				frame->data_size = transformed_size;
+			}
+			frame_trace_stage(frame, FRAME_TRACE_ENCODED);
+		} else if (frame->passthrough || output_ctx->raw_output) {
+			/* the input thread already set the data to send */
+		} else {
+			frame->trace.encoder = output_ctx - pipeline->output_ctxs;
+			frame_trace_stage(frame, FRAME_TRACE_ENCODE_START);
+			frame->picture->quality = (output_ctx->codec_ctx)->global_quality;
+			av_init_packet(&frame->packet);
+			frame->packet.data = NULL;
+			frame->packet.size = 0;
+			frame->got_packet = 0;
+			ret = avcodec_encode_video2(output_ctx->codec_ctx,
+						    &frame->packet,
+						    frame->picture,
+						    &frame->got_packet);
+			if (ret < 0 || !frame->got_packet) {
+				fprintf(stderr, "cannot encode video\n");
+				if (ret >= 0)
+					ret = -EINVAL;
+				pipeline_abort(pipeline);
+				break;
+			}
+
+			frame_trace_stage(frame, FRAME_TRACE_ENCODED);
+
+			frame->data = frame->packet.data;
+			frame->data_size = frame->packet.size;
+		}
+
+		ret = frame_queue_push(&pipeline->encoded_frames, frame);
+		if (ret < 0) {
+			/* the pipeline has been aborted */
+			ret = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&pipeline->mutex);
+	if (ret < 0)
+		pipeline->encode_ret = ret;
+
+	/* the last encoder going away closes the queue */
+	if (--pipeline->running_encoders == 0)
+		frame_queue_close(&pipeline->encoded_frames);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return NULL;
+}
+
+static int send_frame(struct play_frame *frame,
+		      struct video_output_ctx *output_ctx,
+		      am7xxx_image_format image_format,
+		      unsigned int reconnect,
+		      am7xxx_device *dev)
+{
+	int ret;
+
+#ifdef DEBUG
+	char filename[NAME_MAX];
+	FILE *file;
+	if (!output_ctx->raw_output)
+		snprintf(filename, NAME_MAX, "out_q%03d.jpg", output_ctx->quality);
+	else
+		snprintf(filename, NAME_MAX, "out.raw");
+	file = fopen(filename, "wb");
+	fwrite(frame->data, 1, frame->data_size, file);
+	fclose(file);
+#endif
+
+	ret = am7xxx_send_image_async(dev,
+				      image_format,
+				      (output_ctx->codec_ctx)->width,
+				      (output_ctx->codec_ctx)->height,
+				      frame->data,
+				      frame->data_size);
+	if (ret < 0)
+		perror("am7xxx_send_image");
+
+	/* the frame is lost with the device, the next one gets it back,
+	 * unless it did not come back in time */
+	if (ret < 0 && reconnect && ret != -ETIMEDOUT) {
+		fprintf(stderr, "frame dropped, waiting for the device\n");
+		ret = 0;
+	}
+
+	return ret;
+}
+
 static int am7xxx_play(const char *input_format_string,
 		       AVDictionary **input_options,
 		       const char *input_path,
+		       const char *output_path,
 		       unsigned int rescale_method,
 		       unsigned int upscale,
 		       unsigned int quality,
 		       am7xxx_image_format image_format,
+		       unsigned int skip_unchanged,
+		       unsigned int keepalive_interval,
+		       unsigned int queue_depth,
+		       unsigned int threads,
+		       unsigned int preroll,
+		       unsigned int dct_downscale,
+		       unsigned int reconnect,
+		       char **overlay_specs,
+		       unsigned int overlays_count,
+		       enum orientation orientation,
+		       struct frame_trace *trace,
 		       am7xxx_device *dev)
 {
 	struct video_input_ctx input_ctx;
-	struct video_output_ctx output_ctx;
-	AVFrame *picture_raw;
-	AVFrame *picture_scaled;
-	int out_buf_size;
-	uint8_t *out_buf;
-	int out_picture_size;
-	uint8_t *out_picture;
-	struct SwsContext *sw_scale_ctx;
-	AVPacket in_packet;
-	AVPacket out_packet;
-	int got_picture;
-	int got_packet;
+	struct play_pipeline pipeline;
+	struct play_frame **pending;
+	struct play_frame *frame;
+	struct play_frame *next_frame;
+	struct frame_file_writer *writer = NULL;
+	struct frame_trace_record *record;
+	int writer_ret;
+	AVStream *stream;
+	unsigned int buffered_frames;
+	unsigned int dropped_frames;
+	pthread_t input_thread_id;
+	pthread_t *encode_thread_ids;
+	unsigned int encoders_started = 0;
+	unsigned int next_sequence;
+	unsigned int i;
 	int ret;
 
-	ret = video_input_init(&input_ctx, input_format_string, input_path, input_options);
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.input_ctx = &input_ctx;
+	pipeline.rescale_method = rescale_method;
+	pipeline.skip_unchanged = skip_unchanged;
+	pipeline.keepalive_interval = keepalive_interval;
+	pipeline.orientation = orientation;
+	pipeline.trace = trace;
+
+	ret = video_input_init(&input_ctx, input_format_string, input_path, input_options,
+			       threads, dct_downscale, upscale, dev);
 	if (ret < 0) {
 		fprintf(stderr, "cannot initialize input\n");
 		goto out;
 	}
 
-	ret = video_output_init(&output_ctx, &input_ctx, upscale, quality, image_format, dev);
-	if (ret < 0) {
-		fprintf(stderr, "cannot initialize input\n");
+	/* JPEG pictures are independent from each other, so they can be
+	 * encoded in parallel each one with its own encoder, in raw mode there
+	 * is nothing to encode so just one thread is enough to pass the frames
+	 * along.
+	 */
+	pipeline.encoders_count = 1;
+	if (image_format == AM7XXX_IMAGE_FORMAT_JPEG)
+		pipeline.encoders_count = threads > 0 ? threads : get_cpu_count();
+
+	pipeline.output_ctxs = calloc(pipeline.encoders_count, sizeof(*pipeline.output_ctxs));
+	if (pipeline.output_ctxs == NULL) {
+		perror("calloc");
+		ret = -ENOMEM;
 		goto cleanup_input;
 	}
 
-	/* allocate an input frame */
-	picture_raw = avcodec_alloc_frame();
-	if (picture_raw == NULL) {
-		fprintf(stderr, "cannot allocate the raw picture frame!\n");
+	encode_thread_ids = calloc(pipeline.encoders_count, sizeof(*encode_thread_ids));
+	if (encode_thread_ids == NULL) {
+		perror("calloc");
 		ret = -ENOMEM;
-		goto cleanup_output;
+		goto cleanup_output_ctxs;
 	}
 
-	/* allocate output frame */
-	picture_scaled = avcodec_alloc_frame();
-	if (picture_scaled == NULL) {
-		fprintf(stderr, "cannot allocate the scaled picture!\n");
-		ret = -ENOMEM;
-		goto cleanup_picture_raw;
+	for (i = 0; i < pipeline.encoders_count; i++) {
+		ret = video_output_init(&pipeline.output_ctxs[i], &input_ctx, upscale, quality, image_format, dev);
+		if (ret < 0) {
+			fprintf(stderr, "cannot initialize output\n");
+			goto cleanup_output;
+		}
+		pipeline.output_ctxs[i].pipeline = &pipeline;
 	}
 
-	/* calculate the bytes needed for the output image and create buffer for the output image */
-	out_buf_size = avpicture_get_size((output_ctx.codec_ctx)->pix_fmt,
-					  (output_ctx.codec_ctx)->width,
-					  (output_ctx.codec_ctx)->height);
-	out_buf = av_malloc(out_buf_size * sizeof(uint8_t));
-	if (out_buf == NULL) {
-		fprintf(stderr, "cannot allocate output data buffer!\n");
-		ret = -ENOMEM;
-		goto cleanup_picture_scaled;
-	}
-
-	/* assign appropriate parts of buffer to image planes in picture_scaled */
-	avpicture_fill((AVPicture *)picture_scaled,
-		       out_buf,
-		       (output_ctx.codec_ctx)->pix_fmt,
-		       (output_ctx.codec_ctx)->width,
-		       (output_ctx.codec_ctx)->height);
-
-	sw_scale_ctx = sws_getCachedContext(NULL,
-					    (input_ctx.codec_ctx)->width,
-					    (input_ctx.codec_ctx)->height,
-					    (input_ctx.codec_ctx)->pix_fmt,
-					    (output_ctx.codec_ctx)->width,
-					    (output_ctx.codec_ctx)->height,
-					    (output_ctx.codec_ctx)->pix_fmt,
-					    rescale_method,
-					    NULL, NULL, NULL);
-	if (sw_scale_ctx == NULL) {
-		fprintf(stderr, "cannot set up the rescaling context!\n");
-		ret = -EINVAL;
-		goto cleanup_out_buf;
+	/* The overlays are converted once to the format of the scaled
+	 * pictures, YUVJ420P for JPEG and NV12 for raw output */
+	if (overlays_count > 0) {
+		pipeline.overlays = calloc(overlays_count, sizeof(*pipeline.overlays));
+		if (pipeline.overlays == NULL) {
+			perror("calloc");
+			ret = -ENOMEM;
+			goto cleanup_output;
+		}
+	}
+	for (i = 0; i < overlays_count; i++) {
+		ret = overlay_load(&pipeline.overlays[i],
+				   image_format == AM7XXX_IMAGE_FORMAT_NV12 ?
+				   OVERLAY_FORMAT_NV12 : OVERLAY_FORMAT_YUVJ420P,
+				   overlay_specs[i],
+				   (pipeline.output_ctxs[0].codec_ctx)->width,
+				   (pipeline.output_ctxs[0].codec_ctx)->height);
+		if (ret < 0) {
+			fprintf(stderr, "cannot load the overlay %s\n", overlay_specs[i]);
+			goto cleanup_overlays;
+		}
+		pipeline.overlays_count++;
 	}
 
-	while (run) {
-		/* read packet */
-		ret = av_read_frame(input_ctx.format_ctx, &in_packet);
+	/* MJPEG pictures which already fit the device can be sent without
+	 * decoding and encoding them again, the pictures which the device
+	 * may not be able to show still go through the normal path; with
+	 * overlays all the pictures need to be decoded, and so they do when
+	 * they cannot be turned losslessly */
+	if (image_format == AM7XXX_IMAGE_FORMAT_JPEG &&
+	    overlays_count == 0 &&
+	    jpeg_transform_is_lossless(orientation,
+				       (input_ctx.codec_ctx)->width,
+				       (input_ctx.codec_ctx)->height) &&
+	    (input_ctx.codec_ctx)->codec_id == CODEC_ID_MJPEG &&
+	    (input_ctx.codec_ctx)->width == (pipeline.output_ctxs[0].codec_ctx)->width &&
+	    (input_ctx.codec_ctx)->height == (pipeline.output_ctxs[0].codec_ctx)->height) {
+		fprintf(stdout, "passing JPEG pictures through when possible\n");
+		input_ctx.passthrough = 1;
+	}
+
+	/* Likewise NV12 pictures from a native source can be sent straight
+	 * from the source memory when they are at the device native size */
+	if (image_format == AM7XXX_IMAGE_FORMAT_NV12 &&
+	    overlays_count == 0 &&
+	    orientation == ORIENTATION_NORMAL &&
+	    input_ctx.source_ops &&
+	    (input_ctx.codec_ctx)->pix_fmt == PIX_FMT_NV12 &&
+	    (input_ctx.codec_ctx)->width == (pipeline.output_ctxs[0].codec_ctx)->width &&
+	    (input_ctx.codec_ctx)->height == (pipeline.output_ctxs[0].codec_ctx)->height) {
+		fprintf(stdout, "passing NV12 pictures through when possible\n");
+		input_ctx.passthrough = 1;
+	}
+
+	/* Keep at least one frame for each stage of the pipeline */
+	if (queue_depth < pipeline.encoders_count + 2)
+		queue_depth = pipeline.encoders_count + 2;
+
+	if (!input_ctx.live) {
+		stream = (input_ctx.format_ctx)->streams[input_ctx.video_stream_index];
+		if (stream->r_frame_rate.num > 0 && stream->r_frame_rate.den > 0)
+			pipeline.frame_duration = (int64_t)AV_TIME_BASE * stream->r_frame_rate.den / stream->r_frame_rate.num;
+		else
+			pipeline.frame_duration = AV_TIME_BASE / 25;
+	}
+
+	/* Pace the playback of files and network streams according to the
+	 * timestamps; input devices (e.g. x11grab, video4linux2) produce
+	 * frames in real time already, so show them as soon as possible.
+	 * Frames written to a file just go as fast as they can.
+	 */
+	if (preroll > 0 && !input_ctx.live && output_path == NULL) {
+		pipeline.pacing = 1;
+		pipeline.preroll = preroll < queue_depth ? preroll : queue_depth;
+	}
+
+	/* The frames can be saved, ready to be played with am7xxx-loop */
+	if (output_path) {
+		ret = frame_file_create(&writer, output_path, image_format,
+					(pipeline.output_ctxs[0].codec_ctx)->width,
+					(pipeline.output_ctxs[0].codec_ctx)->height);
 		if (ret < 0) {
-			if (ret == (int)AVERROR_EOF || input_ctx.format_ctx->pb->eof_reached)
-				ret = 0;
-			else
-				fprintf(stderr, "av_read_frame failed, EOF?\n");
-			run = 0;
-			goto end_while;
+			fprintf(stderr, "cannot create the output file\n");
+			goto cleanup_overlays;
 		}
+		fprintf(stdout, "writing the frames to %s\n", output_path);
+	}
+
+	/* frames waiting to be sent in order */
+	pending = calloc(queue_depth, sizeof(*pending));
+	if (pending == NULL) {
+		perror("calloc");
+		ret = -ENOMEM;
+		goto cleanup_writer;
+	}
 
-		if (in_packet.stream_index != input_ctx.video_stream_index) {
-			/* that is more or less a "continue", but there is
-			 * still the packet to free */
-			goto end_while;
+	ret = pthread_mutex_init(&pipeline.mutex, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "cannot initialize the pipeline mutex\n");
+		ret = -ret;
+		goto cleanup_pending;
+	}
+
+	ret = frame_queue_init(&pipeline.free_frames, queue_depth);
+	if (ret < 0)
+		goto cleanup_mutex;
+
+	ret = frame_queue_init(&pipeline.scaled_frames, queue_depth);
+	if (ret < 0)
+		goto cleanup_free_frames;
+
+	ret = frame_queue_init(&pipeline.encoded_frames, queue_depth);
+	if (ret < 0)
+		goto cleanup_scaled_frames;
+
+	ret = pipeline_frames_alloc(&pipeline, queue_depth);
+	if (ret < 0)
+		goto cleanup_encoded_frames;
+
+	pipeline.running_encoders = pipeline.encoders_count;
+	for (i = 0; i < pipeline.encoders_count; i++) {
+		ret = pthread_create(&encode_thread_ids[i], NULL, encode_thread, &pipeline.output_ctxs[i]);
+		if (ret != 0) {
+			fprintf(stderr, "cannot create the encoder thread\n");
+			ret = -ret;
+			pipeline_abort(&pipeline);
+			goto join_encode_threads;
 		}
+		encoders_started++;
+	}
 
-		/* decode */
-		got_picture = 0;
-		ret = avcodec_decode_video2(input_ctx.codec_ctx, picture_raw, &got_picture, &in_packet);
-		if (ret < 0) {
-			fprintf(stderr, "cannot decode video\n");
-			run = 0;
-			goto end_while;
+	ret = pthread_create(&input_thread_id, NULL, input_thread, &pipeline);
+	if (ret != 0) {
+		fprintf(stderr, "cannot create the input thread\n");
+		ret = -ret;
+		pipeline_abort(&pipeline);
+		goto join_encode_threads;
+	}
+
+	/* Send the frames in the same order they have been read, the
+	 * encoders may finish them in a different order.
+	 *
+	 * When pacing, wait for some frames to be ready before starting to
+	 * show them, so that small variations in the decoding and encoding
+	 * time do not make the playback stall.
+	 */
+	next_sequence = 0;
+	buffered_frames = 0;
+	dropped_frames = 0;
+	do {
+		frame = frame_queue_pop(&pipeline.encoded_frames);
+		if (frame) {
+			pending[frame->sequence % queue_depth] = frame;
+			buffered_frames++;
+
+			if (pipeline.pacing && !pipeline.clock_started &&
+			    buffered_frames < pipeline.preroll)
+				continue;
 		}
 
-		/* if we get the complete frame */
-		if (got_picture) {
-			/* convert it to YUV */
-			sws_scale(sw_scale_ctx,
-				  (const uint8_t * const*)picture_raw->data,
-				  picture_raw->linesize,
-				  0,
-				  (input_ctx.codec_ctx)->height,
-				  picture_scaled->data,
-				  picture_scaled->linesize);
+		while ((next_frame = pending[next_sequence % queue_depth]) &&
+		       next_frame->sequence == next_sequence) {
+			pending[next_sequence % queue_depth] = NULL;
+			next_sequence++;
+			buffered_frames--;
 
-			if (output_ctx.raw_output) {
-				out_picture = out_buf;
-				out_picture_size = out_buf_size;
+			next_frame->trace.sequence = next_frame->sequence;
+			next_frame->trace.dropped = next_frame->dropped;
+
+			if (next_frame->dropped) {
+				dropped_frames++;
+				if (next_frame->traced)
+					frame_trace_add(trace, &next_frame->trace);
 			} else {
-				picture_scaled->quality = (output_ctx.codec_ctx)->global_quality;
-				av_init_packet(&out_packet);
-				out_packet.data = NULL;
-				out_packet.size = 0;
-				got_packet = 0;
-				ret = avcodec_encode_video2(output_ctx.codec_ctx,
-							    &out_packet,
-							    picture_scaled,
-							    &got_packet);
-				if (ret < 0 || !got_packet) {
-					fprintf(stderr, "cannot encode video\n");
-					run = 0;
-					goto end_while;
+				if (pipeline.pacing)
+					pipeline_clock_wait(&pipeline, next_frame->pts);
+
+				frame_trace_stage(next_frame, FRAME_TRACE_SUBMIT_START);
+				if (writer)
+					ret = frame_file_append(writer,
+								next_frame->data,
+								next_frame->data_size,
+								next_frame->pts);
+				else
+					ret = send_frame(next_frame, &pipeline.output_ctxs[0],
+							 image_format, reconnect, dev);
+				if (ret < 0) {
+					pipeline_abort(&pipeline);
+					goto join_input_thread;
+				}
+				frame_trace_stage(next_frame, FRAME_TRACE_SUBMITTED);
+
+				/* the USB completion comes later, from libam7xxx */
+				if (trace) {
+					record = NULL;
+					if (next_frame->traced)
+						record = frame_trace_add(trace, &next_frame->trace);
+					if (writer == NULL)
+						frame_trace_submitted(trace, record);
 				}
-
-				out_picture = out_packet.data;
-				out_picture_size = out_packet.size;
 			}
 
-#ifdef DEBUG
-			char filename[NAME_MAX];
-			FILE *file;
-			if (!output_ctx.raw_output)
-				snprintf(filename, NAME_MAX, "out_q%03d.jpg", quality);
-			else
-				snprintf(filename, NAME_MAX, "out.raw");
-			file = fopen(filename, "wb");
-			fwrite(out_picture, 1, out_picture_size, file);
-			fclose(file);
-#endif
-
-			ret = am7xxx_send_image_async(dev,
-						image_format,
-						(output_ctx.codec_ctx)->width,
-						(output_ctx.codec_ctx)->height,
-						out_picture,
-						out_picture_size);
-			if (ret < 0) {
-				perror("am7xxx_send_image");
-				run = 0;
-				goto end_while;
-			}
+			/* am7xxx_send_image_async() copies the data, the
+			 * input data can go */
+			pipeline_frame_recycle(&pipeline, next_frame);
+			frame_queue_push(&pipeline.free_frames, next_frame);
 		}
-end_while:
-		if (!output_ctx.raw_output && got_packet)
-			av_free_packet(&out_packet);
-		av_free_packet(&in_packet);
-	}
-
-	sws_freeContext(sw_scale_ctx);
-cleanup_out_buf:
-	av_free(out_buf);
-cleanup_picture_scaled:
-	av_free(picture_scaled);
-cleanup_picture_raw:
-	av_free(picture_raw);
-
+	} while (frame);
+
+	if (dropped_frames > 0)
+		fprintf(stderr, "%u late frames dropped\n", dropped_frames);
+
+join_input_thread:
+	pthread_join(input_thread_id, NULL);
+join_encode_threads:
+	for (i = 0; i < encoders_started; i++)
+		pthread_join(encode_thread_ids[i], NULL);
+
+	if (ret >= 0 && pipeline.input_ret < 0)
+		ret = pipeline.input_ret;
+	if (ret >= 0 && pipeline.encode_ret < 0)
+		ret = pipeline.encode_ret;
+
+	sws_freeContext(pipeline.sw_scale_ctx);
+	pipeline_frames_free(&pipeline);
+cleanup_encoded_frames:
+	frame_queue_cleanup(&pipeline.encoded_frames);
+cleanup_scaled_frames:
+	frame_queue_cleanup(&pipeline.scaled_frames);
+cleanup_free_frames:
+	frame_queue_cleanup(&pipeline.free_frames);
+cleanup_mutex:
+	pthread_mutex_destroy(&pipeline.mutex);
+cleanup_pending:
+	free(pending);
+cleanup_writer:
+	if (writer) {
+		writer_ret = frame_file_finish(writer, pipeline.frame_duration > 0 ?
+					       pipeline.frame_duration : AV_TIME_BASE / 25);
+		if (ret >= 0 && writer_ret < 0)
+			ret = writer_ret;
+	}
+cleanup_overlays:
+	for (i = 0; i < pipeline.overlays_count; i++)
+		overlay_cleanup(&pipeline.overlays[i]);
+	free(pipeline.overlays);
 cleanup_output:
 	/* av_free is needed as well,
 	 * see http://libav.org/doxygen/master/avcodec_8h.html#a5d7440cd7ea195bd0b14f21a00ef36dd
 	 */
-	avcodec_close(output_ctx.codec_ctx);
-	av_free(output_ctx.codec_ctx);
-
+	for (i = 0; i < pipeline.encoders_count; i++) {
+		jpeg_transform_cleanup(&pipeline.output_ctxs[i].transform);
+		if (pipeline.output_ctxs[i].codec_ctx == NULL)
+			continue;
+		avcodec_close(pipeline.output_ctxs[i].codec_ctx);
+		av_free(pipeline.output_ctxs[i].codec_ctx);
+	}
+	free(encode_thread_ids);
+cleanup_output_ctxs:
+	free(pipeline.output_ctxs);
 cleanup_input:
-	avcodec_close(input_ctx.codec_ctx);
-	avformat_close_input(&(input_ctx.format_ctx));
+	video_input_cleanup(&input_ctx);
 
 out:
 	return ret;
@@ -594,17 +1964,48 @@ static void usage(char *name)
 	printf("OPTIONS:\n");
 	printf("\t-d <index>\t\tthe device index (default is 0)\n");
 	printf("\t-f <input format>\tthe input device format\n");
+#ifdef HAVE_XCB_SHM
+	printf("\t\t\t\tor 'xcbshm' to capture the X screen natively\n");
+#endif
+#ifdef HAVE_LINUX_FB
+	printf("\t\t\t\tor 'fbmmap' to capture a framebuffer natively\n");
+#endif
+#ifdef HAVE_LINUX_VIDEODEV2
+	printf("\t\t\t\tor 'v4l2mmap' to capture from a camera natively\n");
+#endif
 	printf("\t-i <input path>\t\tthe input path\n");
 	printf("\t-o <options>\t\ta comma separated list of input format options\n");
 	printf("\t\t\t\tEXAMPLE:\n");
 	printf("\t\t\t\t\t-o draw_mouse=1,framerate=100,video_size=800x480\n");
+	printf("\t-O <output file>\twrite the frames to a file for am7xxx-loop instead of\n");
+	printf("\t\t\t\tshowing them, the device is only asked for its size\n");
 	printf("\t-s <scaling method>\tthe rescaling method (see swscale.h)\n");
+	printf("\t-S \t\t\tdon't let the JPEG decoder downscale big pictures\n");
+	printf("\t\t\t\tin the DCT domain, use only libswscale\n");
 	printf("\t-u \t\t\tupscale the image if smaller than the display dimensions\n");
 	printf("\t-F <format>\t\tthe image format to use (default is JPEG)\n");
 	printf("\t\t\t\tSUPPORTED FORMATS:\n");
 	printf("\t\t\t\t\t1 - JPEG\n");
 	printf("\t\t\t\t\t2 - NV12\n");
 	printf("\t-q <quality>\t\tquality of jpeg sent to the device, between 1 and 100\n");
+	printf("\t-k <interval>\t\tskip frames which did not change, but re-send the\n");
+	printf("\t\t\t\tlast one every <interval> frames (0 means never)\n");
+	printf("\t-Q <depth>\t\tthe number of frames in flight in the pipeline (default is 4)\n");
+	printf("\t-t <threads>\t\tthe number of decoding and encoding threads (default is 0, auto)\n");
+	printf("\t-P <frames>\t\tthe frames to buffer before starting the playback of files\n");
+	printf("\t\t\t\tand network streams at their own pace (default is 2),\n");
+	printf("\t\t\t\t0 shows the frames as soon as they are decoded\n");
+	printf("\t-T <trace file>\t\twrite when the frames went through each stage, as\n");
+	printf("\t\t\t\tChrome trace JSON (see chrome://tracing), on exit\n");
+	printf("\t-R <interval>\t\ttrace one frame every <interval> (default is 1)\n");
+	printf("\t-L <file>[@<x>,<y>]\tblend a PAM picture with alpha over the frames,\n");
+	printf("\t\t\t\tat x,y (default is 0,0), can be repeated\n");
+	printf("\t-m <orientation>\tturn the frames for the projector mount: normal,\n");
+	printf("\t\t\t\thflip, vflip, rotate180, or rear, ceiling-rear, ceiling\n");
+	printf("\t-M <timeout>\t\tswitch the devices in mass storage mode first, and\n");
+	printf("\t\t\t\twait up to <timeout> ms for them to be ready\n");
+	printf("\t-r <timeout>\t\twait up to <timeout> ms for the device to come back\n");
+	printf("\t\t\t\twhen it gets lost, and go on playing (default is 0, never)\n");
 	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
 	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
 	       AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
@@ -615,9 +2016,22 @@ static void usage(char *name)
 	printf("\t-h \t\t\tthis help message\n");
 	printf("\n\nEXAMPLES OF USE:\n");
 	printf("\t%s -f x11grab -i :0.0 -o video_size=800x480\n", name);
+#ifdef HAVE_XCB_SHM
+	printf("\t%s -f xcbshm -i :0.0+100,200 -o framerate=30\n", name);
+#endif
 	printf("\t%s -f fbdev -i /dev/fb0\n", name);
+#ifdef HAVE_LINUX_FB
+	printf("\t%s -f fbmmap -i /dev/fb0 -o vsync=1\n", name);
+#endif
 	printf("\t%s -f video4linux2 -i /dev/video0 -o video_size=320x240,frame_rate=100 -u -q 90\n", name);
+#ifdef HAVE_LINUX_VIDEODEV2
+	printf("\t%s -f v4l2mmap -i /dev/video0 -o pixel_format=nv12 -F 2\n", name);
+#endif
 	printf("\t%s -i http://download.blender.org/peach/bigbuckbunny_movies/BigBuckBunny_640x360.m4v\n", name);
+	printf("\t%s -i clip.mp4 -O clip.am7\n", name);
+	printf("\t%s -i clip.mp4 -T trace.json -R 10\n", name);
+	printf("\t%s -i clip.mp4 -L logo.pam@16,16 -L ticker.pam@0,440\n", name);
+	printf("\t%s -f v4l2mmap -i /dev/video0 -m ceiling\n", name);
 }
 
 int main(int argc, char *argv[])
@@ -630,6 +2044,7 @@ int main(int argc, char *argv[])
 	char *input_format_string = NULL;
 	AVDictionary *options = NULL;
 	char *input_path = NULL;
+	char *output_path = NULL;
 	unsigned int rescale_method = SWS_BICUBIC;
 	unsigned int upscale = 0;
 	unsigned int quality = 95;
@@ -638,10 +2053,25 @@ int main(int argc, char *argv[])
 	int power_mode = AM7XXX_POWER_LOW;
 	int zoom = AM7XXX_ZOOM_ORIGINAL;
 	int format = AM7XXX_IMAGE_FORMAT_JPEG;
+	unsigned int skip_unchanged = 0;
+	int keepalive_interval = 0;
+	int queue_depth = 4;
+	int threads = 0;
+	int preroll = 2;
+	unsigned int dct_downscale = 1;
+	char *trace_path = NULL;
+	int trace_interval = 1;
+	int reconnect_timeout = 0;
+	int modeswitch_timeout = 0;
+	char *overlay_specs[OVERLAYS_MAX];
+	unsigned int overlays_count = 0;
+	enum orientation orientation = ORIENTATION_NORMAL;
+	struct frame_trace trace_data;
+	struct frame_trace *trace = NULL;
 	am7xxx_context *ctx;
 	am7xxx_device *dev;
 
-	while ((opt = getopt(argc, argv, "d:f:i:o:s:uF:q:l:p:z:h")) != -1) {
+	while ((opt = getopt(argc, argv, "d:f:i:o:O:s:SuF:q:k:Q:t:P:T:R:L:m:M:r:l:p:z:h")) != -1) {
 		switch (opt) {
 		case 'd':
 			device_index = atoi(optarg);
@@ -679,6 +2109,9 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "Option '-o' not implemented\n");
 #endif
 			break;
+		case 'O':
+			output_path = strdup(optarg);
+			break;
 		case 's':
 			rescale_method = atoi(optarg);
 			switch(rescale_method) {
@@ -700,6 +2133,9 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'S':
+			dct_downscale = 0;
+			break;
 		case 'u':
 			upscale = 1;
 			break;
@@ -726,6 +2162,83 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'k':
+			keepalive_interval = atoi(optarg);
+			if (keepalive_interval < 0) {
+				fprintf(stderr, "Invalid keepalive interval, must be a non-negative number of frames\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			skip_unchanged = 1;
+			break;
+		case 'Q':
+			queue_depth = atoi(optarg);
+			if (queue_depth < 1) {
+				fprintf(stderr, "Invalid queue depth, must be at least 1\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 0) {
+				fprintf(stderr, "Invalid number of threads, must be a non-negative number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'P':
+			preroll = atoi(optarg);
+			if (preroll < 0) {
+				fprintf(stderr, "Invalid number of preroll frames, must be a non-negative number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'T':
+			free(trace_path);
+			trace_path = strdup(optarg);
+			break;
+		case 'R':
+			trace_interval = atoi(optarg);
+			if (trace_interval < 1) {
+				fprintf(stderr, "Invalid trace interval, must be at least 1\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'L':
+			if (overlays_count == OVERLAYS_MAX) {
+				fprintf(stderr, "Too many overlays, at most %d are supported\n",
+					OVERLAYS_MAX);
+				ret = -EINVAL;
+				goto out;
+			}
+			overlay_specs[overlays_count++] = optarg;
+			break;
+		case 'm':
+			ret = orientation_parse(optarg, &orientation);
+			if (ret < 0) {
+				fprintf(stderr, "Invalid orientation '%s'\n", optarg);
+				goto out;
+			}
+			break;
+		case 'M':
+			modeswitch_timeout = atoi(optarg);
+			if (modeswitch_timeout < 0) {
+				fprintf(stderr, "Invalid mode switch timeout, must be a non-negative number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'r':
+			reconnect_timeout = atoi(optarg);
+			if (reconnect_timeout < 0) {
+				fprintf(stderr, "Invalid reconnect timeout, must be a non-negative number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
 		case 'l':
 			log_level = atoi(optarg);
 			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
@@ -811,7 +2324,7 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	ret = am7xxx_init(&ctx);
+	ret = am7xxx_init_modeswitch(&ctx, modeswitch_timeout);
 	if (ret < 0) {
 		perror("am7xxx_init");
 		goto out;
@@ -825,6 +2338,20 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
+	if (trace_path) {
+		ret = frame_trace_init(&trace_data, trace_interval);
+		if (ret < 0)
+			goto cleanup;
+		trace = &trace_data;
+		am7xxx_set_image_sent_callback(dev, frame_trace_image_sent, trace);
+	}
+
+	am7xxx_set_auto_reconnect(dev, reconnect_timeout);
+
+	/* When writing to a file the device is only asked for its size */
+	if (output_path)
+		goto play;
+
 	ret = am7xxx_set_zoom_mode(dev, zoom);
 	if (ret < 0) {
 		perror("am7xxx_set_zoom_mode");
@@ -841,13 +2368,26 @@ int main(int argc, char *argv[])
 	if (zoom == AM7XXX_ZOOM_TEST)
 		goto cleanup;
 
+play:
 	ret = am7xxx_play(input_format_string,
 			  &options,
 			  input_path,
+			  output_path,
 			  rescale_method,
 			  upscale,
 			  quality,
 			  format,
+			  skip_unchanged,
+			  keepalive_interval,
+			  queue_depth,
+			  threads,
+			  preroll,
+			  dct_downscale,
+			  reconnect_timeout,
+			  overlay_specs,
+			  overlays_count,
+			  orientation,
+			  trace,
 			  dev);
 	if (ret < 0) {
 		fprintf(stderr, "am7xxx_play failed\n");
@@ -855,9 +2395,20 @@ int main(int argc, char *argv[])
 	}
 
 cleanup:
+	/* the last transfer completes when the device gets closed */
 	am7xxx_shutdown(ctx);
+
+	if (trace) {
+		if (frame_trace_write(trace, trace_path) < 0)
+			fprintf(stderr, "cannot write the trace to %s\n", trace_path);
+		else
+			fprintf(stdout, "trace written to %s\n", trace_path);
+		frame_trace_cleanup(trace);
+	}
 out:
+	free(trace_path);
 	av_dict_free(&options);
+	free(output_path);
 	free(input_path);
 	free(input_format_string);
 	return ret;
@@ -0,0 +1,670 @@
+/*
+ * am7xxx-recv - show on am7xxx devices the frames received from the network
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxx-recv.c
+ * am7xxx-recv receives JPEG or NV12 frames over TCP or UDP and passes them
+ * to the device as they are, no decoding or encoding takes place on the
+ * receiving host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <am7xxx.h>
+
+#include "net_frame.h"
+
+/* Senders restarting from a lower sequence number are detected this way */
+#define JITTER_MAX_LATENESS 64
+
+struct receiver {
+	am7xxx_device *dev;
+	unsigned int native_width;
+	unsigned int native_height;
+	unsigned int max_size;
+};
+
+struct jitter_slot {
+	int used;
+	uint32_t sequence;
+	struct net_frame_header header;
+	unsigned int received;
+	uint8_t *data;
+	uint8_t *fragments;
+};
+
+/*
+ * UDP datagrams can arrive out of order, or never, so frames are assembled
+ * in a window of slots: a complete frame is shown as soon as all the frames
+ * before it have been, and an incomplete one is given up when the window
+ * has to move past it.
+ */
+struct jitter_buffer {
+	struct jitter_slot *slots;
+	unsigned int slots_count;
+	unsigned int fragments_size;
+	uint32_t next_sequence;
+	int started;
+};
+
+static volatile sig_atomic_t run = 1;
+
+static int check_header(struct receiver *receiver, struct net_frame_header *header)
+{
+	if (header->format != AM7XXX_IMAGE_FORMAT_JPEG &&
+	    header->format != AM7XXX_IMAGE_FORMAT_NV12) {
+		fprintf(stderr, "unsupported frame format %d\n", header->format);
+		return -EINVAL;
+	}
+
+	if (header->width > receiver->native_width ||
+	    header->height > receiver->native_height) {
+		fprintf(stderr, "frame of %ux%u does not fit the device, native resolution is %ux%u\n",
+			header->width, header->height,
+			receiver->native_width, receiver->native_height);
+		return -EINVAL;
+	}
+
+	if (header->size == 0 || header->size > receiver->max_size ||
+	    (header->format == AM7XXX_IMAGE_FORMAT_NV12 &&
+	     header->size != header->width * header->height * 3 / 2)) {
+		fprintf(stderr, "invalid frame size %u\n", header->size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int show_frame(struct receiver *receiver,
+		      struct net_frame_header *header,
+		      uint8_t *data)
+{
+	int ret;
+
+	/* the image is copied, the buffer can be filled again right away */
+	ret = am7xxx_send_image_async(receiver->dev,
+				      header->format,
+				      header->width,
+				      header->height,
+				      data,
+				      header->size);
+	if (ret < 0)
+		perror("am7xxx_send_image_async");
+
+	return ret;
+}
+
+static int recv_all(int fd, uint8_t *buffer, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = recv(fd, buffer, len, MSG_WAITALL);
+		if (ret < 0) {
+			ret = -errno;
+			if (ret != -EINTR)
+				perror("recv");
+			return ret;
+		} else if (ret == 0) {
+			return -ECONNRESET;
+		}
+		buffer += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Show the frames of a sender until it goes away, a negative return value
+ * means that the device cannot be used anymore.
+ */
+static int receive_tcp_stream(struct receiver *receiver, int fd, uint8_t *buffer)
+{
+	uint8_t header_buffer[NET_FRAME_HEADER_SIZE];
+	struct net_frame_header header;
+	int ret;
+
+	while (run) {
+		ret = recv_all(fd, header_buffer, sizeof(header_buffer));
+		if (ret < 0)
+			return 0;
+
+		/* the stream cannot be followed after an invalid frame */
+		ret = net_frame_unpack_header(header_buffer, &header);
+		if (ret < 0 || header.offset != 0) {
+			fprintf(stderr, "invalid frame header\n");
+			return 0;
+		}
+
+		ret = check_header(receiver, &header);
+		if (ret < 0)
+			return 0;
+
+		ret = recv_all(fd, buffer, header.size);
+		if (ret < 0)
+			return 0;
+
+		ret = show_frame(receiver, &header, buffer);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int receive_tcp(struct receiver *receiver, int listen_fd)
+{
+	uint8_t *buffer;
+	int fd;
+	int ret = 0;
+
+	buffer = malloc(receiver->max_size);
+	if (buffer == NULL) {
+		perror("malloc");
+		return -ENOMEM;
+	}
+
+	/* one sender at a time */
+	while (run) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			perror("accept");
+			break;
+		}
+
+		fprintf(stdout, "sender connected\n");
+		ret = receive_tcp_stream(receiver, fd, buffer);
+		close(fd);
+		if (ret < 0)
+			break;
+		fprintf(stdout, "sender disconnected\n");
+	}
+
+	free(buffer);
+	return ret;
+}
+
+static void jitter_buffer_cleanup(struct jitter_buffer *jitter)
+{
+	unsigned int i;
+
+	for (i = 0; i < jitter->slots_count; i++) {
+		free(jitter->slots[i].data);
+		free(jitter->slots[i].fragments);
+	}
+	free(jitter->slots);
+}
+
+static int jitter_buffer_init(struct jitter_buffer *jitter,
+			      unsigned int slots_count,
+			      unsigned int max_size)
+{
+	unsigned int i;
+
+	memset(jitter, 0, sizeof(*jitter));
+
+	jitter->slots = calloc(slots_count, sizeof(*jitter->slots));
+	if (jitter->slots == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+	jitter->slots_count = slots_count;
+
+	/* one bit for each datagram of the biggest frame */
+	jitter->fragments_size = (max_size / NET_FRAME_UDP_PAYLOAD + 1 + 7) / 8;
+
+	for (i = 0; i < slots_count; i++) {
+		jitter->slots[i].data = malloc(max_size);
+		jitter->slots[i].fragments = malloc(jitter->fragments_size);
+		if (jitter->slots[i].data == NULL || jitter->slots[i].fragments == NULL) {
+			perror("malloc");
+			jitter_buffer_cleanup(jitter);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void jitter_buffer_reset(struct jitter_buffer *jitter, uint32_t sequence)
+{
+	unsigned int i;
+
+	for (i = 0; i < jitter->slots_count; i++)
+		jitter->slots[i].used = 0;
+
+	jitter->next_sequence = sequence;
+	jitter->started = 1;
+}
+
+/* Show the complete frames at the head of the window */
+static int jitter_buffer_flush(struct receiver *receiver, struct jitter_buffer *jitter)
+{
+	struct jitter_slot *slot;
+	int ret;
+
+	for (;;) {
+		slot = &jitter->slots[jitter->next_sequence % jitter->slots_count];
+		if (!slot->used || slot->sequence != jitter->next_sequence ||
+		    slot->received != slot->header.size)
+			return 0;
+
+		ret = show_frame(receiver, &slot->header, slot->data);
+		slot->used = 0;
+		jitter->next_sequence++;
+		if (ret < 0)
+			return ret;
+	}
+}
+
+static int jitter_buffer_add(struct receiver *receiver,
+			     struct jitter_buffer *jitter,
+			     struct net_frame_header *header,
+			     const uint8_t *payload,
+			     unsigned int len)
+{
+	struct jitter_slot *slot;
+	unsigned int fragment;
+	int32_t distance;
+	int ret;
+
+	if (header->offset % NET_FRAME_UDP_PAYLOAD != 0 ||
+	    header->offset >= header->size ||
+	    len > header->size - header->offset ||
+	    (len != NET_FRAME_UDP_PAYLOAD && header->offset + len != header->size))
+		return -EINVAL;
+
+	if (!jitter->started)
+		jitter_buffer_reset(jitter, header->sequence);
+
+	distance = (int32_t)(header->sequence - jitter->next_sequence);
+	if (distance < -JITTER_MAX_LATENESS) {
+		jitter_buffer_reset(jitter, header->sequence);
+		distance = 0;
+	} else if (distance < 0) {
+		/* too late, the window moved on already */
+		return 0;
+	}
+
+	/* make room, giving up on the oldest frames */
+	while (distance >= (int32_t)jitter->slots_count) {
+		jitter->slots[jitter->next_sequence % jitter->slots_count].used = 0;
+		jitter->next_sequence++;
+
+		ret = jitter_buffer_flush(receiver, jitter);
+		if (ret < 0)
+			return ret;
+
+		distance = (int32_t)(header->sequence - jitter->next_sequence);
+	}
+
+	slot = &jitter->slots[header->sequence % jitter->slots_count];
+	if (!slot->used || slot->sequence != header->sequence) {
+		slot->used = 1;
+		slot->sequence = header->sequence;
+		slot->header = *header;
+		slot->received = 0;
+		memset(slot->fragments, 0, jitter->fragments_size);
+	} else if (slot->header.size != header->size) {
+		return -EINVAL;
+	}
+
+	fragment = header->offset / NET_FRAME_UDP_PAYLOAD;
+	if (slot->fragments[fragment / 8] & (1 << (fragment % 8)))
+		return 0;
+	slot->fragments[fragment / 8] |= 1 << (fragment % 8);
+
+	memcpy(slot->data + header->offset, payload, len);
+	slot->received += len;
+
+	return jitter_buffer_flush(receiver, jitter);
+}
+
+static int receive_udp(struct receiver *receiver, int fd, unsigned int jitter_depth)
+{
+	struct jitter_buffer jitter;
+	struct net_frame_header header;
+	uint8_t datagram[NET_FRAME_HEADER_SIZE + NET_FRAME_UDP_PAYLOAD];
+	ssize_t len;
+	int ret;
+
+	ret = jitter_buffer_init(&jitter, jitter_depth, receiver->max_size);
+	if (ret < 0)
+		return ret;
+
+	while (run) {
+		len = recv(fd, datagram, sizeof(datagram), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			perror("recv");
+			break;
+		}
+
+		/* datagrams are independent, bad ones are just dropped */
+		if (len < NET_FRAME_HEADER_SIZE ||
+		    net_frame_unpack_header(datagram, &header) < 0 ||
+		    check_header(receiver, &header) < 0)
+			continue;
+
+		ret = jitter_buffer_add(receiver, &jitter, &header,
+					datagram + NET_FRAME_HEADER_SIZE,
+					len - NET_FRAME_HEADER_SIZE);
+		if (ret == -EINVAL)
+			continue;
+		else if (ret < 0)
+			break;
+	}
+
+	jitter_buffer_cleanup(&jitter);
+	return ret;
+}
+
+static int open_socket(const char *port, int socktype)
+{
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct addrinfo *rp;
+	int buffer_size = 4 * 1024 * 1024;
+	int flag = 1;
+	int fd = -1;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo(NULL, port, &hints, &result);
+	if (ret != 0) {
+		fprintf(stderr, "port %s: %s\n", port, gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+		if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+
+	if (fd < 0) {
+		fprintf(stderr, "cannot listen on port %s\n", port);
+		return -EADDRINUSE;
+	}
+
+	if (socktype == SOCK_STREAM) {
+		ret = listen(fd, 1);
+		if (ret < 0) {
+			ret = -errno;
+			perror("listen");
+			close(fd);
+			return ret;
+		}
+	} else {
+		/* room for a few frames arriving in a burst */
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+	}
+
+	return fd;
+}
+
+static void unset_run(int signo)
+{
+	(void) signo;
+	run = 0;
+}
+
+static int set_signal_handler(void (*signal_handler)(int))
+{
+	struct sigaction new_action;
+	struct sigaction old_action;
+	int ret;
+
+	/* no SA_RESTART, a blocking recv() has to be interrupted */
+	new_action.sa_handler = signal_handler;
+	sigemptyset(&new_action.sa_mask);
+	new_action.sa_flags = 0;
+
+	ret = sigaction(SIGINT, NULL, &old_action);
+	if (ret < 0) {
+		perror("sigaction on old_action");
+		goto out;
+	}
+
+	if (old_action.sa_handler != SIG_IGN) {
+		ret = sigaction(SIGINT, &new_action, NULL);
+		if (ret < 0) {
+			perror("sigaction on new_action");
+			goto out;
+		}
+	}
+
+out:
+	return ret;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-P <port>\t\tthe port to listen on (default is %s)\n", NET_FRAME_DEFAULT_PORT);
+	printf("\t-U \t\t\treceive UDP datagrams instead of a TCP stream\n");
+	printf("\t-j <frames>\t\tthe frames which can be waited for when UDP datagrams\n");
+	printf("\t\t\t\tget lost or reordered (default is 4)\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
+	       AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-z <zoom mode>\t\tthe display zoom mode, between %d (original) and %d (test)\n",
+	       AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TEST);
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLES OF USE:\n");
+	printf("\t%s -P 7070\n", name);
+	printf("\t%s -U -j 8\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *port = NULL;
+	int socktype = SOCK_STREAM;
+	int jitter_depth = 4;
+	int log_level = AM7XXX_LOG_INFO;
+	int device_index = 0;
+	int power_mode = AM7XXX_POWER_LOW;
+	int zoom = AM7XXX_ZOOM_ORIGINAL;
+	struct receiver receiver;
+	am7xxx_device_info device_info;
+	am7xxx_context *ctx;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "d:P:Uj:l:p:z:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device_index = atoi(optarg);
+			if (device_index < 0) {
+				fprintf(stderr, "Unsupported device index\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'P':
+			free(port);
+			port = strdup(optarg);
+			break;
+		case 'U':
+			socktype = SOCK_DGRAM;
+			break;
+		case 'j':
+			jitter_depth = atoi(optarg);
+			if (jitter_depth < 1) {
+				fprintf(stderr, "Invalid jitter buffer depth, must be a positive number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			switch(power_mode) {
+			case AM7XXX_POWER_OFF:
+			case AM7XXX_POWER_LOW:
+			case AM7XXX_POWER_MIDDLE:
+			case AM7XXX_POWER_HIGH:
+			case AM7XXX_POWER_TURBO:
+				fprintf(stdout, "Power mode: %d\n", power_mode);
+				break;
+			default:
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+					AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'z':
+			zoom = atoi(optarg);
+			switch(zoom) {
+			case AM7XXX_ZOOM_ORIGINAL:
+			case AM7XXX_ZOOM_H:
+			case AM7XXX_ZOOM_H_V:
+			case AM7XXX_ZOOM_TEST:
+				fprintf(stdout, "Zoom: %d\n", zoom);
+				break;
+			default:
+				fprintf(stderr, "Invalid zoom mode value, must be between %d and %d\n",
+					AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TEST);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (port == NULL)
+		port = strdup(NET_FRAME_DEFAULT_PORT);
+
+	ret = set_signal_handler(unset_run);
+	if (ret < 0)
+		goto out;
+
+	ret = am7xxx_init(&ctx);
+	if (ret < 0) {
+		perror("am7xxx_init");
+		goto out;
+	}
+
+	am7xxx_set_log_level(ctx, log_level);
+
+	ret = am7xxx_open_device(ctx, &receiver.dev, device_index);
+	if (ret < 0) {
+		perror("am7xxx_open_device");
+		goto cleanup;
+	}
+
+	ret = am7xxx_get_device_info(receiver.dev, &device_info);
+	if (ret < 0) {
+		perror("am7xxx_get_device_info");
+		goto cleanup;
+	}
+
+	receiver.native_width = device_info.native_width;
+	receiver.native_height = device_info.native_height;
+	/* enough for NV12 and for any sensible JPEG */
+	receiver.max_size = receiver.native_width * receiver.native_height * 2;
+
+	ret = am7xxx_set_zoom_mode(receiver.dev, zoom);
+	if (ret < 0) {
+		perror("am7xxx_set_zoom_mode");
+		goto cleanup;
+	}
+
+	ret = am7xxx_set_power_mode(receiver.dev, power_mode);
+	if (ret < 0) {
+		perror("am7xxx_set_power_mode");
+		goto cleanup;
+	}
+
+	/* When setting AM7XXX_ZOOM_TEST don't display the actual image */
+	if (zoom == AM7XXX_ZOOM_TEST)
+		goto cleanup;
+
+	fd = open_socket(port, socktype);
+	if (fd < 0) {
+		ret = fd;
+		goto cleanup;
+	}
+
+	fprintf(stdout, "waiting for %ux%u frames on %s port %s\n",
+		receiver.native_width, receiver.native_height,
+		socktype == SOCK_STREAM ? "TCP" : "UDP", port);
+
+	if (socktype == SOCK_STREAM)
+		ret = receive_tcp(&receiver, fd);
+	else
+		ret = receive_udp(&receiver, fd, jitter_depth);
+
+	close(fd);
+
+cleanup:
+	am7xxx_shutdown(ctx);
+out:
+	free(port);
+	return ret;
+}
@@ -0,0 +1,853 @@
+/*
+ * am7xxxd - share am7xxx devices among several processes
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxxd.c
+ * am7xxxd opens all the am7xxx devices once and lets other processes use
+ * them: the clients write their pictures into shared memory and the daemon
+ * sends them to the device from there, without copying them.
+ *
+ * The main thread reads the requests of all the clients, the requests for
+ * a device are then carried out by a thread of its own which also sends
+ * the replies, so a slow device does not hold up the others.
+ */
+
+#define _GNU_SOURCE /* for memfd_create() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#include <am7xxx.h>
+
+#include "am7xxxd.h"
+
+#define AM7XXXD_MAX_CLIENTS 16
+
+struct daemon_client;
+
+/* A request waiting for the thread of its device */
+struct daemon_job {
+	struct daemon_job *next;
+	struct daemon_client *client;
+	struct am7xxxd_request request;
+};
+
+/*
+ * Each device has a context of its own, as a device and its context are
+ * used from the thread of the device only.
+ */
+struct daemon_device {
+	struct daemon *daemon;
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	am7xxx_device_info info;
+	unsigned int slot_size;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	struct daemon_job *first_job;
+	struct daemon_job *last_job;
+	int closed;
+	int started;
+};
+
+/*
+ * A dropped client is released only when the thread of its device is done
+ * with its jobs: the images are sent straight from the ring, and the reply
+ * must not go to another client reusing the same file descriptor.
+ */
+struct daemon_client {
+	int fd;
+	struct daemon_device *device;
+	uint8_t *ring;
+	size_t ring_size;
+	unsigned int slots_count;
+	unsigned int pending_jobs;
+	int dropped;
+};
+
+struct daemon {
+	int listen_fd;
+	struct daemon_device *devices;
+	unsigned int devices_count;
+	/* protects the fd, pending_jobs and dropped fields of the clients */
+	pthread_mutex_t clients_mutex;
+	struct daemon_client clients[AM7XXXD_MAX_CLIENTS];
+	unsigned int slots_count;
+};
+
+static volatile sig_atomic_t run = 1;
+
+/* The memory is only reachable through the file descriptor */
+static int create_ring(size_t size)
+{
+	int fd;
+	int ret;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("am7xxxd-ring", MFD_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		perror("memfd_create");
+		return ret;
+	}
+#else
+	static unsigned int ring_count;
+	char name[64];
+
+	snprintf(name, sizeof(name), "/am7xxxd-%d-%u", (int)getpid(), ring_count++);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		ret = -errno;
+		perror("shm_open");
+		return ret;
+	}
+	shm_unlink(name);
+#endif
+
+	ret = ftruncate(fd, size);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ftruncate");
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+static int send_reply(struct daemon_client *client,
+		      struct am7xxxd_reply *reply,
+		      int ring_fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t ret;
+
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(*reply);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (ring_fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &ring_fd, sizeof(int));
+	}
+
+	ret = sendmsg(client->fd, &msg, 0);
+	if (ret < 0) {
+		ret = -errno;
+		perror("sendmsg");
+		return ret;
+	}
+
+	return 0;
+}
+
+static int handle_attach(struct daemon *daemon,
+			 struct daemon_client *client,
+			 struct am7xxxd_request *request,
+			 struct am7xxxd_reply *reply)
+{
+	struct daemon_device *device;
+	int ring_fd;
+	int ret;
+
+	if (client->device)
+		return -EISCONN;
+
+	if (request->value < 0 || (unsigned int)request->value >= daemon->devices_count)
+		return -ENODEV;
+
+	device = &daemon->devices[request->value];
+
+	client->slots_count = daemon->slots_count;
+	client->ring_size = (size_t)client->slots_count * device->slot_size;
+
+	ring_fd = create_ring(client->ring_size);
+	if (ring_fd < 0)
+		return ring_fd;
+
+	client->ring = mmap(NULL, client->ring_size, PROT_READ, MAP_SHARED, ring_fd, 0);
+	if (client->ring == MAP_FAILED) {
+		ret = -errno;
+		perror("mmap");
+		client->ring = NULL;
+		goto out;
+	}
+
+	client->device = device;
+
+	reply->status = 0;
+	reply->slots_count = client->slots_count;
+	reply->slot_size = device->slot_size;
+	reply->native_width = device->info.native_width;
+	reply->native_height = device->info.native_height;
+
+	/* the client maps the ring too, then the descriptor is not needed */
+	ret = send_reply(client, reply, ring_fd);
+	if (ret == 0)
+		ret = 1;
+
+out:
+	close(ring_fd);
+	return ret;
+}
+
+/* Called with the clients mutex held */
+static void release_client(struct daemon_client *client)
+{
+	if (client->ring)
+		munmap(client->ring, client->ring_size);
+	close(client->fd);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+static void drop_client(struct daemon *daemon, struct daemon_client *client)
+{
+	pthread_mutex_lock(&daemon->clients_mutex);
+	if (client->fd < 0 || client->dropped)
+		goto out;
+
+	if (client->pending_jobs > 0) {
+		/* the replies still to come fail right away */
+		shutdown(client->fd, SHUT_RDWR);
+		client->dropped = 1;
+	} else {
+		release_client(client);
+	}
+out:
+	pthread_mutex_unlock(&daemon->clients_mutex);
+}
+
+/*
+ * Hand a request over to the thread of the device; a client can have one
+ * image per slot and one more request in flight, more than that is
+ * refused so that a misbehaving client cannot make the queue grow forever.
+ * One job more is allowed for the one whose reply has just been sent but
+ * which is still counted.
+ */
+static int queue_job(struct daemon *daemon, struct daemon_client *client,
+		     struct am7xxxd_request *request)
+{
+	struct daemon_device *device = client->device;
+	struct daemon_job *job;
+	int ret = 0;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL) {
+		perror("malloc");
+		return -ENOMEM;
+	}
+	job->next = NULL;
+	job->client = client;
+	job->request = *request;
+
+	pthread_mutex_lock(&daemon->clients_mutex);
+	if (client->pending_jobs > client->slots_count + 1)
+		ret = -EBUSY;
+	else
+		client->pending_jobs++;
+	pthread_mutex_unlock(&daemon->clients_mutex);
+	if (ret < 0) {
+		free(job);
+		return ret;
+	}
+
+	pthread_mutex_lock(&device->mutex);
+	if (device->last_job)
+		device->last_job->next = job;
+	else
+		device->first_job = job;
+	device->last_job = job;
+	pthread_cond_signal(&device->not_empty);
+	pthread_mutex_unlock(&device->mutex);
+
+	return 0;
+}
+
+/* Get the next job, NULL when the device is closed and no job is left */
+static struct daemon_job *get_job(struct daemon_device *device)
+{
+	struct daemon_job *job;
+
+	pthread_mutex_lock(&device->mutex);
+	while (device->first_job == NULL && !device->closed)
+		pthread_cond_wait(&device->not_empty, &device->mutex);
+
+	job = device->first_job;
+	if (job) {
+		device->first_job = job->next;
+		if (device->first_job == NULL)
+			device->last_job = NULL;
+	}
+	pthread_mutex_unlock(&device->mutex);
+
+	return job;
+}
+
+static int run_job(struct daemon_device *device, struct daemon_job *job)
+{
+	struct daemon_client *client = job->client;
+	struct am7xxxd_request *request = &job->request;
+
+	switch (request->type) {
+	case AM7XXXD_REQUEST_SUBMIT:
+		/* straight from the shared memory, no copy */
+		return am7xxx_send_image(device->dev,
+					 request->format,
+					 request->width,
+					 request->height,
+					 client->ring + (size_t)request->slot * device->slot_size,
+					 request->size);
+	case AM7XXXD_REQUEST_SET_POWER_MODE:
+		return am7xxx_set_power_mode(device->dev, request->value);
+	case AM7XXXD_REQUEST_SET_ZOOM_MODE:
+		return am7xxx_set_zoom_mode(device->dev, request->value);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void *device_thread(void *arg)
+{
+	struct daemon_device *device = arg;
+	struct daemon *daemon = device->daemon;
+	struct daemon_client *client;
+	struct am7xxxd_reply reply;
+	struct daemon_job *job;
+	int dropped;
+	int ret;
+
+	while ((job = get_job(device)) != NULL) {
+		client = job->client;
+
+		ret = run_job(device, job);
+
+		memset(&reply, 0, sizeof(reply));
+		reply.type = job->request.type;
+		reply.slot = job->request.slot;
+		reply.status = ret < 0 ? ret : 0;
+
+		/* the descriptor stays open as long as there are jobs */
+		pthread_mutex_lock(&daemon->clients_mutex);
+		dropped = client->dropped;
+		pthread_mutex_unlock(&daemon->clients_mutex);
+		if (!dropped)
+			send_reply(client, &reply, -1);
+
+		pthread_mutex_lock(&daemon->clients_mutex);
+		if (--client->pending_jobs == 0 && client->dropped)
+			release_client(client);
+		pthread_mutex_unlock(&daemon->clients_mutex);
+
+		free(job);
+	}
+
+	return NULL;
+}
+
+static int check_submit(struct daemon_client *client,
+			struct am7xxxd_request *request)
+{
+	if (request->slot >= client->slots_count ||
+	    request->size > client->device->slot_size ||
+	    (request->format != AM7XXX_IMAGE_FORMAT_JPEG &&
+	     request->format != AM7XXX_IMAGE_FORMAT_NV12))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Serve one request, a negative return value means that the client has to
+ * be dropped.
+ */
+static int handle_request(struct daemon *daemon, struct daemon_client *client)
+{
+	struct am7xxxd_request request;
+	struct am7xxxd_reply reply;
+	ssize_t len;
+	int ret;
+
+	len = recv(client->fd, &request, sizeof(request), 0);
+	if (len < 0) {
+		ret = -errno;
+		perror("recv");
+		return ret;
+	} else if (len == 0) {
+		return -ECONNRESET;
+	} else if (len != sizeof(request)) {
+		fprintf(stderr, "invalid request, dropping the client\n");
+		return -EPROTO;
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	reply.type = request.type;
+
+	switch (request.type) {
+	case AM7XXXD_REQUEST_ATTACH:
+		ret = handle_attach(daemon, client, &request, &reply);
+		/* on success the reply, with the ring, has been sent already */
+		if (ret > 0)
+			return 0;
+		break;
+	case AM7XXXD_REQUEST_SUBMIT:
+		reply.slot = request.slot;
+		if (client->device == NULL) {
+			ret = -ENOTCONN;
+			break;
+		}
+		ret = check_submit(client, &request);
+		if (ret < 0)
+			break;
+		/* fall through */
+	case AM7XXXD_REQUEST_SET_POWER_MODE:
+	case AM7XXXD_REQUEST_SET_ZOOM_MODE:
+		if (client->device == NULL) {
+			ret = -ENOTCONN;
+			break;
+		}
+		/* the thread of the device replies when done */
+		ret = queue_job(daemon, client, &request);
+		if (ret == 0)
+			return 0;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	reply.status = ret < 0 ? ret : 0;
+	return send_reply(client, &reply, -1);
+}
+
+static void accept_client(struct daemon *daemon)
+{
+	unsigned int i;
+	int fd;
+
+	fd = accept(daemon->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		perror("accept");
+		return;
+	}
+
+	pthread_mutex_lock(&daemon->clients_mutex);
+	for (i = 0; i < AM7XXXD_MAX_CLIENTS; i++) {
+		if (daemon->clients[i].fd < 0) {
+			daemon->clients[i].fd = fd;
+			goto out;
+		}
+	}
+
+	fprintf(stderr, "too many clients, refusing a new one\n");
+	close(fd);
+out:
+	pthread_mutex_unlock(&daemon->clients_mutex);
+}
+
+static int serve(struct daemon *daemon)
+{
+	struct pollfd pfds[AM7XXXD_MAX_CLIENTS + 1];
+	struct daemon_client *polled[AM7XXXD_MAX_CLIENTS + 1];
+	unsigned int nfds;
+	unsigned int i;
+	int ret;
+
+	while (run) {
+		pfds[0].fd = daemon->listen_fd;
+		pfds[0].events = POLLIN;
+		nfds = 1;
+		pthread_mutex_lock(&daemon->clients_mutex);
+		for (i = 0; i < AM7XXXD_MAX_CLIENTS; i++) {
+			if (daemon->clients[i].fd < 0 || daemon->clients[i].dropped)
+				continue;
+			pfds[nfds].fd = daemon->clients[i].fd;
+			pfds[nfds].events = POLLIN;
+			polled[nfds] = &daemon->clients[i];
+			nfds++;
+		}
+		pthread_mutex_unlock(&daemon->clients_mutex);
+
+		ret = poll(pfds, nfds, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			perror("poll");
+			return ret;
+		}
+
+		for (i = 1; i < nfds; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+
+			ret = handle_request(daemon, polled[i]);
+			if (ret < 0)
+				drop_client(daemon, polled[i]);
+		}
+
+		if (pfds[0].revents & POLLIN)
+			accept_client(daemon);
+	}
+
+	return 0;
+}
+
+static int open_socket(struct daemon *daemon, const char *socket_path)
+{
+	/* the union avoids casting the address, which breaks strict aliasing */
+	union {
+		struct sockaddr sa;
+		struct sockaddr_un un;
+	} addr;
+	int fd;
+	int ret;
+
+	if (strlen(socket_path) >= sizeof(addr.un.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", socket_path);
+		return -ENAMETOOLONG;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.un.sun_family = AF_UNIX;
+	strcpy(addr.un.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0) {
+		ret = -errno;
+		perror("socket");
+		return ret;
+	}
+
+	/* A socket left behind by a daemon which died can be reused */
+	ret = connect(fd, &addr.sa, sizeof(addr.un));
+	close(fd);
+	if (ret == 0) {
+		fprintf(stderr, "am7xxxd is already running on %s\n", socket_path);
+		return -EADDRINUSE;
+	}
+	unlink(socket_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0) {
+		ret = -errno;
+		perror("socket");
+		return ret;
+	}
+
+	ret = bind(fd, &addr.sa, sizeof(addr.un));
+	if (ret < 0) {
+		ret = -errno;
+		perror(socket_path);
+		goto err_close;
+	}
+
+	ret = listen(fd, AM7XXXD_MAX_CLIENTS);
+	if (ret < 0) {
+		ret = -errno;
+		perror("listen");
+		goto err_unlink;
+	}
+
+	daemon->listen_fd = fd;
+	return 0;
+
+err_unlink:
+	unlink(socket_path);
+err_close:
+	close(fd);
+	return ret;
+}
+
+static int start_device(struct daemon *daemon, struct daemon_device *device)
+{
+	sigset_t signals;
+	sigset_t old_signals;
+	int ret;
+
+	device->daemon = daemon;
+
+	ret = pthread_mutex_init(&device->mutex, NULL);
+	if (ret != 0)
+		goto err;
+
+	ret = pthread_cond_init(&device->not_empty, NULL);
+	if (ret != 0)
+		goto err_destroy_mutex;
+
+	/* the signals are for the main thread, to stop poll() */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	ret = pthread_create(&device->thread, NULL, device_thread, device);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (ret != 0)
+		goto err_destroy_not_empty;
+
+	device->started = 1;
+	return 0;
+
+err_destroy_not_empty:
+	pthread_cond_destroy(&device->not_empty);
+err_destroy_mutex:
+	pthread_mutex_destroy(&device->mutex);
+err:
+	fprintf(stderr, "cannot start the device thread: %s\n", strerror(ret));
+	return -ret;
+}
+
+/* The jobs already queued are carried out before the thread ends */
+static void stop_device(struct daemon_device *device)
+{
+	if (!device->started)
+		return;
+
+	pthread_mutex_lock(&device->mutex);
+	device->closed = 1;
+	pthread_cond_broadcast(&device->not_empty);
+	pthread_mutex_unlock(&device->mutex);
+
+	pthread_join(device->thread, NULL);
+	pthread_cond_destroy(&device->not_empty);
+	pthread_mutex_destroy(&device->mutex);
+}
+
+static void close_devices(struct daemon *daemon)
+{
+	unsigned int i;
+
+	for (i = 0; i < daemon->devices_count; i++) {
+		stop_device(&daemon->devices[i]);
+		am7xxx_shutdown(daemon->devices[i].ctx);
+	}
+
+	free(daemon->devices);
+	daemon->devices = NULL;
+	daemon->devices_count = 0;
+}
+
+static int open_devices(struct daemon *daemon, int log_level)
+{
+	struct daemon_device *devices;
+	struct daemon_device *device;
+	unsigned int page_size = sysconf(_SC_PAGESIZE);
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	unsigned int i;
+	int ret;
+
+	/* Open all the devices the library finds, until one is missing */
+	for (i = 0; ; i++) {
+		ret = am7xxx_init(&ctx);
+		if (ret < 0) {
+			perror("am7xxx_init");
+			return ret;
+		}
+
+		am7xxx_set_log_level(ctx, log_level);
+
+		if (am7xxx_open_device(ctx, &dev, i) < 0) {
+			am7xxx_shutdown(ctx);
+			break;
+		}
+
+		devices = realloc(daemon->devices, (i + 1) * sizeof(*devices));
+		if (devices == NULL) {
+			perror("realloc");
+			am7xxx_shutdown(ctx);
+			return -ENOMEM;
+		}
+		daemon->devices = devices;
+
+		device = &devices[i];
+		memset(device, 0, sizeof(*device));
+		device->ctx = ctx;
+		device->dev = dev;
+
+		ret = am7xxx_get_device_info(dev, &device->info);
+		if (ret < 0) {
+			perror("am7xxx_get_device_info");
+			am7xxx_shutdown(ctx);
+			return ret;
+		}
+
+		/* room for a JPEG or NV12 picture at the native size */
+		device->slot_size = device->info.native_width *
+				    device->info.native_height * 2;
+		device->slot_size = (device->slot_size + page_size - 1) &
+				    ~(page_size - 1);
+
+		daemon->devices_count = i + 1;
+
+		fprintf(stdout, "device %u: %dx%d\n", i,
+			device->info.native_width,
+			device->info.native_height);
+	}
+
+	if (daemon->devices_count == 0) {
+		fprintf(stderr, "no am7xxx devices found\n");
+		return -ENODEV;
+	}
+
+	/* the array does not move anymore, the threads can use it */
+	for (i = 0; i < daemon->devices_count; i++) {
+		ret = start_device(daemon, &daemon->devices[i]);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void unset_run(int signo)
+{
+	(void) signo;
+	run = 0;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-s <socket>\t\tthe socket to listen on (default is %s)\n",
+	       AM7XXXD_SOCKET_PATH);
+	printf("\t-n <slots>\t\tthe frames each client can have in flight (default is 3)\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLE OF USE:\n");
+	printf("\t%s -s /tmp/am7xxxd.socket\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *socket_path = NULL;
+	int slots_count = 3;
+	int log_level = AM7XXX_LOG_INFO;
+	struct daemon daemon;
+	unsigned int i;
+
+	memset(&daemon, 0, sizeof(daemon));
+	daemon.listen_fd = -1;
+	for (i = 0; i < AM7XXXD_MAX_CLIENTS; i++)
+		daemon.clients[i].fd = -1;
+
+	while ((opt = getopt(argc, argv, "s:n:l:h")) != -1) {
+		switch (opt) {
+		case 's':
+			free(socket_path);
+			socket_path = strdup(optarg);
+			break;
+		case 'n':
+			slots_count = atoi(optarg);
+			if (slots_count < 1 || slots_count > AM7XXXD_MAX_SLOTS) {
+				fprintf(stderr, "Invalid number of slots, must be between 1 and %d\n",
+					AM7XXXD_MAX_SLOTS);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (socket_path == NULL)
+		socket_path = strdup(AM7XXXD_SOCKET_PATH);
+
+	daemon.slots_count = slots_count;
+
+	signal(SIGINT, unset_run);
+	signal(SIGTERM, unset_run);
+	/* clients going away are noticed when reading from them */
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = pthread_mutex_init(&daemon.clients_mutex, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "cannot initialize the clients mutex\n");
+		ret = -ret;
+		goto out;
+	}
+
+	ret = open_devices(&daemon, log_level);
+	if (ret < 0)
+		goto cleanup;
+
+	ret = open_socket(&daemon, socket_path);
+	if (ret < 0)
+		goto cleanup;
+
+	fprintf(stdout, "serving %u device(s) on %s\n",
+		daemon.devices_count, socket_path);
+
+	ret = serve(&daemon);
+
+	/* the clients with jobs left are released by the device threads */
+	for (i = 0; i < AM7XXXD_MAX_CLIENTS; i++)
+		drop_client(&daemon, &daemon.clients[i]);
+
+	close(daemon.listen_fd);
+	unlink(socket_path);
+
+cleanup:
+	close_devices(&daemon);
+	pthread_mutex_destroy(&daemon.clients_mutex);
+out:
+	free(socket_path);
+	return ret;
+}
@@ -0,0 +1,124 @@
+/*
+ * am7xxxd - share am7xxx devices among several processes
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AM7XXXD_H
+#define __AM7XXXD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <am7xxx.h>
+
+/*
+ * The daemon owns the devices, the clients talk to it over a Unix
+ * SOCK_SEQPACKET socket, one request gets exactly one reply.
+ *
+ * A client first attaches to a device, the reply carries the file
+ * descriptor of a shared memory ring made of 'slots_count' slots of
+ * 'slot_size' bytes each. To show a picture the client writes it into a
+ * free slot and submits the slot, the daemon sends the image to the device
+ * straight from the shared memory and replies when the slot can be reused.
+ *
+ * The messages are in host byte order, the socket is a local one.
+ */
+
+#define AM7XXXD_SOCKET_PATH "/tmp/am7xxxd.socket"
+
+/* the free slots are tracked in a 32 bits mask */
+#define AM7XXXD_MAX_SLOTS 32
+
+enum am7xxxd_request_type {
+	AM7XXXD_REQUEST_ATTACH = 1,
+	AM7XXXD_REQUEST_SUBMIT,
+	AM7XXXD_REQUEST_SET_POWER_MODE,
+	AM7XXXD_REQUEST_SET_ZOOM_MODE,
+};
+
+struct am7xxxd_request {
+	uint32_t type;
+	int32_t value;		/* device index or mode */
+	uint32_t slot;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t size;
+};
+
+struct am7xxxd_reply {
+	uint32_t type;		/* the type of the request */
+	int32_t status;		/* 0 or a negative errno value */
+	uint32_t slot;
+	uint32_t slots_count;
+	uint32_t slot_size;
+	uint32_t native_width;
+	uint32_t native_height;
+};
+
+/* The client side */
+struct am7xxxd_client {
+	int fd;
+	uint8_t *ring;
+	size_t ring_size;
+	unsigned int slots_count;
+	unsigned int slot_size;
+	uint32_t free_slots;
+	int submit_status;	/* the first error of the submitted images */
+	unsigned int native_width;
+	unsigned int native_height;
+};
+
+int am7xxxd_client_connect(struct am7xxxd_client *client,
+			   const char *socket_path,
+			   unsigned int device_index);
+
+void am7xxxd_client_disconnect(struct am7xxxd_client *client);
+
+/*
+ * Get a free slot, waiting for the daemon to give one back when all of them
+ * are in use; return the slot index or a negative value on error.
+ */
+int am7xxxd_client_get_slot(struct am7xxxd_client *client);
+
+static inline uint8_t *am7xxxd_client_slot_data(struct am7xxxd_client *client,
+						unsigned int slot)
+{
+	return client->ring + (size_t)slot * client->slot_size;
+}
+
+/* Queue the image in 'slot' for display, the call does not wait for it */
+int am7xxxd_client_submit(struct am7xxxd_client *client,
+			  unsigned int slot,
+			  am7xxx_image_format format,
+			  unsigned int width,
+			  unsigned int height,
+			  unsigned int size);
+
+/*
+ * Wait for all the submitted images to be sent; return 0, or the error of
+ * the first image which could not be sent since the last call.
+ */
+int am7xxxd_client_flush(struct am7xxxd_client *client);
+
+int am7xxxd_client_set_power_mode(struct am7xxxd_client *client,
+				  am7xxx_power_mode power);
+
+int am7xxxd_client_set_zoom_mode(struct am7xxxd_client *client,
+				 am7xxx_zoom_mode zoom);
+
+#endif /* __AM7XXXD_H */
@@ -0,0 +1,320 @@
+/*
+ * am7xxxd_client - send pictures to am7xxx devices through am7xxxd
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#include "am7xxxd.h"
+
+static int send_request(struct am7xxxd_client *client,
+			struct am7xxxd_request *request)
+{
+	ssize_t ret;
+
+	ret = send(client->fd, request, sizeof(*request), 0);
+	if (ret < 0) {
+		ret = -errno;
+		perror("send");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the next reply, a slot given back is marked as free and the first
+ * image which could not be sent is remembered for am7xxxd_client_flush().
+ */
+static int read_reply(struct am7xxxd_client *client,
+		      struct am7xxxd_reply *reply)
+{
+	ssize_t ret;
+
+	do {
+		ret = recv(client->fd, reply, sizeof(*reply), 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		ret = -errno;
+		perror("recv");
+		return ret;
+	} else if (ret == 0) {
+		fprintf(stderr, "am7xxxd closed the connection\n");
+		return -ECONNRESET;
+	} else if (ret != sizeof(*reply)) {
+		fprintf(stderr, "invalid reply from am7xxxd\n");
+		return -EPROTO;
+	}
+
+	if (reply->type == AM7XXXD_REQUEST_SUBMIT &&
+	    reply->slot < client->slots_count) {
+		client->free_slots |= 1U << reply->slot;
+		if (reply->status < 0 && client->submit_status == 0)
+			client->submit_status = reply->status;
+	}
+
+	return 0;
+}
+
+/* Wait for the reply to a request of type 'type' */
+static int wait_reply(struct am7xxxd_client *client, uint32_t type)
+{
+	struct am7xxxd_reply reply;
+	int ret;
+
+	for (;;) {
+		ret = read_reply(client, &reply);
+		if (ret < 0)
+			return ret;
+
+		if (reply.type == type)
+			return reply.status;
+	}
+}
+
+static uint32_t all_slots(unsigned int slots_count)
+{
+	if (slots_count == AM7XXXD_MAX_SLOTS)
+		return ~0U;
+
+	return (1U << slots_count) - 1;
+}
+
+int am7xxxd_client_connect(struct am7xxxd_client *client,
+			   const char *socket_path,
+			   unsigned int device_index)
+{
+	/* the union avoids casting the address, which breaks strict aliasing */
+	union {
+		struct sockaddr sa;
+		struct sockaddr_un un;
+	} addr;
+	struct am7xxxd_request request;
+	struct am7xxxd_reply reply;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int ring_fd = -1;
+	ssize_t len;
+	int ret;
+
+	memset(client, 0, sizeof(*client));
+
+	if (strlen(socket_path) >= sizeof(addr.un.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", socket_path);
+		return -ENAMETOOLONG;
+	}
+
+	client->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (client->fd < 0) {
+		ret = -errno;
+		perror("socket");
+		return ret;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.un.sun_family = AF_UNIX;
+	strcpy(addr.un.sun_path, socket_path);
+
+	ret = connect(client->fd, &addr.sa, sizeof(addr.un));
+	if (ret < 0) {
+		ret = -errno;
+		perror(socket_path);
+		goto err_close;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.type = AM7XXXD_REQUEST_ATTACH;
+	request.value = (int32_t)device_index;
+	ret = send_request(client, &request);
+	if (ret < 0)
+		goto err_close;
+
+	/* the reply carries the ring file descriptor */
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	len = recvmsg(client->fd, &msg, 0);
+	if (len < 0) {
+		ret = -errno;
+		perror("recvmsg");
+		goto err_close;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&ring_fd, CMSG_DATA(cmsg), sizeof(ring_fd));
+
+	if (len != sizeof(reply) || reply.type != AM7XXXD_REQUEST_ATTACH) {
+		fprintf(stderr, "invalid reply from am7xxxd\n");
+		ret = -EPROTO;
+		goto err_close_ring;
+	}
+
+	if (reply.status < 0) {
+		fprintf(stderr, "cannot attach to device %u: %s\n",
+			device_index, strerror(-reply.status));
+		ret = reply.status;
+		goto err_close_ring;
+	}
+
+	if (ring_fd < 0 || reply.slots_count == 0 ||
+	    reply.slots_count > AM7XXXD_MAX_SLOTS) {
+		fprintf(stderr, "invalid reply from am7xxxd\n");
+		ret = -EPROTO;
+		goto err_close_ring;
+	}
+
+	client->slots_count = reply.slots_count;
+	client->slot_size = reply.slot_size;
+	client->native_width = reply.native_width;
+	client->native_height = reply.native_height;
+	client->ring_size = (size_t)client->slots_count * client->slot_size;
+
+	client->ring = mmap(NULL, client->ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, ring_fd, 0);
+	if (client->ring == MAP_FAILED) {
+		ret = -errno;
+		perror("mmap");
+		client->ring = NULL;
+		goto err_close_ring;
+	}
+	close(ring_fd);
+
+	client->free_slots = all_slots(client->slots_count);
+
+	return 0;
+
+err_close_ring:
+	if (ring_fd >= 0)
+		close(ring_fd);
+err_close:
+	close(client->fd);
+	client->fd = -1;
+	return ret;
+}
+
+void am7xxxd_client_disconnect(struct am7xxxd_client *client)
+{
+	if (client->ring)
+		munmap(client->ring, client->ring_size);
+	client->ring = NULL;
+
+	if (client->fd >= 0)
+		close(client->fd);
+	client->fd = -1;
+}
+
+int am7xxxd_client_get_slot(struct am7xxxd_client *client)
+{
+	int slot;
+	int ret;
+
+	if (client->free_slots == 0) {
+		ret = wait_reply(client, AM7XXXD_REQUEST_SUBMIT);
+		if (ret < 0)
+			return ret;
+	}
+
+	slot = ffs((int)client->free_slots) - 1;
+	client->free_slots &= ~(1U << slot);
+
+	return slot;
+}
+
+int am7xxxd_client_submit(struct am7xxxd_client *client,
+			  unsigned int slot,
+			  am7xxx_image_format format,
+			  unsigned int width,
+			  unsigned int height,
+			  unsigned int size)
+{
+	struct am7xxxd_request request;
+
+	if (slot >= client->slots_count || size > client->slot_size)
+		return -EINVAL;
+
+	memset(&request, 0, sizeof(request));
+	request.type = AM7XXXD_REQUEST_SUBMIT;
+	request.slot = slot;
+	request.format = format;
+	request.width = width;
+	request.height = height;
+	request.size = size;
+
+	return send_request(client, &request);
+}
+
+int am7xxxd_client_flush(struct am7xxxd_client *client)
+{
+	struct am7xxxd_reply reply;
+	int ret;
+
+	while (client->free_slots != all_slots(client->slots_count)) {
+		ret = read_reply(client, &reply);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = client->submit_status;
+	client->submit_status = 0;
+	return ret;
+}
+
+static int set_mode(struct am7xxxd_client *client, uint32_t type, int value)
+{
+	struct am7xxxd_request request;
+	int ret;
+
+	memset(&request, 0, sizeof(request));
+	request.type = type;
+	request.value = value;
+
+	ret = send_request(client, &request);
+	if (ret < 0)
+		return ret;
+
+	return wait_reply(client, type);
+}
+
+int am7xxxd_client_set_power_mode(struct am7xxxd_client *client,
+				  am7xxx_power_mode power)
+{
+	return set_mode(client, AM7XXXD_REQUEST_SET_POWER_MODE, power);
+}
+
+int am7xxxd_client_set_zoom_mode(struct am7xxxd_client *client,
+				 am7xxx_zoom_mode zoom)
+{
+	return set_mode(client, AM7XXXD_REQUEST_SET_ZOOM_MODE, zoom);
+}
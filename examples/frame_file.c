@@ -0,0 +1,320 @@
+/*
+ * frame_file - files of frames ready to be sent to am7xxx devices
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "frame_file.h"
+
+/* Durations longer than this mean a discontinuity in the timestamps */
+#define FRAME_FILE_MAX_DURATION 10000000
+
+struct frame_file_writer_entry {
+	uint64_t offset;
+	uint32_t size;
+	int64_t pts;
+};
+
+struct frame_file_writer {
+	FILE *fp;
+	am7xxx_image_format format;
+	unsigned int width;
+	unsigned int height;
+	uint64_t offset;
+	struct frame_file_writer_entry *entries;
+	unsigned int entries_count;
+	unsigned int entries_size;
+};
+
+static void put_le32(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = value & 0xff;
+	buffer[1] = (value >> 8) & 0xff;
+	buffer[2] = (value >> 16) & 0xff;
+	buffer[3] = (value >> 24) & 0xff;
+}
+
+static void put_le64(uint8_t *buffer, uint64_t value)
+{
+	put_le32(buffer, value & 0xffffffff);
+	put_le32(buffer + 4, value >> 32);
+}
+
+static uint32_t get_le32(const uint8_t *buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) |
+		((uint32_t)buffer[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *buffer)
+{
+	return get_le32(buffer) | ((uint64_t)get_le32(buffer + 4) << 32);
+}
+
+int frame_file_open(struct frame_file *file, const char *path)
+{
+	struct frame_file_entry entry;
+	struct stat st;
+	uint64_t index_offset;
+	unsigned int i;
+	int fd;
+	int ret;
+
+	memset(file, 0, sizeof(*file));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		perror(path);
+		return ret;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ret = -errno;
+		perror("fstat");
+		goto out;
+	}
+
+	if (st.st_size < FRAME_FILE_HEADER_SIZE) {
+		fprintf(stderr, "%s is not a frame file\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	file->size = st.st_size;
+	file->data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (file->data == MAP_FAILED) {
+		ret = -errno;
+		perror("mmap");
+		file->data = NULL;
+		goto out;
+	}
+
+	if (memcmp(file->data, FRAME_FILE_MAGIC, 8) != 0 ||
+	    get_le32(file->data + 8) != FRAME_FILE_VERSION) {
+		fprintf(stderr, "%s is not a frame file, or it has an unsupported version\n", path);
+		ret = -EINVAL;
+		goto err_unmap;
+	}
+
+	file->format = get_le32(file->data + 12);
+	file->width = get_le32(file->data + 16);
+	file->height = get_le32(file->data + 20);
+	file->frames_count = get_le32(file->data + 24);
+	index_offset = get_le64(file->data + 32);
+
+	if (index_offset > file->size ||
+	    (file->size - index_offset) / FRAME_FILE_INDEX_ENTRY_SIZE < file->frames_count) {
+		fprintf(stderr, "%s is truncated\n", path);
+		ret = -EINVAL;
+		goto err_unmap;
+	}
+	file->index = file->data + index_offset;
+
+	/* check the frames once, so that playing them needs no checks */
+	for (i = 0; i < file->frames_count; i++) {
+		frame_file_get_entry(file, i, &entry);
+		if (entry.offset > index_offset || entry.size > index_offset - entry.offset) {
+			fprintf(stderr, "%s has an invalid frame %u\n", path, i);
+			ret = -EINVAL;
+			goto err_unmap;
+		}
+	}
+
+	/* the whole file is going to be read over and over */
+	posix_madvise(file->data, file->size, POSIX_MADV_WILLNEED);
+
+	ret = 0;
+	goto out;
+
+err_unmap:
+	munmap(file->data, file->size);
+	file->data = NULL;
+out:
+	close(fd);
+	return ret;
+}
+
+void frame_file_get_entry(struct frame_file *file, unsigned int n,
+			  struct frame_file_entry *entry)
+{
+	const uint8_t *index_entry = file->index + n * FRAME_FILE_INDEX_ENTRY_SIZE;
+
+	entry->offset = get_le64(index_entry);
+	entry->size = get_le32(index_entry + 8);
+	entry->duration = get_le32(index_entry + 12);
+}
+
+void frame_file_close(struct frame_file *file)
+{
+	if (file->data)
+		munmap(file->data, file->size);
+	file->data = NULL;
+}
+
+static int frame_file_write_header(struct frame_file_writer *writer,
+				   unsigned int frames_count,
+				   uint64_t index_offset)
+{
+	uint8_t header[FRAME_FILE_HEADER_SIZE];
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, FRAME_FILE_MAGIC, 8);
+	put_le32(header + 8, FRAME_FILE_VERSION);
+	put_le32(header + 12, writer->format);
+	put_le32(header + 16, writer->width);
+	put_le32(header + 20, writer->height);
+	put_le32(header + 24, frames_count);
+	put_le64(header + 32, index_offset);
+
+	if (fwrite(header, sizeof(header), 1, writer->fp) != 1) {
+		perror("fwrite");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int frame_file_create(struct frame_file_writer **writer_out,
+		      const char *path,
+		      am7xxx_image_format format,
+		      unsigned int width,
+		      unsigned int height)
+{
+	struct frame_file_writer *writer;
+	int ret;
+
+	writer = calloc(1, sizeof(*writer));
+	if (writer == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+
+	writer->format = format;
+	writer->width = width;
+	writer->height = height;
+
+	writer->fp = fopen(path, "wb");
+	if (writer->fp == NULL) {
+		ret = -errno;
+		perror(path);
+		goto err_free_writer;
+	}
+
+	/* the header is written again at the end with the real values */
+	ret = frame_file_write_header(writer, 0, 0);
+	if (ret < 0)
+		goto err_close;
+	writer->offset = FRAME_FILE_HEADER_SIZE;
+
+	*writer_out = writer;
+	return 0;
+
+err_close:
+	fclose(writer->fp);
+err_free_writer:
+	free(writer);
+	return ret;
+}
+
+int frame_file_append(struct frame_file_writer *writer,
+		      const uint8_t *data,
+		      unsigned int size,
+		      int64_t pts)
+{
+	struct frame_file_writer_entry *entries;
+	unsigned int entries_size;
+
+	if (writer->entries_count == writer->entries_size) {
+		entries_size = writer->entries_size ? writer->entries_size * 2 : 256;
+		entries = realloc(writer->entries, entries_size * sizeof(*entries));
+		if (entries == NULL) {
+			perror("realloc");
+			return -ENOMEM;
+		}
+		writer->entries = entries;
+		writer->entries_size = entries_size;
+	}
+
+	if (fwrite(data, size, 1, writer->fp) != 1) {
+		perror("fwrite");
+		return -EIO;
+	}
+
+	writer->entries[writer->entries_count].offset = writer->offset;
+	writer->entries[writer->entries_count].size = size;
+	writer->entries[writer->entries_count].pts = pts;
+	writer->entries_count++;
+	writer->offset += size;
+
+	return 0;
+}
+
+int frame_file_finish(struct frame_file_writer *writer,
+		      unsigned int last_duration)
+{
+	uint8_t index_entry[FRAME_FILE_INDEX_ENTRY_SIZE];
+	int64_t duration;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < writer->entries_count; i++) {
+		duration = last_duration;
+		if (i + 1 < writer->entries_count) {
+			duration = writer->entries[i + 1].pts - writer->entries[i].pts;
+			if (duration <= 0 || duration > FRAME_FILE_MAX_DURATION)
+				duration = last_duration;
+		}
+
+		put_le64(index_entry, writer->entries[i].offset);
+		put_le32(index_entry + 8, writer->entries[i].size);
+		put_le32(index_entry + 12, (uint32_t)duration);
+		if (fwrite(index_entry, sizeof(index_entry), 1, writer->fp) != 1) {
+			perror("fwrite");
+			ret = -EIO;
+			goto out;
+		}
+	}
+
+	if (fseek(writer->fp, 0, SEEK_SET) < 0) {
+		ret = -errno;
+		perror("fseek");
+		goto out;
+	}
+
+	ret = frame_file_write_header(writer, writer->entries_count, writer->offset);
+
+out:
+	if (fclose(writer->fp) == EOF) {
+		perror("fclose");
+		if (ret == 0)
+			ret = -EIO;
+	}
+	free(writer->entries);
+	free(writer);
+	return ret;
+}
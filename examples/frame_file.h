@@ -0,0 +1,97 @@
+/*
+ * frame_file - files of frames ready to be sent to am7xxx devices
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_FILE_H
+#define __FRAME_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <am7xxx.h>
+
+/*
+ * A frame file holds pictures already in a format the device can show (JPEG
+ * or NV12 at the device native size), each one with its duration, so that
+ * playing them back does not need any decoding or encoding.
+ *
+ * All the fields are little endian, the layout is:
+ *
+ *   header       "AM7XXXFR", version, format, width, height, frames count,
+ *                and the offset of the index
+ *   frames data  the pictures one after the other
+ *   index        for each frame its offset, size and duration in
+ *                microseconds
+ */
+
+#define FRAME_FILE_MAGIC "AM7XXXFR"
+#define FRAME_FILE_VERSION 1
+
+#define FRAME_FILE_HEADER_SIZE 40
+#define FRAME_FILE_INDEX_ENTRY_SIZE 16
+
+struct frame_file_entry {
+	uint64_t offset;
+	uint32_t size;
+	uint32_t duration;
+};
+
+/* A frame file mapped in memory for playback */
+struct frame_file {
+	uint8_t *data;
+	size_t size;
+	am7xxx_image_format format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int frames_count;
+	const uint8_t *index;
+};
+
+int frame_file_open(struct frame_file *file, const char *path);
+
+/* Get the position of a frame in the mapping, and its duration */
+void frame_file_get_entry(struct frame_file *file, unsigned int n,
+			  struct frame_file_entry *entry);
+
+void frame_file_close(struct frame_file *file);
+
+struct frame_file_writer;
+
+int frame_file_create(struct frame_file_writer **writer,
+		      const char *path,
+		      am7xxx_image_format format,
+		      unsigned int width,
+		      unsigned int height);
+
+/*
+ * Append a frame; 'pts' is in microseconds, the durations of the frames are
+ * the differences between their timestamps.
+ */
+int frame_file_append(struct frame_file_writer *writer,
+		      const uint8_t *data,
+		      unsigned int size,
+		      int64_t pts);
+
+/*
+ * Write the index and close the file, 'last_duration' is the duration of
+ * the last frame, which has no following timestamp to compute it from.
+ */
+int frame_file_finish(struct frame_file_writer *writer,
+		      unsigned int last_duration);
+
+#endif /* __FRAME_FILE_H */
@@ -0,0 +1,210 @@
+/*
+ * frame_trace - record when each frame goes through the stages of a player
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "frame_trace.h"
+
+/* The thread ids of the tracks in the trace */
+#define TRACK_INPUT   1
+#define TRACK_SENDER  2
+#define TRACK_USB     3
+#define TRACK_ENCODER 10
+
+int frame_trace_init(struct frame_trace *trace, unsigned int interval)
+{
+	memset(trace, 0, sizeof(*trace));
+
+	trace->records = calloc(FRAME_TRACE_RING_SIZE, sizeof(*trace->records));
+	if (trace->records == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+	trace->size = FRAME_TRACE_RING_SIZE;
+	trace->interval = interval > 0 ? interval : 1;
+
+	return 0;
+}
+
+struct frame_trace_record *frame_trace_add(struct frame_trace *trace,
+					   const struct frame_trace_record *record)
+{
+	struct frame_trace_record *slot;
+
+	slot = &trace->records[trace->count % trace->size];
+	*slot = *record;
+	trace->count++;
+
+	return slot;
+}
+
+void frame_trace_submitted(struct frame_trace *trace,
+			   struct frame_trace_record *record)
+{
+	trace->submitted++;
+	if (record) {
+		trace->pending = record;
+		trace->pending_number = trace->submitted;
+	}
+}
+
+void frame_trace_image_sent(am7xxx_device *dev, int status, void *user_data)
+{
+	struct frame_trace *trace = user_data;
+	struct timespec ts;
+
+	(void) dev;
+
+	/* the images complete in the order they have been sent */
+	trace->completed++;
+	if (trace->pending == NULL || trace->pending_number != trace->completed)
+		return;
+
+	if (status == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		trace->pending->times[FRAME_TRACE_USB_DONE] =
+			(int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+	trace->pending = NULL;
+}
+
+static void write_metadata(FILE *file, unsigned int track, const char *name)
+{
+	fprintf(file,
+		",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+		"\"args\":{\"name\":\"%s\"}}",
+		track, name);
+}
+
+/* A slice between two stages, if the frame went through both */
+static void write_slice(FILE *file, const struct frame_trace_record *record,
+			const char *name, unsigned int track,
+			enum frame_trace_stage from, enum frame_trace_stage to)
+{
+	int64_t start = record->times[from];
+	int64_t end = record->times[to];
+
+	if (start == 0 || end == 0 || end < start)
+		return;
+
+	fprintf(file,
+		",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%lld,"
+		"\"dur\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"frame\":%u}}",
+		name, (long long)start, (long long)(end - start), track,
+		record->sequence);
+}
+
+/* A flow arrow, to follow a frame from the input to the sender */
+static void write_flow(FILE *file, const struct frame_trace_record *record,
+		       const char *phase, unsigned int track,
+		       enum frame_trace_stage stage)
+{
+	if (record->times[stage] == 0)
+		return;
+
+	fprintf(file,
+		",\n{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%s\",\"id\":%u,"
+		"\"ts\":%lld,\"pid\":1,\"tid\":%u%s}",
+		phase, record->sequence, (long long)record->times[stage], track,
+		phase[0] == 'f' ? ",\"bp\":\"e\"" : "");
+}
+
+int frame_trace_write(struct frame_trace *trace, const char *path)
+{
+	const struct frame_trace_record *record;
+	unsigned int encoders = 0;
+	unsigned int first;
+	unsigned int n;
+	unsigned int i;
+	char name[32];
+	FILE *file;
+	int ret;
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		perror("fopen");
+		return -errno;
+	}
+
+	/* only the most recent records are left when the ring wrapped */
+	n = trace->count < trace->size ? trace->count : trace->size;
+	first = trace->count < trace->size ? 0 : trace->count % trace->size;
+
+	/* the events after the first one start with the separator */
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file,
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"am7xxx-play\"}}");
+	write_metadata(file, TRACK_INPUT, "input");
+	write_metadata(file, TRACK_SENDER, "sender");
+	write_metadata(file, TRACK_USB, "usb");
+
+	for (i = 0; i < n; i++) {
+		record = &trace->records[(first + i) % trace->size];
+
+		for (; encoders <= record->encoder; encoders++) {
+			snprintf(name, sizeof(name), "encoder %u", encoders);
+			write_metadata(file, TRACK_ENCODER + encoders, name);
+		}
+
+		write_slice(file, record, "read", TRACK_INPUT,
+			    FRAME_TRACE_READ_START, FRAME_TRACE_READ);
+		write_slice(file, record, "decode", TRACK_INPUT,
+			    FRAME_TRACE_READ, FRAME_TRACE_DECODED);
+		write_slice(file, record, "scale", TRACK_INPUT,
+			    FRAME_TRACE_SCALE_START, FRAME_TRACE_SCALED);
+		write_slice(file, record, "encode", TRACK_ENCODER + record->encoder,
+			    FRAME_TRACE_ENCODE_START, FRAME_TRACE_ENCODED);
+		write_slice(file, record, "submit", TRACK_SENDER,
+			    FRAME_TRACE_SUBMIT_START, FRAME_TRACE_SUBMITTED);
+		write_slice(file, record, "usb", TRACK_USB,
+			    FRAME_TRACE_SUBMITTED, FRAME_TRACE_USB_DONE);
+
+		write_flow(file, record, "s", TRACK_INPUT, FRAME_TRACE_READ_START);
+		write_flow(file, record, "f", TRACK_SENDER, FRAME_TRACE_SUBMIT_START);
+
+		if (record->dropped)
+			fprintf(file,
+				",\n{\"name\":\"dropped\",\"cat\":\"frame\",\"ph\":\"i\","
+				"\"s\":\"t\",\"ts\":%lld,\"pid\":1,\"tid\":%u,"
+				"\"args\":{\"frame\":%u}}",
+				(long long)record->times[FRAME_TRACE_READ_START],
+				TRACK_SENDER, record->sequence);
+	}
+
+	fprintf(file, "\n]}\n");
+
+	ret = 0;
+	if (fclose(file) != 0) {
+		perror("fclose");
+		ret = -errno;
+	}
+
+	return ret;
+}
+
+void frame_trace_cleanup(struct frame_trace *trace)
+{
+	free(trace->records);
+	trace->records = NULL;
+}
@@ -0,0 +1,102 @@
+/*
+ * frame_trace - record when each frame goes through the stages of a player
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_TRACE_H
+#define __FRAME_TRACE_H
+
+#include <stdint.h>
+
+#include <am7xxx.h>
+
+/*
+ * The times, in microseconds of CLOCK_MONOTONIC, when a frame reached each
+ * stage; the stages a frame did not go through (e.g. no decoding for
+ * pictures passed through) are left to 0.
+ */
+enum frame_trace_stage {
+	FRAME_TRACE_READ_START,
+	FRAME_TRACE_READ,
+	FRAME_TRACE_DECODED,
+	FRAME_TRACE_SCALE_START,
+	FRAME_TRACE_SCALED,
+	FRAME_TRACE_ENCODE_START,
+	FRAME_TRACE_ENCODED,
+	FRAME_TRACE_SUBMIT_START,
+	FRAME_TRACE_SUBMITTED,
+	FRAME_TRACE_USB_DONE,
+	FRAME_TRACE_STAGES,
+};
+
+struct frame_trace_record {
+	unsigned int sequence;
+	unsigned int encoder;
+	int dropped;
+	int64_t times[FRAME_TRACE_STAGES];
+};
+
+/*
+ * The records go in a ring which keeps the most recent ones; only the
+ * sending thread adds records, so no locking is needed, and the ring is
+ * written out once the threads are gone.
+ */
+#define FRAME_TRACE_RING_SIZE 8192
+
+struct frame_trace {
+	struct frame_trace_record *records;
+	unsigned int size;
+	uint64_t count;
+	unsigned int interval;
+
+	/* the images sent, and the one whose completion is awaited */
+	uint64_t submitted;
+	uint64_t completed;
+	struct frame_trace_record *pending;
+	uint64_t pending_number;
+};
+
+/* Trace one frame every 'interval' ones */
+int frame_trace_init(struct frame_trace *trace, unsigned int interval);
+
+static inline int frame_trace_sampled(struct frame_trace *trace,
+				      unsigned int sequence)
+{
+	return trace && sequence % trace->interval == 0;
+}
+
+/* Copy a record in the ring, the copy is returned */
+struct frame_trace_record *frame_trace_add(struct frame_trace *trace,
+					   const struct frame_trace_record *record);
+
+/*
+ * Count every image sent to the device, 'record' is the one of the image
+ * if it is traced, or NULL; its USB completion time gets filled in when
+ * frame_trace_image_sent() is called for it.
+ */
+void frame_trace_submitted(struct frame_trace *trace,
+			   struct frame_trace_record *record);
+
+/* An am7xxx_image_sent_callback, 'user_data' is the trace */
+void frame_trace_image_sent(am7xxx_device *dev, int status, void *user_data);
+
+/* Write the records as Chrome trace event JSON, see chrome://tracing */
+int frame_trace_write(struct frame_trace *trace, const char *path);
+
+void frame_trace_cleanup(struct frame_trace *trace);
+
+#endif /* __FRAME_TRACE_H */
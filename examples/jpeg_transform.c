@@ -0,0 +1,1050 @@
+/*
+ * jpeg_transform - mirror and rotate JPEG pictures without decoding them
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "jpeg_transform.h"
+
+#define JPEG_MAX_COMPONENTS 4
+#define JPEG_MAX_TABLES 4
+
+/* Huffman codes up to this long are decoded with a single lookup */
+#define HUFFMAN_LOOKUP_BITS 9
+
+/* The most bytes a coded block can take, with every byte stuffed */
+#define BLOCK_MAX_SIZE 512
+
+/* The position in a 8x8 block of the zig-zag ordered coefficients */
+static const uint8_t natural_order[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/*
+ * The luminance DC table suggested by the JPEG standard, it has codes for
+ * all the DC differences of 8 bits pictures; it replaces tables which do
+ * not, because the DC differences change when the blocks move around.
+ */
+static const uint8_t standard_dc_counts[17] = {
+	0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t standard_dc_values[12] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+struct huffman_table {
+	int defined;
+	int used;
+	uint8_t counts[17];
+	uint8_t values[256];
+	unsigned int values_count;
+
+	/* for decoding: the code length and the value by code prefix, or
+	 * 0 for longer codes, which are found with max_code instead */
+	uint16_t lookup[1 << HUFFMAN_LOOKUP_BITS];
+	int32_t max_code[17];
+	int32_t value_offset[17];
+
+	/* for encoding */
+	uint16_t codes[256];
+	uint8_t sizes[256];
+};
+
+struct jpeg_component {
+	unsigned int id;
+	unsigned int h;
+	unsigned int v;
+	unsigned int blocks_w;
+	unsigned int blocks_h;
+	int16_t *blocks;
+	struct huffman_table *dc_table;
+	struct huffman_table *ac_table;
+
+	/* the DC differences get coded again with this table */
+	struct huffman_table *dc_output_table;
+};
+
+struct jpeg_picture {
+	unsigned int width;
+	unsigned int height;
+	unsigned int mcu_width;
+	unsigned int mcu_height;
+	unsigned int mcus_x;
+	unsigned int mcus_y;
+	unsigned int restart_interval;
+
+	struct jpeg_component components[JPEG_MAX_COMPONENTS];
+	unsigned int components_count;
+
+	/* the components in the order they are coded */
+	struct jpeg_component *scan[JPEG_MAX_COMPONENTS];
+
+	struct huffman_table dc_tables[JPEG_MAX_TABLES];
+	struct huffman_table ac_tables[JPEG_MAX_TABLES];
+	struct huffman_table standard_dc_table;
+};
+
+/*
+ * The entropy coded data, read ahead into a left aligned bit buffer; when
+ * a marker is found zeros are fed instead, and counted as padding so that
+ * reading past the data can be told.
+ */
+struct bit_reader {
+	const uint8_t *data;
+	const uint8_t *end;
+	uint64_t bits;
+	unsigned int count;
+	unsigned int padding;
+};
+
+struct bit_writer {
+	uint8_t **buffer;
+	size_t *capacity;
+	size_t size;
+	uint64_t bits;
+	unsigned int count;
+};
+
+static int huffman_table_build(struct huffman_table *table)
+{
+	unsigned int code = 0;
+	unsigned int k = 0;
+	unsigned int prefix;
+	unsigned int l;
+	unsigned int i;
+	unsigned int j;
+	uint8_t value;
+
+	memset(table->lookup, 0, sizeof(table->lookup));
+	memset(table->sizes, 0, sizeof(table->sizes));
+
+	for (l = 1; l <= 16; l++) {
+		table->value_offset[l] = (int32_t)k - (int32_t)code;
+		for (i = 0; i < table->counts[l]; i++, k++, code++) {
+			value = table->values[k];
+			table->codes[value] = code;
+			table->sizes[value] = l;
+
+			if (l <= HUFFMAN_LOOKUP_BITS) {
+				prefix = code << (HUFFMAN_LOOKUP_BITS - l);
+				for (j = 0; j < (1U << (HUFFMAN_LOOKUP_BITS - l)); j++)
+					table->lookup[prefix | j] = (l << 8) | value;
+			}
+		}
+		table->max_code[l] = table->counts[l] ? (int32_t)code - 1 : -1;
+
+		/* more codes than can fit in l bits */
+		if (code > (1U << l))
+			return -EINVAL;
+		code <<= 1;
+	}
+
+	return 0;
+}
+
+static void huffman_table_set(struct huffman_table *table,
+			      const uint8_t counts[17],
+			      const uint8_t *values, unsigned int values_count)
+{
+	memcpy(table->counts, counts, sizeof(table->counts));
+	memcpy(table->values, values, values_count);
+	table->values_count = values_count;
+}
+
+/* Check that the table has codes for all the DC differences */
+static int huffman_table_is_complete_dc(const struct huffman_table *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(standard_dc_values); i++)
+		if (table->sizes[i] == 0)
+			return 0;
+
+	return 1;
+}
+
+/* Check whether any of the four bytes of a word is 0xff */
+static inline int has_ff_byte(uint32_t word)
+{
+	word = ~word;
+	return ((word - 0x01010101) & ~word & 0x80808080) != 0;
+}
+
+/* Read ahead at least 32 bits */
+static void reader_fill(struct bit_reader *reader)
+{
+	uint32_t word;
+	uint8_t byte;
+
+	/* most of the times there are no stuffed bytes to care about */
+	if (reader->end - reader->data >= 4 && reader->count <= 32) {
+		word = ((uint32_t)reader->data[0] << 24) | (reader->data[1] << 16) |
+			(reader->data[2] << 8) | reader->data[3];
+		if (!has_ff_byte(word)) {
+			reader->bits |= (uint64_t)word << (32 - reader->count);
+			reader->count += 32;
+			reader->data += 4;
+			return;
+		}
+	}
+
+	while (reader->count <= 56) {
+		byte = 0;
+		if (reader->data < reader->end && reader->data[0] != 0xff) {
+			byte = *reader->data++;
+		} else if (reader->end - reader->data >= 2 &&
+			   reader->data[0] == 0xff && reader->data[1] == 0x00) {
+			byte = 0xff;
+			reader->data += 2;
+		} else {
+			reader->padding++;
+		}
+		reader->bits |= (uint64_t)byte << (56 - reader->count);
+		reader->count += 8;
+	}
+}
+
+static inline unsigned int reader_peek(const struct bit_reader *reader,
+				       unsigned int n)
+{
+	return (unsigned int)(reader->bits >> (64 - n));
+}
+
+static inline void reader_skip(struct bit_reader *reader, unsigned int n)
+{
+	reader->bits <<= n;
+	reader->count -= n;
+}
+
+/*
+ * Check that all the data up to a marker has been read, and nothing more;
+ * only the bits padding the last byte can be left.
+ */
+static int reader_at_marker(const struct bit_reader *reader)
+{
+	if (reader->padding * 8 > reader->count ||
+	    reader->count - reader->padding * 8 >= 8)
+		return 0;
+
+	return reader->end - reader->data >= 2 && reader->data[0] == 0xff;
+}
+
+static int reader_restart(struct bit_reader *reader)
+{
+	/* fill bytes can come before the marker */
+	if (reader_at_marker(reader)) {
+		while (reader->end - reader->data >= 2 && reader->data[1] == 0xff)
+			reader->data++;
+	}
+
+	if (!reader_at_marker(reader) ||
+	    reader->data[1] < 0xd0 || reader->data[1] > 0xd7)
+		return -EINVAL;
+
+	reader->data += 2;
+	reader->bits = 0;
+	reader->count = 0;
+	reader->padding = 0;
+	return 0;
+}
+
+static int decode_symbol(struct bit_reader *reader,
+			 const struct huffman_table *table)
+{
+	unsigned int entry;
+	unsigned int code;
+	unsigned int l;
+
+	entry = table->lookup[reader_peek(reader, HUFFMAN_LOOKUP_BITS)];
+	if (entry) {
+		reader_skip(reader, entry >> 8);
+		return entry & 0xff;
+	}
+
+	for (l = HUFFMAN_LOOKUP_BITS + 1; l <= 16; l++) {
+		code = reader_peek(reader, l);
+		if ((int32_t)code <= table->max_code[l]) {
+			reader_skip(reader, l);
+			return table->values[table->value_offset[l] + (int32_t)code];
+		}
+	}
+
+	return -EINVAL;
+}
+
+static inline int receive_extend(struct bit_reader *reader, unsigned int s)
+{
+	int value = reader_peek(reader, s);
+
+	reader_skip(reader, s);
+	if (value < (1 << (s - 1)))
+		value -= (1 << s) - 1;
+
+	return value;
+}
+
+static int decode_block(struct bit_reader *reader,
+			const struct jpeg_component *component,
+			int *dc_pred, int16_t *block)
+{
+	unsigned int k;
+	unsigned int r;
+	unsigned int s;
+	int symbol;
+
+	memset(block, 0, 64 * sizeof(*block));
+
+	if (reader->count < 32)
+		reader_fill(reader);
+	symbol = decode_symbol(reader, component->dc_table);
+	if (symbol < 0 || symbol > 11)
+		return -EINVAL;
+	if (symbol)
+		*dc_pred += receive_extend(reader, symbol);
+	block[0] = *dc_pred;
+
+	for (k = 1; k < 64; k++) {
+		if (reader->count < 32)
+			reader_fill(reader);
+		symbol = decode_symbol(reader, component->ac_table);
+		if (symbol < 0)
+			return -EINVAL;
+
+		r = symbol >> 4;
+		s = symbol & 0x0f;
+		if (s == 0) {
+			/* end of block, or a run of 16 zeros */
+			if (r != 15)
+				break;
+			k += 15;
+			continue;
+		}
+
+		k += r;
+		if (k > 63 || s > 10)
+			return -EINVAL;
+		block[k] = receive_extend(reader, s);
+	}
+
+	return 0;
+}
+
+static int decode_scan(struct jpeg_picture *picture,
+		       const uint8_t *data, const uint8_t *end,
+		       const uint8_t **scan_end)
+{
+	struct bit_reader reader = { data, end, 0, 0, 0 };
+	struct jpeg_component *component;
+	int dc_pred[JPEG_MAX_COMPONENTS];
+	unsigned int mcus = picture->mcus_x * picture->mcus_y;
+	unsigned int mcu;
+	unsigned int mx;
+	unsigned int my;
+	unsigned int bx;
+	unsigned int by;
+	unsigned int i;
+	int ret;
+
+	memset(dc_pred, 0, sizeof(dc_pred));
+
+	for (mcu = 0; mcu < mcus; mcu++) {
+		if (picture->restart_interval && mcu > 0 &&
+		    mcu % picture->restart_interval == 0) {
+			ret = reader_restart(&reader);
+			if (ret < 0)
+				return ret;
+			memset(dc_pred, 0, sizeof(dc_pred));
+		}
+
+		mx = mcu % picture->mcus_x;
+		my = mcu / picture->mcus_x;
+		for (i = 0; i < picture->components_count; i++) {
+			component = picture->scan[i];
+			for (by = 0; by < component->v; by++) {
+				for (bx = 0; bx < component->h; bx++) {
+					ret = decode_block(&reader, component, &dc_pred[i],
+							   component->blocks +
+							   ((my * component->v + by) * component->blocks_w +
+							    mx * component->h + bx) * 64);
+					if (ret < 0)
+						return ret;
+				}
+			}
+		}
+	}
+
+	if (!reader_at_marker(&reader))
+		return -EINVAL;
+
+	*scan_end = reader.data;
+	return 0;
+}
+
+static int writer_reserve(struct bit_writer *writer, size_t len)
+{
+	uint8_t *buffer;
+	size_t capacity;
+
+	if (writer->size + len <= *writer->capacity)
+		return 0;
+
+	capacity = *writer->capacity * 2;
+	if (capacity < writer->size + len)
+		capacity = writer->size + len;
+
+	buffer = realloc(*writer->buffer, capacity);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	*writer->buffer = buffer;
+	*writer->capacity = capacity;
+	return 0;
+}
+
+/* The space has to be reserved beforehand */
+static void writer_write(struct bit_writer *writer, const void *data, size_t len)
+{
+	memcpy(*writer->buffer + writer->size, data, len);
+	writer->size += len;
+}
+
+static inline void writer_put_byte(struct bit_writer *writer, uint8_t byte)
+{
+	(*writer->buffer)[writer->size++] = byte;
+	if (byte == 0xff)
+		(*writer->buffer)[writer->size++] = 0x00;
+}
+
+/* A word with 0xff bytes in it, rare enough to be kept out of line */
+static void writer_put_word_stuffed(struct bit_writer *writer, uint32_t word)
+{
+	writer_put_byte(writer, word >> 24);
+	writer_put_byte(writer, word >> 16);
+	writer_put_byte(writer, word >> 8);
+	writer_put_byte(writer, word);
+}
+
+/* Up to 32 bits at a time, they are written out in words */
+static inline void writer_put_bits(struct bit_writer *writer,
+				   unsigned int bits, unsigned int n)
+{
+	uint8_t *data;
+	uint32_t word;
+
+	writer->bits = (writer->bits << n) | bits;
+	writer->count += n;
+	if (writer->count < 32)
+		return;
+
+	writer->count -= 32;
+	word = writer->bits >> writer->count;
+	if (has_ff_byte(word)) {
+		writer_put_word_stuffed(writer, word);
+		return;
+	}
+
+	data = *writer->buffer + writer->size;
+	data[0] = word >> 24;
+	data[1] = word >> 16;
+	data[2] = word >> 8;
+	data[3] = word;
+	writer->size += 4;
+}
+
+/* Write out the bits left, padding the last byte with 1 bits */
+static void writer_flush_bits(struct bit_writer *writer)
+{
+	unsigned int padding = (8 - writer->count % 8) % 8;
+
+	writer->bits = (writer->bits << padding) | ((1 << padding) - 1);
+	writer->count += padding;
+	while (writer->count > 0) {
+		writer->count -= 8;
+		writer_put_byte(writer, writer->bits >> writer->count);
+	}
+}
+
+static inline unsigned int category(int value)
+{
+	unsigned int magnitude = value < 0 ? -value : value;
+#if defined(__GNUC__)
+	return magnitude ? 32 - __builtin_clz(magnitude) : 0;
+#else
+	unsigned int s = 0;
+
+	while (magnitude) {
+		s++;
+		magnitude >>= 1;
+	}
+
+	return s;
+#endif
+}
+
+static inline void encode_value(struct bit_writer *writer,
+				const struct huffman_table *table,
+				unsigned int symbol, int value, unsigned int s)
+{
+	unsigned int bits = (value < 0 ? value - 1 : value) & ((1 << s) - 1);
+
+	writer_put_bits(writer, (table->codes[symbol] << s) | bits,
+			table->sizes[symbol] + s);
+}
+
+static int encode_block(struct bit_writer *writer,
+			const struct jpeg_component *component,
+			int *dc_pred, const int16_t *block, const int8_t *signs)
+{
+	const struct huffman_table *ac_table = component->ac_table;
+	unsigned int run = 0;
+	unsigned int symbol;
+	unsigned int s;
+	unsigned int k;
+	int value;
+	int ret;
+
+	ret = writer_reserve(writer, BLOCK_MAX_SIZE);
+	if (ret < 0)
+		return ret;
+
+	value = block[0] - *dc_pred;
+	*dc_pred = block[0];
+	s = category(value);
+	if (s > 11)
+		return -EINVAL;
+	encode_value(writer, component->dc_output_table, s, value, s);
+
+	for (k = 1; k < 64; k++) {
+		value = block[k] * signs[k];
+		if (value == 0) {
+			run++;
+			continue;
+		}
+
+		while (run > 15) {
+			encode_value(writer, ac_table, 0xf0, 0, 0);
+			run -= 16;
+		}
+
+		/* the AC values are the same as in the source picture, so
+		 * the table has codes for them */
+		s = category(value);
+		symbol = (run << 4) | s;
+		if (ac_table->sizes[symbol] == 0)
+			return -EINVAL;
+		encode_value(writer, ac_table, symbol, value, s);
+		run = 0;
+	}
+
+	if (run > 0)
+		encode_value(writer, ac_table, 0x00, 0, 0);
+
+	return 0;
+}
+
+static int encode_scan(struct jpeg_picture *picture,
+		       enum orientation orientation,
+		       struct bit_writer *writer)
+{
+	struct jpeg_component *component;
+	int dc_pred[JPEG_MAX_COMPONENTS];
+	int8_t signs[64];
+	unsigned int mcus = picture->mcus_x * picture->mcus_y;
+	int hflip = (orientation == ORIENTATION_HFLIP ||
+		     orientation == ORIENTATION_ROTATE_180);
+	int vflip = (orientation == ORIENTATION_VFLIP ||
+		     orientation == ORIENTATION_ROTATE_180);
+	uint8_t marker[2];
+	unsigned int restarts = 0;
+	unsigned int mcu;
+	unsigned int mx;
+	unsigned int my;
+	unsigned int bx;
+	unsigned int by;
+	unsigned int x;
+	unsigned int y;
+	unsigned int i;
+	unsigned int k;
+	int ret;
+
+	/* Mirroring a block horizontally negates the coefficients of the
+	 * odd horizontal frequencies, and likewise vertically */
+	for (k = 0; k < 64; k++) {
+		signs[k] = 1;
+		if (hflip && (natural_order[k] & 1))
+			signs[k] = -signs[k];
+		if (vflip && ((natural_order[k] >> 3) & 1))
+			signs[k] = -signs[k];
+	}
+
+	memset(dc_pred, 0, sizeof(dc_pred));
+
+	for (mcu = 0; mcu < mcus; mcu++) {
+		if (picture->restart_interval && mcu > 0 &&
+		    mcu % picture->restart_interval == 0) {
+			ret = writer_reserve(writer, 2 * sizeof(uint32_t) + sizeof(marker));
+			if (ret < 0)
+				return ret;
+
+			writer_flush_bits(writer);
+			marker[0] = 0xff;
+			marker[1] = 0xd0 + (restarts++ & 7);
+			writer_write(writer, marker, sizeof(marker));
+			memset(dc_pred, 0, sizeof(dc_pred));
+		}
+
+		mx = mcu % picture->mcus_x;
+		my = mcu / picture->mcus_x;
+		for (i = 0; i < picture->components_count; i++) {
+			component = picture->scan[i];
+			for (by = 0; by < component->v; by++) {
+				for (bx = 0; bx < component->h; bx++) {
+					x = mx * component->h + bx;
+					y = my * component->v + by;
+					if (hflip)
+						x = component->blocks_w - 1 - x;
+					if (vflip)
+						y = component->blocks_h - 1 - y;
+
+					ret = encode_block(writer, component, &dc_pred[i],
+							   component->blocks +
+							   (y * component->blocks_w + x) * 64,
+							   signs);
+					if (ret < 0)
+						return ret;
+				}
+			}
+		}
+	}
+
+	/* the bits left, stuffed, and room for the EOI marker */
+	ret = writer_reserve(writer, 2 * sizeof(uint32_t) + sizeof(marker));
+	if (ret < 0)
+		return ret;
+
+	writer_flush_bits(writer);
+	return 0;
+}
+
+/* SOF0 and SOF1, the Huffman coded sequential DCT frames */
+static int parse_frame(struct jpeg_picture *picture,
+		       const uint8_t *segment, unsigned int length)
+{
+	struct jpeg_component *component;
+	unsigned int h_max = 1;
+	unsigned int v_max = 1;
+	unsigned int i;
+
+	if (picture->components_count > 0 || length < 6)
+		return -EINVAL;
+
+	/* 12 bits samples do not fit the 16 bits coefficients */
+	if (segment[0] != 8)
+		return -ENOTSUP;
+
+	picture->height = (segment[1] << 8) | segment[2];
+	picture->width = (segment[3] << 8) | segment[4];
+	picture->components_count = segment[5];
+
+	/* the height may come later in a DNL segment */
+	if (picture->width == 0 || picture->height == 0)
+		return -ENOTSUP;
+
+	if (picture->components_count == 0 ||
+	    picture->components_count > JPEG_MAX_COMPONENTS ||
+	    length < 6 + 3 * picture->components_count)
+		return -EINVAL;
+
+	for (i = 0; i < picture->components_count; i++) {
+		component = &picture->components[i];
+		component->id = segment[6 + 3 * i];
+		component->h = segment[7 + 3 * i] >> 4;
+		component->v = segment[7 + 3 * i] & 0x0f;
+		if (component->h < 1 || component->h > 4 ||
+		    component->v < 1 || component->v > 4)
+			return -EINVAL;
+
+		/* a single component is never interleaved, the sampling
+		 * factors do not count then */
+		if (picture->components_count == 1) {
+			component->h = 1;
+			component->v = 1;
+		}
+
+		if (component->h > h_max)
+			h_max = component->h;
+		if (component->v > v_max)
+			v_max = component->v;
+	}
+
+	picture->mcu_width = 8 * h_max;
+	picture->mcu_height = 8 * v_max;
+	picture->mcus_x = (picture->width + picture->mcu_width - 1) / picture->mcu_width;
+	picture->mcus_y = (picture->height + picture->mcu_height - 1) / picture->mcu_height;
+
+	for (i = 0; i < picture->components_count; i++) {
+		component = &picture->components[i];
+		component->blocks_w = picture->mcus_x * component->h;
+		component->blocks_h = picture->mcus_y * component->v;
+	}
+
+	return 0;
+}
+
+static int parse_huffman_tables(struct jpeg_picture *picture,
+				const uint8_t *segment, unsigned int length)
+{
+	struct huffman_table *table;
+	unsigned int values_count;
+	unsigned int i;
+	int ret;
+
+	while (length > 0) {
+		if (length < 17)
+			return -EINVAL;
+
+		if ((segment[0] >> 4) > 1 || (segment[0] & 0x0f) >= JPEG_MAX_TABLES)
+			return -EINVAL;
+
+		if (segment[0] >> 4)
+			table = &picture->ac_tables[segment[0] & 0x0f];
+		else
+			table = &picture->dc_tables[segment[0] & 0x0f];
+
+		values_count = 0;
+		for (i = 1; i <= 16; i++)
+			values_count += segment[i];
+		if (values_count > 256 || length < 17 + values_count)
+			return -EINVAL;
+
+		table->counts[0] = 0;
+		huffman_table_set(table, segment, segment + 17, values_count);
+		ret = huffman_table_build(table);
+		if (ret < 0)
+			return ret;
+		table->defined = 1;
+
+		segment += 17 + values_count;
+		length -= 17 + values_count;
+	}
+
+	return 0;
+}
+
+static int parse_scan(struct jpeg_picture *picture,
+		      const uint8_t *segment, unsigned int length)
+{
+	struct jpeg_component *component;
+	unsigned int count;
+	unsigned int i;
+	unsigned int j;
+
+	if (picture->components_count == 0 || length < 1)
+		return -EINVAL;
+
+	/* the components coded in separate scans could be supported too,
+	 * but encoders put them all in one scan anyway */
+	count = segment[0];
+	if (count != picture->components_count)
+		return -ENOTSUP;
+	if (length < 1 + 2 * count + 3)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		component = NULL;
+		for (j = 0; j < picture->components_count; j++)
+			if (picture->components[j].id == segment[1 + 2 * i])
+				component = &picture->components[j];
+		if (component == NULL)
+			return -EINVAL;
+
+		if ((segment[2 + 2 * i] >> 4) >= JPEG_MAX_TABLES ||
+		    (segment[2 + 2 * i] & 0x0f) >= JPEG_MAX_TABLES)
+			return -EINVAL;
+
+		component->dc_table = &picture->dc_tables[segment[2 + 2 * i] >> 4];
+		component->ac_table = &picture->ac_tables[segment[2 + 2 * i] & 0x0f];
+		if (!component->dc_table->defined || !component->ac_table->defined)
+			return -EINVAL;
+		component->dc_table->used = 1;
+		component->ac_table->used = 1;
+
+		picture->scan[i] = component;
+	}
+
+	/* spectral selection and successive approximation are progressive
+	 * only */
+	segment += 1 + 2 * count;
+	if (segment[0] != 0 || segment[1] != 63 || segment[2] != 0)
+		return -ENOTSUP;
+
+	return 0;
+}
+
+/*
+ * All the tables used by the scan go in one DHT segment, the DC tables
+ * missing some codes are replaced by the standard one.
+ */
+static int write_huffman_tables(struct jpeg_picture *picture,
+				struct bit_writer *writer)
+{
+	const struct huffman_table *tables[2 * JPEG_MAX_TABLES];
+	struct jpeg_component *component;
+	unsigned int length = 2;
+	uint8_t header[4];
+	uint8_t table_class;
+	unsigned int i;
+	int ret;
+
+	huffman_table_set(&picture->standard_dc_table, standard_dc_counts,
+			  standard_dc_values, sizeof(standard_dc_values));
+	ret = huffman_table_build(&picture->standard_dc_table);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < picture->components_count; i++) {
+		component = &picture->components[i];
+		component->dc_output_table = component->dc_table;
+		if (!huffman_table_is_complete_dc(component->dc_table))
+			component->dc_output_table = &picture->standard_dc_table;
+	}
+
+	for (i = 0; i < JPEG_MAX_TABLES; i++) {
+		tables[i] = NULL;
+		if (picture->dc_tables[i].used)
+			tables[i] = huffman_table_is_complete_dc(&picture->dc_tables[i]) ?
+				&picture->dc_tables[i] : &picture->standard_dc_table;
+
+		tables[JPEG_MAX_TABLES + i] = NULL;
+		if (picture->ac_tables[i].used)
+			tables[JPEG_MAX_TABLES + i] = &picture->ac_tables[i];
+	}
+
+	for (i = 0; i < 2 * JPEG_MAX_TABLES; i++)
+		if (tables[i])
+			length += 17 + tables[i]->values_count;
+
+	ret = writer_reserve(writer, length + 2);
+	if (ret < 0)
+		return ret;
+
+	header[0] = 0xff;
+	header[1] = 0xc4;
+	header[2] = length >> 8;
+	header[3] = length & 0xff;
+	writer_write(writer, header, sizeof(header));
+
+	for (i = 0; i < 2 * JPEG_MAX_TABLES; i++) {
+		if (tables[i] == NULL)
+			continue;
+
+		table_class = ((i / JPEG_MAX_TABLES) << 4) | (i % JPEG_MAX_TABLES);
+		writer_write(writer, &table_class, 1);
+		writer_write(writer, tables[i]->counts + 1, 16);
+		writer_write(writer, tables[i]->values, tables[i]->values_count);
+	}
+
+	return 0;
+}
+
+static int alloc_blocks(struct jpeg_transform *transform,
+			struct jpeg_picture *picture)
+{
+	struct jpeg_component *component;
+	int16_t *coefficients;
+	size_t blocks_count = 0;
+	unsigned int i;
+
+	for (i = 0; i < picture->components_count; i++) {
+		component = &picture->components[i];
+		blocks_count += (size_t)component->blocks_w * component->blocks_h;
+	}
+
+	if (blocks_count > transform->blocks_count) {
+		coefficients = realloc(transform->coefficients,
+				       blocks_count * 64 * sizeof(*coefficients));
+		if (coefficients == NULL)
+			return -ENOMEM;
+		transform->coefficients = coefficients;
+		transform->blocks_count = blocks_count;
+	}
+
+	coefficients = transform->coefficients;
+	for (i = 0; i < picture->components_count; i++) {
+		component = &picture->components[i];
+		component->blocks = coefficients;
+		coefficients += (size_t)component->blocks_w * component->blocks_h * 64;
+	}
+
+	return 0;
+}
+
+int jpeg_transform_is_lossless(enum orientation orientation,
+			       unsigned int width, unsigned int height)
+{
+	switch (orientation) {
+	case ORIENTATION_HFLIP:
+		return width % 16 == 0;
+	case ORIENTATION_VFLIP:
+		return height % 16 == 0;
+	case ORIENTATION_ROTATE_180:
+		return width % 16 == 0 && height % 16 == 0;
+	case ORIENTATION_NORMAL:
+		break;
+	}
+
+	return 1;
+}
+
+int jpeg_transform_picture(struct jpeg_transform *transform,
+			   enum orientation orientation,
+			   const uint8_t *data, size_t size,
+			   uint8_t **out, size_t *out_capacity,
+			   size_t *out_size)
+{
+	const uint8_t *end = data + size;
+	struct jpeg_picture picture;
+	struct bit_writer writer;
+	const uint8_t *segment;
+	const uint8_t *scan_end;
+	unsigned int length;
+	uint8_t marker;
+	int ret;
+
+	if (size < 4 || data[0] != 0xff || data[1] != 0xd8)
+		return -EINVAL;
+
+	memset(&picture, 0, sizeof(picture));
+
+	writer.buffer = out;
+	writer.capacity = out_capacity;
+	writer.size = 0;
+	writer.bits = 0;
+	writer.count = 0;
+
+	/* the output is about as big as the input */
+	ret = writer_reserve(&writer, size);
+	if (ret < 0)
+		return ret;
+	writer_write(&writer, data, 2);
+
+	/* Copy the segments up to the scan, only the Huffman tables are
+	 * written again as they may need to be changed */
+	data += 2;
+	marker = 0;
+	do {
+		if (end - data < 4 || data[0] != 0xff)
+			return -EINVAL;
+
+		/* fill bytes */
+		if (data[1] == 0xff) {
+			data++;
+			continue;
+		}
+
+		marker = data[1];
+		length = (data[2] << 8) | data[3];
+		if (length < 2 || (size_t)(end - data) < length + 2)
+			return -EINVAL;
+		segment = data + 4;
+
+		switch (marker) {
+		case 0xc0: /* SOF0, baseline DCT */
+		case 0xc1: /* SOF1, extended sequential DCT */
+			ret = parse_frame(&picture, segment, length - 2);
+			break;
+		case 0xc4: /* DHT */
+			ret = parse_huffman_tables(&picture, segment, length - 2);
+			break;
+		case 0xda: /* SOS */
+			ret = parse_scan(&picture, segment, length - 2);
+			if (ret == 0)
+				ret = write_huffman_tables(&picture, &writer);
+			break;
+		case 0xdd: /* DRI */
+			if (length < 4)
+				return -EINVAL;
+			picture.restart_interval = (segment[0] << 8) | segment[1];
+			break;
+		default:
+			/* progressive, lossless or arithmetic coding */
+			if (marker >= 0xc2 && marker <= 0xcf && marker != 0xc8)
+				return -ENOTSUP;
+			if (marker < 0xc0 || (marker >= 0xd0 && marker <= 0xd9))
+				return -EINVAL;
+			break;
+		}
+		if (ret < 0)
+			return ret;
+
+		if (marker != 0xc4) {
+			ret = writer_reserve(&writer, length + 2);
+			if (ret < 0)
+				return ret;
+			writer_write(&writer, data, length + 2);
+		}
+
+		data += length + 2;
+	} while (marker != 0xda);
+
+	if ((orientation == ORIENTATION_HFLIP || orientation == ORIENTATION_ROTATE_180) &&
+	    picture.width % picture.mcu_width != 0)
+		return -ENOTSUP;
+	if ((orientation == ORIENTATION_VFLIP || orientation == ORIENTATION_ROTATE_180) &&
+	    picture.height % picture.mcu_height != 0)
+		return -ENOTSUP;
+
+	ret = alloc_blocks(transform, &picture);
+	if (ret < 0)
+		return ret;
+
+	ret = decode_scan(&picture, data, end, &scan_end);
+	if (ret < 0)
+		return ret;
+
+	/* only one scan is supported */
+	while (end - scan_end >= 2 && scan_end[1] == 0xff)
+		scan_end++;
+	if (end - scan_end < 2 || scan_end[1] != 0xd9)
+		return -ENOTSUP;
+
+	ret = encode_scan(&picture, orientation, &writer);
+	if (ret < 0)
+		return ret;
+
+	writer_write(&writer, scan_end, 2);
+	*out_size = writer.size;
+
+	return 0;
+}
+
+void jpeg_transform_cleanup(struct jpeg_transform *transform)
+{
+	free(transform->coefficients);
+	transform->coefficients = NULL;
+	transform->blocks_count = 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * jpeg_transform - mirror and rotate JPEG pictures without decoding them
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __JPEG_TRANSFORM_H
+#define __JPEG_TRANSFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "orientation.h"
+
+/*
+ * The DCT coefficients of a picture being transformed, kept between calls
+ * so that they are allocated just once; a zeroed struct is ready to use.
+ */
+struct jpeg_transform {
+	int16_t *coefficients;
+	size_t blocks_count;
+};
+
+/*
+ * Check whether 4:2:0 pictures of the given size can be transformed
+ * without loss: mirroring needs whole 16x16 MCUs along the mirrored
+ * direction, the partial MCUs at the right and bottom edges cannot be
+ * moved.
+ */
+int jpeg_transform_is_lossless(enum orientation orientation,
+			       unsigned int width, unsigned int height);
+
+/*
+ * Turn a baseline Huffman coded JPEG picture, the way jpegtran does: the
+ * entropy coded data is decoded down to the DCT coefficients, which are
+ * moved and negated as needed and then coded again with the same
+ * quantization and Huffman tables, so no quality is lost.
+ *
+ * The result is written to *out, a buffer of *out_capacity bytes which is
+ * grown with realloc() when needed; its size is stored in *out_size.
+ *
+ * Returns 0 on success, -ENOTSUP for pictures which cannot be transformed,
+ * -EINVAL for broken ones or -ENOMEM.
+ */
+int jpeg_transform_picture(struct jpeg_transform *transform,
+			   enum orientation orientation,
+			   const uint8_t *data, size_t size,
+			   uint8_t **out, size_t *out_capacity,
+			   size_t *out_size);
+
+void jpeg_transform_cleanup(struct jpeg_transform *transform);
+
+#endif /* __JPEG_TRANSFORM_H */
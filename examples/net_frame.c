@@ -0,0 +1,265 @@
+/*
+ * net_frame - send frames for am7xxx devices over the network
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "net_frame.h"
+
+/* where there is no MSG_NOSIGNAL the socket gets SO_NOSIGPIPE instead */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void put_be32(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = (value >> 24) & 0xff;
+	buffer[1] = (value >> 16) & 0xff;
+	buffer[2] = (value >> 8) & 0xff;
+	buffer[3] = value & 0xff;
+}
+
+static void put_be16(uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = (value >> 8) & 0xff;
+	buffer[1] = value & 0xff;
+}
+
+static uint32_t get_be32(const uint8_t *buffer)
+{
+	return ((uint32_t)buffer[0] << 24) | (buffer[1] << 16) |
+		(buffer[2] << 8) | buffer[3];
+}
+
+static uint16_t get_be16(const uint8_t *buffer)
+{
+	return (buffer[0] << 8) | buffer[1];
+}
+
+void net_frame_pack_header(const struct net_frame_header *header, uint8_t *buffer)
+{
+	put_be32(buffer, NET_FRAME_MAGIC);
+	put_be32(buffer + 4, header->sequence);
+	put_be32(buffer + 8, header->size);
+	put_be32(buffer + 12, header->offset);
+	put_be16(buffer + 16, header->format);
+	put_be16(buffer + 18, header->width);
+	put_be16(buffer + 20, header->height);
+	put_be16(buffer + 22, 0);
+}
+
+int net_frame_unpack_header(const uint8_t *buffer, struct net_frame_header *header)
+{
+	if (get_be32(buffer) != NET_FRAME_MAGIC)
+		return -EPROTO;
+
+	header->sequence = get_be32(buffer + 4);
+	header->size = get_be32(buffer + 8);
+	header->offset = get_be32(buffer + 12);
+	header->format = get_be16(buffer + 16);
+	header->width = get_be16(buffer + 18);
+	header->height = get_be16(buffer + 20);
+
+	return 0;
+}
+
+int net_frame_sender_open(struct net_frame_sender *sender, const char *url)
+{
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct addrinfo *rp;
+	char *host = NULL;
+	const char *port;
+	char *separator;
+	int flag = 1;
+	int ret;
+
+	memset(sender, 0, sizeof(*sender));
+	sender->fd = -1;
+
+	if (strncmp(url, "tcp://", 6) == 0) {
+		sender->socktype = SOCK_STREAM;
+	} else if (strncmp(url, "udp://", 6) == 0) {
+		sender->socktype = SOCK_DGRAM;
+	} else {
+		fprintf(stderr, "invalid URL, use tcp://<host>:<port> or udp://<host>:<port>\n");
+		return -EINVAL;
+	}
+
+	host = strdup(url + 6);
+	if (host == NULL) {
+		perror("strdup");
+		return -ENOMEM;
+	}
+
+	port = NET_FRAME_DEFAULT_PORT;
+	separator = strrchr(host, ':');
+	if (separator && strchr(separator, ']') == NULL) {
+		*separator = '\0';
+		port = separator + 1;
+	}
+
+	/* IPv6 addresses come between square brackets */
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = sender->socktype;
+
+	ret = getaddrinfo(host, port, &hints, &result);
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", url, gai_strerror(ret));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* UDP sockets get connected too, so that send() can be used */
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sender->fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sender->fd < 0)
+			continue;
+
+		if (connect(sender->fd, rp->ai_addr, rp->ai_addrlen) == 0)
+			break;
+
+		close(sender->fd);
+		sender->fd = -1;
+	}
+	freeaddrinfo(result);
+
+	if (sender->fd < 0) {
+		fprintf(stderr, "cannot connect to %s\n", url);
+		ret = -ECONNREFUSED;
+		goto out;
+	}
+
+	/* a frame is sent with a single call, do not wait for more data */
+	if (sender->socktype == SOCK_STREAM)
+		setsockopt(sender->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+#ifdef SO_NOSIGPIPE
+	setsockopt(sender->fd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif
+
+	ret = 0;
+out:
+	free(host);
+	return ret;
+}
+
+static int send_iov(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen > 0) {
+		/* a receiver going away is reported as -EPIPE, without
+		 * SIGPIPE killing the sender */
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* skip what has been sent already */
+		while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+int net_frame_send(struct net_frame_sender *sender,
+		   am7xxx_image_format format,
+		   unsigned int width,
+		   unsigned int height,
+		   const uint8_t *data,
+		   unsigned int size)
+{
+	struct net_frame_header header;
+	uint8_t buffer[NET_FRAME_HEADER_SIZE];
+	struct iovec iov[2];
+	unsigned int len;
+	int ret;
+
+	header.sequence = sender->sequence++;
+	header.size = size;
+	header.offset = 0;
+	header.format = format;
+	header.width = width;
+	header.height = height;
+
+	do {
+		len = size - header.offset;
+		if (sender->socktype == SOCK_DGRAM && len > NET_FRAME_UDP_PAYLOAD)
+			len = NET_FRAME_UDP_PAYLOAD;
+
+		net_frame_pack_header(&header, buffer);
+		iov[0].iov_base = buffer;
+		iov[0].iov_len = sizeof(buffer);
+		iov[1].iov_base = (uint8_t *)data + header.offset;
+		iov[1].iov_len = len;
+
+		ret = send_iov(sender->fd, iov, 2);
+		if (ret < 0) {
+			/* nobody listening yet, the frame is lost like any
+			 * other datagram */
+			if (ret == -ECONNREFUSED && sender->socktype == SOCK_DGRAM)
+				return 0;
+			fprintf(stderr, "sendmsg: %s\n", strerror(-ret));
+			return ret;
+		}
+
+		header.offset += len;
+	} while (header.offset < size);
+
+	return 0;
+}
+
+void net_frame_sender_close(struct net_frame_sender *sender)
+{
+	if (sender->fd >= 0)
+		close(sender->fd);
+	sender->fd = -1;
+}
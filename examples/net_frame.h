@@ -0,0 +1,84 @@
+/*
+ * net_frame - send frames for am7xxx devices over the network
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NET_FRAME_H
+#define __NET_FRAME_H
+
+#include <stdint.h>
+
+#include <am7xxx.h>
+
+/*
+ * Each frame is preceded by a header, all the fields are in network byte
+ * order:
+ *
+ *   magic     "AM7F"
+ *   sequence  incremented by one for each frame
+ *   size      the size of the whole frame
+ *   offset    where the data following the header goes in the frame
+ *   format    JPEG or NV12, as in am7xxx_image_format
+ *   width
+ *   height
+ *   reserved  0
+ *
+ * Over TCP the header is followed by the whole frame; over UDP a frame is
+ * split in datagrams carrying NET_FRAME_UDP_PAYLOAD bytes each (the last
+ * one can be shorter), every datagram with its own header, so that no IP
+ * fragmentation happens on usual networks.
+ */
+
+#define NET_FRAME_MAGIC 0x414d3746
+#define NET_FRAME_HEADER_SIZE 24
+#define NET_FRAME_UDP_PAYLOAD 1400
+
+#define NET_FRAME_DEFAULT_PORT "7070"
+
+struct net_frame_header {
+	uint32_t sequence;
+	uint32_t size;
+	uint32_t offset;
+	am7xxx_image_format format;
+	unsigned int width;
+	unsigned int height;
+};
+
+void net_frame_pack_header(const struct net_frame_header *header, uint8_t *buffer);
+
+/* Return 0 on success, -EPROTO if the buffer does not hold a header */
+int net_frame_unpack_header(const uint8_t *buffer, struct net_frame_header *header);
+
+struct net_frame_sender {
+	int fd;
+	int socktype;
+	uint32_t sequence;
+};
+
+/* 'url' is tcp://<host>:<port> or udp://<host>:<port> */
+int net_frame_sender_open(struct net_frame_sender *sender, const char *url);
+
+int net_frame_send(struct net_frame_sender *sender,
+		   am7xxx_image_format format,
+		   unsigned int width,
+		   unsigned int height,
+		   const uint8_t *data,
+		   unsigned int size);
+
+void net_frame_sender_close(struct net_frame_sender *sender);
+
+#endif /* __NET_FRAME_H */
@@ -0,0 +1,278 @@
+/*
+ * orientation - mirror and rotate YUV 4:2:0 frames for the projector mount
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SSSE3_KERNEL
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "orientation.h"
+
+/*
+ * Mirror two rows into each other: 'a' gets the units of 'b' in reverse
+ * order and 'b' the ones of 'a'; when 'a' and 'b' are the same row it is
+ * just mirrored in place. A unit is one byte for luma and for planar
+ * chroma, and two bytes for the interleaved U and V of NV12.
+ *
+ * Both rows are walked at once from opposite ends, so flipping a frame
+ * upside down as well touches each cache line only once and there is
+ * nothing to gain from working in tiles.
+ */
+typedef void (*mirror_rows_func)(uint8_t *a, uint8_t *b,
+				 unsigned int len, unsigned int unit);
+
+/* Where to stop when mirroring a row in place, in bytes */
+static inline unsigned int mirror_end(const uint8_t *a, const uint8_t *b,
+				      unsigned int len, unsigned int unit)
+{
+	return a == b ? len / unit / 2 * unit : len;
+}
+
+static void mirror_rows_tail(uint8_t *a, uint8_t *b, unsigned int start,
+			     unsigned int len, unsigned int unit)
+{
+	unsigned int end = mirror_end(a, b, len, unit);
+	uint8_t *right;
+	uint8_t tmp;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = start; i < end; i += unit) {
+		right = b + len - unit - i;
+		for (j = 0; j < unit; j++) {
+			tmp = a[i + j];
+			a[i + j] = right[j];
+			right[j] = tmp;
+		}
+	}
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+static void mirror_rows_c(uint8_t *a, uint8_t *b,
+			  unsigned int len, unsigned int unit)
+{
+	mirror_rows_tail(a, b, 0, len, unit);
+}
+#endif
+
+#if defined(__SSE2__)
+static inline __m128i reverse_sse2(__m128i x, unsigned int unit)
+{
+	x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+	x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+	if (unit == 1)
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+	return x;
+}
+
+static void mirror_rows_sse2(uint8_t *a, uint8_t *b,
+			     unsigned int len, unsigned int unit)
+{
+	unsigned int end = mirror_end(a, b, len, unit);
+	__m128i left;
+	__m128i right;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= end; i += 16) {
+		left = _mm_loadu_si128((const __m128i *)(a + i));
+		right = _mm_loadu_si128((const __m128i *)(b + len - 16 - i));
+		_mm_storeu_si128((__m128i *)(a + i), reverse_sse2(right, unit));
+		_mm_storeu_si128((__m128i *)(b + len - 16 - i), reverse_sse2(left, unit));
+	}
+	mirror_rows_tail(a, b, i, len, unit);
+}
+#endif
+
+#ifdef HAVE_SSSE3_KERNEL
+__attribute__((target("ssse3")))
+static void mirror_rows_ssse3(uint8_t *a, uint8_t *b,
+			      unsigned int len, unsigned int unit)
+{
+	unsigned int end = mirror_end(a, b, len, unit);
+	__m128i shuffle;
+	__m128i left;
+	__m128i right;
+	unsigned int i;
+
+	if (unit == 1)
+		shuffle = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					7, 6, 5, 4, 3, 2, 1, 0);
+	else
+		shuffle = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+					6, 7, 4, 5, 2, 3, 0, 1);
+
+	for (i = 0; i + 16 <= end; i += 16) {
+		left = _mm_loadu_si128((const __m128i *)(a + i));
+		right = _mm_loadu_si128((const __m128i *)(b + len - 16 - i));
+		_mm_storeu_si128((__m128i *)(a + i), _mm_shuffle_epi8(right, shuffle));
+		_mm_storeu_si128((__m128i *)(b + len - 16 - i), _mm_shuffle_epi8(left, shuffle));
+	}
+	mirror_rows_tail(a, b, i, len, unit);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline uint8x16_t reverse_neon(uint8x16_t x, unsigned int unit)
+{
+	if (unit == 1)
+		x = vrev64q_u8(x);
+	else
+		x = vreinterpretq_u8_u16(vrev64q_u16(vreinterpretq_u16_u8(x)));
+	return vcombine_u8(vget_high_u8(x), vget_low_u8(x));
+}
+
+static void mirror_rows_neon(uint8_t *a, uint8_t *b,
+			     unsigned int len, unsigned int unit)
+{
+	unsigned int end = mirror_end(a, b, len, unit);
+	uint8x16_t left;
+	uint8x16_t right;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= end; i += 16) {
+		left = vld1q_u8(a + i);
+		right = vld1q_u8(b + len - 16 - i);
+		vst1q_u8(a + i, reverse_neon(right, unit));
+		vst1q_u8(b + len - 16 - i, reverse_neon(left, unit));
+	}
+	mirror_rows_tail(a, b, i, len, unit);
+}
+#endif
+
+static mirror_rows_func select_mirror_rows(void)
+{
+#ifdef HAVE_SSSE3_KERNEL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		return mirror_rows_ssse3;
+#endif
+#if defined(__SSE2__)
+	return mirror_rows_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return mirror_rows_neon;
+#else
+	return mirror_rows_c;
+#endif
+}
+
+static void swap_rows(uint8_t *a, uint8_t *b, unsigned int len)
+{
+	uint8_t tmp[256];
+	unsigned int count;
+
+	while (len > 0) {
+		count = len < sizeof(tmp) ? len : sizeof(tmp);
+		memcpy(tmp, a, count);
+		memcpy(a, b, count);
+		memcpy(b, tmp, count);
+		a += count;
+		b += count;
+		len -= count;
+	}
+}
+
+static void orient_plane(mirror_rows_func mirror_rows,
+			 enum orientation orientation,
+			 uint8_t *data, int stride,
+			 unsigned int len, unsigned int rows, unsigned int unit)
+{
+	uint8_t *top = data;
+	uint8_t *bottom = data + (rows - 1) * stride;
+	unsigned int i;
+
+	switch (orientation) {
+	case ORIENTATION_HFLIP:
+		for (i = 0; i < rows; i++)
+			mirror_rows(data + i * stride, data + i * stride, len, unit);
+		break;
+	case ORIENTATION_VFLIP:
+		for (i = 0; i < rows / 2; i++)
+			swap_rows(top + i * stride, bottom - i * stride, len);
+		break;
+	case ORIENTATION_ROTATE_180:
+		/* the middle row of an odd number of rows is just mirrored */
+		for (i = 0; i < (rows + 1) / 2; i++)
+			mirror_rows(top + i * stride, bottom - i * stride, len, unit);
+		break;
+	case ORIENTATION_NORMAL:
+		break;
+	}
+}
+
+int orientation_parse(const char *name, enum orientation *orientation)
+{
+	static const struct {
+		const char *name;
+		enum orientation orientation;
+	} names[] = {
+		{ "normal", ORIENTATION_NORMAL },
+		{ "hflip", ORIENTATION_HFLIP },
+		{ "vflip", ORIENTATION_VFLIP },
+		{ "rotate180", ORIENTATION_ROTATE_180 },
+		{ "rear", ORIENTATION_HFLIP },
+		{ "ceiling-rear", ORIENTATION_VFLIP },
+		{ "ceiling", ORIENTATION_ROTATE_180 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i].name) == 0) {
+			*orientation = names[i].orientation;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+void orientation_apply(enum orientation orientation, int nv12,
+		       uint8_t *y, int y_stride,
+		       uint8_t *u, uint8_t *v, int uv_stride,
+		       unsigned int width, unsigned int height)
+{
+	mirror_rows_func mirror_rows;
+	unsigned int chroma_width = (width + 1) / 2;
+	unsigned int chroma_height = (height + 1) / 2;
+
+	if (orientation == ORIENTATION_NORMAL || width == 0 || height == 0)
+		return;
+
+	mirror_rows = select_mirror_rows();
+
+	orient_plane(mirror_rows, orientation, y, y_stride, width, height, 1);
+	if (nv12) {
+		orient_plane(mirror_rows, orientation, u, uv_stride,
+			     chroma_width * 2, chroma_height, 2);
+	} else {
+		orient_plane(mirror_rows, orientation, u, uv_stride,
+			     chroma_width, chroma_height, 1);
+		orient_plane(mirror_rows, orientation, v, uv_stride,
+			     chroma_width, chroma_height, 1);
+	}
+}
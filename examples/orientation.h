@@ -0,0 +1,48 @@
+/*
+ * orientation - mirror and rotate YUV 4:2:0 frames for the projector mount
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ORIENTATION_H
+#define __ORIENTATION_H
+
+#include <stdint.h>
+
+/* How the pictures have to be turned so that they look right */
+enum orientation {
+	ORIENTATION_NORMAL,
+	ORIENTATION_HFLIP,      /* rear projection */
+	ORIENTATION_VFLIP,      /* rear projection from the ceiling */
+	ORIENTATION_ROTATE_180, /* ceiling mount */
+};
+
+/*
+ * Parse an orientation name: "normal", "hflip", "vflip" or "rotate180",
+ * or the mount names "ceiling", "rear" and "ceiling-rear".
+ */
+int orientation_parse(const char *name, enum orientation *orientation);
+
+/*
+ * Turn a frame in place, 'v' is ignored when 'nv12' is set and 'u' points
+ * to the interleaved chroma plane.
+ */
+void orientation_apply(enum orientation orientation, int nv12,
+		       uint8_t *y, int y_stride,
+		       uint8_t *u, uint8_t *v, int uv_stride,
+		       unsigned int width, unsigned int height);
+
+#endif /* __ORIENTATION_H */
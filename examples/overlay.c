@@ -0,0 +1,592 @@
+/*
+ * overlay - blend RGBA pictures over YUV 4:2:0 frames
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "overlay.h"
+
+/* The overlay rows are checked for transparency in bands this tall */
+#define OVERLAY_BAND_HEIGHT 16
+
+typedef void (*blend_row_func)(uint8_t *dst, const uint8_t *src,
+			       const uint8_t *alpha, unsigned int len);
+
+/* x / 255, rounded, exact for all the products of two bytes */
+static inline unsigned int div255(unsigned int x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static void blend_row_c(uint8_t *dst, const uint8_t *src,
+			const uint8_t *alpha, unsigned int len)
+{
+	unsigned int value;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		value = src[i] + div255(dst[i] * (255 - alpha[i]));
+		dst[i] = value > 255 ? 255 : value;
+	}
+}
+
+#if defined(__SSE2__)
+static inline __m128i div255_epu16(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static void blend_row_sse2(uint8_t *dst, const uint8_t *src,
+			   const uint8_t *alpha, unsigned int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(-1);
+	__m128i d, s, a, lo, hi;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(alpha + i)), ones);
+
+		lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero));
+		hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero));
+		d = _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(d, s));
+	}
+
+	blend_row_c(dst + i, src + i, alpha + i, len - i);
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2")))
+static inline __m256i div255_epu16_avx2(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+/* unpack and pack work within each 128 bits lane, so the order is kept */
+__attribute__((target("avx2")))
+static void blend_row_avx2(uint8_t *dst, const uint8_t *src,
+			   const uint8_t *alpha, unsigned int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi8(-1);
+	__m256i d, s, a, lo, hi;
+	unsigned int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(alpha + i)), ones);
+
+		lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(a, zero));
+		hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(a, zero));
+		d = _mm256_packus_epi16(div255_epu16_avx2(lo), div255_epu16_avx2(hi));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(d, s));
+	}
+
+	blend_row_c(dst + i, src + i, alpha + i, len - i);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void blend_row_neon(uint8_t *dst, const uint8_t *src,
+			   const uint8_t *alpha, unsigned int len)
+{
+	uint8x16_t d, s, a;
+	uint16x8_t lo, hi;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		d = vld1q_u8(dst + i);
+		s = vld1q_u8(src + i);
+		a = vmvnq_u8(vld1q_u8(alpha + i));
+
+		lo = vmull_u8(vget_low_u8(d), vget_low_u8(a));
+		hi = vmull_u8(vget_high_u8(d), vget_high_u8(a));
+
+		/* (x + ((x + 128) >> 8) + 128) >> 8, like div255() */
+		d = vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)),
+				vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+
+		vst1q_u8(dst + i, vqaddq_u8(d, s));
+	}
+
+	blend_row_c(dst + i, src + i, alpha + i, len - i);
+}
+#endif
+
+static blend_row_func select_blend_row(void)
+{
+#ifdef HAVE_AVX2_KERNEL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return blend_row_avx2;
+#endif
+#if defined(__SSE2__)
+	return blend_row_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return blend_row_neon;
+#else
+	return blend_row_c;
+#endif
+}
+
+/* BT.601 coefficients, the offsets get scaled by alpha */
+struct yuv_coefficients {
+	float y_offset, yr, yg, yb;
+	float ur, ug, ub;
+	float vr, vg, vb;
+};
+
+static const struct yuv_coefficients limited_range = {
+	16.0f, 0.256788f, 0.504129f, 0.097906f,
+	-0.148223f, -0.290993f, 0.439216f,
+	0.439216f, -0.367788f, -0.071427f,
+};
+
+static const struct yuv_coefficients full_range = {
+	0.0f, 0.299f, 0.587f, 0.114f,
+	-0.168736f, -0.331264f, 0.5f,
+	0.5f, -0.418688f, -0.081312f,
+};
+
+static inline uint8_t clamp_byte(float value)
+{
+	if (value <= 0.0f)
+		return 0;
+	if (value >= 255.0f)
+		return 255;
+	return (uint8_t)(value + 0.5f);
+}
+
+/* Each 2x2 block of pixels shares the same chroma and chroma alpha */
+static void convert_rgba(struct overlay *overlay, const uint8_t *rgba,
+			 unsigned int stride)
+{
+	const struct yuv_coefficients *k;
+	unsigned int i, j, dx, dy;
+	unsigned int alpha_sum;
+	float u_sum, v_sum;
+	float scale;
+	const uint8_t *p;
+	unsigned int offset;
+	uint8_t u, v, ca;
+
+	k = overlay->format == OVERLAY_FORMAT_NV12 ? &limited_range : &full_range;
+
+	for (j = 0; j < overlay->height; j += 2) {
+		for (i = 0; i < overlay->width; i += 2) {
+			alpha_sum = 0;
+			u_sum = 0.0f;
+			v_sum = 0.0f;
+
+			for (dy = 0; dy < 2; dy++) {
+				for (dx = 0; dx < 2; dx++) {
+					p = rgba + (j + dy) * stride + (i + dx) * 4;
+					offset = (j + dy) * overlay->width + i + dx;
+					scale = p[3] / 255.0f;
+
+					overlay->luma[offset] = clamp_byte(k->y_offset * scale +
+									   k->yr * p[0] + k->yg * p[1] + k->yb * p[2]);
+					overlay->luma_alpha[offset] = p[3];
+
+					alpha_sum += p[3];
+					u_sum += 128.0f * scale + k->ur * p[0] + k->ug * p[1] + k->ub * p[2];
+					v_sum += 128.0f * scale + k->vr * p[0] + k->vg * p[1] + k->vb * p[2];
+				}
+			}
+
+			u = clamp_byte(u_sum / 4);
+			v = clamp_byte(v_sum / 4);
+			ca = (alpha_sum + 2) / 4;
+
+			offset = (j / 2) * overlay->chroma_stride;
+			if (overlay->format == OVERLAY_FORMAT_NV12) {
+				offset += i;
+				overlay->chroma[offset] = u;
+				overlay->chroma[offset + 1] = v;
+				overlay->chroma_alpha[offset] = ca;
+				overlay->chroma_alpha[offset + 1] = ca;
+			} else {
+				offset += i / 2;
+				overlay->chroma[offset] = u;
+				overlay->chroma_v[offset] = v;
+				overlay->chroma_alpha[offset] = ca;
+			}
+		}
+	}
+}
+
+/* Find the parts of each band of rows which are not fully transparent */
+static int find_rects(struct overlay *overlay)
+{
+	struct overlay_rect *rect;
+	unsigned int min_x;
+	unsigned int max_x;
+	unsigned int band;
+	unsigned int i, j;
+	const uint8_t *alpha;
+
+	overlay->rects = calloc((overlay->height + OVERLAY_BAND_HEIGHT - 1) / OVERLAY_BAND_HEIGHT,
+				sizeof(*overlay->rects));
+	if (overlay->rects == NULL)
+		return -ENOMEM;
+
+	for (band = 0; band < overlay->height; band += OVERLAY_BAND_HEIGHT) {
+		min_x = overlay->width;
+		max_x = 0;
+
+		for (j = band; j < band + OVERLAY_BAND_HEIGHT && j < overlay->height; j++) {
+			alpha = overlay->luma_alpha + j * overlay->width;
+			for (i = 0; i < overlay->width; i++) {
+				if (alpha[i] == 0)
+					continue;
+				if (i < min_x)
+					min_x = i;
+				if (i > max_x)
+					max_x = i;
+			}
+		}
+
+		if (min_x > max_x)
+			continue;
+
+		/* whole 2x2 blocks, for the chroma */
+		rect = &overlay->rects[overlay->rects_count++];
+		rect->x = min_x & ~1U;
+		rect->y = band;
+		rect->width = ((max_x + 2) & ~1U) - rect->x;
+		rect->height = j - band;
+	}
+
+	return 0;
+}
+
+int overlay_init(struct overlay *overlay, enum overlay_format format,
+		 const uint8_t *rgba, unsigned int stride,
+		 unsigned int width, unsigned int height,
+		 int x, int y,
+		 unsigned int frame_width, unsigned int frame_height)
+{
+	unsigned int src_x = 0;
+	unsigned int src_y = 0;
+	unsigned int luma_size;
+	unsigned int chroma_size;
+	uint8_t *buffer;
+	int ret;
+
+	memset(overlay, 0, sizeof(*overlay));
+	overlay->format = format;
+
+	/* keep the overlay aligned to the chroma samples */
+	x &= ~1;
+	y &= ~1;
+
+	if (x < 0) {
+		src_x = -x;
+		x = 0;
+	}
+	if (y < 0) {
+		src_y = -y;
+		y = 0;
+	}
+	if (src_x >= width || src_y >= height ||
+	    (unsigned int)x >= frame_width || (unsigned int)y >= frame_height) {
+		fprintf(stderr, "the overlay is out of the frame\n");
+		return -EINVAL;
+	}
+
+	overlay->x = x;
+	overlay->y = y;
+	overlay->width = width - src_x;
+	if (overlay->width > frame_width - x)
+		overlay->width = frame_width - x;
+	overlay->width &= ~1U;
+	overlay->height = height - src_y;
+	if (overlay->height > frame_height - y)
+		overlay->height = frame_height - y;
+	overlay->height &= ~1U;
+
+	if (overlay->width == 0 || overlay->height == 0) {
+		fprintf(stderr, "the overlay is too small\n");
+		return -EINVAL;
+	}
+
+	luma_size = overlay->width * overlay->height;
+	chroma_size = overlay->width / 2 * overlay->height / 2;
+
+	/* luma and its alpha, then U and V and their alpha, which takes
+	 * twice the space with NV12 as it is repeated for U and V */
+	buffer = malloc(2 * luma_size + 4 * chroma_size);
+	if (buffer == NULL) {
+		perror("malloc");
+		return -ENOMEM;
+	}
+
+	overlay->luma = buffer;
+	overlay->luma_alpha = buffer + luma_size;
+	overlay->chroma = buffer + 2 * luma_size;
+	if (format == OVERLAY_FORMAT_NV12) {
+		overlay->chroma_alpha = overlay->chroma + 2 * chroma_size;
+		overlay->chroma_stride = overlay->width;
+	} else {
+		overlay->chroma_v = overlay->chroma + chroma_size;
+		overlay->chroma_alpha = overlay->chroma_v + chroma_size;
+		overlay->chroma_stride = overlay->width / 2;
+	}
+
+	convert_rgba(overlay, rgba + src_y * stride + src_x * 4, stride);
+
+	ret = find_rects(overlay);
+	if (ret < 0) {
+		overlay_cleanup(overlay);
+		return ret;
+	}
+
+	overlay->blend_row = select_blend_row();
+
+	return 0;
+}
+
+static int skip_pam_comment(FILE *file)
+{
+	int c;
+
+	do {
+		c = fgetc(file);
+	} while (c != '\n' && c != EOF);
+
+	return c == EOF ? -EINVAL : 0;
+}
+
+/* Read a PAM picture and premultiply its colors by alpha */
+static int load_pam(const char *path, uint8_t **rgba,
+		    unsigned int *width, unsigned int *height)
+{
+	FILE *file;
+	char token[32];
+	unsigned int depth = 0;
+	unsigned int maxval = 0;
+	int has_alpha = 0;
+	size_t size;
+	size_t i;
+	uint8_t *p;
+	int ret;
+
+	*width = 0;
+	*height = 0;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		ret = -errno;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	if (fscanf(file, "%31s", token) != 1 || strcmp(token, "P7") != 0)
+		goto err_format;
+
+	for (;;) {
+		if (fscanf(file, "%31s", token) != 1)
+			goto err_format;
+
+		if (token[0] == '#') {
+			if (skip_pam_comment(file) < 0)
+				goto err_format;
+		} else if (strcmp(token, "WIDTH") == 0) {
+			if (fscanf(file, "%u", width) != 1)
+				goto err_format;
+		} else if (strcmp(token, "HEIGHT") == 0) {
+			if (fscanf(file, "%u", height) != 1)
+				goto err_format;
+		} else if (strcmp(token, "DEPTH") == 0) {
+			if (fscanf(file, "%u", &depth) != 1)
+				goto err_format;
+		} else if (strcmp(token, "MAXVAL") == 0) {
+			if (fscanf(file, "%u", &maxval) != 1)
+				goto err_format;
+		} else if (strcmp(token, "TUPLTYPE") == 0) {
+			if (fscanf(file, "%31s", token) != 1)
+				goto err_format;
+			has_alpha = strcmp(token, "RGB_ALPHA") == 0;
+		} else if (strcmp(token, "ENDHDR") == 0) {
+			break;
+		}
+	}
+
+	/* the single newline after ENDHDR */
+	fgetc(file);
+
+	if (*width == 0 || *height == 0 || depth != 4 || maxval != 255 || !has_alpha) {
+		fprintf(stderr, "%s: only 8 bits RGB_ALPHA PAM pictures are supported\n",
+			path);
+		ret = -ENOTSUP;
+		goto out;
+	}
+
+	size = (size_t)*width * *height * 4;
+	*rgba = malloc(size);
+	if (*rgba == NULL) {
+		perror("malloc");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (fread(*rgba, 1, size, file) != size) {
+		fprintf(stderr, "%s: the picture is truncated\n", path);
+		free(*rgba);
+		*rgba = NULL;
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0, p = *rgba; i < size; i += 4, p += 4) {
+		p[0] = div255(p[0] * p[3]);
+		p[1] = div255(p[1] * p[3]);
+		p[2] = div255(p[2] * p[3]);
+	}
+
+	ret = 0;
+	goto out;
+
+err_format:
+	fprintf(stderr, "%s: not a PAM picture\n", path);
+	ret = -EINVAL;
+out:
+	fclose(file);
+	return ret;
+}
+
+int overlay_load(struct overlay *overlay, enum overlay_format format,
+		 const char *spec,
+		 unsigned int frame_width, unsigned int frame_height)
+{
+	char *path;
+	char *position;
+	uint8_t *rgba = NULL;
+	unsigned int width;
+	unsigned int height;
+	int x = 0;
+	int y = 0;
+	int ret;
+
+	path = strdup(spec);
+	if (path == NULL) {
+		perror("strdup");
+		return -ENOMEM;
+	}
+
+	position = strrchr(path, '@');
+	if (position && sscanf(position + 1, "%d,%d", &x, &y) == 2)
+		*position = '\0';
+
+	ret = load_pam(path, &rgba, &width, &height);
+	if (ret < 0)
+		goto out;
+
+	ret = overlay_init(overlay, format, rgba, width * 4, width, height,
+			   x, y, frame_width, frame_height);
+	free(rgba);
+
+out:
+	free(path);
+	return ret;
+}
+
+void overlay_cleanup(struct overlay *overlay)
+{
+	free(overlay->luma);
+	free(overlay->rects);
+	memset(overlay, 0, sizeof(*overlay));
+}
+
+void overlay_blend(const struct overlay *overlay,
+		   uint8_t *y, int y_stride,
+		   uint8_t *u, uint8_t *v, int uv_stride)
+{
+	const struct overlay_rect *rect;
+	unsigned int chroma_x;
+	unsigned int chroma_rect_x;
+	unsigned int chroma_len;
+	unsigned int row;
+	unsigned int i;
+	uint8_t *dst;
+	unsigned int offset;
+
+	for (i = 0; i < overlay->rects_count; i++) {
+		rect = &overlay->rects[i];
+
+		for (row = rect->y; row < rect->y + rect->height; row++) {
+			dst = y + (overlay->y + row) * y_stride + overlay->x + rect->x;
+			offset = row * overlay->width + rect->x;
+			overlay->blend_row(dst, overlay->luma + offset,
+					   overlay->luma_alpha + offset,
+					   rect->width);
+		}
+
+		/* NV12 chroma rows hold U and V of rect->width / 2 pixels */
+		if (overlay->format == OVERLAY_FORMAT_NV12) {
+			chroma_x = overlay->x + rect->x;
+			chroma_rect_x = rect->x;
+			chroma_len = rect->width;
+		} else {
+			chroma_x = (overlay->x + rect->x) / 2;
+			chroma_rect_x = rect->x / 2;
+			chroma_len = rect->width / 2;
+		}
+
+		for (row = rect->y / 2; row < (rect->y + rect->height) / 2; row++) {
+			offset = row * overlay->chroma_stride + chroma_rect_x;
+
+			dst = u + (overlay->y / 2 + row) * uv_stride + chroma_x;
+			overlay->blend_row(dst, overlay->chroma + offset,
+					   overlay->chroma_alpha + offset,
+					   chroma_len);
+
+			if (overlay->format == OVERLAY_FORMAT_NV12)
+				continue;
+
+			dst = v + (overlay->y / 2 + row) * uv_stride + chroma_x;
+			overlay->blend_row(dst, overlay->chroma_v + offset,
+					   overlay->chroma_alpha + offset,
+					   chroma_len);
+		}
+	}
+}
@@ -0,0 +1,102 @@
+/*
+ * overlay - blend RGBA pictures over YUV 4:2:0 frames
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __OVERLAY_H
+#define __OVERLAY_H
+
+#include <stdint.h>
+
+/* The layouts of the frames the overlays are blended onto */
+enum overlay_format {
+	OVERLAY_FORMAT_NV12,     /* limited range, U and V interleaved */
+	OVERLAY_FORMAT_YUVJ420P, /* full range, U and V in separate planes */
+};
+
+/* A part of the overlay which is not fully transparent */
+struct overlay_rect {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+/*
+ * An overlay converted once to the frame format: luma and chroma with
+ * their own alpha planes, all premultiplied, so that blending is just
+ * dst = src + dst * (255 - alpha) / 255 for every byte.
+ *
+ * In the NV12 layout each chroma row holds U and V interleaved and the
+ * chroma alpha is repeated for both; in the planar layout the U rows, the
+ * V rows and the chroma alpha rows are width / 2 bytes each.
+ */
+struct overlay {
+	enum overlay_format format;
+
+	/* where the overlay goes on the frame, always even */
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+
+	uint8_t *luma;
+	uint8_t *luma_alpha;
+	uint8_t *chroma;
+	uint8_t *chroma_v;
+	uint8_t *chroma_alpha;
+	unsigned int chroma_stride;
+
+	/* only these parts of the frame get touched */
+	struct overlay_rect *rects;
+	unsigned int rects_count;
+
+	void (*blend_row)(uint8_t *dst, const uint8_t *src,
+			  const uint8_t *alpha, unsigned int len);
+};
+
+/*
+ * Convert a premultiplied RGBA picture to be blended at (x, y) on frames
+ * of frame_width x frame_height pixels; the parts falling out of the
+ * frames are cropped.
+ */
+int overlay_init(struct overlay *overlay, enum overlay_format format,
+		 const uint8_t *rgba, unsigned int stride,
+		 unsigned int width, unsigned int height,
+		 int x, int y,
+		 unsigned int frame_width, unsigned int frame_height);
+
+/*
+ * Load an overlay from a spec like "<file>[@<x>,<y>]", the file is a PAM
+ * picture with a RGB_ALPHA tuple type and straight (not premultiplied)
+ * alpha, as written for instance by "convert logo.png logo.pam".
+ */
+int overlay_load(struct overlay *overlay, enum overlay_format format,
+		 const char *spec,
+		 unsigned int frame_width, unsigned int frame_height);
+
+void overlay_cleanup(struct overlay *overlay);
+
+/*
+ * Blend the overlay on a frame, 'v' is ignored for the NV12 layout where
+ * 'u' points to the interleaved chroma plane.
+ */
+void overlay_blend(const struct overlay *overlay,
+		   uint8_t *y, int y_stride,
+		   uint8_t *u, uint8_t *v, int uv_stride);
+
+#endif /* __OVERLAY_H */
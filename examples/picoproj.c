@@ -18,26 +18,351 @@
 
 /**
  * @example examples/picoproj.c
- * A minimal example to show how to use libam7xxx to display a static image.
+ * A minimal example to show how to use libam7xxx to display a static image,
+ * or a slideshow of images.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "am7xxx.h"
+#include "am7xxxd.h"
+
+static volatile sig_atomic_t run = 1;
+
+/*
+ * The images are mapped in memory and sent to the device straight from the
+ * mapping; the mappings are kept around, up to a maximum total size, so that
+ * showing an image again in a slideshow costs only the USB transfer.
+ */
+struct slide {
+	char *filename;
+	unsigned char *image;
+	size_t size;
+	unsigned long last_used;
+};
+
+struct slideshow {
+	struct slide *slides;
+	unsigned int slides_count;
+	size_t cache_size;
+	size_t cache_max_size;
+	unsigned long clock;
+};
+
+static int slideshow_add(struct slideshow *slideshow, const char *filename)
+{
+	struct slide *slides;
+
+	slides = realloc(slideshow->slides,
+			 (slideshow->slides_count + 1) * sizeof(*slides));
+	if (slides == NULL) {
+		perror("realloc");
+		return -ENOMEM;
+	}
+	slideshow->slides = slides;
+
+	memset(&slides[slideshow->slides_count], 0, sizeof(*slides));
+	slides[slideshow->slides_count].filename = strdup(filename);
+	if (slides[slideshow->slides_count].filename == NULL) {
+		perror("strdup");
+		return -ENOMEM;
+	}
+	slideshow->slides_count++;
+
+	return 0;
+}
+
+/* The playlist has an image file name per line, '#' starts a comment */
+static int slideshow_read_playlist(struct slideshow *slideshow, const char *playlist)
+{
+	char line[FILENAME_MAX];
+	FILE *playlist_fp;
+	size_t len;
+	int ret = 0;
+
+	playlist_fp = fopen(playlist, "r");
+	if (playlist_fp == NULL) {
+		perror("fopen");
+		return -EINVAL;
+	}
+
+	while (fgets(line, sizeof(line), playlist_fp)) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		ret = slideshow_add(slideshow, line);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret == 0 && slideshow->slides_count == 0) {
+		fprintf(stderr, "No images in the playlist %s\n", playlist);
+		ret = -EINVAL;
+	}
+
+	if (fclose(playlist_fp) == EOF)
+		perror("fclose");
+
+	return ret;
+}
+
+static void slide_unmap(struct slideshow *slideshow, struct slide *slide)
+{
+	munmap(slide->image, slide->size);
+	slideshow->cache_size -= slide->size;
+	slide->image = NULL;
+	slide->size = 0;
+}
+
+/* Map the image of a slide in memory, unless it is already there */
+static int slide_map(struct slideshow *slideshow, struct slide *slide)
+{
+	struct slide *lru;
+	struct stat st;
+	unsigned int i;
+	int flags;
+	int fd;
+	int ret;
+
+	slide->last_used = ++slideshow->clock;
+	if (slide->image)
+		return 0;
+
+	fd = open(slide->filename, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		perror(slide->filename);
+		return ret;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ret = -errno;
+		perror("fstat");
+		goto out;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s is empty\n", slide->filename);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* make room dropping the least recently used images */
+	while (slideshow->cache_size + st.st_size > slideshow->cache_max_size) {
+		lru = NULL;
+		for (i = 0; i < slideshow->slides_count; i++)
+			if (slideshow->slides[i].image &&
+			    (lru == NULL || slideshow->slides[i].last_used < lru->last_used))
+				lru = &slideshow->slides[i];
+		if (lru == NULL)
+			break;
+		slide_unmap(slideshow, lru);
+	}
+
+	/* read the whole image in advance where possible */
+	flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	slide->image = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+	if (slide->image == MAP_FAILED) {
+		ret = -errno;
+		perror("mmap");
+		slide->image = NULL;
+		goto out;
+	}
+	slide->size = st.st_size;
+	slideshow->cache_size += slide->size;
+
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static void slideshow_cleanup(struct slideshow *slideshow)
+{
+	unsigned int i;
+
+	for (i = 0; i < slideshow->slides_count; i++) {
+		if (slideshow->slides[i].image)
+			slide_unmap(slideshow, &slideshow->slides[i]);
+		free(slideshow->slides[i].filename);
+	}
+	free(slideshow->slides);
+}
+
+/*
+ * When going through am7xxxd the image has to be copied into the shared
+ * memory, it lives in the mapping of its file.
+ */
+static int send_slide(am7xxx_device *dev,
+		      struct am7xxxd_client *client,
+		      am7xxx_image_format format,
+		      unsigned int width,
+		      unsigned int height,
+		      struct slide *slide)
+{
+	int slot;
+	int ret;
+
+	if (client == NULL) {
+		ret = am7xxx_send_image(dev, format, width, height,
+					slide->image, (unsigned int)slide->size);
+		if (ret < 0)
+			perror("am7xxx_send_image");
+		return ret;
+	}
+
+	if (slide->size > client->slot_size) {
+		fprintf(stderr, "%s is too big for am7xxxd\n", slide->filename);
+		return -EFBIG;
+	}
+
+	slot = am7xxxd_client_get_slot(client);
+	if (slot < 0)
+		return slot;
+
+	memcpy(am7xxxd_client_slot_data(client, slot), slide->image, slide->size);
+
+	return am7xxxd_client_submit(client, slot, format, width, height,
+				     (unsigned int)slide->size);
+}
+
+static int slideshow_play(struct slideshow *slideshow,
+			  am7xxx_device *dev,
+			  struct am7xxxd_client *client,
+			  am7xxx_image_format format,
+			  unsigned int width,
+			  unsigned int height,
+			  unsigned int slide_duration)
+{
+	struct slide *slide;
+	struct timespec delay;
+	unsigned int i = 0;
+	unsigned int next;
+	int ret;
+
+	do {
+		slide = &slideshow->slides[i];
+		ret = slide_map(slideshow, slide);
+		if (ret < 0)
+			return ret;
+
+		ret = send_slide(dev, client, format, width, height, slide);
+		if (ret < 0)
+			return ret;
+
+		/* a single image is just shown once */
+		if (slideshow->slides_count == 1)
+			break;
+
+		/* get the next image ready while this one is shown */
+		next = (i + 1) % slideshow->slides_count;
+		ret = slide_map(slideshow, &slideshow->slides[next]);
+		if (ret < 0)
+			return ret;
+
+		delay.tv_sec = slide_duration;
+		delay.tv_nsec = 0;
+		while (run && nanosleep(&delay, &delay) < 0 && errno == EINTR)
+			;
+
+		i = next;
+	} while (run);
+
+	return 0;
+}
+
+/* Show the slideshow through am7xxxd instead of opening the device */
+static int slideshow_play_with_daemon(struct slideshow *slideshow,
+				      const char *socket_path,
+				      unsigned int device_index,
+				      am7xxx_power_mode power_mode,
+				      am7xxx_zoom_mode zoom,
+				      am7xxx_image_format format,
+				      unsigned int width,
+				      unsigned int height,
+				      unsigned int slide_duration)
+{
+	struct am7xxxd_client client;
+	int ret;
+
+	ret = am7xxxd_client_connect(&client, socket_path, device_index);
+	if (ret < 0)
+		return ret;
+
+	printf("Native resolution: %ux%u\n",
+	       client.native_width, client.native_height);
+
+	ret = am7xxxd_client_set_zoom_mode(&client, zoom);
+	if (ret < 0) {
+		fprintf(stderr, "cannot set the zoom mode: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	ret = am7xxxd_client_set_power_mode(&client, power_mode);
+	if (ret < 0) {
+		fprintf(stderr, "cannot set the power mode: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	/* When setting AM7XXX_ZOOM_TEST don't display the actual image */
+	if (zoom == AM7XXX_ZOOM_TEST) {
+		printf("AM7XXX_ZOOM_TEST requested, not sending actual image.\n");
+		goto out;
+	}
+
+	if (width > client.native_width || height > client.native_height)
+		fprintf(stderr,
+			"WARNING: image is %dx%d, not fitting the native resolution, it may be displayed wrongly!\n",
+			width, height);
+
+	ret = slideshow_play(slideshow, NULL, &client, format, width, height,
+			     slide_duration);
+	if (ret < 0)
+		goto out;
+
+	/* the images are sent by am7xxxd, get to know how that went */
+	ret = am7xxxd_client_flush(&client);
+	if (ret < 0)
+		fprintf(stderr, "am7xxxd cannot send the image: %s\n",
+			strerror(-ret));
+
+out:
+	am7xxxd_client_disconnect(&client);
+	return ret;
+}
+
+static void unset_run(int signo)
+{
+	(void) signo;
+	run = 0;
+}
 
 static void usage(char *name)
 {
 	printf("usage: %s [OPTIONS]\n\n", name);
 	printf("OPTIONS:\n");
 	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-D <socket>\t\tsend the images through am7xxxd listening on <socket>\n");
+	printf("\t\t\t\tinstead of opening the device\n");
 	printf("\t-f <filename>\t\tthe image file to upload\n");
+	printf("\t-P <playlist>\t\ta file listing the images of a slideshow, one per line\n");
+	printf("\t-t <seconds>\t\thow long each slide is shown (default is 5)\n");
+	printf("\t-c <MiB>\t\tthe memory for keeping the slideshow images (default is 64)\n");
 	printf("\t-F <format>\t\tthe image format to use (default is JPEG)\n");
 	printf("\t\t\t\tSUPPORTED FORMATS:\n");
 	printf("\t\t\t\t\t1 - JPEG\n");
@@ -52,8 +377,10 @@ static void usage(char *name)
 	printf("\t-W <image width>\tthe width of the image to upload\n");
 	printf("\t-H <image height>\tthe height of the image to upload\n");
 	printf("\t-h \t\t\tthis help message\n");
-	printf("\n\nEXAMPLE OF USE:\n");
+	printf("\n\nEXAMPLES OF USE:\n");
 	printf("\t%s -f file.jpg -F 1 -l 5 -W 800 -H 480\n", name);
+	printf("\t%s -P playlist.txt -t 10 -W 800 -H 480\n", name);
+	printf("\t%s -D %s -f file.jpg -W 800 -H 480\n", name, AM7XXXD_SOCKET_PATH);
 }
 
 int main(int argc, char *argv[])
@@ -62,8 +389,11 @@ int main(int argc, char *argv[])
 	int opt;
 
 	char filename[FILENAME_MAX] = {0};
-	FILE *image_fp;
-	struct stat st;
+	char playlist[FILENAME_MAX] = {0};
+	char *socket_path = NULL;
+	struct slideshow slideshow;
+	int slide_duration = 5;
+	int cache_size = 64;
 	am7xxx_context *ctx;
 	am7xxx_device *dev;
 	int log_level = AM7XXX_LOG_INFO;
@@ -73,11 +403,11 @@ int main(int argc, char *argv[])
 	int format = AM7XXX_IMAGE_FORMAT_JPEG;
 	int width = 800;
 	int height = 480;
-	unsigned char *image;
-	off_t size;
 	am7xxx_device_info device_info;
 
-	while ((opt = getopt(argc, argv, "d:f:F:l:p:z:W:H:h")) != -1) {
+	memset(&slideshow, 0, sizeof(slideshow));
+
+	while ((opt = getopt(argc, argv, "d:D:f:P:t:c:F:l:p:z:W:H:h")) != -1) {
 		switch (opt) {
 		case 'd':
 			device_index = atoi(optarg);
@@ -87,11 +417,34 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'D':
+			free(socket_path);
+			socket_path = strdup(optarg);
+			break;
 		case 'f':
 			if (filename[0] != '\0')
 				fprintf(stderr, "Warning: image file already specified\n");
 			strncpy(filename, optarg, FILENAME_MAX);
 			break;
+		case 'P':
+			strncpy(playlist, optarg, FILENAME_MAX);
+			break;
+		case 't':
+			slide_duration = atoi(optarg);
+			if (slide_duration < 1) {
+				fprintf(stderr, "Invalid slide duration, must be at least 1 second\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'c':
+			cache_size = atoi(optarg);
+			if (cache_size < 0) {
+				fprintf(stderr, "Invalid cache size, must be a non-negative number\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
 		case 'F':
 			format = atoi(optarg);
 			switch(format) {
@@ -174,51 +527,41 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (filename[0] == '\0') {
-		fprintf(stderr, "An image file MUST be specified with the -f option.\n\n");
+	if ((filename[0] == '\0') == (playlist[0] == '\0')) {
+		fprintf(stderr, "Either an image file with the -f option or a playlist with the -P option MUST be specified.\n\n");
 		usage(argv[0]);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	image_fp = fopen(filename, "rb");
-	if (image_fp == NULL) {
-		perror("fopen");
-		ret = -EINVAL;
-		goto out;
-	}
-	ret = fstat(fileno(image_fp), &st);
-	if (ret < 0) {
-		perror("fstat");
-		goto out_close_image_fp;
-	}
-	size = st.st_size;
+	slideshow.cache_max_size = (size_t)cache_size * 1024 * 1024;
 
-	image = malloc(size * sizeof(unsigned char));
-	if (image == NULL) {
-		perror("malloc");
-		ret = -ENOMEM;
-		goto out_close_image_fp;
-	}
+	if (playlist[0] != '\0')
+		ret = slideshow_read_playlist(&slideshow, playlist);
+	else
+		ret = slideshow_add(&slideshow, filename);
+	if (ret < 0)
+		goto out_cleanup_slideshow;
 
-	ret = (int)fread(image, size, 1, image_fp);
-	if (ret != 1) {
-		if (feof(image_fp))
-			fprintf(stderr, "Unexpected end of file.\n");
-		else if (ferror(image_fp))
-			perror("fread");
-		else
-			fprintf(stderr, "Unexpected error condition.\n");
+	/* load the first image before touching the device */
+	ret = slide_map(&slideshow, &slideshow.slides[0]);
+	if (ret < 0)
+		goto out_cleanup_slideshow;
 
-		if (ret >= 0)
-			ret = -EINVAL;
-		goto out_free_image;
+	signal(SIGINT, unset_run);
+
+	if (socket_path) {
+		ret = slideshow_play_with_daemon(&slideshow, socket_path,
+						 device_index, power_mode, zoom,
+						 format, width, height,
+						 slide_duration);
+		goto out_cleanup_slideshow;
 	}
 
 	ret = am7xxx_init(&ctx);
 	if (ret < 0) {
 		perror("am7xxx_init");
-		goto out_free_image;
+		goto out_cleanup_slideshow;
 	}
 
 	am7xxx_set_log_level(ctx, log_level);
@@ -273,24 +616,19 @@ int main(int argc, char *argv[])
 			"WARNING: image is %dx%d, not fitting the native resolution, it may be displayed wrongly!\n",
 			width, height);
 
-	ret = am7xxx_send_image(dev, format, width, height, image, (unsigned int)size);
-	if (ret < 0) {
-		perror("am7xxx_send_image");
+	ret = slideshow_play(&slideshow, dev, NULL, format, width, height, slide_duration);
+	if (ret < 0)
 		goto cleanup;
-	}
 
 	ret = 0;
 
 cleanup:
 	am7xxx_shutdown(ctx);
 
-out_free_image:
-	free(image);
-
-out_close_image_fp:
-	if (fclose(image_fp) == EOF)
-		perror("fclose");
+out_cleanup_slideshow:
+	slideshow_cleanup(&slideshow);
 
 out:
+	free(socket_path);
 	return ret;
 }
@@ -0,0 +1,68 @@
+/*
+ * video_source - native capture sources for am7xxx-play
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/parseutils.h>
+
+#include "video_source.h"
+
+int64_t video_source_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int video_source_get_frame_interval(AVDictionary *options,
+				    int default_framerate,
+				    int64_t *frame_interval)
+{
+	AVDictionaryEntry *entry;
+	AVRational framerate = { default_framerate, 1 };
+
+	entry = av_dict_get(options, "framerate", NULL, 0);
+	if (entry && (av_parse_video_rate(&framerate, entry->value) < 0 ||
+		      framerate.num <= 0)) {
+		fprintf(stderr, "invalid frame rate: %s\n", entry->value);
+		return -EINVAL;
+	}
+
+	*frame_interval = (int64_t)1000000 * framerate.den / framerate.num;
+	return 0;
+}
+
+void video_source_throttle(int64_t *next_capture, int64_t frame_interval)
+{
+	struct timespec delay;
+	int64_t now;
+
+	now = video_source_time();
+	if (now < *next_capture) {
+		delay.tv_sec = (*next_capture - now) / 1000000;
+		delay.tv_nsec = (*next_capture - now) % 1000000 * 1000;
+		nanosleep(&delay, NULL);
+		now = *next_capture;
+	}
+	*next_capture = now + frame_interval;
+}
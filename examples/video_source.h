@@ -0,0 +1,104 @@
+/*
+ * video_source - native capture sources for am7xxx-play
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VIDEO_SOURCE_H
+#define __VIDEO_SOURCE_H
+
+#include <libavutil/avutil.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * The native sources capture pictures straight from the memory the system
+ * exposes (e.g. a shared memory segment, or a mmapped device) without going
+ * through libavdevice, the pictures are then scaled directly from there.
+ */
+
+/*
+ * A picture as captured by a source, it stays valid until released; for
+ * compressed pictures data[0] holds 'size' bytes of compressed data.
+ */
+struct video_source_picture {
+	uint8_t *data[4];
+	int linesize[4];
+	int size;
+	unsigned int index;
+};
+
+struct video_source_ops {
+	const char *name;
+
+	/*
+	 * Open the source at 'path', the source takes the options it
+	 * understands out of 'options'; 'width' and 'height' are the
+	 * dimensions of the area to capture when the source can choose it.
+	 */
+	int (*open)(void **source, const char *path, AVDictionary **options,
+		    unsigned int width, unsigned int height);
+
+	/*
+	 * Get the dimensions and the format of the pictures, 'codec_id' is
+	 * CODEC_ID_RAWVIDEO for uncompressed pictures in 'pix_fmt'.
+	 */
+	void (*get_format)(void *source, int *width, int *height,
+			   enum PixelFormat *pix_fmt, enum CodecID *codec_id);
+
+	/*
+	 * Wait for a new picture, returns 1 when a picture is available, 0 at
+	 * the end of the input, -EAGAIN when nothing happened for a while,
+	 * so that the caller can check if it has to stop, or a negative
+	 * value on error.
+	 */
+	int (*read)(void *source, struct video_source_picture *picture);
+
+	/* Give the picture memory back to the source */
+	void (*release)(void *source, struct video_source_picture *picture);
+
+	void (*close)(void *source);
+};
+
+/* The current time in microseconds, from a monotonic clock */
+int64_t video_source_time(void);
+
+/*
+ * Get the time between two pictures in microseconds from the 'framerate'
+ * option, or from 'default_framerate' if the option is not set.
+ */
+int video_source_get_frame_interval(AVDictionary *options,
+				    int default_framerate,
+				    int64_t *frame_interval);
+
+/*
+ * Wait until the time for the next capture comes, so that the pictures are
+ * not captured more often than the frame rate allows.
+ */
+void video_source_throttle(int64_t *next_capture, int64_t frame_interval);
+
+#ifdef HAVE_XCB_SHM
+extern const struct video_source_ops xcb_shm_source_ops;
+#endif
+
+#ifdef HAVE_LINUX_FB
+extern const struct video_source_ops fbdev_mmap_source_ops;
+#endif
+
+#ifdef HAVE_LINUX_VIDEODEV2
+extern const struct video_source_ops v4l2_mmap_source_ops;
+#endif
+
+#endif /* __VIDEO_SOURCE_H */
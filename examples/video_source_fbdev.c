@@ -0,0 +1,331 @@
+/*
+ * video_source_fbdev - capture a Linux framebuffer via mmap for am7xxx-play
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The framebuffer memory is mapped once and the pictures are scaled and
+ * converted straight from there, no copy of the screen is ever made.
+ *
+ * A regular file can be used in place of the framebuffer device, this is
+ * handy for testing; its dimensions and pixel format have to be given with
+ * the 'video_size' and 'pixel_format' options, as the file has no way to
+ * tell them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/parseutils.h>
+
+#include "video_source.h"
+
+#ifndef ENOTSUP
+#define ENOTSUP 95
+#endif
+
+struct fbdev_mmap_source {
+	int fd;
+	int is_device;
+	uint8_t *data;
+	size_t size;
+	int width;
+	int height;
+	int stride;
+	int bytes_per_pixel;
+	enum PixelFormat pix_fmt;
+
+	int vsync;
+	int64_t frame_interval;
+	int64_t next_capture;
+};
+
+/* The pixel layouts which can be found in a framebuffer */
+static const struct {
+	int bits_per_pixel;
+	int red_offset;
+	int green_offset;
+	int blue_offset;
+	enum PixelFormat pix_fmt;
+} fbdev_pixel_formats[] = {
+	{ 32,  0,  8, 16, PIX_FMT_RGBA },
+	{ 32, 16,  8,  0, PIX_FMT_BGRA },
+	{ 32,  8, 16, 24, PIX_FMT_ARGB },
+	{ 32, 24, 16,  8, PIX_FMT_ABGR },
+	{ 24,  0,  8, 16, PIX_FMT_RGB24 },
+	{ 24, 16,  8,  0, PIX_FMT_BGR24 },
+	{ 16, 11,  5,  0, PIX_FMT_RGB565LE },
+};
+
+static enum PixelFormat get_pixel_format(struct fb_var_screeninfo *var_info)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(fbdev_pixel_formats) / sizeof(fbdev_pixel_formats[0]); i++)
+		if (fbdev_pixel_formats[i].bits_per_pixel == (int)var_info->bits_per_pixel &&
+		    fbdev_pixel_formats[i].red_offset == (int)var_info->red.offset &&
+		    fbdev_pixel_formats[i].green_offset == (int)var_info->green.offset &&
+		    fbdev_pixel_formats[i].blue_offset == (int)var_info->blue.offset)
+			return fbdev_pixel_formats[i].pix_fmt;
+
+	return PIX_FMT_NONE;
+}
+
+static int fbdev_mmap_source_init_device(struct fbdev_mmap_source *source)
+{
+	struct fb_var_screeninfo var_info;
+	struct fb_fix_screeninfo fix_info;
+	int ret;
+
+	ret = ioctl(source->fd, FBIOGET_VSCREENINFO, &var_info);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ioctl FBIOGET_VSCREENINFO");
+		return ret;
+	}
+
+	ret = ioctl(source->fd, FBIOGET_FSCREENINFO, &fix_info);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ioctl FBIOGET_FSCREENINFO");
+		return ret;
+	}
+
+	source->pix_fmt = get_pixel_format(&var_info);
+	if (source->pix_fmt == PIX_FMT_NONE) {
+		fprintf(stderr, "unsupported framebuffer pixel format: %d bits per pixel\n",
+			var_info.bits_per_pixel);
+		return -ENOTSUP;
+	}
+
+	source->width = var_info.xres;
+	source->height = var_info.yres;
+	source->stride = fix_info.line_length;
+	source->bytes_per_pixel = var_info.bits_per_pixel / 8;
+	source->size = fix_info.smem_len;
+
+	return 0;
+}
+
+static int fbdev_mmap_source_init_file(struct fbdev_mmap_source *source,
+				       AVDictionary *options)
+{
+	AVDictionaryEntry *entry;
+	struct stat st;
+	int linesizes[4];
+	int ret;
+
+	entry = av_dict_get(options, "video_size", NULL, 0);
+	if (entry == NULL ||
+	    av_parse_video_size(&source->width, &source->height, entry->value) < 0) {
+		fprintf(stderr, "a valid video_size option is needed when reading from a file\n");
+		return -EINVAL;
+	}
+
+	source->pix_fmt = PIX_FMT_BGRA;
+	entry = av_dict_get(options, "pixel_format", NULL, 0);
+	if (entry) {
+		source->pix_fmt = av_get_pix_fmt(entry->value);
+		if (source->pix_fmt == PIX_FMT_NONE) {
+			fprintf(stderr, "invalid pixel format: %s\n", entry->value);
+			return -EINVAL;
+		}
+	}
+
+	ret = av_image_fill_linesizes(linesizes, source->pix_fmt, source->width);
+	if (ret < 0 || linesizes[1] != 0) {
+		fprintf(stderr, "the pixel format must be a packed one\n");
+		return -EINVAL;
+	}
+	source->stride = linesizes[0];
+	source->bytes_per_pixel = 0;
+
+	ret = fstat(source->fd, &st);
+	if (ret < 0) {
+		ret = -errno;
+		perror("fstat");
+		return ret;
+	}
+
+	source->size = (size_t)source->stride * source->height;
+	if ((size_t)st.st_size < source->size) {
+		fprintf(stderr, "the file is too small for a %dx%d picture\n",
+			source->width, source->height);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int fbdev_mmap_source_open(void **source_out, const char *path,
+				  AVDictionary **options,
+				  unsigned int width, unsigned int height)
+{
+	struct fbdev_mmap_source *source;
+	AVDictionaryEntry *entry;
+	struct stat st;
+	int ret;
+
+	/* the framebuffer decides the dimensions */
+	(void) width;
+	(void) height;
+
+	source = calloc(1, sizeof(*source));
+	if (source == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+
+	ret = video_source_get_frame_interval(*options, 25, &source->frame_interval);
+	if (ret < 0)
+		goto err_free_source;
+
+	entry = av_dict_get(*options, "vsync", NULL, 0);
+	if (entry)
+		source->vsync = atoi(entry->value);
+
+	source->fd = open(path, O_RDONLY);
+	if (source->fd < 0) {
+		ret = -errno;
+		perror("open");
+		goto err_free_source;
+	}
+
+	ret = fstat(source->fd, &st);
+	if (ret < 0) {
+		ret = -errno;
+		perror("fstat");
+		goto err_close;
+	}
+
+	source->is_device = S_ISCHR(st.st_mode);
+	if (source->is_device)
+		ret = fbdev_mmap_source_init_device(source);
+	else
+		ret = fbdev_mmap_source_init_file(source, *options);
+	if (ret < 0)
+		goto err_close;
+
+	source->data = mmap(NULL, source->size, PROT_READ, MAP_SHARED, source->fd, 0);
+	if (source->data == MAP_FAILED) {
+		ret = -errno;
+		perror("mmap");
+		goto err_close;
+	}
+
+	fprintf(stdout, "capturing %dx%d from %s%s\n",
+		source->width, source->height, path,
+		source->vsync ? " on vertical sync" : "");
+
+	*source_out = source;
+	return 0;
+
+err_close:
+	close(source->fd);
+err_free_source:
+	free(source);
+	return ret;
+}
+
+static void fbdev_mmap_source_get_format(void *source_ptr, int *width, int *height,
+					 enum PixelFormat *pix_fmt, enum CodecID *codec_id)
+{
+	struct fbdev_mmap_source *source = source_ptr;
+
+	*width = source->width;
+	*height = source->height;
+	*pix_fmt = source->pix_fmt;
+	*codec_id = CODEC_ID_RAWVIDEO;
+}
+
+static int fbdev_mmap_source_read(void *source_ptr, struct video_source_picture *picture)
+{
+	struct fbdev_mmap_source *source = source_ptr;
+	struct fb_var_screeninfo var_info;
+	uint32_t crtc = 0;
+	size_t offset = 0;
+	int ret;
+
+	video_source_throttle(&source->next_capture, source->frame_interval);
+
+	if (source->is_device) {
+		/* Capture between two refreshes to avoid tearing, not all
+		 * the drivers support that though */
+		if (source->vsync) {
+			ret = ioctl(source->fd, FBIO_WAITFORVSYNC, &crtc);
+			if (ret < 0) {
+				perror("ioctl FBIO_WAITFORVSYNC");
+				fprintf(stderr, "capturing without waiting for vertical sync\n");
+				source->vsync = 0;
+			}
+		}
+
+		/* with double buffering the visible area moves around */
+		ret = ioctl(source->fd, FBIOGET_VSCREENINFO, &var_info);
+		if (ret < 0) {
+			ret = -errno;
+			perror("ioctl FBIOGET_VSCREENINFO");
+			return ret;
+		}
+		offset = (size_t)var_info.yoffset * source->stride +
+			 (size_t)var_info.xoffset * source->bytes_per_pixel;
+		if (offset + (size_t)source->stride * source->height > source->size)
+			offset = 0;
+	}
+
+	memset(picture, 0, sizeof(*picture));
+	picture->data[0] = source->data + offset;
+	picture->linesize[0] = source->stride;
+	picture->size = source->stride * source->height;
+
+	return 1;
+}
+
+static void fbdev_mmap_source_release(void *source, struct video_source_picture *picture)
+{
+	/* the picture is the framebuffer itself */
+	(void) source;
+	(void) picture;
+}
+
+static void fbdev_mmap_source_close(void *source_ptr)
+{
+	struct fbdev_mmap_source *source = source_ptr;
+
+	munmap(source->data, source->size);
+	close(source->fd);
+	free(source);
+}
+
+const struct video_source_ops fbdev_mmap_source_ops = {
+	.name = "fbmmap",
+	.open = fbdev_mmap_source_open,
+	.get_format = fbdev_mmap_source_get_format,
+	.read = fbdev_mmap_source_read,
+	.release = fbdev_mmap_source_release,
+	.close = fbdev_mmap_source_close,
+};
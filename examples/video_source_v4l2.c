@@ -0,0 +1,463 @@
+/*
+ * video_source_v4l2 - capture from a V4L2 device via mmap for am7xxx-play
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The driver fills a ring of buffers mapped in our memory, each picture is
+ * used right from its buffer which goes back to the driver only after the
+ * picture has been scaled, or sent to the device when it can be sent as it
+ * is (MJPEG pictures, or NV12 pictures at the device native size).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/parseutils.h>
+
+#include "video_source.h"
+
+#ifndef ENOTSUP
+#define ENOTSUP 95
+#endif
+
+/* How long to wait for a picture before giving control back, in ms */
+#define V4L2_MMAP_TIMEOUT 100
+
+#define V4L2_MMAP_DEFAULT_BUFFERS 4
+
+struct v4l2_mmap_buffer {
+	uint8_t *data;
+	size_t length;
+};
+
+struct v4l2_mmap_source {
+	int fd;
+	int width;
+	int height;
+	int stride;
+	uint32_t pixelformat;
+	enum PixelFormat pix_fmt;
+	enum CodecID codec_id;
+
+	struct v4l2_mmap_buffer *buffers;
+	unsigned int buffers_count;
+};
+
+/* The formats we ask the driver for, in order of preference */
+static const struct {
+	const char *name;
+	uint32_t pixelformat;
+	enum PixelFormat pix_fmt;
+	enum CodecID codec_id;
+} v4l2_formats[] = {
+	{ "mjpeg",   V4L2_PIX_FMT_MJPEG, PIX_FMT_NONE,    CODEC_ID_MJPEG },
+	{ "nv12",    V4L2_PIX_FMT_NV12,  PIX_FMT_NV12,    CODEC_ID_RAWVIDEO },
+	{ "yuyv422", V4L2_PIX_FMT_YUYV,  PIX_FMT_YUYV422, CODEC_ID_RAWVIDEO },
+};
+
+#define V4L2_FORMATS_COUNT (sizeof(v4l2_formats) / sizeof(v4l2_formats[0]))
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static int device_has_format(int fd, uint32_t pixelformat)
+{
+	struct v4l2_fmtdesc fmtdesc;
+
+	memset(&fmtdesc, 0, sizeof(fmtdesc));
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	while (xioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+		if (fmtdesc.pixelformat == pixelformat)
+			return 1;
+		fmtdesc.index++;
+	}
+
+	return 0;
+}
+
+static int v4l2_mmap_source_set_format(struct v4l2_mmap_source *source,
+				       AVDictionary *options,
+				       unsigned int width, unsigned int height)
+{
+	AVDictionaryEntry *entry;
+	struct v4l2_format format;
+	struct v4l2_streamparm parm;
+	AVRational framerate;
+	unsigned int i;
+	int w = width;
+	int h = height;
+	int ret;
+
+	entry = av_dict_get(options, "video_size", NULL, 0);
+	if (entry && av_parse_video_size(&w, &h, entry->value) < 0) {
+		fprintf(stderr, "invalid video size: %s\n", entry->value);
+		return -EINVAL;
+	}
+
+	/* either the requested format, or the first one the driver has */
+	entry = av_dict_get(options, "pixel_format", NULL, 0);
+	for (i = 0; i < V4L2_FORMATS_COUNT; i++) {
+		if (entry && strcmp(entry->value, v4l2_formats[i].name) != 0)
+			continue;
+		if (device_has_format(source->fd, v4l2_formats[i].pixelformat))
+			break;
+	}
+	if (i == V4L2_FORMATS_COUNT) {
+		fprintf(stderr, "the device does not support %s\n",
+			entry ? entry->value : "MJPEG, NV12 or YUYV");
+		return -ENOTSUP;
+	}
+
+	memset(&format, 0, sizeof(format));
+	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	format.fmt.pix.width = w;
+	format.fmt.pix.height = h;
+	format.fmt.pix.pixelformat = v4l2_formats[i].pixelformat;
+	format.fmt.pix.field = V4L2_FIELD_NONE;
+	ret = xioctl(source->fd, VIDIOC_S_FMT, &format);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ioctl VIDIOC_S_FMT");
+		return ret;
+	}
+
+	/* the driver may choose a different format, or other dimensions */
+	if (format.fmt.pix.pixelformat != v4l2_formats[i].pixelformat) {
+		fprintf(stderr, "the driver did not accept the %s format\n",
+			v4l2_formats[i].name);
+		return -ENOTSUP;
+	}
+
+	source->width = format.fmt.pix.width;
+	source->height = format.fmt.pix.height;
+	source->stride = format.fmt.pix.bytesperline;
+	source->pixelformat = v4l2_formats[i].pixelformat;
+	source->pix_fmt = v4l2_formats[i].pix_fmt;
+	source->codec_id = v4l2_formats[i].codec_id;
+
+	entry = av_dict_get(options, "framerate", NULL, 0);
+	if (entry) {
+		if (av_parse_video_rate(&framerate, entry->value) < 0 ||
+		    framerate.num <= 0) {
+			fprintf(stderr, "invalid frame rate: %s\n", entry->value);
+			return -EINVAL;
+		}
+
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		parm.parm.capture.timeperframe.numerator = framerate.den;
+		parm.parm.capture.timeperframe.denominator = framerate.num;
+		ret = xioctl(source->fd, VIDIOC_S_PARM, &parm);
+		if (ret < 0)
+			fprintf(stderr, "the device does not allow to set the frame rate\n");
+	}
+
+	return 0;
+}
+
+static void v4l2_mmap_source_free_buffers(struct v4l2_mmap_source *source)
+{
+	struct v4l2_requestbuffers requestbuffers;
+	unsigned int i;
+
+	for (i = 0; i < source->buffers_count; i++)
+		if (source->buffers[i].data)
+			munmap(source->buffers[i].data, source->buffers[i].length);
+	free(source->buffers);
+	source->buffers = NULL;
+	source->buffers_count = 0;
+
+	memset(&requestbuffers, 0, sizeof(requestbuffers));
+	requestbuffers.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	requestbuffers.memory = V4L2_MEMORY_MMAP;
+	xioctl(source->fd, VIDIOC_REQBUFS, &requestbuffers);
+}
+
+static int v4l2_mmap_source_alloc_buffers(struct v4l2_mmap_source *source,
+					  unsigned int buffers_count)
+{
+	struct v4l2_requestbuffers requestbuffers;
+	struct v4l2_buffer buffer;
+	unsigned int i;
+	int ret;
+
+	memset(&requestbuffers, 0, sizeof(requestbuffers));
+	requestbuffers.count = buffers_count;
+	requestbuffers.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	requestbuffers.memory = V4L2_MEMORY_MMAP;
+	ret = xioctl(source->fd, VIDIOC_REQBUFS, &requestbuffers);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ioctl VIDIOC_REQBUFS");
+		return ret;
+	}
+	if (requestbuffers.count < 2) {
+		fprintf(stderr, "not enough capture buffers\n");
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	source->buffers = calloc(requestbuffers.count, sizeof(*source->buffers));
+	if (source->buffers == NULL) {
+		perror("calloc");
+		ret = -ENOMEM;
+		goto err;
+	}
+	source->buffers_count = requestbuffers.count;
+
+	for (i = 0; i < source->buffers_count; i++) {
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		ret = xioctl(source->fd, VIDIOC_QUERYBUF, &buffer);
+		if (ret < 0) {
+			ret = -errno;
+			perror("ioctl VIDIOC_QUERYBUF");
+			goto err;
+		}
+
+		source->buffers[i].length = buffer.length;
+		source->buffers[i].data = mmap(NULL, buffer.length,
+					       PROT_READ | PROT_WRITE, MAP_SHARED,
+					       source->fd, buffer.m.offset);
+		if (source->buffers[i].data == MAP_FAILED) {
+			ret = -errno;
+			perror("mmap");
+			source->buffers[i].data = NULL;
+			goto err;
+		}
+
+		ret = xioctl(source->fd, VIDIOC_QBUF, &buffer);
+		if (ret < 0) {
+			ret = -errno;
+			perror("ioctl VIDIOC_QBUF");
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	v4l2_mmap_source_free_buffers(source);
+	return ret;
+}
+
+static int v4l2_mmap_source_open(void **source_out, const char *path,
+				 AVDictionary **options,
+				 unsigned int width, unsigned int height)
+{
+	struct v4l2_mmap_source *source;
+	struct v4l2_capability capability;
+	AVDictionaryEntry *entry;
+	enum v4l2_buf_type type;
+	unsigned int buffers_count = V4L2_MMAP_DEFAULT_BUFFERS;
+	uint32_t capabilities;
+	int ret;
+
+	entry = av_dict_get(*options, "buffers", NULL, 0);
+	if (entry) {
+		buffers_count = atoi(entry->value);
+		if (buffers_count < 2) {
+			fprintf(stderr, "at least 2 capture buffers are needed\n");
+			return -EINVAL;
+		}
+	}
+
+	source = calloc(1, sizeof(*source));
+	if (source == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+
+	source->fd = open(path, O_RDWR | O_NONBLOCK);
+	if (source->fd < 0) {
+		ret = -errno;
+		perror("open");
+		goto err_free_source;
+	}
+
+	ret = xioctl(source->fd, VIDIOC_QUERYCAP, &capability);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ioctl VIDIOC_QUERYCAP");
+		goto err_close;
+	}
+
+	capabilities = capability.capabilities;
+	if (capabilities & V4L2_CAP_DEVICE_CAPS)
+		capabilities = capability.device_caps;
+	if (!(capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+	    !(capabilities & V4L2_CAP_STREAMING)) {
+		fprintf(stderr, "%s cannot stream video captures\n", path);
+		ret = -ENOTSUP;
+		goto err_close;
+	}
+
+	/* ask for pictures as big as the device can show, by default */
+	ret = v4l2_mmap_source_set_format(source, *options, width, height);
+	if (ret < 0)
+		goto err_close;
+
+	ret = v4l2_mmap_source_alloc_buffers(source, buffers_count);
+	if (ret < 0)
+		goto err_close;
+
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ret = xioctl(source->fd, VIDIOC_STREAMON, &type);
+	if (ret < 0) {
+		ret = -errno;
+		perror("ioctl VIDIOC_STREAMON");
+		goto err_free_buffers;
+	}
+
+	fprintf(stdout, "capturing %dx%d %.4s from %s with %u buffers\n",
+		source->width, source->height, (char *)&source->pixelformat,
+		path, source->buffers_count);
+
+	*source_out = source;
+	return 0;
+
+err_free_buffers:
+	v4l2_mmap_source_free_buffers(source);
+err_close:
+	close(source->fd);
+err_free_source:
+	free(source);
+	return ret;
+}
+
+static void v4l2_mmap_source_get_format(void *source_ptr, int *width, int *height,
+					enum PixelFormat *pix_fmt, enum CodecID *codec_id)
+{
+	struct v4l2_mmap_source *source = source_ptr;
+
+	*width = source->width;
+	*height = source->height;
+	*pix_fmt = source->pix_fmt;
+	*codec_id = source->codec_id;
+}
+
+static int v4l2_mmap_source_read(void *source_ptr, struct video_source_picture *picture)
+{
+	struct v4l2_mmap_source *source = source_ptr;
+	struct v4l2_buffer buffer;
+	struct pollfd pfd;
+	uint8_t *data;
+	int ret;
+
+	pfd.fd = source->fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		ret = poll(&pfd, 1, V4L2_MMAP_TIMEOUT);
+		if (ret < 0 && errno != EINTR) {
+			ret = -errno;
+			perror("poll");
+			return ret;
+		} else if (ret <= 0) {
+			return -EAGAIN;
+		}
+
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		ret = xioctl(source->fd, VIDIOC_DQBUF, &buffer);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				continue;
+			ret = -errno;
+			perror("ioctl VIDIOC_DQBUF");
+			return ret;
+		}
+
+		/* a corrupted picture, just wait for the next one */
+		if ((buffer.flags & V4L2_BUF_FLAG_ERROR) || buffer.bytesused == 0) {
+			xioctl(source->fd, VIDIOC_QBUF, &buffer);
+			continue;
+		}
+
+		break;
+	}
+
+	data = source->buffers[buffer.index].data;
+
+	memset(picture, 0, sizeof(*picture));
+	picture->index = buffer.index;
+	picture->size = buffer.bytesused;
+	picture->data[0] = data;
+	picture->linesize[0] = source->stride;
+
+	/* the chroma plane follows the luma one */
+	if (source->pixelformat == V4L2_PIX_FMT_NV12) {
+		picture->data[1] = data + source->stride * source->height;
+		picture->linesize[1] = source->stride;
+	}
+
+	return 1;
+}
+
+static void v4l2_mmap_source_release(void *source_ptr, struct video_source_picture *picture)
+{
+	struct v4l2_mmap_source *source = source_ptr;
+	struct v4l2_buffer buffer;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = V4L2_MEMORY_MMAP;
+	buffer.index = picture->index;
+	if (xioctl(source->fd, VIDIOC_QBUF, &buffer) < 0)
+		perror("ioctl VIDIOC_QBUF");
+}
+
+static void v4l2_mmap_source_close(void *source_ptr)
+{
+	struct v4l2_mmap_source *source = source_ptr;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	xioctl(source->fd, VIDIOC_STREAMOFF, &type);
+	v4l2_mmap_source_free_buffers(source);
+	close(source->fd);
+	free(source);
+}
+
+const struct video_source_ops v4l2_mmap_source_ops = {
+	.name = "v4l2mmap",
+	.open = v4l2_mmap_source_open,
+	.get_format = v4l2_mmap_source_get_format,
+	.read = v4l2_mmap_source_read,
+	.release = v4l2_mmap_source_release,
+	.close = v4l2_mmap_source_close,
+};
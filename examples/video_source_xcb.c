@@ -0,0 +1,542 @@
+/*
+ * video_source_xcb - capture the X screen via MIT-SHM for am7xxx-play
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The screen area is copied by the X server into a shared memory segment
+ * which is allocated once and reused for every picture, and only the area
+ * shown by the device is captured.
+ *
+ * The XDamage extension tells when something changed on the screen, so
+ * a new picture is captured only when there is actually something new to
+ * show.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <xcb/damage.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/parseutils.h>
+
+#include "video_source.h"
+
+#ifndef ENOTSUP
+#define ENOTSUP 95
+#endif
+
+/* How long to wait for damage before giving control back, in ms */
+#define XCB_SHM_DAMAGE_TIMEOUT 100
+
+struct xcb_shm_source {
+	xcb_connection_t *connection;
+	xcb_window_t root;
+	int x;
+	int y;
+	int width;
+	int height;
+	int stride;
+	enum PixelFormat pix_fmt;
+
+	int shmid;
+	uint8_t *data;
+	xcb_shm_seg_t segment;
+
+	int use_damage;
+	int damaged;
+	xcb_damage_damage_t damage;
+	uint8_t damage_event;
+
+	int64_t frame_interval;
+	int64_t next_capture;
+};
+
+static xcb_screen_t *get_screen(const xcb_setup_t *setup, int screen_number)
+{
+	xcb_screen_iterator_t iter;
+
+	iter = xcb_setup_roots_iterator(setup);
+	for (; iter.rem; --screen_number, xcb_screen_next(&iter))
+		if (screen_number == 0)
+			return iter.data;
+
+	return NULL;
+}
+
+static xcb_visualtype_t *get_visual(xcb_screen_t *screen)
+{
+	xcb_depth_iterator_t depth_iter;
+	xcb_visualtype_iterator_t visual_iter;
+
+	depth_iter = xcb_screen_allowed_depths_iterator(screen);
+	for (; depth_iter.rem; xcb_depth_next(&depth_iter)) {
+		visual_iter = xcb_depth_visuals_iterator(depth_iter.data);
+		for (; visual_iter.rem; xcb_visualtype_next(&visual_iter))
+			if (visual_iter.data->visual_id == screen->root_visual)
+				return visual_iter.data;
+	}
+
+	return NULL;
+}
+
+/* Find out how the pixels of a Z pixmap look like in memory */
+static int get_pixel_format(const xcb_setup_t *setup,
+			    xcb_screen_t *screen,
+			    int *bits_per_pixel,
+			    int *scanline_pad,
+			    enum PixelFormat *pix_fmt)
+{
+	xcb_format_iterator_t iter;
+	xcb_visualtype_t *visual;
+	int lsb_first;
+
+	*bits_per_pixel = 0;
+	iter = xcb_setup_pixmap_formats_iterator(setup);
+	for (; iter.rem; xcb_format_next(&iter))
+		if (iter.data->depth == screen->root_depth) {
+			*bits_per_pixel = iter.data->bits_per_pixel;
+			*scanline_pad = iter.data->scanline_pad;
+			break;
+		}
+
+	visual = get_visual(screen);
+	if (*bits_per_pixel == 0 || visual == NULL) {
+		fprintf(stderr, "cannot find the screen pixel format\n");
+		return -ENOTSUP;
+	}
+
+	lsb_first = (setup->image_byte_order == XCB_IMAGE_ORDER_LSB_FIRST);
+
+	*pix_fmt = PIX_FMT_NONE;
+	switch (*bits_per_pixel) {
+	case 32:
+		if (visual->red_mask == 0xff0000 && visual->blue_mask == 0x0000ff)
+			*pix_fmt = lsb_first ? PIX_FMT_BGRA : PIX_FMT_ARGB;
+		else if (visual->red_mask == 0x0000ff && visual->blue_mask == 0xff0000)
+			*pix_fmt = lsb_first ? PIX_FMT_RGBA : PIX_FMT_ABGR;
+		break;
+	case 24:
+		if (visual->red_mask == 0xff0000 && visual->blue_mask == 0x0000ff)
+			*pix_fmt = lsb_first ? PIX_FMT_BGR24 : PIX_FMT_RGB24;
+		else if (visual->red_mask == 0x0000ff && visual->blue_mask == 0xff0000)
+			*pix_fmt = lsb_first ? PIX_FMT_RGB24 : PIX_FMT_BGR24;
+		break;
+	case 16:
+		if (visual->red_mask == 0xf800 && visual->blue_mask == 0x001f)
+			*pix_fmt = lsb_first ? PIX_FMT_RGB565LE : PIX_FMT_RGB565BE;
+		break;
+	}
+
+	if (*pix_fmt == PIX_FMT_NONE) {
+		fprintf(stderr, "unsupported screen pixel format: %d bits per pixel\n",
+			*bits_per_pixel);
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+static int xcb_shm_source_init_damage(struct xcb_shm_source *source)
+{
+	const xcb_query_extension_reply_t *extension;
+	xcb_damage_query_version_reply_t *version;
+	xcb_generic_error_t *error;
+
+	extension = xcb_get_extension_data(source->connection, &xcb_damage_id);
+	if (extension == NULL || !extension->present) {
+		fprintf(stderr, "the X server has no DAMAGE extension\n");
+		return -ENOTSUP;
+	}
+
+	/* the version has to be negotiated before using the extension */
+	version = xcb_damage_query_version_reply(source->connection,
+						 xcb_damage_query_version(source->connection,
+									  XCB_DAMAGE_MAJOR_VERSION,
+									  XCB_DAMAGE_MINOR_VERSION),
+						 NULL);
+	if (version == NULL) {
+		fprintf(stderr, "cannot query the DAMAGE extension version\n");
+		return -ENOTSUP;
+	}
+	free(version);
+
+	source->damage = xcb_generate_id(source->connection);
+	error = xcb_request_check(source->connection,
+				  xcb_damage_create_checked(source->connection,
+							    source->damage,
+							    source->root,
+							    XCB_DAMAGE_REPORT_LEVEL_BOUNDING_BOX));
+	if (error) {
+		fprintf(stderr, "cannot track the screen damage (error %d)\n",
+			error->error_code);
+		free(error);
+		return -EIO;
+	}
+
+	source->damage_event = extension->first_event + XCB_DAMAGE_NOTIFY;
+
+	/* the first picture is always captured */
+	source->damaged = 1;
+
+	return 0;
+}
+
+static int xcb_shm_source_init_shm(struct xcb_shm_source *source)
+{
+	const xcb_query_extension_reply_t *extension;
+	xcb_shm_query_version_reply_t *version;
+	xcb_generic_error_t *error;
+	int ret;
+
+	extension = xcb_get_extension_data(source->connection, &xcb_shm_id);
+	if (extension == NULL || !extension->present) {
+		fprintf(stderr, "the X server has no MIT-SHM extension\n");
+		return -ENOTSUP;
+	}
+
+	version = xcb_shm_query_version_reply(source->connection,
+					      xcb_shm_query_version(source->connection),
+					      NULL);
+	if (version == NULL) {
+		fprintf(stderr, "cannot query the MIT-SHM extension version\n");
+		return -ENOTSUP;
+	}
+	free(version);
+
+	source->shmid = shmget(IPC_PRIVATE, source->stride * source->height,
+			       IPC_CREAT | 0600);
+	if (source->shmid < 0) {
+		ret = -errno;
+		perror("shmget");
+		return ret;
+	}
+
+	source->data = shmat(source->shmid, NULL, 0);
+	if (source->data == (void *)-1) {
+		ret = -errno;
+		perror("shmat");
+		goto err_remove;
+	}
+
+	source->segment = xcb_generate_id(source->connection);
+	error = xcb_request_check(source->connection,
+				  xcb_shm_attach_checked(source->connection,
+							 source->segment,
+							 source->shmid,
+							 0));
+	if (error) {
+		fprintf(stderr, "the X server cannot attach the shared memory (error %d)\n",
+			error->error_code);
+		free(error);
+		ret = -EIO;
+		goto err_detach;
+	}
+
+	/* The segment goes away when both the X server and we detach it,
+	 * even if the program gets killed.
+	 */
+	shmctl(source->shmid, IPC_RMID, NULL);
+
+	return 0;
+
+err_detach:
+	shmdt(source->data);
+err_remove:
+	shmctl(source->shmid, IPC_RMID, NULL);
+	return ret;
+}
+
+/*
+ * The path has the same syntax used by x11grab:
+ *   [hostname]:display_number.screen_number[+x_offset,y_offset]
+ */
+static int xcb_shm_source_open(void **source_out, const char *path,
+			       AVDictionary **options,
+			       unsigned int width, unsigned int height)
+{
+	struct xcb_shm_source *source;
+	const xcb_setup_t *setup;
+	xcb_screen_t *screen;
+	AVDictionaryEntry *entry;
+	char *display_name;
+	char *offset;
+	int screen_number;
+	int bits_per_pixel;
+	int scanline_pad;
+	int ret;
+
+	source = calloc(1, sizeof(*source));
+	if (source == NULL) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+
+	display_name = strdup(path);
+	if (display_name == NULL) {
+		perror("strdup");
+		ret = -ENOMEM;
+		goto err_free_source;
+	}
+
+	offset = strchr(display_name, '+');
+	if (offset) {
+		*offset++ = '\0';
+		if (sscanf(offset, "%d,%d", &source->x, &source->y) != 2 ||
+		    source->x < 0 || source->y < 0) {
+			fprintf(stderr, "invalid screen offset: %s\n", offset);
+			ret = -EINVAL;
+			goto err_free_display_name;
+		}
+	}
+
+	source->width = width;
+	source->height = height;
+	entry = av_dict_get(*options, "video_size", NULL, 0);
+	if (entry && av_parse_video_size(&source->width, &source->height, entry->value) < 0) {
+		fprintf(stderr, "invalid video size: %s\n", entry->value);
+		ret = -EINVAL;
+		goto err_free_display_name;
+	}
+
+	ret = video_source_get_frame_interval(*options, 60, &source->frame_interval);
+	if (ret < 0)
+		goto err_free_display_name;
+
+	source->use_damage = 1;
+	entry = av_dict_get(*options, "damage", NULL, 0);
+	if (entry)
+		source->use_damage = atoi(entry->value);
+
+	source->connection = xcb_connect(display_name, &screen_number);
+	if (xcb_connection_has_error(source->connection)) {
+		fprintf(stderr, "cannot open a connection to %s\n", display_name);
+		ret = -EINVAL;
+		goto err_disconnect;
+	}
+
+	setup = xcb_get_setup(source->connection);
+	screen = get_screen(setup, screen_number);
+	if (screen == NULL) {
+		fprintf(stderr, "cannot find screen %d on %s\n", screen_number, display_name);
+		ret = -EINVAL;
+		goto err_disconnect;
+	}
+	source->root = screen->root;
+
+	/* Capture only the area which fits on the screen */
+	if (source->x >= screen->width_in_pixels ||
+	    source->y >= screen->height_in_pixels) {
+		fprintf(stderr, "the capture area is outside the screen\n");
+		ret = -EINVAL;
+		goto err_disconnect;
+	}
+	if (source->x + source->width > screen->width_in_pixels)
+		source->width = screen->width_in_pixels - source->x;
+	if (source->y + source->height > screen->height_in_pixels)
+		source->height = screen->height_in_pixels - source->y;
+
+	ret = get_pixel_format(setup, screen, &bits_per_pixel, &scanline_pad, &source->pix_fmt);
+	if (ret < 0)
+		goto err_disconnect;
+
+	/* lines in a Z pixmap are padded to scanline_pad bits */
+	source->stride = ((source->width * bits_per_pixel + scanline_pad - 1) /
+			  scanline_pad) * scanline_pad / 8;
+
+	ret = xcb_shm_source_init_shm(source);
+	if (ret < 0)
+		goto err_disconnect;
+
+	if (source->use_damage) {
+		ret = xcb_shm_source_init_damage(source);
+		if (ret < 0)
+			goto err_cleanup_shm;
+	}
+
+	fprintf(stdout, "capturing %dx%d at +%d,%d from %s%s\n",
+		source->width, source->height, source->x, source->y,
+		display_name, source->use_damage ? " when it changes" : "");
+
+	free(display_name);
+	*source_out = source;
+	return 0;
+
+err_cleanup_shm:
+	xcb_shm_detach(source->connection, source->segment);
+	shmdt(source->data);
+err_disconnect:
+	xcb_disconnect(source->connection);
+err_free_display_name:
+	free(display_name);
+err_free_source:
+	free(source);
+	return ret;
+}
+
+static void xcb_shm_source_get_format(void *source_ptr, int *width, int *height,
+				      enum PixelFormat *pix_fmt, enum CodecID *codec_id)
+{
+	struct xcb_shm_source *source = source_ptr;
+
+	*width = source->width;
+	*height = source->height;
+	*pix_fmt = source->pix_fmt;
+	*codec_id = CODEC_ID_RAWVIDEO;
+}
+
+static int rectangle_intersects(const xcb_rectangle_t *rect, struct xcb_shm_source *source)
+{
+	return rect->x < source->x + source->width &&
+	       rect->x + rect->width > source->x &&
+	       rect->y < source->y + source->height &&
+	       rect->y + rect->height > source->y;
+}
+
+/* Wait for some damage to happen in the captured area */
+static int xcb_shm_source_wait_damage(struct xcb_shm_source *source)
+{
+	xcb_generic_event_t *event;
+	xcb_damage_notify_event_t *notify;
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = xcb_get_file_descriptor(source->connection);
+	pfd.events = POLLIN;
+
+	while (!source->damaged) {
+		event = xcb_poll_for_event(source->connection);
+		if (event == NULL) {
+			if (xcb_connection_has_error(source->connection)) {
+				fprintf(stderr, "the connection to the X server has been lost\n");
+				return -EIO;
+			}
+
+			ret = poll(&pfd, 1, XCB_SHM_DAMAGE_TIMEOUT);
+			if (ret < 0 && errno != EINTR) {
+				ret = -errno;
+				perror("poll");
+				return ret;
+			} else if (ret <= 0) {
+				return -EAGAIN;
+			}
+			continue;
+		}
+
+		if ((event->response_type & ~0x80) == source->damage_event) {
+			notify = (xcb_damage_notify_event_t *)event;
+			if (rectangle_intersects(&notify->area, source))
+				source->damaged = 1;
+			else
+				/* With BOUNDING_BOX the server only notifies
+				 * when the damaged area grows, start again
+				 * so that changes in the captured area are
+				 * not covered by the damage around it. */
+				xcb_damage_subtract(source->connection, source->damage,
+						    XCB_NONE, XCB_NONE);
+		}
+		free(event);
+	}
+
+	return 0;
+}
+
+static int xcb_shm_source_read(void *source_ptr, struct video_source_picture *picture)
+{
+	struct xcb_shm_source *source = source_ptr;
+	xcb_shm_get_image_reply_t *reply;
+	xcb_generic_error_t *error = NULL;
+	int ret;
+
+	if (source->use_damage) {
+		ret = xcb_shm_source_wait_damage(source);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* Don't capture more often than the frame rate, changes happening
+	 * in the meantime end up in the next picture anyway */
+	video_source_throttle(&source->next_capture, source->frame_interval);
+
+	/* everything damaged from now on goes in the next picture */
+	if (source->use_damage) {
+		xcb_damage_subtract(source->connection, source->damage,
+				    XCB_NONE, XCB_NONE);
+		source->damaged = 0;
+	}
+
+	reply = xcb_shm_get_image_reply(source->connection,
+					xcb_shm_get_image(source->connection,
+							  source->root,
+							  source->x, source->y,
+							  source->width, source->height,
+							  ~0,
+							  XCB_IMAGE_FORMAT_Z_PIXMAP,
+							  source->segment,
+							  0),
+					&error);
+	if (error) {
+		fprintf(stderr, "cannot capture the screen (error %d)\n", error->error_code);
+		free(error);
+		return -EIO;
+	}
+	free(reply);
+
+	memset(picture, 0, sizeof(*picture));
+	picture->data[0] = source->data;
+	picture->linesize[0] = source->stride;
+	picture->size = source->stride * source->height;
+
+	return 1;
+}
+
+static void xcb_shm_source_release(void *source, struct video_source_picture *picture)
+{
+	/* the segment is just overwritten by the next capture */
+	(void) source;
+	(void) picture;
+}
+
+static void xcb_shm_source_close(void *source_ptr)
+{
+	struct xcb_shm_source *source = source_ptr;
+
+	if (source->use_damage)
+		xcb_damage_destroy(source->connection, source->damage);
+	xcb_shm_detach(source->connection, source->segment);
+	xcb_flush(source->connection);
+	shmdt(source->data);
+	xcb_disconnect(source->connection);
+	free(source);
+}
+
+const struct video_source_ops xcb_shm_source_ops = {
+	.name = "xcbshm",
+	.open = xcb_shm_source_open,
+	.get_format = xcb_shm_source_get_format,
+	.read = xcb_shm_source_read,
+	.release = xcb_shm_source_release,
+	.close = xcb_shm_source_close,
+};
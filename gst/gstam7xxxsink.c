@@ -0,0 +1,421 @@
+/*
+ * am7xxxsink - GStreamer video sink for am7xxx devices
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * am7xxxsink shows JPEG or NV12 frames on am7xxx devices, the frames must
+ * already have the native size of the device: scaling and encoding are left
+ * to the other elements of the pipeline, for instance:
+ *
+ *   gst-launch-1.0 videotestsrc ! videoscale ! videoconvert ! \
+ *     video/x-raw,format=NV12 ! am7xxxsink
+ *
+ *   gst-launch-1.0 videotestsrc ! videoscale ! jpegenc ! am7xxxsink
+ *
+ * The frames are sent straight from the memory of the buffers, and the time
+ * the device takes to get a frame is reported as latency, so that the frames
+ * which would be late are dropped, and upstream elements get told about
+ * that with QoS events.
+ */
+
+#include <string.h>
+
+#include "gstam7xxxsink.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_am7xxx_sink_debug);
+#define GST_CAT_DEFAULT gst_am7xxx_sink_debug
+
+enum {
+	PROP_0,
+	PROP_DEVICE_INDEX,
+	PROP_POWER_MODE,
+	PROP_ZOOM_MODE,
+};
+
+#define DEFAULT_DEVICE_INDEX 0
+#define DEFAULT_POWER_MODE AM7XXX_POWER_LOW
+#define DEFAULT_ZOOM_MODE AM7XXX_ZOOM_ORIGINAL
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE("sink",
+	GST_PAD_SINK,
+	GST_PAD_ALWAYS,
+	GST_STATIC_CAPS("image/jpeg, "
+			"width = (int) [ 1, MAX ], "
+			"height = (int) [ 1, MAX ], "
+			"framerate = (fraction) [ 0, MAX ]; "
+			GST_VIDEO_CAPS_MAKE("NV12")));
+
+#define gst_am7xxx_sink_parent_class parent_class
+G_DEFINE_TYPE(GstAm7xxxSink, gst_am7xxx_sink, GST_TYPE_VIDEO_SINK);
+
+static void gst_am7xxx_sink_set_property(GObject *object, guint prop_id,
+					 const GValue *value, GParamSpec *pspec)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(object);
+
+	/* the modes are applied by the streaming thread, between frames */
+	GST_OBJECT_LOCK(sink);
+	switch (prop_id) {
+	case PROP_DEVICE_INDEX:
+		sink->device_index = g_value_get_uint(value);
+		break;
+	case PROP_POWER_MODE:
+		sink->power_mode = g_value_get_int(value);
+		sink->modes_changed = TRUE;
+		break;
+	case PROP_ZOOM_MODE:
+		sink->zoom_mode = g_value_get_int(value);
+		sink->modes_changed = TRUE;
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+	GST_OBJECT_UNLOCK(sink);
+}
+
+static void gst_am7xxx_sink_get_property(GObject *object, guint prop_id,
+					 GValue *value, GParamSpec *pspec)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(object);
+
+	GST_OBJECT_LOCK(sink);
+	switch (prop_id) {
+	case PROP_DEVICE_INDEX:
+		g_value_set_uint(value, sink->device_index);
+		break;
+	case PROP_POWER_MODE:
+		g_value_set_int(value, sink->power_mode);
+		break;
+	case PROP_ZOOM_MODE:
+		g_value_set_int(value, sink->zoom_mode);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+	GST_OBJECT_UNLOCK(sink);
+}
+
+static int gst_am7xxx_sink_apply_modes(GstAm7xxxSink *sink)
+{
+	gint power_mode;
+	gint zoom_mode;
+	int ret;
+
+	GST_OBJECT_LOCK(sink);
+	power_mode = sink->power_mode;
+	zoom_mode = sink->zoom_mode;
+	sink->modes_changed = FALSE;
+	GST_OBJECT_UNLOCK(sink);
+
+	ret = am7xxx_set_zoom_mode(sink->dev, zoom_mode);
+	if (ret < 0) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, SETTINGS,
+				  ("Could not set the zoom mode"),
+				  ("am7xxx_set_zoom_mode failed: %d", ret));
+		return ret;
+	}
+
+	ret = am7xxx_set_power_mode(sink->dev, power_mode);
+	if (ret < 0) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, SETTINGS,
+				  ("Could not set the power mode"),
+				  ("am7xxx_set_power_mode failed: %d", ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static gboolean gst_am7xxx_sink_start(GstBaseSink *bsink)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(bsink);
+	am7xxx_device_info device_info;
+	int ret;
+
+	ret = am7xxx_init(&sink->ctx);
+	if (ret < 0) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, FAILED,
+				  ("Could not initialize libam7xxx"),
+				  ("am7xxx_init failed: %d", ret));
+		sink->ctx = NULL;
+		return FALSE;
+	}
+
+	ret = am7xxx_open_device(sink->ctx, &sink->dev, sink->device_index);
+	if (ret < 0) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, NOT_FOUND,
+				  ("Could not open am7xxx device %u", sink->device_index),
+				  ("am7xxx_open_device failed: %d", ret));
+		goto err;
+	}
+
+	ret = am7xxx_get_device_info(sink->dev, &device_info);
+	if (ret < 0) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, READ,
+				  ("Could not get the device information"),
+				  ("am7xxx_get_device_info failed: %d", ret));
+		goto err;
+	}
+	sink->native_width = device_info.native_width;
+	sink->native_height = device_info.native_height;
+
+	ret = gst_am7xxx_sink_apply_modes(sink);
+	if (ret < 0)
+		goto err;
+
+	GST_DEBUG_OBJECT(sink, "device %u opened, native resolution %ux%u",
+			 sink->device_index, sink->native_width, sink->native_height);
+
+	sink->render_delay = 0;
+	gst_base_sink_set_render_delay(bsink, 0);
+
+	return TRUE;
+
+err:
+	am7xxx_shutdown(sink->ctx);
+	sink->ctx = NULL;
+	sink->dev = NULL;
+	return FALSE;
+}
+
+static gboolean gst_am7xxx_sink_stop(GstBaseSink *bsink)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(bsink);
+
+	/* the devices get closed too */
+	if (sink->ctx)
+		am7xxx_shutdown(sink->ctx);
+	sink->ctx = NULL;
+	sink->dev = NULL;
+
+	return TRUE;
+}
+
+/* Once the device is open only its native size is accepted */
+static GstCaps *gst_am7xxx_sink_get_caps(GstBaseSink *bsink, GstCaps *filter)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(bsink);
+	GstCaps *caps;
+	GstCaps *tmp;
+	guint i;
+
+	caps = gst_pad_get_pad_template_caps(GST_BASE_SINK_PAD(bsink));
+
+	GST_OBJECT_LOCK(sink);
+	if (sink->dev) {
+		caps = gst_caps_make_writable(caps);
+		for (i = 0; i < gst_caps_get_size(caps); i++)
+			gst_structure_set(gst_caps_get_structure(caps, i),
+					  "width", G_TYPE_INT, (gint)sink->native_width,
+					  "height", G_TYPE_INT, (gint)sink->native_height,
+					  NULL);
+	}
+	GST_OBJECT_UNLOCK(sink);
+
+	if (filter) {
+		tmp = gst_caps_intersect_full(filter, caps, GST_CAPS_INTERSECT_FIRST);
+		gst_caps_unref(caps);
+		caps = tmp;
+	}
+
+	return caps;
+}
+
+static gboolean gst_am7xxx_sink_set_caps(GstBaseSink *bsink, GstCaps *caps)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(bsink);
+	GstStructure *structure;
+	GstVideoInfo info;
+	gint width;
+	gint height;
+
+	structure = gst_caps_get_structure(caps, 0);
+
+	if (gst_structure_has_name(structure, "image/jpeg")) {
+		if (!gst_structure_get_int(structure, "width", &width) ||
+		    !gst_structure_get_int(structure, "height", &height))
+			return FALSE;
+		sink->format = AM7XXX_IMAGE_FORMAT_JPEG;
+		sink->frame_size = 0;
+	} else {
+		if (!gst_video_info_from_caps(&info, caps))
+			return FALSE;
+
+		width = GST_VIDEO_INFO_WIDTH(&info);
+		height = GST_VIDEO_INFO_HEIGHT(&info);
+
+		/* the device wants the planes packed with no padding */
+		if (GST_VIDEO_INFO_PLANE_STRIDE(&info, 0) != width ||
+		    GST_VIDEO_INFO_PLANE_OFFSET(&info, 1) != (gsize)(width * height)) {
+			GST_ERROR_OBJECT(sink, "unsupported NV12 layout for %dx%d", width, height);
+			return FALSE;
+		}
+		sink->format = AM7XXX_IMAGE_FORMAT_NV12;
+		sink->frame_size = width * height * 3 / 2;
+	}
+
+	GST_VIDEO_SINK_WIDTH(sink) = width;
+	GST_VIDEO_SINK_HEIGHT(sink) = height;
+
+	GST_DEBUG_OBJECT(sink, "sending %s frames of %dx%d",
+			 sink->format == AM7XXX_IMAGE_FORMAT_JPEG ? "JPEG" : "NV12",
+			 width, height);
+
+	return TRUE;
+}
+
+/*
+ * Sync the frames earlier by the time it takes to send them, and tell the
+ * pipeline about the new latency, when that grows.
+ */
+static void gst_am7xxx_sink_update_render_delay(GstAm7xxxSink *sink,
+						GstClockTime elapsed)
+{
+	if (elapsed <= sink->render_delay)
+		return;
+
+	/* some margin, not to post a message for each small increase */
+	sink->render_delay = elapsed + elapsed / 4;
+	gst_base_sink_set_render_delay(GST_BASE_SINK(sink), sink->render_delay);
+
+	GST_DEBUG_OBJECT(sink, "render delay now %" GST_TIME_FORMAT,
+			 GST_TIME_ARGS(sink->render_delay));
+
+	gst_element_post_message(GST_ELEMENT(sink),
+				 gst_message_new_latency(GST_OBJECT(sink)));
+}
+
+static GstFlowReturn gst_am7xxx_sink_show_frame(GstVideoSink *vsink, GstBuffer *buf)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(vsink);
+	GstMapInfo map;
+	GstClockTime start;
+	gsize size;
+	int ret;
+
+	if (sink->modes_changed && gst_am7xxx_sink_apply_modes(sink) < 0)
+		return GST_FLOW_ERROR;
+
+	if (!gst_buffer_map(buf, &map, GST_MAP_READ)) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, READ,
+				  ("Could not map the buffer"), (NULL));
+		return GST_FLOW_ERROR;
+	}
+
+	/* JPEG frames have variable size, NV12 buffers can have padding */
+	size = map.size;
+	if (sink->frame_size && size > sink->frame_size)
+		size = sink->frame_size;
+
+	/* no copy, the frame goes to the device from the buffer memory */
+	start = gst_util_get_timestamp();
+	ret = am7xxx_send_image(sink->dev,
+				sink->format,
+				GST_VIDEO_SINK_WIDTH(sink),
+				GST_VIDEO_SINK_HEIGHT(sink),
+				map.data,
+				(unsigned int)size);
+	gst_buffer_unmap(buf, &map);
+
+	if (ret < 0) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+				  ("Could not send the frame to the device"),
+				  ("am7xxx_send_image failed: %d", ret));
+		return GST_FLOW_ERROR;
+	}
+
+	gst_am7xxx_sink_update_render_delay(sink, gst_util_get_timestamp() - start);
+
+	return GST_FLOW_OK;
+}
+
+static void gst_am7xxx_sink_class_init(GstAm7xxxSinkClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+	GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS(klass);
+	GstVideoSinkClass *videosink_class = GST_VIDEO_SINK_CLASS(klass);
+
+	gobject_class->set_property = gst_am7xxx_sink_set_property;
+	gobject_class->get_property = gst_am7xxx_sink_get_property;
+
+	g_object_class_install_property(gobject_class, PROP_DEVICE_INDEX,
+		g_param_spec_uint("device-index", "Device index",
+				  "The index of the am7xxx device to use",
+				  0, G_MAXUINT, DEFAULT_DEVICE_INDEX,
+				  G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POWER_MODE,
+		g_param_spec_int("power-mode", "Power mode",
+				 "The power mode of the device, between 0 (off) and 4 (turbo), "
+				 "2 and greater need both the USB connectors plugged in",
+				 AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO, DEFAULT_POWER_MODE,
+				 G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_ZOOM_MODE,
+		g_param_spec_int("zoom-mode", "Zoom mode",
+				 "The display zoom mode, between 0 (original) and 3 (test)",
+				 AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TEST, DEFAULT_ZOOM_MODE,
+				 G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	gst_element_class_set_static_metadata(element_class,
+		"am7xxx video sink", "Sink/Video",
+		"Shows JPEG or NV12 frames on Actions Micro AM7XXX based projectors",
+		"Antonio Ospite <ospite@studenti.unina.it>");
+
+	gst_element_class_add_pad_template(element_class,
+		gst_static_pad_template_get(&sink_template));
+
+	basesink_class->start = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_start);
+	basesink_class->stop = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_stop);
+	basesink_class->get_caps = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_get_caps);
+	basesink_class->set_caps = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_set_caps);
+
+	videosink_class->show_frame = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_show_frame);
+}
+
+static void gst_am7xxx_sink_init(GstAm7xxxSink *sink)
+{
+	sink->device_index = DEFAULT_DEVICE_INDEX;
+	sink->power_mode = DEFAULT_POWER_MODE;
+	sink->zoom_mode = DEFAULT_ZOOM_MODE;
+
+	/* late frames are dropped here, and upstream is told to skip them */
+	gst_base_sink_set_qos_enabled(GST_BASE_SINK(sink), TRUE);
+}
+
+static gboolean plugin_init(GstPlugin *plugin)
+{
+	GST_DEBUG_CATEGORY_INIT(gst_am7xxx_sink_debug, "am7xxxsink", 0,
+				"am7xxx video sink");
+
+	return gst_element_register(plugin, "am7xxxsink", GST_RANK_NONE,
+				    GST_TYPE_AM7XXX_SINK);
+}
+
+GST_PLUGIN_DEFINE(GST_VERSION_MAJOR,
+		  GST_VERSION_MINOR,
+		  am7xxx,
+		  "Elements for Actions Micro AM7XXX based projectors",
+		  plugin_init,
+		  VERSION,
+		  "GPL",
+		  PACKAGE,
+		  "http://git.ao2.it/libam7xxx.git")
@@ -0,0 +1,74 @@
+/*
+ * am7xxxsink - GStreamer video sink for am7xxx devices
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_AM7XXX_SINK_H
+#define __GST_AM7XXX_SINK_H
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideosink.h>
+
+#include <am7xxx.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_AM7XXX_SINK \
+	(gst_am7xxx_sink_get_type())
+#define GST_AM7XXX_SINK(obj) \
+	(G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_AM7XXX_SINK, GstAm7xxxSink))
+#define GST_AM7XXX_SINK_CLASS(klass) \
+	(G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_AM7XXX_SINK, GstAm7xxxSinkClass))
+#define GST_IS_AM7XXX_SINK(obj) \
+	(G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_AM7XXX_SINK))
+#define GST_IS_AM7XXX_SINK_CLASS(klass) \
+	(G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_AM7XXX_SINK))
+
+typedef struct _GstAm7xxxSink GstAm7xxxSink;
+typedef struct _GstAm7xxxSinkClass GstAm7xxxSinkClass;
+
+struct _GstAm7xxxSink {
+	GstVideoSink parent;
+
+	/* properties */
+	guint device_index;
+	gint power_mode;
+	gint zoom_mode;
+	gboolean modes_changed;
+
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	guint native_width;
+	guint native_height;
+
+	am7xxx_image_format format;
+	gsize frame_size;
+
+	/* how long sending a frame to the device takes */
+	GstClockTime render_delay;
+};
+
+struct _GstAm7xxxSinkClass {
+	GstVideoSinkClass parent_class;
+};
+
+GType gst_am7xxx_sink_get_type(void);
+
+G_END_DECLS
+
+#endif /* __GST_AM7XXX_SINK_H */
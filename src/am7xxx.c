@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 #include <libusb.h>
 #include <math.h>
 
@@ -64,6 +65,17 @@ static void log_message(am7xxx_context *ctx,
 #define debug(ctx, ...)   log_message(ctx,  AM7XXX_LOG_DEBUG,   __func__, 0,        __VA_ARGS__)
 #define trace(ctx, ...)   log_message(ctx,  AM7XXX_LOG_TRACE,   NULL,     0,        __VA_ARGS__)
 
+/* USDT probes, see HACKING.asciidoc; each one is just a nop instruction
+ * until a tracer attaches to it.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define probe(name, dev, packet_type, len, status) \
+	DTRACE_PROBE4(libam7xxx, name, dev, packet_type, len, status)
+#else
+#define probe(name, dev, packet_type, len, status) do {} while (0)
+#endif
+
 #define AM7XXX_QUIRK_NO_POWER_MODE (1 << 0)
 #define AM7XXX_QUIRK_NO_ZOOM_MODE  (1 << 1)
 
@@ -122,21 +134,87 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 	},
 };
 
+/* Some devices show up as USB mass storage devices first, and become
+ * projectors only after getting this command, see am7xxx_init_modeswitch()
+ */
+#define AM7XXX_STORAGE_VID           0x1de1
+#define AM7XXX_STORAGE_PID           0x1101
+#define AM7XXX_STORAGE_CONFIGURATION 1
+#define AM7XXX_STORAGE_INTERFACE     0
+#define AM7XXX_STORAGE_OUT_EP        0x01
+
+static unsigned char switch_command[] =
+	"\x55\x53\x42\x43\x08\x70\x52\x89\x00\x00\x00\x00\x00\x00"
+	"\x0c\xff\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+
 /* The header size on the wire is known to be always 24 bytes, regardless of
  * the memory configuration enforced by different architectures or compilers
  * for struct am7xxx_header
  */
 #define AM7XXX_HEADER_WIRE_SIZE 24
 
+/* The state of a payload being sent in chunks, see am7xxx_set_chunking() */
+struct am7xxx_chunks {
+	unsigned int size;
+	unsigned int depth;
+	struct libusb_transfer **transfers;
+
+	uint8_t *buffer;
+	int free_buffer;
+	int async;
+	unsigned int len;
+	unsigned int queued;
+	unsigned int in_flight;
+	int status;
+	int queued_all;
+	int completed;
+};
+
 struct _am7xxx_device {
 	libusb_device_handle *usb_device;
 	struct libusb_transfer *transfer;
 	int transfer_completed;
+	int transfer_status;
+	struct am7xxx_chunks chunks;
+	am7xxx_image_sent_callback image_sent_callback;
+	void *image_sent_callback_data;
+	/* called once the pending async image is sent, see
+	 * am7xxx_send_image_async_nocopy() */
+	am7xxx_image_sent_callback transfer_callback;
+	void *transfer_callback_data;
 	uint8_t buffer[AM7XXX_HEADER_WIRE_SIZE];
+	/* the type of the last header sent, the data which follows it
+	 * belongs to the same packet, only used by the probes */
+	uint32_t packet_type;
 	am7xxx_device_info *device_info;
 	am7xxx_context *ctx;
 	const struct am7xxx_usb_device_descriptor *desc;
 	am7xxx_device *next;
+
+	/* how to find the same device again after losing it, see
+	 * reconnect_device() */
+	uint8_t bus_number;
+	uint8_t port_numbers[7];
+	int port_numbers_len;
+	unsigned char serial[64];
+	int lost;
+	uint64_t lost_time;
+	unsigned int reconnect_timeout;
+
+	/* the modes to restore after a reconnection, -1 when never set */
+	int power_mode;
+	int zoom_mode;
+};
+
+struct _am7xxx_frame {
+	int refcount;
+	am7xxx_image_format format;
+	unsigned int width;
+	unsigned int height;
+	uint8_t *data;
+	unsigned int size;
+	am7xxx_frame_release_callback release;
+	void *release_data;
 };
 
 struct _am7xxx_context {
@@ -340,44 +418,47 @@ static void trace_dump_buffer(am7xxx_context *ctx, const char *message,
 }
 #endif /* DEBUG */
 
-static int read_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+/* In milliseconds, to measure how long a device has been away */
+static uint64_t monotonic_time_ms(void)
 {
-	int ret;
-	int transferred = 0;
+	struct timespec ts;
 
-	ret = libusb_bulk_transfer(dev->usb_device, 0x81, buffer, len, &transferred, 0);
-	if (ret != 0 || (unsigned int)transferred != len) {
-		error(dev->ctx, "ret: %d\ttransferred: %d (expected %u)\n",
-		      ret, transferred, len);
-		return ret;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	trace_dump_buffer(dev->ctx, "<-- received", buffer, len);
+static void device_lost(am7xxx_device *dev)
+{
+	if (dev->lost)
+		return;
 
-	return 0;
+	warning(dev->ctx, "device lost\n");
+	dev->lost = 1;
+	dev->lost_time = monotonic_time_ms();
 }
 
-static int send_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+static int read_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
 {
 	int ret;
 	int transferred = 0;
 
-	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
-
-	ret = libusb_bulk_transfer(dev->usb_device, 0x1, buffer, len, &transferred, 0);
+	ret = libusb_bulk_transfer(dev->usb_device, 0x81, buffer, len, &transferred, 0);
+	if (ret == LIBUSB_ERROR_NO_DEVICE)
+		device_lost(dev);
 	if (ret != 0 || (unsigned int)transferred != len) {
 		error(dev->ctx, "ret: %d\ttransferred: %d (expected %u)\n",
 		      ret, transferred, len);
 		return ret;
 	}
 
+	trace_dump_buffer(dev->ctx, "<-- received", buffer, len);
+
 	return 0;
 }
 
-static void send_data_async_complete_cb(struct libusb_transfer *transfer)
+static int transfer_status_to_error(am7xxx_device *dev,
+				    struct libusb_transfer *transfer)
 {
-	am7xxx_device *dev = (am7xxx_device *)(transfer->user_data);
-	int *completed = &(dev->transfer_completed);
 	int transferred = transfer->actual_length;
 	int ret;
 
@@ -400,6 +481,7 @@ static void send_data_async_complete_cb(struct libusb_transfer *transfer)
 		ret = LIBUSB_ERROR_OVERFLOW;
 		break;
 	case LIBUSB_TRANSFER_NO_DEVICE:
+		device_lost(dev);
 		ret = LIBUSB_ERROR_NO_DEVICE;
 		break;
 	case LIBUSB_TRANSFER_ERROR:
@@ -415,55 +497,350 @@ static void send_data_async_complete_cb(struct libusb_transfer *transfer)
 		error(dev->ctx, "libusb transfer failed: %s",
 		      libusb_error_name(ret));
 
+	return ret;
+}
+
+static void notify_image_sent(am7xxx_device *dev, int status)
+{
+	if (dev->image_sent_callback)
+		dev->image_sent_callback(dev, status,
+					 dev->image_sent_callback_data);
+}
+
+static void async_image_sent(am7xxx_device *dev, int status)
+{
+	am7xxx_image_sent_callback callback = dev->transfer_callback;
+
+	dev->transfer_status = status;
+	dev->transfer_callback = NULL;
+
+	notify_image_sent(dev, status);
+
+	/* the caller gets the image buffer back */
+	if (callback)
+		callback(dev, status, dev->transfer_callback_data);
+}
+
+/*
+ * Payloads bigger than the chunk size are sent with several transfers of
+ * chunk size bytes each, at most 'depth' of them are in flight at any
+ * time and a new one is queued as soon as one completes, the payload has
+ * been sent when the last chunk completes.
+ */
+static int submit_chunk(am7xxx_device *dev, struct libusb_transfer *transfer);
+
+static void send_chunks_done(am7xxx_device *dev)
+{
+	struct am7xxx_chunks *chunks = &(dev->chunks);
+
+	/* the buffer is the copy made for an async payload */
+	if (chunks->free_buffer)
+		free(chunks->buffer);
+	chunks->buffer = NULL;
+	chunks->queued_all = 1;
+	chunks->completed = 1;
+
+	if (chunks->async)
+		async_image_sent(dev, chunks->status);
+}
+
+static void send_chunk_complete_cb(struct libusb_transfer *transfer)
+{
+	am7xxx_device *dev = (am7xxx_device *)(transfer->user_data);
+	struct am7xxx_chunks *chunks = &(dev->chunks);
+	int ret;
+
+	chunks->in_flight--;
+
+	ret = transfer_status_to_error(dev, transfer);
+	probe(send_chunk_complete, dev, dev->packet_type,
+	      transfer->actual_length, ret);
+	if (ret < 0 && chunks->status == 0)
+		chunks->status = ret;
+
+	/* keep the queue full, the transfer can be reused right away */
+	if (chunks->status == 0 && chunks->queued < chunks->len) {
+		ret = submit_chunk(dev, transfer);
+		if (ret < 0)
+			chunks->status = ret;
+	}
+
+	/* after an error the rest of the payload is not sent */
+	if (chunks->status < 0)
+		chunks->queued_all = 1;
+
+	if (chunks->in_flight == 0)
+		send_chunks_done(dev);
+}
+
+static int submit_chunk(am7xxx_device *dev, struct libusb_transfer *transfer)
+{
+	struct am7xxx_chunks *chunks = &(dev->chunks);
+	unsigned int len;
+	int ret;
+
+	len = chunks->len - chunks->queued;
+	if (len > chunks->size)
+		len = chunks->size;
+
+	libusb_fill_bulk_transfer(transfer, dev->usb_device, 0x1,
+				  chunks->buffer + chunks->queued, len,
+				  send_chunk_complete_cb, dev, 0);
+
+	ret = libusb_submit_transfer(transfer);
+	probe(send_chunk_submit, dev, dev->packet_type, len, ret);
+	if (ret == LIBUSB_ERROR_NO_DEVICE)
+		device_lost(dev);
+	if (ret < 0) {
+		error(dev->ctx, "cannot submit chunk: %s\n",
+		      libusb_error_name(ret));
+		return ret;
+	}
+
+	chunks->queued += len;
+	chunks->in_flight++;
+	if (chunks->queued == chunks->len)
+		chunks->queued_all = 1;
+
+	return 0;
+}
+
+static void wait_for_chunks(am7xxx_device *dev, int *condition)
+{
+	int cancelled = 0;
+	unsigned int i;
+	int ret;
+
+	while (!*condition) {
+		ret = libusb_handle_events_completed(dev->ctx->usb_context,
+						     condition);
+		if (ret < 0) {
+			if (ret == LIBUSB_ERROR_INTERRUPTED || cancelled)
+				continue;
+			error(dev->ctx, "libusb_handle_events failed: %s, cancelling transfers and retrying",
+			      libusb_error_name(ret));
+			for (i = 0; i < dev->chunks.depth; i++)
+				libusb_cancel_transfer(dev->chunks.transfers[i]);
+			cancelled = 1;
+			continue;
+		}
+	}
+}
+
+/* Nothing else can be queued on the endpoint before the last chunk */
+static inline void wait_for_chunks_queued(am7xxx_device *dev)
+{
+	wait_for_chunks(dev, &(dev->chunks.queued_all));
+}
+
+static inline void wait_for_chunks_completed(am7xxx_device *dev)
+{
+	wait_for_chunks(dev, &(dev->chunks.completed));
+}
+
+/* The buffer is freed when all the chunks are sent, if free_buffer is set */
+static int send_data_chunked(am7xxx_device *dev, uint8_t *buffer,
+			     unsigned int len, int free_buffer, int async)
+{
+	struct am7xxx_chunks *chunks = &(dev->chunks);
+	unsigned int i;
+	int ret;
+
+	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
+
+	chunks->buffer = buffer;
+	chunks->free_buffer = free_buffer;
+	chunks->async = async;
+	chunks->len = len;
+	chunks->queued = 0;
+	chunks->in_flight = 0;
+	chunks->status = 0;
+	chunks->queued_all = 0;
+	chunks->completed = 0;
+
+	for (i = 0; i < chunks->depth && chunks->queued < len; i++) {
+		ret = submit_chunk(dev, chunks->transfers[i]);
+		if (ret < 0) {
+			chunks->status = ret;
+			chunks->queued_all = 1;
+			break;
+		}
+	}
+
+	if (chunks->in_flight == 0)
+		send_chunks_done(dev);
+
+	return chunks->status;
+}
+
+static void free_chunk_transfers(am7xxx_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->chunks.depth; i++)
+		libusb_free_transfer(dev->chunks.transfers[i]);
+	free(dev->chunks.transfers);
+	dev->chunks.transfers = NULL;
+	dev->chunks.depth = 0;
+	dev->chunks.size = 0;
+}
+
+static int send_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+{
+	int ret;
+	int transferred = 0;
+
+	probe(send_data_entry, dev, dev->packet_type, len, 0);
+
+	wait_for_chunks_queued(dev);
+
+	if (dev->chunks.size && len > dev->chunks.size) {
+		/* the transfers may still be used by the previous payload */
+		wait_for_chunks_completed(dev);
+		send_data_chunked(dev, buffer, len, 0, 0);
+		wait_for_chunks_completed(dev);
+		ret = dev->chunks.status;
+		goto out;
+	}
+
+	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
+
+	ret = libusb_bulk_transfer(dev->usb_device, 0x1, buffer, len, &transferred, 0);
+	if (ret == LIBUSB_ERROR_NO_DEVICE)
+		device_lost(dev);
+	if (ret != 0 || (unsigned int)transferred != len) {
+		error(dev->ctx, "ret: %d\ttransferred: %d (expected %u)\n",
+		      ret, transferred, len);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	probe(send_data_return, dev, dev->packet_type, len, ret);
+	return ret;
+}
+
+static void send_data_async_complete_cb(struct libusb_transfer *transfer)
+{
+	am7xxx_device *dev = (am7xxx_device *)(transfer->user_data);
+	int *completed = &(dev->transfer_completed);
+	int ret;
+
+	ret = transfer_status_to_error(dev, transfer);
+	probe(send_data_async_complete, dev, dev->packet_type,
+	      transfer->actual_length, ret);
+
 	libusb_free_transfer(transfer);
 	transfer = NULL;
 
 	*completed = 1;
+
+	async_image_sent(dev, ret);
 }
 
 static inline void wait_for_trasfer_completed(am7xxx_device *dev)
 {
+	int cancelled = 0;
+
+	probe(wait_for_transfer_entry, dev, dev->packet_type,
+	      dev->transfer_completed ? 0 : dev->transfer->length, 0);
+
+	/* the transfer gets cancelled only once, then it is just a matter
+	 * of waiting for its completion */
 	while (!dev->transfer_completed) {
 		int ret = libusb_handle_events_completed(dev->ctx->usb_context,
 							 &(dev->transfer_completed));
 		if (ret < 0) {
-			if (ret == LIBUSB_ERROR_INTERRUPTED)
+			if (ret == LIBUSB_ERROR_INTERRUPTED || cancelled)
 				continue;
 			error(dev->ctx, "libusb_handle_events failed: %s, cancelling transfer and retrying",
 			      libusb_error_name(ret));
 			libusb_cancel_transfer(dev->transfer);
+			cancelled = 1;
 			continue;
 		}
 	}
+
+	probe(wait_for_transfer_return, dev, dev->packet_type, 0,
+	      dev->transfer_status);
+}
+
+static int send_data_async_chunked(am7xxx_device *dev, uint8_t *buffer,
+				   unsigned int len,
+				   am7xxx_image_sent_callback callback,
+				   void *user_data)
+{
+	uint8_t *transfer_buffer = buffer;
+
+	if (callback == NULL) {
+		transfer_buffer = malloc(len);
+		if (transfer_buffer == NULL) {
+			error(dev->ctx, "cannot allocate transfer buffer (%s)\n",
+			      strerror(errno));
+			return -ENOMEM;
+		}
+		memcpy(transfer_buffer, buffer, len);
+	}
+
+	/* wait for the previous payload, as send_data_async() does */
+	wait_for_trasfer_completed(dev);
+	wait_for_chunks_completed(dev);
+
+	/* the callback gets called when the last chunk is done, even if
+	 * some chunk could not be submitted */
+	dev->transfer_callback = callback;
+	dev->transfer_callback_data = user_data;
+
+	return send_data_chunked(dev, transfer_buffer, len,
+				 callback == NULL, 1);
 }
 
-static int send_data_async(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+/*
+ * Without a callback the buffer is copied, otherwise it is sent as it is
+ * and the callback is called when the library does not need it anymore,
+ * even when sending fails.
+ */
+static int send_data_async(am7xxx_device *dev, uint8_t *buffer, unsigned int len,
+			   am7xxx_image_sent_callback callback, void *user_data)
 {
 	int ret;
-	uint8_t *transfer_buffer;
+	struct libusb_transfer *transfer;
+	uint8_t *transfer_buffer = buffer;
+
+	if (dev->chunks.size && len > dev->chunks.size)
+		return send_data_async_chunked(dev, buffer, len,
+					       callback, user_data);
 
-	dev->transfer = libusb_alloc_transfer(0);
-	if (dev->transfer == NULL) {
+	/* dev->transfer may still be in flight, it is replaced only after
+	 * waiting for it below */
+	transfer = libusb_alloc_transfer(0);
+	if (transfer == NULL) {
 		error(dev->ctx, "cannot allocate transfer (%s)\n",
 		      strerror(errno));
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto err;
 	}
 
 	/* Make a copy of the buffer so the caller can safely reuse it just
 	 * after libusb_submit_transfer() has returned. This technique
 	 * requires more allocations than a proper double-buffering approach
 	 * but it takes a lot less code. */
-	transfer_buffer = malloc(len);
-	if (transfer_buffer == NULL) {
-		error(dev->ctx, "cannot allocate transfer buffer (%s)\n",
-		      strerror(errno));
-		ret = -ENOMEM;
-		goto err;
+	if (callback == NULL) {
+		transfer_buffer = malloc(len);
+		if (transfer_buffer == NULL) {
+			error(dev->ctx, "cannot allocate transfer buffer (%s)\n",
+			      strerror(errno));
+			ret = -ENOMEM;
+			goto err;
+		}
+		memcpy(transfer_buffer, buffer, len);
+		transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
 	}
-	memcpy(transfer_buffer, buffer, len);
 
-	dev->transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
-	libusb_fill_bulk_transfer(dev->transfer, dev->usb_device, 0x1,
+	/* wait for the previous payload sent in chunks to complete */
+	wait_for_chunks_completed(dev);
+
+	libusb_fill_bulk_transfer(transfer, dev->usb_device, 0x1,
 				  transfer_buffer, len,
 				  send_data_async_complete_cb, dev, 0);
 
@@ -472,16 +849,25 @@ static int send_data_async(am7xxx_device *dev, uint8_t *buffer, unsigned int len
 
 	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
 
-	dev->transfer_completed = 0;
-	ret = libusb_submit_transfer(dev->transfer);
+	ret = libusb_submit_transfer(transfer);
+	probe(send_data_async_submit, dev, dev->packet_type, len, ret);
+	if (ret == LIBUSB_ERROR_NO_DEVICE)
+		device_lost(dev);
 	if (ret < 0)
 		goto err;
 
+	dev->transfer = transfer;
+	dev->transfer_completed = 0;
+	dev->transfer_status = 0;
+	dev->transfer_callback = callback;
+	dev->transfer_callback_data = user_data;
+
 	return 0;
 
 err:
-	libusb_free_transfer(dev->transfer);
-	dev->transfer = NULL;
+	libusb_free_transfer(transfer);
+	if (callback)
+		callback(dev, ret, user_data);
 	return ret;
 }
 
@@ -515,15 +901,13 @@ static void unserialize_header(uint8_t *buffer, struct am7xxx_header *h)
 	h->header_data.data.field3 = get_le32(buffer_iterator);
 }
 
-static int read_header(am7xxx_device *dev, struct am7xxx_header *h)
+/* The header read from the device is in dev->buffer */
+static int parse_header(am7xxx_device *dev, struct am7xxx_header *h)
 {
 	int ret;
 
-	ret = read_data(dev, dev->buffer, AM7XXX_HEADER_WIRE_SIZE);
-	if (ret < 0)
-		goto out;
-
 	unserialize_header(dev->buffer, h);
+	probe(read_header, dev, h->packet_type, AM7XXX_HEADER_WIRE_SIZE, 0);
 
 	if (h->direction == AM7XXX_DIRECTION_IN) {
 		ret = 0;
@@ -536,14 +920,40 @@ static int read_header(am7xxx_device *dev, struct am7xxx_header *h)
 
 	debug_dump_header(dev->ctx, h);
 
-out:
 	return ret;
 }
 
+static int read_header(am7xxx_device *dev, struct am7xxx_header *h)
+{
+	int ret;
+
+	ret = read_data(dev, dev->buffer, AM7XXX_HEADER_WIRE_SIZE);
+	if (ret < 0) {
+		probe(read_header, dev, 0, 0, ret);
+		return ret;
+	}
+
+	return parse_header(dev, h);
+}
+
+static int reconnect_device(am7xxx_device *dev, unsigned int timeout_ms,
+			    unsigned int *outage_ms);
+
 static int send_header(am7xxx_device *dev, struct am7xxx_header *h)
 {
 	int ret;
 
+	/* every command starts with a header, this is the place to get the
+	 * device back if it has been lost */
+	if (dev->lost) {
+		if (dev->reconnect_timeout == 0)
+			return -ENODEV;
+
+		ret = reconnect_device(dev, dev->reconnect_timeout, NULL);
+		if (ret < 0)
+			return ret;
+	}
+
 	debug_dump_header(dev->ctx, h);
 
 	/* For symmetry with read_header() we should check here for
@@ -552,8 +962,10 @@ static int send_header(am7xxx_device *dev, struct am7xxx_header *h)
 	 */
 
 	serialize_header(h, dev->buffer);
+	dev->packet_type = h->packet_type;
 
 	ret = send_data(dev, dev->buffer, AM7XXX_HEADER_WIRE_SIZE);
+	probe(send_header, dev, h->packet_type, AM7XXX_HEADER_WIRE_SIZE, ret);
 	if (ret < 0)
 		error(dev->ctx, "failed to send data\n");
 
@@ -610,6 +1022,10 @@ static am7xxx_device *add_new_device(am7xxx_context *ctx,
 	new_device->ctx = ctx;
 	new_device->desc = desc;
 	new_device->transfer_completed = 1;
+	new_device->chunks.queued_all = 1;
+	new_device->chunks.completed = 1;
+	new_device->power_mode = -1;
+	new_device->zoom_mode = -1;
 
 	devices_list = &(ctx->devices_list);
 
@@ -642,9 +1058,66 @@ static am7xxx_device *find_device(am7xxx_context *ctx,
 	return current;
 }
 
+static int open_usb_device(am7xxx_device *dev, libusb_device *usb_device)
+{
+	struct libusb_device_descriptor desc;
+	int ret;
+
+	ret = libusb_open(usb_device, &(dev->usb_device));
+	if (ret < 0) {
+		debug(dev->ctx, "libusb_open failed\n");
+		return ret;
+	}
+
+	/* XXX, the device is now open, if any
+	 * of the calls below fail we need to
+	 * close it again before bailing out.
+	 */
+
+	ret = libusb_set_configuration(dev->usb_device,
+				       dev->desc->configuration);
+	if (ret < 0) {
+		debug(dev->ctx, "libusb_set_configuration failed\n");
+		debug(dev->ctx, "Cannot set configuration %hhu\n",
+		      dev->desc->configuration);
+		goto out_libusb_close;
+	}
+
+	ret = libusb_claim_interface(dev->usb_device,
+				     dev->desc->interface_number);
+	if (ret < 0) {
+		debug(dev->ctx, "libusb_claim_interface failed\n");
+		debug(dev->ctx, "Cannot claim interface %hhu\n",
+		      dev->desc->interface_number);
+		goto out_libusb_close;
+	}
+
+	/* remember where the device is, to find it again if it gets lost */
+	dev->bus_number = libusb_get_bus_number(usb_device);
+	ret = libusb_get_port_numbers(usb_device, dev->port_numbers,
+				      sizeof(dev->port_numbers));
+	dev->port_numbers_len = (ret < 0) ? 0 : ret;
+
+	memset(dev->serial, 0, sizeof(dev->serial));
+	ret = libusb_get_device_descriptor(usb_device, &desc);
+	if (ret == 0 && desc.iSerialNumber != 0)
+		libusb_get_string_descriptor_ascii(dev->usb_device,
+						   desc.iSerialNumber,
+						   dev->serial,
+						   sizeof(dev->serial) - 1);
+
+	return 0;
+
+out_libusb_close:
+	libusb_close(dev->usb_device);
+	dev->usb_device = NULL;
+	return ret;
+}
+
 typedef enum {
 	SCAN_OP_BUILD_DEVLIST,
 	SCAN_OP_OPEN_DEVICE,
+	SCAN_OP_OPEN_ALL_DEVICES,
 } scan_op;
 
 /**
@@ -659,6 +1132,11 @@ typedef enum {
  * am7xxx_device in the 'dev' parameter; the function returns 0 on success,
  * 1 if the device was already open and a negative value on error.
  *
+ * When 'op' == SCAN_OP_OPEN_ALL_DEVICES the function opens all the supported
+ * USB devices, up to 'open_device_index' of them, and stores them in the
+ * 'dev' array, devices already open included; the function returns the
+ * number of devices stored, devices which cannot be opened are skipped.
+ *
  * NOTES:
  * if scan_devices() fails when called with 'op' == SCAN_OP_BUILD_DEVLIST,
  * the caller might want to call am7xxx_shutdown() in order to remove
@@ -670,6 +1148,7 @@ static int scan_devices(am7xxx_context *ctx, scan_op op,
 	ssize_t num_devices;
 	libusb_device** list;
 	unsigned int current_index;
+	unsigned int num_open = 0;
 	int i;
 	int ret;
 
@@ -733,39 +1212,25 @@ static int scan_devices(am7xxx_context *ctx, scan_op op,
 						goto out;
 					}
 
-					ret = libusb_open(list[i], &((*dev)->usb_device));
-					if (ret < 0) {
-						debug(ctx, "libusb_open failed\n");
-						goto out;
-					}
-
-					/* XXX, the device is now open, if any
-					 * of the calls below fail we need to
-					 * close it again before bailing out.
-					 */
-
-					ret = libusb_set_configuration((*dev)->usb_device,
-								       (*dev)->desc->configuration);
-					if (ret < 0) {
-						debug(ctx, "libusb_set_configuration failed\n");
-						debug(ctx, "Cannot set configuration %hhu\n",
-						      (*dev)->desc->configuration);
-						goto out_libusb_close;
-					}
+					ret = open_usb_device(*dev, list[i]);
+					goto out;
+				} else if (op == SCAN_OP_OPEN_ALL_DEVICES &&
+					   num_open < open_device_index) {
+					am7xxx_device *current;
 
-					ret = libusb_claim_interface((*dev)->usb_device,
-								     (*dev)->desc->interface_number);
-					if (ret < 0) {
-						debug(ctx, "libusb_claim_interface failed\n");
-						debug(ctx, "Cannot claim interface %hhu\n",
-						      (*dev)->desc->interface_number);
-out_libusb_close:
-						libusb_close((*dev)->usb_device);
-						(*dev)->usb_device = NULL;
+					current = find_device(ctx, current_index);
+					if (current == NULL) {
+						ret = -ENODEV;
 						goto out;
 					}
 
-					goto out;
+					if (current->usb_device == NULL &&
+					    open_usb_device(current, list[i]) < 0) {
+						warning(ctx, "cannot open device %d\n",
+							current_index);
+					} else {
+						dev[num_open++] = current;
+					}
 				}
 				current_index++;
 			}
@@ -779,36 +1244,757 @@ out_libusb_close:
 		goto out;
 	}
 
+	if (op == SCAN_OP_OPEN_ALL_DEVICES) {
+		ret = num_open;
+		goto out;
+	}
+
 	/* everything went fine when building the device list */
 	ret = 0;
 out:
 	libusb_free_device_list(list, 1);
+	probe(scan_devices, ctx, op, num_devices, ret);
 	return ret;
 }
 
-/* Public API */
-
-AM7XXX_PUBLIC int am7xxx_init(am7xxx_context **ctx)
+/* Check whether another device of the context has usb_device open */
+static int is_device_in_use(am7xxx_device *dev, libusb_device *usb_device)
 {
-	int ret;
+	am7xxx_device *current;
 
-	*ctx = malloc(sizeof(**ctx));
-	if (*ctx == NULL) {
-		fatal("cannot allocate the context (%s)\n", strerror(errno));
-		ret = -ENOMEM;
-		goto out;
+	for (current = dev->ctx->devices_list; current; current = current->next) {
+		if (current != dev && current->usb_device &&
+		    libusb_get_device(current->usb_device) == usb_device)
+			return 1;
 	}
-	memset(*ctx, 0, sizeof(**ctx));
 
-	/* Set the highest log level during initialization */
-	(*ctx)->log_level = AM7XXX_LOG_TRACE;
+	return 0;
+}
 
-	ret = libusb_init(&((*ctx)->usb_context));
-	if (ret < 0)
-		goto out_free_context;
+/*
+ * A lost device is the same one when it has the same serial number, for
+ * devices without one it has to be plugged in the same port; the devices
+ * already open in the context are never the lost one.
+ */
+static int is_lost_device(am7xxx_device *dev, libusb_device *usb_device)
+{
+	struct libusb_device_descriptor desc;
+	uint8_t port_numbers[7];
+	int ret;
+
+	ret = libusb_get_device_descriptor(usb_device, &desc);
+	if (ret < 0 ||
+	    desc.idVendor != dev->desc->vendor_id ||
+	    desc.idProduct != dev->desc->product_id ||
+	    is_device_in_use(dev, usb_device))
+		return 0;
+
+	/* the serial number can only be read after opening the device,
+	 * see open_lost_device() */
+	if (dev->serial[0] != '\0')
+		return 1;
+
+	ret = libusb_get_port_numbers(usb_device, port_numbers,
+				      sizeof(port_numbers));
+	return libusb_get_bus_number(usb_device) == dev->bus_number &&
+		ret == dev->port_numbers_len &&
+		memcmp(port_numbers, dev->port_numbers, ret) == 0;
+}
+
+/*
+ * Open a candidate for the lost device, and close it again if it turns out
+ * to have another serial number.
+ *
+ * Returns 0 when the lost device is open, -ENODEV when usb_device is
+ * another one, or a libusb error.
+ */
+static int open_lost_device(am7xxx_device *dev, libusb_device *usb_device)
+{
+	unsigned char serial[sizeof(dev->serial)];
+	int ret;
+
+	memcpy(serial, dev->serial, sizeof(serial));
+
+	ret = open_usb_device(dev, usb_device);
+	if (ret < 0)
+		return ret;
+
+	if (serial[0] != '\0' &&
+	    memcmp(serial, dev->serial, sizeof(serial)) != 0) {
+		debug(dev->ctx, "another device with the same ID, ignoring it\n");
+		libusb_release_interface(dev->usb_device,
+					 dev->desc->interface_number);
+		libusb_close(dev->usb_device);
+		dev->usb_device = NULL;
+		memcpy(dev->serial, serial, sizeof(serial));
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static int LIBUSB_CALL device_arrived_cb(libusb_context *usb_context,
+					 libusb_device *usb_device,
+					 libusb_hotplug_event event,
+					 void *user_data)
+{
+	int *arrived = (int *)user_data;
+
+	(void) usb_context;
+	(void) usb_device;
+	(void) event;
+
+	/* the device list is looked at out of the callback */
+	*arrived = 1;
+
+	return 0;
+}
+
+/*
+ * Look for the lost device in the device list and open it, all the
+ * candidates are tried as with two devices of the same model only the
+ * serial number tells them apart.
+ *
+ * Returns 0 when the lost device is open, LIBUSB_ERROR_ACCESS when some
+ * candidate could not be opened yet, -ENODEV otherwise.
+ */
+static int find_lost_device(am7xxx_device *dev)
+{
+	libusb_device **list;
+	ssize_t num_devices;
+	ssize_t i;
+	int ret = -ENODEV;
+
+	num_devices = libusb_get_device_list(dev->ctx->usb_context, &list);
+	if (num_devices < 0)
+		return -ENODEV;
+
+	for (i = 0; i < num_devices; i++) {
+		if (!is_lost_device(dev, list[i]))
+			continue;
+
+		switch (open_lost_device(dev, list[i])) {
+		case 0:
+			ret = 0;
+			goto out;
+		case LIBUSB_ERROR_ACCESS:
+			/* the device node may not be accessible yet */
+			ret = LIBUSB_ERROR_ACCESS;
+			break;
+		default:
+			break;
+		}
+	}
+
+out:
+	libusb_free_device_list(list, 1);
+	return ret;
+}
+
+/*
+ * Wait for the lost device to be plugged in again and open it; the time
+ * passes in libusb_handle_events_timeout_completed() so that no CPU is
+ * used meanwhile, and the hotplug events wake it up as soon as a device
+ * is there.
+ */
+static int wait_for_lost_device(am7xxx_device *dev, unsigned int timeout_ms)
+{
+	libusb_context *usb_context = dev->ctx->usb_context;
+	libusb_hotplug_callback_handle handle;
+	int arrived = 0;
+	uint64_t deadline;
+	uint64_t now;
+	uint64_t wait;
+	struct timeval tv;
+	int hotplug;
+	int ret;
+
+	hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	if (hotplug) {
+		ret = libusb_hotplug_register_callback(usb_context,
+						       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+						       LIBUSB_HOTPLUG_NO_FLAGS,
+						       dev->desc->vendor_id,
+						       dev->desc->product_id,
+						       LIBUSB_HOTPLUG_MATCH_ANY,
+						       device_arrived_cb,
+						       &arrived, &handle);
+		if (ret < 0) {
+			debug(dev->ctx, "cannot register the hotplug callback: %s\n",
+			      libusb_error_name(ret));
+			hotplug = 0;
+		}
+	}
+
+	/* the device may be back already */
+	ret = find_lost_device(dev);
+
+	deadline = monotonic_time_ms() + timeout_ms;
+	while (ret != 0) {
+		now = monotonic_time_ms();
+		if (now >= deadline) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		/* poll the device list ten times per second without hotplug,
+		 * or when retrying to open the device */
+		wait = deadline - now;
+		if ((!hotplug || ret == LIBUSB_ERROR_ACCESS) && wait > 100)
+			wait = 100;
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+
+		ret = libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			error(dev->ctx, "libusb_handle_events failed: %s\n",
+			      libusb_error_name(ret));
+			break;
+		}
+
+		if (!hotplug || arrived || ret == LIBUSB_ERROR_ACCESS) {
+			arrived = 0;
+			ret = find_lost_device(dev);
+		} else {
+			ret = -ENODEV;
+		}
+	}
+
+	if (hotplug)
+		libusb_hotplug_deregister_callback(usb_context, handle);
+
+	return ret;
+}
+
+/*
+ * Get a lost device back: the pending transfers are completed, the device
+ * is opened again when it comes back and its state is restored.
+ */
+static int reconnect_device(am7xxx_device *dev, unsigned int timeout_ms,
+			    unsigned int *outage_ms)
+{
+	am7xxx_device_info *device_info;
+	unsigned int outage;
+	int ret;
+
+	if (!dev->lost) {
+		outage = 0;
+		ret = 0;
+		goto out;
+	}
+
+	/* the transfers in flight have failed, let their completion be
+	 * handled before closing the device */
+	if (dev->usb_device) {
+		wait_for_trasfer_completed(dev);
+		wait_for_chunks_completed(dev);
+		libusb_release_interface(dev->usb_device, dev->desc->interface_number);
+		libusb_close(dev->usb_device);
+		dev->usb_device = NULL;
+	}
+
+	info(dev->ctx, "waiting up to %u ms for the device to come back\n",
+	     timeout_ms);
+
+	ret = wait_for_lost_device(dev, timeout_ms);
+	if (ret < 0) {
+		error(dev->ctx, "the device did not come back\n");
+		return ret;
+	}
+	dev->lost = 0;
+
+	/* Some devices need DEVINFO as the first packet, see
+	 * am7xxx_open_device(), the cached info is kept if that fails */
+	device_info = dev->device_info;
+	dev->device_info = NULL;
+	ret = am7xxx_get_device_info(dev, NULL);
+	if (ret < 0) {
+		free(dev->device_info);
+		dev->device_info = device_info;
+		goto out_restore;
+	}
+	free(device_info);
+
+	if (dev->zoom_mode >= 0) {
+		ret = am7xxx_set_zoom_mode(dev, dev->zoom_mode);
+		if (ret < 0)
+			goto out_restore;
+	}
+
+	if (dev->power_mode >= 0) {
+		ret = am7xxx_set_power_mode(dev, dev->power_mode);
+		if (ret < 0)
+			goto out_restore;
+	}
+
+	outage = (unsigned int)(monotonic_time_ms() - dev->lost_time);
+	info(dev->ctx, "device back after %u ms\n", outage);
+
+out:
+	if (outage_ms)
+		*outage_ms = outage;
+	return ret;
+
+out_restore:
+	error(dev->ctx, "cannot restore the device state\n");
+	return ret;
+}
+
+static const struct am7xxx_header devinfo_header = {
+	.packet_type     = AM7XXX_PACKET_TYPE_DEVINFO,
+	.direction       = AM7XXX_DIRECTION_OUT,
+	.header_data_len = 0x00,
+	.unknown2        = 0x3e,
+	.unknown3        = 0x10,
+	.header_data = {
+		.devinfo = {
+			.native_width  = 0,
+			.native_height = 0,
+			.unknown0      = 0,
+			.unknown1      = 0,
+		},
+	},
+};
+
+static int store_device_info(am7xxx_device *dev, struct am7xxx_header *h)
+{
+	if (h->packet_type != AM7XXX_PACKET_TYPE_DEVINFO) {
+		error(dev->ctx, "expected packet type: %d, got %d instead!\n",
+		      AM7XXX_PACKET_TYPE_DEVINFO, h->packet_type);
+		errno = ENOTSUP;
+		return -ENOTSUP;
+	}
+
+	dev->device_info = malloc(sizeof(*dev->device_info));
+	if (dev->device_info == NULL) {
+		error(dev->ctx, "cannot allocate a device info (%s)\n",
+		       strerror(errno));
+		return -ENOMEM;
+	}
+	memset(dev->device_info, 0, sizeof(*dev->device_info));
+
+	dev->device_info->native_width = h->header_data.devinfo.native_width;
+	dev->device_info->native_height = h->header_data.devinfo.native_height;
+#if 0
+	/* No reason to expose these in the public API until we know what they mean */
+	dev->device_info->unknown0 = h->header_data.devinfo.unknown0;
+	dev->device_info->unknown1 = h->header_data.devinfo.unknown1;
+#endif
+
+	return 0;
+}
+
+struct devinfo_handshake {
+	am7xxx_device *dev;
+	struct libusb_transfer *transfer;
+	unsigned int *pending;
+	int *completed;
+	int status;
+};
+
+static void devinfo_handshake_done(struct devinfo_handshake *handshake)
+{
+	if (--(*handshake->pending) == 0)
+		*handshake->completed = 1;
+}
+
+static void devinfo_read_cb(struct libusb_transfer *transfer)
+{
+	struct devinfo_handshake *handshake = transfer->user_data;
+
+	handshake->status = transfer_status_to_error(handshake->dev, transfer);
+	if (handshake->status == 0 &&
+	    transfer->actual_length != AM7XXX_HEADER_WIRE_SIZE)
+		handshake->status = LIBUSB_ERROR_IO;
+
+	devinfo_handshake_done(handshake);
+}
+
+/* The request has been sent, the same transfer reads the reply */
+static void devinfo_sent_cb(struct libusb_transfer *transfer)
+{
+	struct devinfo_handshake *handshake = transfer->user_data;
+	am7xxx_device *dev = handshake->dev;
+
+	handshake->status = transfer_status_to_error(dev, transfer);
+	probe(send_header, dev, AM7XXX_PACKET_TYPE_DEVINFO,
+	      AM7XXX_HEADER_WIRE_SIZE, handshake->status);
+	if (handshake->status < 0) {
+		error(dev->ctx, "failed to send data\n");
+		goto out;
+	}
+
+	libusb_fill_bulk_transfer(transfer, dev->usb_device, 0x81,
+				  dev->buffer, AM7XXX_HEADER_WIRE_SIZE,
+				  devinfo_read_cb, handshake, 0);
+
+	handshake->status = libusb_submit_transfer(transfer);
+	if (handshake->status == LIBUSB_ERROR_NO_DEVICE)
+		device_lost(dev);
+	if (handshake->status == 0)
+		return;
+
+out:
+	devinfo_handshake_done(handshake);
+}
+
+/*
+ * Ask the devices for their info all at once: both the DEVINFO requests
+ * and the replies go with asynchronous transfers, so that the devices
+ * answer in parallel and the whole handshake takes as long as the slowest
+ * one.
+ *
+ * The devices which did not get their info are moved past the ones which
+ * did, the return value is the number of the latter.
+ */
+static int get_devices_info(am7xxx_context *ctx, am7xxx_device **devices,
+			    unsigned int num_devices)
+{
+	struct devinfo_handshake *handshakes;
+	struct am7xxx_header h;
+	unsigned int pending = 0;
+	unsigned int num_ready = 0;
+	int completed = 0;
+	int cancelled = 0;
+	unsigned int i;
+	int ret;
+
+	handshakes = calloc(num_devices, sizeof(*handshakes));
+	if (handshakes == NULL) {
+		error(ctx, "cannot allocate the handshakes (%s)\n",
+		      strerror(errno));
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_devices; i++) {
+		struct devinfo_handshake *handshake = &handshakes[i];
+		am7xxx_device *dev = devices[i];
+
+		handshake->dev = dev;
+		handshake->pending = &pending;
+		handshake->completed = &completed;
+
+		if (dev->device_info)
+			continue;
+
+		handshake->transfer = libusb_alloc_transfer(0);
+		if (handshake->transfer == NULL) {
+			handshake->status = -ENOMEM;
+			continue;
+		}
+
+		h = devinfo_header;
+		debug_dump_header(ctx, &h);
+		serialize_header(&h, dev->buffer);
+		dev->packet_type = h.packet_type;
+		trace_dump_buffer(ctx, "sending -->", dev->buffer,
+				  AM7XXX_HEADER_WIRE_SIZE);
+
+		libusb_fill_bulk_transfer(handshake->transfer, dev->usb_device,
+					  0x1, dev->buffer,
+					  AM7XXX_HEADER_WIRE_SIZE,
+					  devinfo_sent_cb, handshake, 0);
+
+		handshake->status = libusb_submit_transfer(handshake->transfer);
+		if (handshake->status == LIBUSB_ERROR_NO_DEVICE)
+			device_lost(dev);
+		if (handshake->status < 0)
+			continue;
+
+		pending++;
+	}
+
+	completed = (pending == 0);
+	while (pending > 0) {
+		ret = libusb_handle_events_completed(ctx->usb_context, &completed);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED && !cancelled) {
+			error(ctx, "libusb_handle_events failed: %s, cancelling the handshakes\n",
+			      libusb_error_name(ret));
+			for (i = 0; i < num_devices; i++)
+				if (handshakes[i].transfer)
+					libusb_cancel_transfer(handshakes[i].transfer);
+			cancelled = 1;
+		}
+	}
+
+	for (i = 0; i < num_devices; i++) {
+		struct devinfo_handshake *handshake = &handshakes[i];
+
+		libusb_free_transfer(handshake->transfer);
+
+		if (handshake->dev->device_info == NULL) {
+			if (handshake->status == 0)
+				handshake->status = parse_header(handshake->dev, &h);
+			else
+				probe(read_header, handshake->dev, 0, 0,
+				      handshake->status);
+			if (handshake->status == 0)
+				handshake->status = store_device_info(handshake->dev, &h);
+			if (handshake->status < 0) {
+				error(ctx, "cannot get device info\n");
+				continue;
+			}
+		}
+
+		/* keep the failed devices after the ready ones */
+		devices[i] = devices[num_ready];
+		devices[num_ready++] = handshake->dev;
+	}
+
+	free(handshakes);
+	return num_ready;
+}
+
+static int is_supported_device(libusb_device *usb_device)
+{
+	struct libusb_device_descriptor desc;
+	unsigned int i;
+	int ret;
+
+	ret = libusb_get_device_descriptor(usb_device, &desc);
+	if (ret < 0)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(supported_devices); i++) {
+		if (desc.idVendor == supported_devices[i].vendor_id &&
+		    desc.idProduct == supported_devices[i].product_id)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int count_supported_devices(am7xxx_context *ctx)
+{
+	libusb_device **list;
+	ssize_t num_devices;
+	ssize_t i;
+	int count = 0;
+
+	num_devices = libusb_get_device_list(ctx->usb_context, &list);
+	if (num_devices < 0)
+		return 0;
+
+	for (i = 0; i < num_devices; i++)
+		count += is_supported_device(list[i]);
+
+	libusb_free_device_list(list, 1);
+	return count;
+}
+
+static int LIBUSB_CALL supported_device_arrived_cb(libusb_context *usb_context,
+						   libusb_device *usb_device,
+						   libusb_hotplug_event event,
+						   void *user_data)
+{
+	int *arrived = (int *)user_data;
+
+	(void) usb_context;
+	(void) event;
+
+	if (is_supported_device(usb_device))
+		(*arrived)++;
+
+	return 0;
+}
+
+/* Send the mode switch command to a device in mass storage mode */
+static int switch_storage_device(am7xxx_context *ctx, libusb_device *usb_device)
+{
+	libusb_device_handle *usb_handle;
+	int transferred = 0;
+	unsigned int len;
+	int ret;
+
+	ret = libusb_open(usb_device, &usb_handle);
+	if (ret < 0) {
+		debug(ctx, "libusb_open failed\n");
+		return ret;
+	}
+
+	if (libusb_kernel_driver_active(usb_handle, AM7XXX_STORAGE_INTERFACE) == 1) {
+		ret = libusb_detach_kernel_driver(usb_handle,
+						  AM7XXX_STORAGE_INTERFACE);
+		if (ret < 0)
+			warning(ctx, "cannot detach kernel driver\n");
+	}
+
+	ret = libusb_set_configuration(usb_handle, AM7XXX_STORAGE_CONFIGURATION);
+	if (ret < 0) {
+		debug(ctx, "Cannot set configuration %d\n",
+		      AM7XXX_STORAGE_CONFIGURATION);
+		goto out_libusb_close;
+	}
+
+	ret = libusb_claim_interface(usb_handle, AM7XXX_STORAGE_INTERFACE);
+	if (ret < 0) {
+		debug(ctx, "Cannot claim interface %d\n",
+		      AM7XXX_STORAGE_INTERFACE);
+		goto out_libusb_close;
+	}
+
+	len = sizeof(switch_command);
+	ret = libusb_bulk_transfer(usb_handle, AM7XXX_STORAGE_OUT_EP,
+				   switch_command, len, &transferred, 0);
+	if (ret != 0 || (unsigned int)transferred != len) {
+		error(ctx, "ret: %d\ttransferred: %d (expected %u)\n",
+		      ret, transferred, len);
+		if (ret == 0)
+			ret = LIBUSB_ERROR_IO;
+	}
+
+	libusb_release_interface(usb_handle, AM7XXX_STORAGE_INTERFACE);
+out_libusb_close:
+	libusb_close(usb_handle);
+	return ret;
+}
+
+/*
+ * Switch the devices in mass storage mode and wait for them to come back
+ * as projectors: with hotplug support the wait ends as soon as the last
+ * one arrives, otherwise the device list is polled ten times per second.
+ *
+ * Devices which do not come back in time are not an error, the ones which
+ * did can be used anyway.
+ */
+static int switch_storage_devices(am7xxx_context *ctx, unsigned int timeout_ms)
+{
+	libusb_hotplug_callback_handle handle;
+	libusb_device **list;
+	ssize_t num_devices;
+	ssize_t i;
+	struct libusb_device_descriptor desc;
+	int switched = 0;
+	int arrived = 0;
+	int present;
+	int hotplug;
+	uint64_t deadline;
+	uint64_t now;
+	uint64_t wait;
+	struct timeval tv;
+	int ret;
+
+	/* register before switching, not to miss the fastest devices */
+	hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	if (hotplug) {
+		ret = libusb_hotplug_register_callback(ctx->usb_context,
+						       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+						       LIBUSB_HOTPLUG_NO_FLAGS,
+						       LIBUSB_HOTPLUG_MATCH_ANY,
+						       LIBUSB_HOTPLUG_MATCH_ANY,
+						       LIBUSB_HOTPLUG_MATCH_ANY,
+						       supported_device_arrived_cb,
+						       &arrived, &handle);
+		if (ret < 0) {
+			debug(ctx, "cannot register the hotplug callback: %s\n",
+			      libusb_error_name(ret));
+			hotplug = 0;
+		}
+	}
+
+	present = count_supported_devices(ctx);
+
+	num_devices = libusb_get_device_list(ctx->usb_context, &list);
+	if (num_devices < 0) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	for (i = 0; i < num_devices; i++) {
+		ret = libusb_get_device_descriptor(list[i], &desc);
+		if (ret < 0 ||
+		    desc.idVendor != AM7XXX_STORAGE_VID ||
+		    desc.idProduct != AM7XXX_STORAGE_PID)
+			continue;
+
+		ret = switch_storage_device(ctx, list[i]);
+		if (ret < 0) {
+			warning(ctx, "cannot switch a device in storage mode: %s\n",
+				libusb_error_name(ret));
+			continue;
+		}
+		switched++;
+	}
+	libusb_free_device_list(list, 1);
+
+	if (switched == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	info(ctx, "%d devices switched, waiting up to %u ms for them\n",
+	     switched, timeout_ms);
+
+	deadline = monotonic_time_ms() + timeout_ms;
+	for (;;) {
+		if (!hotplug)
+			arrived = count_supported_devices(ctx) - present;
+		if (arrived >= switched) {
+			ret = 0;
+			break;
+		}
+
+		now = monotonic_time_ms();
+		if (now >= deadline) {
+			warning(ctx, "%d of %d switched devices came back\n",
+				arrived, switched);
+			ret = 0;
+			break;
+		}
+
+		wait = deadline - now;
+		if (!hotplug && wait > 100)
+			wait = 100;
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+
+		ret = libusb_handle_events_timeout_completed(ctx->usb_context, &tv, NULL);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			error(ctx, "libusb_handle_events failed: %s\n",
+			      libusb_error_name(ret));
+			break;
+		}
+	}
+
+out:
+	if (hotplug)
+		libusb_hotplug_deregister_callback(ctx->usb_context, handle);
+
+	return ret;
+}
+
+/* Public API */
+
+static int init_context(am7xxx_context **ctx, unsigned int switch_timeout_ms)
+{
+	int ret;
+
+	*ctx = malloc(sizeof(**ctx));
+	if (*ctx == NULL) {
+		fatal("cannot allocate the context (%s)\n", strerror(errno));
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(*ctx, 0, sizeof(**ctx));
+
+	/* Set the highest log level during initialization */
+	(*ctx)->log_level = AM7XXX_LOG_TRACE;
+
+	ret = libusb_init(&((*ctx)->usb_context));
+	if (ret < 0)
+		goto out_free_context;
 
 	libusb_set_debug((*ctx)->usb_context, LIBUSB_LOG_LEVEL_INFO);
 
+	if (switch_timeout_ms > 0) {
+		ret = switch_storage_devices(*ctx, switch_timeout_ms);
+		if (ret < 0) {
+			error(*ctx, "switch_storage_devices() failed\n");
+			am7xxx_shutdown(*ctx);
+			goto out;
+		}
+	}
+
 	ret = scan_devices(*ctx, SCAN_OP_BUILD_DEVLIST , 0, NULL);
 	if (ret < 0) {
 		error(*ctx, "scan_devices() failed\n");
@@ -827,6 +2013,17 @@ out:
 	return ret;
 }
 
+AM7XXX_PUBLIC int am7xxx_init(am7xxx_context **ctx)
+{
+	return init_context(ctx, 0);
+}
+
+AM7XXX_PUBLIC int am7xxx_init_modeswitch(am7xxx_context **ctx,
+					 unsigned int timeout_ms)
+{
+	return init_context(ctx, timeout_ms);
+}
+
 AM7XXX_PUBLIC void am7xxx_shutdown(am7xxx_context *ctx)
 {
 	am7xxx_device *current;
@@ -840,6 +2037,7 @@ AM7XXX_PUBLIC void am7xxx_shutdown(am7xxx_context *ctx)
 	while (current) {
 		am7xxx_device *next = current->next;
 		am7xxx_close_device(current);
+		free_chunk_transfers(current);
 		free(current->device_info);
 		free(current);
 		current = next;
@@ -893,6 +2091,92 @@ out:
 	return ret;
 }
 
+/* Whether dev is among the devices which were open before the scan */
+static int was_open(am7xxx_device **open_devices, unsigned int num_open,
+		    am7xxx_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_open; i++)
+		if (open_devices[i] == dev)
+			return 1;
+
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_open_all_devices(am7xxx_context *ctx,
+					  am7xxx_device **devices,
+					  unsigned int max_devices)
+{
+	am7xxx_device **open_devices = NULL;
+	unsigned int num_open = 0;
+	am7xxx_device *current;
+	int num_devices;
+	unsigned int i;
+	int ret;
+
+	if (ctx == NULL) {
+		fatal("context must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	/* the devices open already belong to the caller, they are never
+	 * closed here */
+	for (current = ctx->devices_list; current; current = current->next)
+		if (current->usb_device)
+			num_open++;
+
+	if (num_open > 0) {
+		open_devices = calloc(num_open, sizeof(*open_devices));
+		if (open_devices == NULL) {
+			error(ctx, "cannot allocate the open devices (%s)\n",
+			      strerror(errno));
+			return -ENOMEM;
+		}
+
+		num_open = 0;
+		for (current = ctx->devices_list; current; current = current->next)
+			if (current->usb_device)
+				open_devices[num_open++] = current;
+	}
+
+	num_devices = scan_devices(ctx, SCAN_OP_OPEN_ALL_DEVICES, max_devices,
+				   devices);
+	if (num_devices < 0) {
+		errno = ENODEV;
+		ret = num_devices;
+		goto out;
+	} else if (num_devices == 0) {
+		error(ctx, "Cannot find any device to open\n");
+		errno = ENODEV;
+		ret = -ENODEV;
+		goto out;
+	}
+
+	/* See am7xxx_open_device() about why DEVINFO is sent at open time */
+	ret = get_devices_info(ctx, devices, num_devices);
+	if (ret < 0)
+		goto out;
+
+	/* the devices which did not answer are of no use */
+	for (i = ret; i < (unsigned int)num_devices; i++) {
+		if (!was_open(open_devices, num_open, devices[i])) {
+			warning(ctx, "closing a device which cannot be used\n");
+			am7xxx_close_device(devices[i]);
+		}
+		devices[i] = NULL;
+	}
+
+	if (ret == 0) {
+		errno = ENODEV;
+		ret = -ENODEV;
+	}
+
+out:
+	free(open_devices);
+	return ret;
+}
+
 AM7XXX_PUBLIC int am7xxx_close_device(am7xxx_device *dev)
 {
 	if (dev == NULL) {
@@ -901,6 +2185,7 @@ AM7XXX_PUBLIC int am7xxx_close_device(am7xxx_device *dev)
 	}
 	if (dev->usb_device) {
 		wait_for_trasfer_completed(dev);
+		wait_for_chunks_completed(dev);
 		libusb_release_interface(dev->usb_device, dev->desc->interface_number);
 		libusb_close(dev->usb_device);
 		dev->usb_device = NULL;
@@ -912,21 +2197,7 @@ AM7XXX_PUBLIC int am7xxx_get_device_info(am7xxx_device *dev,
 			   am7xxx_device_info *device_info)
 {
 	int ret;
-	struct am7xxx_header h = {
-		.packet_type     = AM7XXX_PACKET_TYPE_DEVINFO,
-		.direction       = AM7XXX_DIRECTION_OUT,
-		.header_data_len = 0x00,
-		.unknown2        = 0x3e,
-		.unknown3        = 0x10,
-		.header_data = {
-			.devinfo = {
-				.native_width  = 0,
-				.native_height = 0,
-				.unknown0      = 0,
-				.unknown1      = 0,
-			},
-		},
-	};
+	struct am7xxx_header h = devinfo_header;
 
 	if (dev->device_info) {
 		memcpy(device_info, dev->device_info, sizeof(*device_info));
@@ -941,30 +2212,7 @@ AM7XXX_PUBLIC int am7xxx_get_device_info(am7xxx_device *dev,
 	if (ret < 0)
 		return ret;
 
-	if (h.packet_type != AM7XXX_PACKET_TYPE_DEVINFO) {
-		error(dev->ctx, "expected packet type: %d, got %d instead!\n",
-		      AM7XXX_PACKET_TYPE_DEVINFO, h.packet_type);
-		errno = ENOTSUP;
-		return -ENOTSUP;
-	}
-
-	dev->device_info = malloc(sizeof(*dev->device_info));
-	if (dev->device_info == NULL) {
-		error(dev->ctx, "cannot allocate a device info (%s)\n",
-		       strerror(errno));
-		return -ENOMEM;
-	}
-	memset(dev->device_info, 0, sizeof(*dev->device_info));
-
-	dev->device_info->native_width = h.header_data.devinfo.native_width;
-	dev->device_info->native_height = h.header_data.devinfo.native_height;
-#if 0
-	/* No reason to expose these in the public API until we know what they mean */
-	dev->device_info->unknown0 = h.header_data.devinfo.unknown0;
-	dev->device_info->unknown1 = h.header_data.devinfo.unknown1;
-#endif
-
-	return 0;
+	return store_device_info(dev, &h);
 }
 
 AM7XXX_PUBLIC int am7xxx_calc_scaled_image_dimensions(am7xxx_device *dev,
@@ -1062,7 +2310,10 @@ AM7XXX_PUBLIC int am7xxx_send_image(am7xxx_device *dev,
 		return 0;
 	}
 
-	return send_data(dev, image, image_size);
+	ret = send_data(dev, image, image_size);
+	notify_image_sent(dev, ret);
+
+	return ret;
 }
 
 AM7XXX_PUBLIC int am7xxx_send_image_async(am7xxx_device *dev,
@@ -1098,7 +2349,297 @@ AM7XXX_PUBLIC int am7xxx_send_image_async(am7xxx_device *dev,
 		return 0;
 	}
 
-	return send_data_async(dev, image, image_size);
+	return send_data_async(dev, image, image_size, NULL, NULL);
+}
+
+AM7XXX_PUBLIC int am7xxx_send_image_async_nocopy(am7xxx_device *dev,
+						 am7xxx_image_format format,
+						 unsigned int width,
+						 unsigned int height,
+						 uint8_t *image,
+						 unsigned int image_size,
+						 am7xxx_image_sent_callback callback,
+						 void *user_data)
+{
+	int ret;
+	struct am7xxx_header h = {
+		.packet_type     = AM7XXX_PACKET_TYPE_IMAGE,
+		.direction       = AM7XXX_DIRECTION_OUT,
+		.header_data_len = sizeof(struct am7xxx_image_header),
+		.unknown2        = 0x3e,
+		.unknown3        = 0x10,
+		.header_data = {
+			.image = {
+				.format     = format,
+				.width      = width,
+				.height     = height,
+				.image_size = image_size,
+			},
+		},
+	};
+
+	if (callback == NULL) {
+		error(dev->ctx, "callback must not be NULL\n");
+		return -EINVAL;
+	}
+
+	ret = send_header(dev, &h);
+	if (ret < 0)
+		goto err;
+
+	if (image == NULL || image_size == 0) {
+		warning(dev->ctx, "Not sending any data, check the 'image' or 'image_size' parameters\n");
+		goto err;
+	}
+
+	return send_data_async(dev, image, image_size, callback, user_data);
+
+err:
+	callback(dev, ret, user_data);
+	return ret;
+}
+
+AM7XXX_PUBLIC int am7xxx_frame_new(am7xxx_frame **frame,
+				   am7xxx_image_format format,
+				   unsigned int width,
+				   unsigned int height,
+				   unsigned int size)
+{
+	/* the data follows the frame in the same allocation */
+	*frame = malloc(sizeof(**frame) + size);
+	if (*frame == NULL) {
+		fatal("cannot allocate a frame (%s)\n", strerror(errno));
+		return -ENOMEM;
+	}
+
+	(*frame)->refcount = 1;
+	(*frame)->format = format;
+	(*frame)->width = width;
+	(*frame)->height = height;
+	(*frame)->data = (uint8_t *)(*frame + 1);
+	(*frame)->size = size;
+	(*frame)->release = NULL;
+	(*frame)->release_data = NULL;
+
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_frame_new_wrapped(am7xxx_frame **frame,
+					   am7xxx_image_format format,
+					   unsigned int width,
+					   unsigned int height,
+					   uint8_t *data,
+					   unsigned int size,
+					   am7xxx_frame_release_callback release,
+					   void *user_data)
+{
+	*frame = malloc(sizeof(**frame));
+	if (*frame == NULL) {
+		fatal("cannot allocate a frame (%s)\n", strerror(errno));
+		return -ENOMEM;
+	}
+
+	(*frame)->refcount = 1;
+	(*frame)->format = format;
+	(*frame)->width = width;
+	(*frame)->height = height;
+	(*frame)->data = data;
+	(*frame)->size = size;
+	(*frame)->release = release;
+	(*frame)->release_data = user_data;
+
+	return 0;
+}
+
+/* Frames can be shared with other threads, hence the atomic refcount */
+AM7XXX_PUBLIC am7xxx_frame *am7xxx_frame_ref(am7xxx_frame *frame)
+{
+	__atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+	return frame;
+}
+
+AM7XXX_PUBLIC void am7xxx_frame_unref(am7xxx_frame *frame)
+{
+	if (frame == NULL)
+		return;
+
+	if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	if (frame->release)
+		frame->release(frame->data, frame->release_data);
+	free(frame);
+}
+
+AM7XXX_PUBLIC uint8_t *am7xxx_frame_get_data(am7xxx_frame *frame)
+{
+	return frame->data;
+}
+
+AM7XXX_PUBLIC unsigned int am7xxx_frame_get_size(am7xxx_frame *frame)
+{
+	return frame->size;
+}
+
+AM7XXX_PUBLIC int am7xxx_send_frame(am7xxx_device *dev, am7xxx_frame *frame)
+{
+	return am7xxx_send_image(dev, frame->format,
+				 frame->width, frame->height,
+				 frame->data, frame->size);
+}
+
+static void frame_sent(am7xxx_device *dev, int status, void *user_data)
+{
+	(void) dev;
+	(void) status;
+	am7xxx_frame_unref((am7xxx_frame *)user_data);
+}
+
+AM7XXX_PUBLIC int am7xxx_send_frame_async(am7xxx_device *dev,
+					  am7xxx_frame *frame)
+{
+	/* the reference is dropped when the library is done with the data */
+	return am7xxx_send_image_async_nocopy(dev, frame->format,
+					      frame->width, frame->height,
+					      frame->data, frame->size,
+					      frame_sent,
+					      am7xxx_frame_ref(frame));
+}
+
+AM7XXX_PUBLIC int am7xxx_wait_image_sent(am7xxx_device *dev)
+{
+	if (dev->usb_device == NULL) {
+		error(dev->ctx, "the device must be open\n");
+		return -ENODEV;
+	}
+
+	wait_for_trasfer_completed(dev);
+	wait_for_chunks_completed(dev);
+
+	return dev->transfer_status;
+}
+
+AM7XXX_PUBLIC int am7xxx_handle_events(am7xxx_context *ctx,
+				       unsigned int timeout_ms)
+{
+	struct timeval tv;
+	int ret;
+
+	if (ctx == NULL) {
+		fatal("context must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	ret = libusb_handle_events_timeout_completed(ctx->usb_context, &tv, NULL);
+	if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+		error(ctx, "libusb_handle_events failed: %s\n",
+		      libusb_error_name(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+AM7XXX_PUBLIC void am7xxx_set_image_sent_callback(am7xxx_device *dev,
+						  am7xxx_image_sent_callback callback,
+						  void *user_data)
+{
+	dev->image_sent_callback = callback;
+	dev->image_sent_callback_data = user_data;
+}
+
+AM7XXX_PUBLIC int am7xxx_set_chunking(am7xxx_device *dev,
+				      unsigned int chunk_size,
+				      unsigned int depth)
+{
+	struct libusb_transfer **transfers;
+	int max_packet_size;
+	unsigned int i;
+
+	if (dev->usb_device == NULL) {
+		error(dev->ctx, "the device must be open\n");
+		return -ENODEV;
+	}
+
+	if (chunk_size > 0) {
+		if (depth == 0 || depth > AM7XXX_MAX_CHUNK_DEPTH) {
+			error(dev->ctx, "the depth must be between 1 and %d\n",
+			      AM7XXX_MAX_CHUNK_DEPTH);
+			return -EINVAL;
+		}
+
+		/*
+		 * A chunk must not end with a short packet, the device would
+		 * take it as the end of the payload.
+		 */
+		max_packet_size = libusb_get_max_packet_size(libusb_get_device(dev->usb_device),
+							     0x1);
+		if (max_packet_size <= 0) {
+			error(dev->ctx, "cannot get the max packet size: %s\n",
+			      libusb_error_name(max_packet_size));
+			return max_packet_size;
+		}
+		if (chunk_size % max_packet_size != 0) {
+			error(dev->ctx, "the chunk size must be a multiple of %d\n",
+			      max_packet_size);
+			return -EINVAL;
+		}
+	}
+
+	/* the transfers of the previous settings may still be in flight */
+	wait_for_trasfer_completed(dev);
+	wait_for_chunks_completed(dev);
+	free_chunk_transfers(dev);
+
+	if (chunk_size == 0)
+		return 0;
+
+	transfers = calloc(depth, sizeof(*transfers));
+	if (transfers == NULL) {
+		error(dev->ctx, "cannot allocate the transfers (%s)\n",
+		      strerror(errno));
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < depth; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (transfers[i] == NULL) {
+			error(dev->ctx, "cannot allocate transfer (%s)\n",
+			      strerror(errno));
+			goto err;
+		}
+	}
+
+	dev->chunks.transfers = transfers;
+	dev->chunks.depth = depth;
+	dev->chunks.size = chunk_size;
+
+	debug(dev->ctx, "sending payloads in chunks of %u bytes, %u in flight\n",
+	      chunk_size, depth);
+
+	return 0;
+
+err:
+	while (i-- > 0)
+		libusb_free_transfer(transfers[i]);
+	free(transfers);
+	return -ENOMEM;
+}
+
+AM7XXX_PUBLIC void am7xxx_set_auto_reconnect(am7xxx_device *dev,
+					     unsigned int timeout_ms)
+{
+	dev->reconnect_timeout = timeout_ms;
+}
+
+AM7XXX_PUBLIC int am7xxx_reconnect_device(am7xxx_device *dev,
+					  unsigned int timeout_ms,
+					  unsigned int *outage_ms)
+{
+	return reconnect_device(dev, timeout_ms, outage_ms);
 }
 
 AM7XXX_PUBLIC int am7xxx_set_power_mode(am7xxx_device *dev, am7xxx_power_mode power)
@@ -1158,6 +2699,8 @@ AM7XXX_PUBLIC int am7xxx_set_power_mode(am7xxx_device *dev, am7xxx_power_mode po
 	if (ret < 0)
 		return ret;
 
+	dev->power_mode = power;
+
 	return 0;
 }
 
@@ -1208,5 +2751,7 @@ AM7XXX_PUBLIC int am7xxx_set_zoom_mode(am7xxx_device *dev, am7xxx_zoom_mode zoom
 	if (ret < 0)
 		return ret;
 
+	dev->zoom_mode = zoom;
+
 	return 0;
 }
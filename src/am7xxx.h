@@ -131,6 +131,31 @@ typedef enum {
  */
 int am7xxx_init(am7xxx_context **ctx);
 
+/**
+ * Initialize the library like am7xxx_init(), switching first the devices
+ * which start in mass storage mode.
+ *
+ * Some devices show up as USB mass storage devices when plugged in, and
+ * become projectors only after receiving a mode switch command; the command
+ * is sent to all of them, then the function waits for them to come back
+ * as projectors before scanning for devices, so that they can be opened
+ * right away. The wait ends as soon as the last switched device is back,
+ * when libusb supports hotplug events.
+ *
+ * The switched devices which do not come back within timeout_ms are not an
+ * error, they are just not in the devices found.
+ *
+ * @note Detaching the kernel driver from the storage devices may require
+ * some privileges, the am7xxx-modeswitch example and a udev rule can do the
+ * switch instead, as devices get plugged in.
+ *
+ * @param[out] ctx A pointer to the context the library will be used in.
+ * @param[in] timeout_ms How long to wait for the switched devices to come back, 0 means not to switch the devices at all, like am7xxx_init()
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_init_modeswitch(am7xxx_context **ctx, unsigned int timeout_ms);
+
 /**
  * Cleanup the library data structures and free the context.
  *
@@ -170,6 +195,31 @@ int am7xxx_open_device(am7xxx_context *ctx,
 		       am7xxx_device **dev,
 		       unsigned int device_index);
 
+/**
+ * Open all the am7xxx devices found by am7xxx_init().
+ *
+ * The devices are claimed with a single scan of the USB bus, then their
+ * info is asked to all of them at once, so opening several devices takes
+ * about as long as opening the slowest one; am7xxx_open_device() calls
+ * on the devices one after the other take instead the sum of their times.
+ *
+ * Devices which are open already are returned too. Devices which cannot
+ * be opened are skipped, and the ones which do not answer when asked for
+ * their info are closed and skipped as well. The devices are stored in
+ * the order of their index, each one has to be closed with
+ * am7xxx_close_device().
+ *
+ * @param[in] ctx The context previously allocated with am7xxx_init()
+ * @param[out] devices An array where to store the pointers to the opened devices
+ * @param[in] max_devices The size of the devices array
+ *
+ * @return the number of devices stored in the array, a negative value on
+ * error or when no device could be opened
+ */
+int am7xxx_open_all_devices(am7xxx_context *ctx,
+			    am7xxx_device **devices,
+			    unsigned int max_devices);
+
 /**
  * Close an am7xxx_device.
  *
@@ -267,6 +317,299 @@ int am7xxx_send_image_async(am7xxx_device *dev,
 			    unsigned char *image,
 			    unsigned int image_size);
 
+/**
+ * The function called when the data of an image has been sent.
+ *
+ * @param[in] dev The device the image has been sent to
+ * @param[in] status 0 if the image has been sent, a negative value on error
+ * @param[in] user_data The pointer passed to am7xxx_set_image_sent_callback()
+ */
+typedef void (*am7xxx_image_sent_callback)(am7xxx_device *dev,
+					   int status,
+					   void *user_data);
+
+/**
+ * Get notified when the data of each image has been sent to an am7xxx device.
+ *
+ * For am7xxx_send_image() the callback is called just before the function
+ * returns; for am7xxx_send_image_async() it is called when the USB
+ * transfer completion gets handled, which happens during a later call on
+ * the device (usually the next am7xxx_send_image_async() waiting for the
+ * transfer), or in am7xxx_close_device(). The callback is always called from
+ * the thread making that call, and in the same order as the images are sent.
+ *
+ * @param[in] dev A pointer to the structure representing the device
+ * @param[in] callback The function to call, or NULL to stop the notifications
+ * @param[in] user_data A pointer passed back to the callback
+ */
+void am7xxx_set_image_sent_callback(am7xxx_device *dev,
+				    am7xxx_image_sent_callback callback,
+				    void *user_data);
+
+/**
+ * Queue transfer of an image for display on an am7xxx device without copying it.
+ *
+ * Like am7xxx_send_image_async() but the image buffer is sent as it is: it
+ * must stay valid and unchanged until the callback is called; at that point
+ * the library does not use it anymore and the caller can reuse or free it.
+ *
+ * The callback is called exactly once for each call of this function, also
+ * when it fails, possibly before it returns. As for the callback set with
+ * am7xxx_set_image_sent_callback() it is called when the USB transfer
+ * completion gets handled, see am7xxx_wait_image_sent(), and it must not
+ * call any libam7xxx function on the same context.
+ *
+ * @param[in] dev A pointer to the structure representing the device to send the image to
+ * @param[in] format The format the image is in (see @link am7xxx_image_format @endlink enum)
+ * @param[in] width The width of the image
+ * @param[in] height The height of the image
+ * @param[in] image A buffer holding data in the format specified by the format parameter
+ * @param[in] image_size The size in bytes of the image buffer
+ * @param[in] callback The function to call when the image buffer is not used anymore, must not be NULL
+ * @param[in] user_data A pointer passed back to the callback
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_send_image_async_nocopy(am7xxx_device *dev,
+				   am7xxx_image_format format,
+				   unsigned int width,
+				   unsigned int height,
+				   unsigned char *image,
+				   unsigned int image_size,
+				   am7xxx_image_sent_callback callback,
+				   void *user_data);
+
+/**
+ * Wait until the last image queued with an _async() function has been sent.
+ *
+ * The image sent callbacks get called from here, if the transfer was still
+ * pending.
+ *
+ * @param[in] dev A pointer to the structure representing the device
+ *
+ * @return 0 if the last asynchronous image has been sent, or if there was
+ * none, a negative value on error
+ */
+int am7xxx_wait_image_sent(am7xxx_device *dev);
+
+/**
+ * @typedef am7xxx_frame
+ *
+ * An opaque data type representing an image, with a reference count.
+ *
+ * A frame can be sent to several devices at the same time, and used by
+ * other parts of the program meanwhile, without copying it: each user
+ * holds a reference and the frame is released when the last one is
+ * dropped. am7xxx_send_frame_async() holds a reference only until the
+ * image has been sent.
+ *
+ * The reference count is atomic, so references can be taken and dropped
+ * from any thread; the image data must not be changed while the frame is
+ * shared.
+ */
+struct _am7xxx_frame;
+typedef struct _am7xxx_frame am7xxx_frame;
+
+/**
+ * The function called to release the data of a frame created with am7xxx_frame_new_wrapped().
+ *
+ * It is called when the last reference to the frame is dropped, that can
+ * happen during the USB events handling, so it must not call any libam7xxx
+ * function on a device.
+ *
+ * @param[in] data The data of the frame
+ * @param[in] user_data The pointer passed to am7xxx_frame_new_wrapped()
+ */
+typedef void (*am7xxx_frame_release_callback)(unsigned char *data,
+					      void *user_data);
+
+/**
+ * Create a frame, allocating its data.
+ *
+ * The data is not initialized, am7xxx_frame_get_data() gives access to it.
+ *
+ * @param[out] frame A pointer to the new frame, holding the only reference to it
+ * @param[in] format The format of the image (see @link am7xxx_image_format @endlink enum)
+ * @param[in] width The width of the image
+ * @param[in] height The height of the image
+ * @param[in] size The size in bytes of the image data
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_frame_new(am7xxx_frame **frame,
+		     am7xxx_image_format format,
+		     unsigned int width,
+		     unsigned int height,
+		     unsigned int size);
+
+/**
+ * Create a frame for image data owned by the caller.
+ *
+ * @param[out] frame A pointer to the new frame, holding the only reference to it
+ * @param[in] format The format of the image (see @link am7xxx_image_format @endlink enum)
+ * @param[in] width The width of the image
+ * @param[in] height The height of the image
+ * @param[in] data The image data, it must stay valid until the release callback is called
+ * @param[in] size The size in bytes of the image data
+ * @param[in] release The function to call when the frame is released, it can be NULL
+ * @param[in] user_data A pointer passed back to the release function
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_frame_new_wrapped(am7xxx_frame **frame,
+			     am7xxx_image_format format,
+			     unsigned int width,
+			     unsigned int height,
+			     unsigned char *data,
+			     unsigned int size,
+			     am7xxx_frame_release_callback release,
+			     void *user_data);
+
+/**
+ * Take a reference to a frame.
+ *
+ * @param[in] frame The frame
+ *
+ * @return the frame itself
+ */
+am7xxx_frame *am7xxx_frame_ref(am7xxx_frame *frame);
+
+/**
+ * Drop a reference to a frame, the frame is released with the last one.
+ *
+ * @param[in] frame The frame, NULL is allowed
+ */
+void am7xxx_frame_unref(am7xxx_frame *frame);
+
+/**
+ * Get the image data of a frame.
+ *
+ * @param[in] frame The frame
+ *
+ * @return a pointer to the image data
+ */
+unsigned char *am7xxx_frame_get_data(am7xxx_frame *frame);
+
+/**
+ * Get the size of the image data of a frame.
+ *
+ * @param[in] frame The frame
+ *
+ * @return the size in bytes of the image data
+ */
+unsigned int am7xxx_frame_get_size(am7xxx_frame *frame);
+
+/**
+ * Send a frame for display on an am7xxx device.
+ *
+ * Like am7xxx_send_image(), with the image described by the frame.
+ *
+ * @param[in] dev A pointer to the structure representing the device to send the frame to
+ * @param[in] frame The frame to send
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_send_frame(am7xxx_device *dev, am7xxx_frame *frame);
+
+/**
+ * Queue transfer of a frame for display on an am7xxx device and return immediately.
+ *
+ * The frame data is not copied: a reference to the frame is held until the
+ * image has been sent, so the caller can drop its own reference right
+ * away, or send the same frame to other devices too.
+ *
+ * @param[in] dev A pointer to the structure representing the device to send the frame to
+ * @param[in] frame The frame to send
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_send_frame_async(am7xxx_device *dev, am7xxx_frame *frame);
+
+/**
+ * Handle the USB events of all the devices of a context.
+ *
+ * The completion of asynchronous transfers is otherwise only handled
+ * during the library calls on a device, a program driving several devices
+ * from a single thread can call this function when it has nothing else to
+ * do, to get the image sent callbacks called as soon as possible.
+ *
+ * @param[in] ctx The context of the devices
+ * @param[in] timeout_ms How long to wait for an event, in milliseconds, 0 to return right away
+ *
+ * @return 0 on success, also when no event came before the timeout, a negative value on error
+ */
+int am7xxx_handle_events(am7xxx_context *ctx, unsigned int timeout_ms);
+
+/** The maximum number of chunks in flight, see am7xxx_set_chunking() */
+#define AM7XXX_MAX_CHUNK_DEPTH 64
+
+/**
+ * Send the image data to an am7xxx device in chunks.
+ *
+ * By default the image data is sent with a single USB transfer; big frames
+ * (about 1.2 MB for a 1024x768 NV12 image) can then get split or refused by
+ * the kernel, depending on its version and on the usbfs limits.
+ *
+ * With chunking enabled, image data bigger than chunk_size is sent with
+ * several transfers of chunk_size bytes each, keeping up to depth of them
+ * queued at the same time, so that the host controller never waits for the
+ * next one; the image has been sent when its last chunk has.
+ *
+ * The best values depend on the host controller, am7xxx-bench can measure
+ * them.
+ *
+ * @note With am7xxx_send_image_async() only the first depth chunks are
+ * queued before the function returns, the others are queued as the USB
+ * events get handled, that is during the next call on the device; a depth
+ * covering a whole frame gives the most overlap in this case.
+ *
+ * @param[in] dev A pointer to the structure representing the device to set the chunking of
+ * @param[in] chunk_size The size in bytes of each chunk, a multiple of the maximum packet size of the device endpoint (512 bytes for high speed devices), 0 disables chunking
+ * @param[in] depth How many chunks can be in flight at the same time, between 1 and #AM7XXX_MAX_CHUNK_DEPTH, ignored when chunk_size is 0
+ *
+ * @return 0 on success, a negative value on error
+ */
+int am7xxx_set_chunking(am7xxx_device *dev,
+			unsigned int chunk_size,
+			unsigned int depth);
+
+/**
+ * Get an am7xxx device back automatically when it gets lost.
+ *
+ * When the device disappears from the bus, for instance because of a loose
+ * cable or of a brownout, the call that notices it fails and the next
+ * ones fail with -ENODEV; with auto reconnect enabled the next call on the
+ * device waits instead up to timeout_ms for the same device to come back,
+ * then reopens it and sets again the power mode and the zoom mode, see
+ * am7xxx_reconnect_device().
+ *
+ * @param[in] dev A pointer to the structure representing the device to set auto reconnect to
+ * @param[in] timeout_ms How long to wait for the device to come back, 0 disables auto reconnect (the default)
+ */
+void am7xxx_set_auto_reconnect(am7xxx_device *dev, unsigned int timeout_ms);
+
+/**
+ * Get back an am7xxx device which has been lost.
+ *
+ * Wait for the device to be plugged in again, the same device is found by
+ * its serial number or, when it has none, by the USB port it was plugged
+ * in; the device is then opened again, its info is read again and the last
+ * power mode and zoom mode set are restored.
+ *
+ * The wait is driven by libusb hotplug events when available, so a device
+ * coming back is used right away and no CPU time is spent meanwhile.
+ *
+ * @param[in] dev A pointer to the structure representing the device to reconnect
+ * @param[in] timeout_ms How long to wait for the device to come back
+ * @param[out] outage_ms How long the device has been lost, in milliseconds, 0 when it was not lost (can be NULL)
+ *
+ * @return 0 on success, -ETIMEDOUT if the device did not come back in time,
+ * another negative value on error
+ */
+int am7xxx_reconnect_device(am7xxx_device *dev,
+			    unsigned int timeout_ms,
+			    unsigned int *outage_ms);
+
 /**
  * Set the power mode of an am7xxx device.
  *
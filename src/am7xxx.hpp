@@ -0,0 +1,519 @@
+/* am7xxx - communication with AM7XXX based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * C++ interface to libam7xxx, header only and requiring C++20.
+ *
+ * Errors are reported with am7xxx::Error exceptions; the handles are
+ * move-only and release the underlying C objects when destroyed.
+ *
+ * A Device must not outlive the Context it has been opened from, and the
+ * objects of one Context must be used from one thread at a time, as with
+ * the C API.
+ */
+
+#ifndef __AM7XXX_HPP
+#define __AM7XXX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <set>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "am7xxx.h"
+
+namespace am7xxx {
+
+/** The error raised when a libam7xxx function fails. */
+class Error : public std::runtime_error {
+public:
+	Error(const std::string &function, int code) :
+		std::runtime_error(function + " failed (" + std::to_string(code) + ")"),
+		code_(code) {}
+
+	/** The negative value returned by the C function. */
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+/** @see am7xxx_image_format */
+enum class ImageFormat {
+	JPEG = AM7XXX_IMAGE_FORMAT_JPEG,
+	NV12 = AM7XXX_IMAGE_FORMAT_NV12,
+};
+
+/** @see am7xxx_power_mode */
+enum class PowerMode {
+	Off    = AM7XXX_POWER_OFF,
+	Low    = AM7XXX_POWER_LOW,
+	Middle = AM7XXX_POWER_MIDDLE,
+	High   = AM7XXX_POWER_HIGH,
+	Turbo  = AM7XXX_POWER_TURBO,
+};
+
+/** @see am7xxx_zoom_mode */
+enum class ZoomMode {
+	Original = AM7XXX_ZOOM_ORIGINAL,
+	H        = AM7XXX_ZOOM_H,
+	HV       = AM7XXX_ZOOM_H_V,
+	Test     = AM7XXX_ZOOM_TEST,
+};
+
+/** @see am7xxx_log_level */
+enum class LogLevel {
+	Fatal   = AM7XXX_LOG_FATAL,
+	Error   = AM7XXX_LOG_ERROR,
+	Warning = AM7XXX_LOG_WARNING,
+	Info    = AM7XXX_LOG_INFO,
+	Debug   = AM7XXX_LOG_DEBUG,
+	Trace   = AM7XXX_LOG_TRACE,
+};
+
+/**
+ * What is known about the size of the images in a given format.
+ *
+ * fixed_size tells if the size only depends on the dimensions, in that case
+ * size() returns it and valid_dimensions() tells which dimensions can be
+ * used.
+ */
+template <ImageFormat Format>
+struct FormatTraits;
+
+template <>
+struct FormatTraits<ImageFormat::JPEG> {
+	static constexpr bool fixed_size = false;
+
+	static constexpr bool valid_dimensions(unsigned int, unsigned int) { return true; }
+};
+
+template <>
+struct FormatTraits<ImageFormat::NV12> {
+	static constexpr bool fixed_size = true;
+
+	/* the chroma plane is subsampled by two in both directions */
+	static constexpr bool valid_dimensions(unsigned int width, unsigned int height)
+	{
+		return width % 2 == 0 && height % 2 == 0;
+	}
+
+	static constexpr std::size_t size(unsigned int width, unsigned int height)
+	{
+		return (std::size_t)width * height * 3 / 2;
+	}
+};
+
+namespace detail {
+
+inline void check(const char *function, int ret)
+{
+	if (ret < 0)
+		throw Error(function, ret);
+}
+
+inline void check_size(ImageFormat format, unsigned int width,
+		       unsigned int height, std::size_t size)
+{
+	using NV12 = FormatTraits<ImageFormat::NV12>;
+
+	if (size > UINT32_MAX)
+		throw std::invalid_argument("image too big");
+
+	if (format == ImageFormat::NV12 &&
+	    (!NV12::valid_dimensions(width, height) || size != NV12::size(width, height)))
+		throw std::invalid_argument("wrong size for a NV12 image");
+}
+
+/* the C API does not write to the images but it takes them as non-const */
+inline unsigned char *image_data(std::span<const std::byte> image)
+{
+	return reinterpret_cast<unsigned char *>(const_cast<std::byte *>(image.data()));
+}
+
+/* the devices of a Context owned by a Device, shared with the Devices so
+ * that they can take themselves out when closed */
+using OwnedDevices = std::set<am7xxx_device *>;
+
+} /* namespace detail */
+
+/**
+ * An image owning its buffer.
+ *
+ * Frames are moved into Device::send_async() and given back by the
+ * returned future once the library is done with them, so the same buffers
+ * can be filled and sent over and over without copies or allocations.
+ */
+class Frame {
+public:
+	Frame() = default;
+
+	/** Allocate an uninitialized buffer of size bytes. */
+	Frame(ImageFormat format, unsigned int width, unsigned int height,
+	      std::size_t size) :
+		data_(new std::byte[size]), size_(size), capacity_(size),
+		format_(format), width_(width), height_(height)
+	{
+		detail::check_size(format, width, height, size);
+	}
+
+	/** Allocate a buffer of the size of a Format image, for fixed size formats. */
+	template <ImageFormat Format>
+	static Frame make(unsigned int width, unsigned int height)
+	{
+		static_assert(FormatTraits<Format>::fixed_size,
+			      "the size of the images depends on their content in this format");
+		return Frame(Format, width, height,
+			     FormatTraits<Format>::size(width, height));
+	}
+
+	Frame(Frame &&other) noexcept { *this = std::move(other); }
+
+	Frame &operator=(Frame &&other) noexcept
+	{
+		data_ = std::move(other.data_);
+		size_ = std::exchange(other.size_, 0);
+		capacity_ = std::exchange(other.capacity_, 0);
+		format_ = other.format_;
+		width_ = other.width_;
+		height_ = other.height_;
+		return *this;
+	}
+
+	Frame(const Frame &) = delete;
+	Frame &operator=(const Frame &) = delete;
+
+	/**
+	 * Describe new content for the buffer, e.g. a JPEG image of a
+	 * different size; the size must fit in the allocated buffer.
+	 */
+	void set_image(ImageFormat format, unsigned int width,
+		       unsigned int height, std::size_t size)
+	{
+		if (size > capacity_)
+			throw std::length_error("image bigger than the frame buffer");
+		detail::check_size(format, width, height, size);
+		format_ = format;
+		width_ = width;
+		height_ = height;
+		size_ = size;
+	}
+
+	std::span<std::byte> data() noexcept { return { data_.get(), size_ }; }
+	std::span<const std::byte> data() const noexcept { return { data_.get(), size_ }; }
+	std::size_t capacity() const noexcept { return capacity_; }
+	ImageFormat format() const noexcept { return format_; }
+	unsigned int width() const noexcept { return width_; }
+	unsigned int height() const noexcept { return height_; }
+	explicit operator bool() const noexcept { return data_ != nullptr; }
+
+private:
+	std::unique_ptr<std::byte[]> data_;
+	std::size_t size_ = 0;
+	std::size_t capacity_ = 0;
+	ImageFormat format_ = ImageFormat::JPEG;
+	unsigned int width_ = 0;
+	unsigned int height_ = 0;
+};
+
+/** An open am7xxx device, see am7xxx_open_device(). */
+class Device {
+public:
+	Device() = default;
+
+	/** Take ownership of a device opened with am7xxx_open_device(). */
+	explicit Device(am7xxx_device *dev) noexcept : dev_(dev) {}
+
+	~Device() { close(); }
+
+	Device(Device &&other) noexcept :
+		dev_(std::exchange(other.dev_, nullptr)),
+		owned_devices_(std::move(other.owned_devices_)) {}
+
+	Device &operator=(Device &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			dev_ = std::exchange(other.dev_, nullptr);
+			owned_devices_ = std::move(other.owned_devices_);
+		}
+		return *this;
+	}
+
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	/** Close the device, pending images are sent first. */
+	void close() noexcept
+	{
+		if (dev_)
+			am7xxx_close_device(dev_);
+		if (owned_devices_)
+			owned_devices_->erase(dev_);
+		dev_ = nullptr;
+		owned_devices_.reset();
+	}
+
+	am7xxx_device *native_handle() const noexcept { return dev_; }
+	explicit operator bool() const noexcept { return dev_ != nullptr; }
+
+	am7xxx_device_info info() const
+	{
+		am7xxx_device_info device_info;
+
+		detail::check("am7xxx_get_device_info",
+			      am7xxx_get_device_info(dev_, &device_info));
+		return device_info;
+	}
+
+	/** @return the scaled width and height, see am7xxx_calc_scaled_image_dimensions() */
+	std::pair<unsigned int, unsigned int>
+	scaled_dimensions(bool upscale, unsigned int width, unsigned int height) const
+	{
+		unsigned int scaled_width;
+		unsigned int scaled_height;
+
+		detail::check("am7xxx_calc_scaled_image_dimensions",
+			      am7xxx_calc_scaled_image_dimensions(dev_, upscale,
+								  width, height,
+								  &scaled_width,
+								  &scaled_height));
+		return { scaled_width, scaled_height };
+	}
+
+	void set_power_mode(PowerMode power)
+	{
+		detail::check("am7xxx_set_power_mode",
+			      am7xxx_set_power_mode(dev_, static_cast<am7xxx_power_mode>(power)));
+	}
+
+	void set_zoom_mode(ZoomMode zoom)
+	{
+		detail::check("am7xxx_set_zoom_mode",
+			      am7xxx_set_zoom_mode(dev_, static_cast<am7xxx_zoom_mode>(zoom)));
+	}
+
+	void set_chunking(unsigned int chunk_size, unsigned int depth)
+	{
+		detail::check("am7xxx_set_chunking",
+			      am7xxx_set_chunking(dev_, chunk_size, depth));
+	}
+
+	/** Send an image and wait for it to be on the wire, no copy is made. */
+	void send(ImageFormat format, unsigned int width, unsigned int height,
+		  std::span<const std::byte> image)
+	{
+		detail::check_size(format, width, height, image.size());
+		detail::check("am7xxx_send_image",
+			      am7xxx_send_image(dev_, static_cast<am7xxx_image_format>(format),
+						width, height, detail::image_data(image),
+						static_cast<unsigned int>(image.size())));
+	}
+
+	/**
+	 * Send an image whose format and dimensions are known at compile
+	 * time; with a fixed-extent span the size is checked at compile time
+	 * too.
+	 */
+	template <ImageFormat Format, unsigned int Width, unsigned int Height,
+		  std::size_t Extent>
+	void send(std::span<const std::byte, Extent> image)
+	{
+		static_assert(FormatTraits<Format>::valid_dimensions(Width, Height),
+			      "invalid dimensions for this image format");
+		if constexpr (FormatTraits<Format>::fixed_size &&
+			      Extent != std::dynamic_extent)
+			static_assert(Extent == FormatTraits<Format>::size(Width, Height),
+				      "wrong image size for these format and dimensions");
+
+		send(Format, Width, Height, std::span<const std::byte>(image));
+	}
+
+	/**
+	 * Queue an image and return right away, the image is copied so the
+	 * buffer can be reused immediately.
+	 */
+	void send_copy_async(ImageFormat format, unsigned int width,
+			     unsigned int height, std::span<const std::byte> image)
+	{
+		detail::check_size(format, width, height, image.size());
+		detail::check("am7xxx_send_image_async",
+			      am7xxx_send_image_async(dev_, static_cast<am7xxx_image_format>(format),
+						      width, height, detail::image_data(image),
+						      static_cast<unsigned int>(image.size())));
+	}
+
+	/**
+	 * Queue a frame and return right away, without copying it.
+	 *
+	 * The frame is given back by the returned future when it has been
+	 * sent; as the C library handles the USB events only during its
+	 * calls, the future is a deferred one: calling get() or wait() waits
+	 * for the transfer if the following send_async() has not done it
+	 * already. get() raises an Error if sending failed.
+	 */
+	std::future<Frame> send_async(Frame frame)
+	{
+		auto pending = std::make_shared<Pending>();
+		am7xxx_device *dev = dev_;
+		std::span<std::byte> image = frame.data();
+		int ret;
+
+		pending->frame = std::move(frame);
+
+		/* the reference held by the C callback, released there */
+		auto callback_reference = new std::shared_ptr<Pending>(pending);
+
+		ret = am7xxx_send_image_async_nocopy(dev,
+						     static_cast<am7xxx_image_format>(pending->frame.format()),
+						     pending->frame.width(),
+						     pending->frame.height(),
+						     reinterpret_cast<unsigned char *>(image.data()),
+						     static_cast<unsigned int>(image.size()),
+						     image_sent, callback_reference);
+		detail::check("am7xxx_send_image_async_nocopy", ret);
+
+		return std::async(std::launch::deferred, [dev, pending]() {
+			if (!pending->sent)
+				am7xxx_wait_image_sent(dev);
+			detail::check("am7xxx_send_image_async_nocopy", pending->status);
+			return std::move(pending->frame);
+		});
+	}
+
+	/** Wait for the last asynchronous image to be sent. */
+	void wait_image_sent()
+	{
+		detail::check("am7xxx_wait_image_sent", am7xxx_wait_image_sent(dev_));
+	}
+
+private:
+	friend class Context;
+
+	Device(am7xxx_device *dev, std::shared_ptr<detail::OwnedDevices> owned_devices) :
+		dev_(dev), owned_devices_(std::move(owned_devices))
+	{
+		owned_devices_->insert(dev_);
+	}
+
+	struct Pending {
+		Frame frame;
+		int status = 0;
+		bool sent = false;
+	};
+
+	static void image_sent(am7xxx_device *, int status, void *user_data)
+	{
+		auto pending = static_cast<std::shared_ptr<Pending> *>(user_data);
+
+		(*pending)->status = status;
+		(*pending)->sent = true;
+		delete pending;
+	}
+
+	am7xxx_device *dev_ = nullptr;
+	std::shared_ptr<detail::OwnedDevices> owned_devices_;
+};
+
+/** A libam7xxx context, see am7xxx_init(). */
+class Context {
+public:
+	Context()
+	{
+		detail::check("am7xxx_init", am7xxx_init(&ctx_));
+	}
+
+	~Context()
+	{
+		if (ctx_)
+			am7xxx_shutdown(ctx_);
+	}
+
+	Context(Context &&other) noexcept :
+		ctx_(std::exchange(other.ctx_, nullptr)),
+		owned_devices_(std::move(other.owned_devices_)) {}
+
+	Context &operator=(Context &&other) noexcept
+	{
+		if (this != &other) {
+			if (ctx_)
+				am7xxx_shutdown(ctx_);
+			ctx_ = std::exchange(other.ctx_, nullptr);
+			owned_devices_ = std::move(other.owned_devices_);
+		}
+		return *this;
+	}
+
+	Context(const Context &) = delete;
+	Context &operator=(const Context &) = delete;
+
+	am7xxx_context *native_handle() const noexcept { return ctx_; }
+
+	void set_log_level(LogLevel log_level)
+	{
+		am7xxx_set_log_level(ctx_, static_cast<am7xxx_log_level>(log_level));
+	}
+
+	Device open_device(unsigned int device_index)
+	{
+		am7xxx_device *dev;
+
+		detail::check("am7xxx_open_device",
+			      am7xxx_open_device(ctx_, &dev, device_index));
+		return Device(dev, owned_devices_);
+	}
+
+	/**
+	 * Open up to max_devices devices at once, see am7xxx_open_all_devices().
+	 *
+	 * The devices already owned by a Device are left out, so some of the
+	 * max_devices slots may go to them.
+	 */
+	std::vector<Device> open_all_devices(unsigned int max_devices)
+	{
+		std::vector<am7xxx_device *> handles(max_devices);
+		std::vector<Device> devices;
+		int num_devices;
+
+		num_devices = am7xxx_open_all_devices(ctx_, handles.data(), max_devices);
+		detail::check("am7xxx_open_all_devices", num_devices);
+
+		devices.reserve(num_devices);
+		for (int i = 0; i < num_devices; i++) {
+			if (!owned_devices_->contains(handles[i]))
+				devices.push_back(Device(handles[i], owned_devices_));
+		}
+		return devices;
+	}
+
+private:
+	am7xxx_context *ctx_ = nullptr;
+	std::shared_ptr<detail::OwnedDevices> owned_devices_ =
+		std::make_shared<detail::OwnedDevices>();
+};
+
+} /* namespace am7xxx */
+
+#endif /* __AM7XXX_HPP */
@@ -0,0 +1,320 @@
+/* am7xxx - communication with AM7XXX based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012  Antonio Ospite <ospite@studenti.unina.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * C++20 coroutine interface to libam7xxx.
+ *
+ * Coroutines returning an am7xxx::coro::Task are run by a Scheduler on
+ * the thread calling Scheduler::run(); when a coroutine sends an image
+ * with co_await dev.send(frame) it is suspended until the USB transfer
+ * completes and the other coroutines run meanwhile, so one thread can keep
+ * several devices busy:
+ *
+ * @code
+ * am7xxx::coro::Task play(am7xxx::coro::Device dev, am7xxx::Frame &frame)
+ * {
+ *         for (;;) {
+ *                 fill_frame(frame.data());
+ *                 co_await dev.send(frame);
+ *         }
+ * }
+ *
+ * am7xxx::coro::Scheduler scheduler(ctx);
+ * scheduler.spawn(play(dev0, frame0));
+ * scheduler.spawn(play(dev1, frame1));
+ * scheduler.run();
+ * @endcode
+ *
+ * The image header is still sent synchronously, only its data is sent
+ * while the coroutine is suspended.
+ */
+
+#ifndef __AM7XXX_CORO_HPP
+#define __AM7XXX_CORO_HPP
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include "am7xxx.hpp"
+
+namespace am7xxx::coro {
+
+class Scheduler;
+
+/**
+ * A coroutine run by a Scheduler.
+ *
+ * A Task starts when it is spawned on a Scheduler or when another Task
+ * awaits it; exceptions are raised in the awaiting Task, or by
+ * Scheduler::run() for spawned ones.
+ */
+class Task {
+public:
+	struct promise_type;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		/* go on with the awaiting coroutine, if any */
+		std::coroutine_handle<> await_suspend(handle_type handle) noexcept
+		{
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		Scheduler *scheduler = nullptr;
+		std::coroutine_handle<> continuation;
+		std::exception_ptr exception;
+
+		Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { exception = std::current_exception(); }
+	};
+
+	Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other) {
+			if (handle_)
+				handle_.destroy();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+	~Task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool done() const noexcept { return !handle_ || handle_.done(); }
+
+	bool await_ready() const noexcept { return done(); }
+
+	template <typename Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> caller) noexcept
+	{
+		handle_.promise().scheduler = caller.promise().scheduler;
+		handle_.promise().continuation = caller;
+		return handle_;
+	}
+
+	void await_resume()
+	{
+		if (handle_ && handle_.promise().exception)
+			std::rethrow_exception(handle_.promise().exception);
+	}
+
+private:
+	friend class Scheduler;
+
+	explicit Task(handle_type handle) noexcept : handle_(handle) {}
+
+	handle_type handle_;
+};
+
+/**
+ * Runs the Task coroutines and handles the USB events of a Context
+ * when none of them can run.
+ */
+class Scheduler {
+public:
+	explicit Scheduler(Context &ctx) noexcept : ctx_(ctx.native_handle()) {}
+
+	Scheduler(const Scheduler &) = delete;
+	Scheduler &operator=(const Scheduler &) = delete;
+
+	/** Run task too, the next time run() is called or from the running one. */
+	void spawn(Task task)
+	{
+		task.handle_.promise().scheduler = this;
+		schedule(task.handle_);
+		tasks_.push_back(std::move(task));
+	}
+
+	/** Resume a suspended coroutine from the run() loop. */
+	void schedule(std::coroutine_handle<> handle)
+	{
+		ready_.push_back(handle);
+	}
+
+	/**
+	 * Run the spawned tasks until they are all done, or until none of
+	 * them can go on; the first exception raised by a task is raised
+	 * again here, once the others are done.
+	 */
+	void run()
+	{
+		std::exception_ptr exception;
+
+		for (;;) {
+			while (!ready_.empty()) {
+				std::coroutine_handle<> handle = ready_.front();
+				ready_.pop_front();
+				handle.resume();
+			}
+
+			if (pending_ == 0)
+				break;
+
+			detail::check("am7xxx_handle_events",
+				      am7xxx_handle_events(ctx_, 1000));
+		}
+
+		for (Task &task : tasks_) {
+			if (!exception && task.handle_.done())
+				exception = task.handle_.promise().exception;
+		}
+		tasks_.clear();
+
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+
+private:
+	friend class SendOperation;
+
+	am7xxx_context *ctx_;
+	std::deque<std::coroutine_handle<>> ready_;
+	std::vector<Task> tasks_;
+	unsigned int pending_ = 0;
+};
+
+/** Let the other ready coroutines run before going on. */
+struct yield {
+	bool await_ready() const noexcept { return false; }
+
+	template <typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		handle.promise().scheduler->schedule(handle);
+	}
+
+	void await_resume() const noexcept {}
+};
+
+/** The awaitable returned by Device::send(). */
+class SendOperation {
+public:
+	SendOperation(am7xxx_device *dev, ImageFormat format,
+		      unsigned int width, unsigned int height,
+		      std::span<const std::byte> image) :
+		dev_(dev), format_(format), width_(width), height_(height),
+		image_(image) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	/* the coroutine is not suspended when sending fails right away */
+	template <typename Promise>
+	bool await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		scheduler_ = handle.promise().scheduler;
+		handle_ = handle;
+		scheduler_->pending_++;
+
+		submitting_ = true;
+		am7xxx_send_image_async_nocopy(dev_, static_cast<am7xxx_image_format>(format_),
+					       width_, height_, detail::image_data(image_),
+					       static_cast<unsigned int>(image_.size()),
+					       image_sent, this);
+		submitting_ = false;
+
+		return !sent_;
+	}
+
+	void await_resume() const
+	{
+		detail::check("am7xxx_send_image_async_nocopy", status_);
+	}
+
+private:
+	/* called exactly once, also when sending fails */
+	static void image_sent(am7xxx_device *, int status, void *user_data)
+	{
+		SendOperation *operation = static_cast<SendOperation *>(user_data);
+
+		operation->status_ = status;
+		operation->sent_ = true;
+		operation->scheduler_->pending_--;
+
+		/* when called from am7xxx_send_image_async_nocopy() itself
+		 * the coroutine has not been suspended */
+		if (!operation->submitting_)
+			operation->scheduler_->schedule(operation->handle_);
+	}
+
+	am7xxx_device *dev_;
+	ImageFormat format_;
+	unsigned int width_;
+	unsigned int height_;
+	std::span<const std::byte> image_;
+
+	Scheduler *scheduler_ = nullptr;
+	std::coroutine_handle<> handle_;
+	bool submitting_ = false;
+	bool sent_ = false;
+	int status_ = 0;
+};
+
+/**
+ * A non-owning view of an am7xxx::Device for coroutines.
+ *
+ * The image passed to send() is not copied, it is used until the awaiting
+ * coroutine resumes.
+ */
+class Device {
+public:
+	explicit Device(am7xxx::Device &dev) noexcept : dev_(dev.native_handle()) {}
+
+	SendOperation send(ImageFormat format, unsigned int width,
+			   unsigned int height, std::span<const std::byte> image)
+	{
+		detail::check_size(format, width, height, image.size());
+		return SendOperation(dev_, format, width, height, image);
+	}
+
+	SendOperation send(const Frame &frame)
+	{
+		return SendOperation(dev_, frame.format(), frame.width(),
+				     frame.height(), frame.data());
+	}
+
+private:
+	am7xxx_device *dev_;
+};
+
+} /* namespace am7xxx::coro */
+
+#endif /* __AM7XXX_CORO_HPP */